@@ -2,7 +2,9 @@
 KXKM - ESP32 audio & battery module
 STM32 Energy API test from ESP32
 
-Battery voltage and percentage ; load current ; board temperature are queried every 2s.
+Battery voltage and percentage ; load current ; board temperature are queried every 2s (single telemetry command),
+or pushed by the STM32 if it supports it (API version 5 or more). Button events are pushed as well.
+The STM32 is driven by the non-blocking client (KXKM_STM32_energy_client.h) : the loop never waits for answers.
 
 The following features are tested :
   * setting LEDs independently
@@ -13,6 +15,9 @@ The following features are tested :
     * Leaving the critical section (click)
     * requesting a shutdown (double click)
   * Request a self reset
+  * Binary protocol (used if the STM32 API version is 3 or more)
+  * Pipelined requests for the board info (API version 6 or more)
+  * Load current statistics and delivered energy, printed with the board info (API version 8 or more)
 
 To test the critical section, it should be done by setting the voltage under 12V.
 
@@ -23,7 +28,7 @@ Connect with telnet to get the debug information
 
 #include <Arduino.h>
 #include "KXKM_STM32_energy_API.h"
-#include "serial.h"
+#include "KXKM_STM32_energy_client.h"
 #include <WiFi.h>
 #include <DNSServer.h>
 #include "ESPmDNS.h"
@@ -47,20 +52,41 @@ enum test_type_t {
 
 RemoteDebug Debug;
 
+KXKM_STM32_Client stm32(Serial);
+bool serialPushEnabled = false; // Button events and telemetry are pushed by the STM32 instead of being polled
+
 const char* ssid = "ssid";
 const char* password = "password";
 
 void processCmdRemoteDebug();
 void beginTest(test_type_t test);
+void processButtonEvent(int buttonEvent);
+void printTelemetry(const KXKM_STM32_Energy::Telemetry &telemetry);
+void printLoadStats(const KXKM_STM32_Energy::LoadStats &stats);
+void handleStm32Event(KXKM_STM32_Energy::PushEvent event);
+void setLeds(uint8_t *values);
+void setSingleLed(uint8_t index);
 void endTest(test_type_t test);
 
 void setup() {
   Serial.begin(115200, SERIAL_8N1);
-  Serial.setTimeout(10);
+
+  stm32.onTelemetry(printTelemetry);
+  stm32.onLoadStats(printLoadStats);
+  stm32.onEvent(handleStm32Event);
+  stm32.begin();
 
   //Disable the load switch immediately
   debugI("Disabling load switch.");
-  sendSerialCommand(KXKM_STM32_Energy::SET_LOAD_SWITCH, 0);
+  stm32.send(KXKM_STM32_Energy::SET_LOAD_SWITCH, 0);
+
+  // Wait for the protocol negotiation and the load switch command
+  while (stm32.pending())
+    stm32.update();
+
+  // Subscribe to events and telemetry if the STM32 supports it
+  if (stm32.isBinary() && stm32.apiVersion() >= 5)
+    serialPushEnabled = stm32.send(KXKM_STM32_Energy::SUBSCRIBE, BATTERY_CHECK_PERIOD_MS);
   
   WiFi.begin(ssid, password);
 
@@ -69,6 +95,7 @@ void setup() {
     static int ledId = 0;
     setSingleLed(ledId++ % 6);
     delay(300);
+    stm32.update();
   }
 
   // Register host name in WiFi and mDNS
@@ -86,85 +113,70 @@ void setup() {
   currentTestType = INIT;
 }
 
-void printInfo() {
-  sendSerialCommand(KXKM_STM32_Energy::GET_HW_REVISION);
-  debugI("Hardware revision : %d", readSerialAnswer());
-  
-  sendSerialCommand(KXKM_STM32_Energy::GET_BOARD_ID);
-  debugI("Board ID : %d", readSerialAnswer());
+void printInfoAnswer(KXKM_STM32_Energy::CommandType cmd, long value, bool timeout) {
+  if (timeout)
+  {
+    debugI("No answer to command %c", cmd);
+    return;
+  }
 
-  sendSerialCommand(KXKM_STM32_Energy::GET_API_VERSION);
-  debugI("STM32 API version : %d", readSerialAnswer());
-  debugI("Local API version : %d", KXKM_STM32_Energy::API_VERSION);
+  switch (cmd)
+  {
+    case KXKM_STM32_Energy::GET_HW_REVISION: debugI("Hardware revision : %d", value); break;
+    case KXKM_STM32_Energy::GET_BOARD_ID: debugI("Board ID : %d", value); break;
+    case KXKM_STM32_Energy::GET_API_VERSION: debugI("STM32 API version : %d", value); break;
+    case KXKM_STM32_Energy::GET_FW_VERSION: debugI("STM32 firmware version : %d", value); break;
 
-  sendSerialCommand(KXKM_STM32_Energy::GET_FW_VERSION);
-  debugI("STM32 firmware version : %d", readSerialAnswer());
+    case KXKM_STM32_Energy::GET_BATTERY_TYPE:
+      switch (value)
+      {
+        case KXKM_STM32_Energy::BATTERY_LIPO: debugI("Battery type : LiPo"); break;
+        case KXKM_STM32_Energy::BATTERY_LIFE: debugI("Battery type : LiFe"); break;
+        case KXKM_STM32_Energy::BATTERY_CUSTOM: debugI("Battery type : custom"); break;
+      }
+      break;
 
-  sendSerialCommand(KXKM_STM32_Energy::GET_BATTERY_TYPE);
-  debugI("Battery type : ");
-  switch (readSerialAnswer())
-  {
-    case KXKM_STM32_Energy::BATTERY_LIPO: debugI("LiPo"); break;
-    case KXKM_STM32_Energy::BATTERY_LIFE: debugI("LiFe"); break;
-    case KXKM_STM32_Energy::BATTERY_CUSTOM: debugI("custom"); break;
+    default:
+      break;
   }
 }
 
+void printInfo() {
+  debugI("Local API version : %d", KXKM_STM32_Energy::API_VERSION);
+  debugI("Serial protocol : %s", stm32.isBinary() ? "binary" : "text");
+  debugI("Event push : %s", serialPushEnabled ? "enabled" : "disabled");
+
+  // All requests are queued at once (pipelined if the STM32 supports it), answers are printed as they arrive
+  stm32.request(KXKM_STM32_Energy::GET_HW_REVISION, printInfoAnswer);
+  stm32.request(KXKM_STM32_Energy::GET_BOARD_ID, printInfoAnswer);
+  stm32.request(KXKM_STM32_Energy::GET_API_VERSION, printInfoAnswer);
+  stm32.request(KXKM_STM32_Energy::GET_FW_VERSION, printInfoAnswer);
+  stm32.request(KXKM_STM32_Energy::GET_BATTERY_TYPE, printInfoAnswer);
+
+  if (stm32.apiVersion() >= 8)
+    stm32.send(KXKM_STM32_Energy::GET_LOAD_STATS);
+}
+
+void showLoadCurrent(KXKM_STM32_Energy::CommandType cmd, long value, bool timeout) {
+  if (!timeout)
+    stm32.send(KXKM_STM32_Energy::SET_LED_GAUGE, value * 100 / 3500); //Max test current : 3500mA
+}
+
 void loop() {
   static unsigned long lastBatteryCheck, lastButtonCheck;
-  if (millis() - lastBatteryCheck > BATTERY_CHECK_PERIOD_MS)
+  stm32.update();
+
+  // Telemetry and button events are delivered through the client callbacks
+  if (!serialPushEnabled && millis() - lastBatteryCheck > BATTERY_CHECK_PERIOD_MS)
   {
     lastBatteryCheck = millis();
-    debugI("--------------------------------------------");
-    
-    sendSerialCommand(KXKM_STM32_Energy::GET_BATTERY_VOLTAGE);
-    debugI("Batt voltage : %d mV", readSerialAnswer());
-
-    sendSerialCommand(KXKM_STM32_Energy::GET_BATTERY_PERCENTAGE);
-    debugI("Batt percentage : %d %%", readSerialAnswer());
-    
-    sendSerialCommand(KXKM_STM32_Energy::GET_LOAD_CURRENT);
-    debugI("Load current : %d mA", readSerialAnswer());
-    
-    sendSerialCommand(KXKM_STM32_Energy::GET_TEMPERATURE);
-    debugI("Board temperature : %d deg. C", readSerialAnswer());
+    stm32.send(KXKM_STM32_Energy::GET_TELEMETRY);
   }
 
-  if (millis() - lastButtonCheck > BUTTON_CHECK_PERIOD_MS)
+  if (!serialPushEnabled && millis() - lastButtonCheck > BUTTON_CHECK_PERIOD_MS)
   {
     lastButtonCheck = millis();
-    sendSerialCommand(KXKM_STM32_Energy::GET_BUTTON_EVENT);
-
-    int buttonEvent = readSerialAnswer();
-    if (buttonEvent == KXKM_STM32_Energy::BUTTON_CLICK_EVENT)
-    {
-      debugI("Main button clicked.");
-      endTest(currentTestType);
-      currentTestType = (test_type_t)((int)currentTestType + 1);
-      beginTest(currentTestType);
-    }
-    else if (buttonEvent == KXKM_STM32_Energy::BUTTON_DOUBLE_CLICK_EVENT)
-    {
-      debugI("Main button double clicked.");
-      switch (currentTestType)
-      {
-        case TEST_ENTER_CRITICAL_SECTION:
-        case TEST_LEAVE_CRITICAL_SECTION:
-        {
-          debugI("Shutting down...");
-          unsigned int currentTime = millis();
-          while (millis() - currentTime < 1000)
-          {
-            Debug.handle();          
-          }
-          sendSerialCommand(KXKM_STM32_Energy::SHUTDOWN);
-          break;
-        }
-
-        default:
-          break;
-      }
-    }
+    stm32.send(KXKM_STM32_Energy::GET_BUTTON_EVENT);
   }
 
   switch (currentTestType)
@@ -172,7 +184,7 @@ void loop() {
     case TEST_LED_1:
     {
       static unsigned long ledUpdateTime = millis();
-      if (millis() - ledUpdateTime > 100)
+      if (stm32.apiVersion() < 14 && millis() - ledUpdateTime > 100)
       {
         ledUpdateTime = millis();
         uint8_t leds[] = {0, 0, 0, 0, 0, 0};
@@ -192,11 +204,11 @@ void loop() {
     case TEST_LED_2:
     {
       static unsigned long ledUpdateTime = millis();
-      if (millis() - ledUpdateTime > 20)
+      if (stm32.apiVersion() < 14 && millis() - ledUpdateTime > 20)
       {
         ledUpdateTime = millis();
         static uint8_t percentage = 0;
-        sendSerialCommand(KXKM_STM32_Energy::SET_LED_GAUGE, percentage++);
+        stm32.send(KXKM_STM32_Energy::SET_LED_GAUGE, percentage++);
 
         if (percentage >= 100)
           percentage = 0;
@@ -210,10 +222,7 @@ void loop() {
       if (millis() - ledUpdateTime > 50)
       {
         ledUpdateTime = millis();
-        sendSerialCommand(KXKM_STM32_Energy::GET_LOAD_CURRENT);
-        int percentage = readSerialAnswer() * 100 / 3500; //Max test current : 3500mA
-        
-        sendSerialCommand(KXKM_STM32_Energy::SET_LED_GAUGE, percentage);
+        stm32.request(KXKM_STM32_Energy::GET_LOAD_CURRENT, showLoadCurrent);
       }
       break;
     }
@@ -225,35 +234,149 @@ void loop() {
   Debug.handle();
 }
 
+void printTelemetry(const KXKM_STM32_Energy::Telemetry &telemetry)
+{
+  debugI("--------------------------------------------");
+  debugI("Batt voltage : %d mV (average %d mV)", telemetry.batteryVoltage, telemetry.avgBatteryVoltage);
+  debugI("Batt percentage : %d %%", telemetry.batteryPercentage);
+  debugI("Load current : %d mA", telemetry.loadCurrent);
+  debugI("Board temperature : %d deg. C", telemetry.temperature);
+  debugI("STM32 state : %d, uptime : %u ms", telemetry.state, telemetry.uptime);
+}
+
+void printLoadStats(const KXKM_STM32_Energy::LoadStats &stats)
+{
+  debugI("Load current : peak %d mA, min %d mA, mean %d mA, RMS %d mA", stats.peakCurrent, stats.minCurrent, stats.meanCurrent, stats.rmsCurrent);
+  debugI("Delivered : %u mAh, %u mWh", stats.charge, stats.energy);
+}
+
+void handleStm32Event(KXKM_STM32_Energy::PushEvent event)
+{
+  switch (event)
+  {
+    case KXKM_STM32_Energy::PUSH_BUTTON_CLICK:
+      processButtonEvent(KXKM_STM32_Energy::BUTTON_CLICK_EVENT);
+      break;
+
+    case KXKM_STM32_Energy::PUSH_BUTTON_DOUBLE_CLICK:
+      processButtonEvent(KXKM_STM32_Energy::BUTTON_DOUBLE_CLICK_EVENT);
+      break;
+
+    case KXKM_STM32_Energy::PUSH_BATTERY_LOW:
+      debugI("Battery low.");
+      break;
+
+    case KXKM_STM32_Energy::PUSH_BATTERY_OK:
+      debugI("Battery not low anymore.");
+      break;
+
+    case KXKM_STM32_Energy::PUSH_SHUTDOWN_PENDING:
+      debugI("STM32 shutdown pending.");
+      break;
+  }
+}
+
+void setLeds(uint8_t *values)
+{
+  int arg = 0;
+  for (int i = 0; i < 6; i++)
+    arg += values[i] * pow(10, i);
+
+  stm32.send(KXKM_STM32_Energy::SET_LEDS, arg);
+}
+
+void setSingleLed(uint8_t index)
+{
+  stm32.send(KXKM_STM32_Energy::SET_LEDS, 4 * pow(10, index));
+}
+
+void processButtonEvent(int buttonEvent)
+{
+  if (buttonEvent == KXKM_STM32_Energy::BUTTON_CLICK_EVENT)
+  {
+    debugI("Main button clicked.");
+    endTest(currentTestType);
+    currentTestType = (test_type_t)((int)currentTestType + 1);
+    beginTest(currentTestType);
+  }
+  else if (buttonEvent == KXKM_STM32_Energy::BUTTON_DOUBLE_CLICK_EVENT)
+  {
+    debugI("Main button double clicked.");
+    switch (currentTestType)
+    {
+      case TEST_ENTER_CRITICAL_SECTION:
+      case TEST_LEAVE_CRITICAL_SECTION:
+      {
+        debugI("Shutting down...");
+        unsigned int currentTime = millis();
+        while (millis() - currentTime < 1000)
+        {
+          Debug.handle();          
+        }
+        stm32.send(KXKM_STM32_Energy::SHUTDOWN);
+        break;
+      }
+
+      default:
+        break;
+    }
+  }
+}
+
 void beginTest(test_type_t test)
 {
   switch (test)
   {
+    case TEST_LED_1:
+      // Same chase as the SET_LEDS version, played by the STM32 (API version >= 14)
+      if (stm32.apiVersion() >= 14)
+      {
+        stm32.send(KXKM_STM32_Energy::ADD_ANIMATION_KEYFRAME, -1);
+        for (int idx = 0; idx < 6; idx++)
+        {
+          uint32_t leds = 0xFUL << (4 * idx);
+          if (idx < 5)
+            leds |= 0x8UL << (4 * (idx + 1));
+          if (idx > 0)
+            leds |= 0x4UL << (4 * (idx - 1));
+          stm32.send(KXKM_STM32_Energy::ADD_ANIMATION_KEYFRAME, KXKM_STM32_Energy::encodeKeyframe(leds, 8, false));
+        }
+        stm32.send(KXKM_STM32_Energy::PLAY_ANIMATION, KXKM_STM32_Energy::ANIMATION_CUSTOM); // Forever
+      }
+      break;
+
+    case TEST_LED_2:
+      if (stm32.apiVersion() >= 14)
+        stm32.send(KXKM_STM32_Energy::PLAY_ANIMATION, KXKM_STM32_Energy::ANIMATION_SWEEP_UP);
+      break;
+
     case TEST_LOAD_SW:
       debugI("Enabling load switch.");
-      sendSerialCommand(KXKM_STM32_Energy::SET_LOAD_SWITCH, 1);
+      stm32.send(KXKM_STM32_Energy::SET_LOAD_SWITCH, 1);
       break;
 
     case TEST_CUSTOM_BATT:
       debugI("Setting new battery characteristics.");
-      sendSerialCommand(KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_LOW, 12000);
-      sendSerialCommand(KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_3, 12500);
-      sendSerialCommand(KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_6, 14000);
+      stm32.send(KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_LOW, 12000);
+      stm32.send(KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_3, 12500);
+      stm32.send(KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_6, 14000);
+      if (stm32.apiVersion() >= 9)
+        stm32.send(KXKM_STM32_Energy::SET_BATTERY_CAPACITY, 5000);
       break;
 
     case TEST_ENTER_CRITICAL_SECTION:
       debugI("Entering critical section for 8s.");
-      sendSerialCommand(KXKM_STM32_Energy::ENTER_CRITICAL_SECTION, 8000);
+      stm32.send(KXKM_STM32_Energy::ENTER_CRITICAL_SECTION, 8000);
       break;
 
     case TEST_LEAVE_CRITICAL_SECTION:
       debugI("Leaving critical section");
-      sendSerialCommand(KXKM_STM32_Energy::LEAVE_CRITICAL_SECTION);
+      stm32.send(KXKM_STM32_Energy::LEAVE_CRITICAL_SECTION);
       break;
 
     case TEST_SELF_RESET:
       debugI("Self reset");
-      sendSerialCommand(KXKM_STM32_Energy::REQUEST_RESET);
+      stm32.send(KXKM_STM32_Energy::REQUEST_RESET);
 
     default:
       break;
@@ -264,9 +387,15 @@ void endTest(test_type_t test)
 {
   switch (test)
   {
+    case TEST_LED_1:
+    case TEST_LED_2:
+      if (stm32.apiVersion() >= 14)
+        stm32.send(KXKM_STM32_Energy::PLAY_ANIMATION, KXKM_STM32_Energy::ANIMATION_STOP);
+      break;
+
     case TEST_LOAD_SW:
       debugI("Disabling load switch.");
-      sendSerialCommand(KXKM_STM32_Energy::SET_LOAD_SWITCH, 0);
+      stm32.send(KXKM_STM32_Energy::SET_LOAD_SWITCH, 0);
       break;
 
     default:
@@ -2,54 +2,75 @@
 KXKM - ESP32 audio & battery module
 OLED screen test
 
-Battery voltage and percentage are queried every 2s and displayed on screen.
+Battery voltage and percentage are queried every 200ms and displayed on screen.
+The STM32 is driven by the non-blocking client : answers are stored when they arrive and the display
+shows the latest values.
 */
 
 #include "KXKM_STM32_energy_API.h"
+#include "KXKM_STM32_energy_client.h"
 #include "SSD1306Wire.h"
 
 const unsigned long BATTERY_CHECK_PERIOD_MS = 200;
 
 SSD1306Wire  display(0x3c, 2, 4); //SDA = 2, SCL = 4
+KXKM_STM32_Client stm32(Serial);
 
 int stm32FwVer = 0;
 String battType;
+long battVoltage = 0;
+long battPercentage = 0;
+
+void storeAnswer(KXKM_STM32_Energy::CommandType cmd, long value, bool timeout) {
+  if (timeout)
+    return;
+
+  switch (cmd) {
+    case KXKM_STM32_Energy::GET_FW_VERSION: stm32FwVer = value; break;
+    case KXKM_STM32_Energy::GET_BATTERY_VOLTAGE: battVoltage = value; break;
+    case KXKM_STM32_Energy::GET_BATTERY_PERCENTAGE: battPercentage = value; break;
+
+    case KXKM_STM32_Energy::GET_BATTERY_TYPE:
+      switch (value) {
+        case KXKM_STM32_Energy::BATTERY_LIPO: battType = "LiPo"; break;
+        case KXKM_STM32_Energy::BATTERY_LIFE: battType = "LiFe"; break;
+        case KXKM_STM32_Energy::BATTERY_CUSTOM: battType = "custom"; break;
+      }
+      break;
+
+    default:
+      break;
+  }
+}
 
 void setup() {
   Serial.begin(115200, SERIAL_8N1);
-  Serial.setTimeout(10);
 
   Serial.println("Beginning OLED test sketch.");
 
-  sendSerialCommand(KXKM_STM32_Energy::GET_FW_VERSION);
-  stm32FwVer = readSerialAnswer();
-
-  sendSerialCommand(KXKM_STM32_Energy::GET_BATTERY_TYPE);
-  switch (readSerialAnswer()) {
-    case KXKM_STM32_Energy::BATTERY_LIPO: battType = "LiPo"; break;
-    case KXKM_STM32_Energy::BATTERY_LIFE: battType = "LiFe"; break;
-    case KXKM_STM32_Energy::BATTERY_CUSTOM: battType = "custom"; break;
-  }
+  stm32.begin();
+  stm32.request(KXKM_STM32_Energy::GET_FW_VERSION, storeAnswer);
+  stm32.request(KXKM_STM32_Energy::GET_BATTERY_TYPE, storeAnswer);
 
   display.init();
 }
 
 void loop() {
   static unsigned long lastBatteryCheck;
+  stm32.update();
+
   if (millis() - lastBatteryCheck > BATTERY_CHECK_PERIOD_MS)
   {
     lastBatteryCheck = millis();
 
+    stm32.request(KXKM_STM32_Energy::GET_BATTERY_VOLTAGE, storeAnswer);
+    stm32.request(KXKM_STM32_Energy::GET_BATTERY_PERCENTAGE, storeAnswer);
+
     display.clear();
     display.drawString(0, 0, "STM32 FW ver. " + String(stm32FwVer));
     display.drawString(0, 10, "Battery type : " + battType);
-
-    sendSerialCommand(KXKM_STM32_Energy::GET_BATTERY_VOLTAGE);
-    display.drawString(0, 38, "Battery voltage : " + String((float)readSerialAnswer() / 1000.0) + "V");
-
-    sendSerialCommand(KXKM_STM32_Energy::GET_BATTERY_PERCENTAGE);
-    display.drawString(0, 48, "Batt percentage : " + String(readSerialAnswer()) + "%");
-
+    display.drawString(0, 38, "Battery voltage : " + String((float)battVoltage / 1000.0) + "V");
+    display.drawString(0, 48, "Batt percentage : " + String(battPercentage) + "%");
     display.display();
   }
 }
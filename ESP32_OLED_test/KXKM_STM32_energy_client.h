@@ -0,0 +1,500 @@
+/* KXKM - STM32 coprocessor API client
+
+Non-blocking client for the STM32 energy API (see KXKM_STM32_energy_API.h), running on the main processor.
+
+The client owns the serial port : requests are queued and sent as soon as possible, answers are parsed
+incrementally in update() and delivered through callbacks. The last telemetry and load stats received are cached.
+
+begin() queries the STM32 API version in plain text, then the client switches to the best protocol available :
+  * API version < 3 : text, one request at a time
+  * API version 3 - 5 : binary frames, one request at a time
+  * API version >= 6 : binary frames with sequence numbers, requests are pipelined
+Requests queued before the API version is known are sent after the negotiation. GET_API_VERSION is sent up to
+NEGOTIATION_ATTEMPTS times (the STM32 may still be booting) before the client falls back to the text protocol.
+
+update() must be called often (from loop() for example). It never waits for data.
+*/
+
+#ifndef KXKM_STM32_ENERGY_CLIENT_H
+#define KXKM_STM32_ENERGY_CLIENT_H
+
+#include <Arduino.h>
+#include "KXKM_STM32_energy_API.h"
+
+class KXKM_STM32_Client {
+public:
+  /* Called with the answer to a request. On timeout, value is 0 and timeout is true. */
+  typedef void (*AnswerCallback)(KXKM_STM32_Energy::CommandType cmd, long value, bool timeout);
+
+  /* Called for each telemetry received (answer to GET_TELEMETRY or pushed telemetry) */
+  typedef void (*TelemetryCallback)(const KXKM_STM32_Energy::Telemetry &telemetry);
+
+  /* Called for each load stats received (answer to GET_LOAD_STATS) */
+  typedef void (*LoadStatsCallback)(const KXKM_STM32_Energy::LoadStats &stats);
+
+  /* Called for each event pushed by the STM32. Button events found in GET_BUTTON_EVENT and GET_TELEMETRY
+     answers are also reported here. */
+  typedef void (*EventCallback)(KXKM_STM32_Energy::PushEvent event);
+
+  static constexpr uint8_t QUEUE_SIZE = 8;
+  static constexpr unsigned long ANSWER_TIMEOUT_MS = 50;
+  static constexpr uint8_t NEGOTIATION_ATTEMPTS = 3;
+
+  KXKM_STM32_Client(Stream &serial) : _serial(serial) {}
+
+  /* Start the protocol negotiation. The serial port should already be initialized. */
+  void begin()
+  {
+    _apiVersion = -1;
+    _binary = false;
+    _negotiationAttempts = 0;
+    _queueCount = 0;
+    _parserState = IDLE;
+    send(KXKM_STM32_Energy::GET_API_VERSION);
+  }
+
+  /* Queue a command. The answer, if any, is ignored.
+     Return false if the queue is full. */
+  bool send(KXKM_STM32_Energy::CommandType cmd, long arg = 0)
+  {
+    return enqueue(cmd, arg, NULL);
+  }
+
+  /* Queue a SET_LED_FRAME command : the brightness of each LED, 0 to 255 (API version >= 15, binary protocol).
+     Return false if the queue is full or the STM32 doesn't support it. */
+  bool sendLedFrame(const uint8_t *values)
+  {
+    if (!_binary || _apiVersion < 15 || !enqueue(KXKM_STM32_Energy::SET_LED_FRAME, 0, NULL, false))
+      return false;
+
+    Request &req = _queue[_queueCount - 1];
+    memcpy(req.leds, values, KXKM_STM32_Energy::LED_FRAME_SIZE);
+    sendPending();
+    return true;
+  }
+
+  /* Queue a request. The callback is called with the answer.
+     Return false if the queue is full. */
+  bool request(KXKM_STM32_Energy::CommandType cmd, AnswerCallback callback)
+  {
+    return enqueue(cmd, 0, callback);
+  }
+
+  /* Parse received data, handle timeouts and send queued requests. */
+  void update()
+  {
+    if (_parserState != IDLE && millis() - _lastByteTime > ANSWER_TIMEOUT_MS)
+      _parserState = IDLE; // Drop incomplete answers
+
+    while (_serial.available())
+    {
+      parseByte(_serial.read());
+      _lastByteTime = millis();
+    }
+
+    for (uint8_t i = 0; i < _queueCount; )
+    {
+      if (!_queue[i].sent || millis() - _queue[i].sentTime <= ANSWER_TIMEOUT_MS)
+        i++;
+      else if (_queue[i].cmd == KXKM_STM32_Energy::GET_API_VERSION && _apiVersion < 0 &&
+               ++_negotiationAttempts < NEGOTIATION_ATTEMPTS)
+        _queue[i++].sent = false; // Sent again below
+      else
+        complete(i, 0, true); // Removes the request
+    }
+
+    sendPending();
+  }
+
+  /* Number of requests waiting to be sent or answered */
+  uint8_t pending() const { return _queueCount; }
+
+  /* STM32 API version, -1 until known */
+  int apiVersion() const { return _apiVersion; }
+  bool isBinary() const { return _binary; }
+
+  /* Last telemetry received and its reception time (0 if none) */
+  const KXKM_STM32_Energy::Telemetry &telemetry() const { return _telemetry; }
+  unsigned long telemetryTime() const { return _telemetryTime; }
+
+  /* Last load stats received */
+  const KXKM_STM32_Energy::LoadStats &loadStats() const { return _loadStats; }
+
+  void onTelemetry(TelemetryCallback callback) { _telemetryCallback = callback; }
+  void onLoadStats(LoadStatsCallback callback) { _loadStatsCallback = callback; }
+  void onEvent(EventCallback callback) { _eventCallback = callback; }
+
+private:
+  struct Request {
+    uint8_t cmd;
+    long arg;
+    uint8_t leds[KXKM_STM32_Energy::LED_FRAME_SIZE]; // SET_LED_FRAME payload
+    AnswerCallback callback;
+    bool sent;
+    uint8_t seq;
+    unsigned long sentTime;
+  };
+
+  enum ParserState {
+    IDLE,
+    PREAMBLE,
+    TEXT_VALUES, // Until the end of line
+    FRAME_CMD,
+    FRAME_SEQ,
+    FRAME_LEN,
+    FRAME_PAYLOAD // Payload and CRC
+  };
+
+  Stream &_serial;
+  int _apiVersion = -1;
+  bool _binary = false;
+  uint8_t _negotiationAttempts = 0;
+
+  Request _queue[QUEUE_SIZE];
+  uint8_t _queueCount = 0;
+  uint8_t _nextSeq = 0;
+
+  KXKM_STM32_Energy::Telemetry _telemetry = {};
+  unsigned long _telemetryTime = 0;
+  TelemetryCallback _telemetryCallback = NULL;
+  KXKM_STM32_Energy::LoadStats _loadStats = {};
+  LoadStatsCallback _loadStatsCallback = NULL;
+  EventCallback _eventCallback = NULL;
+
+  ParserState _parserState = IDLE;
+  unsigned long _lastByteTime = 0;
+  uint8_t _parserIndex;
+  uint8_t _frameCmd;
+  int _frameSeq;
+  uint8_t _frameLen;
+  uint8_t _framePayload[KXKM_STM32_Energy::FRAME_MAX_PAYLOAD + 1];
+  long _textValues[KXKM_STM32_Energy::TELEMETRY_FIELDS];
+  uint8_t _textCount;
+  long _textValue;
+  bool _textDigits;
+  bool _textNegative;
+
+  bool pipelined() const { return _binary && _apiVersion >= 6; }
+
+  bool enqueue(KXKM_STM32_Energy::CommandType cmd, long arg, AnswerCallback callback, bool send = true)
+  {
+    if (_queueCount >= QUEUE_SIZE)
+      return false;
+
+    Request &req = _queue[_queueCount++];
+    req.cmd = cmd;
+    req.arg = arg;
+    req.callback = callback;
+    req.sent = false;
+
+    if (send)
+      sendPending();
+    return true;
+  }
+
+  /* Send queued requests, in order. Without pipelining, wait for the answer to the previous request. */
+  void sendPending()
+  {
+    for (uint8_t i = 0; i < _queueCount; )
+    {
+      Request &req = _queue[i];
+      if (req.sent)
+      {
+        if (!pipelined())
+          return; // Waiting for the answer
+        i++;
+        continue;
+      }
+
+      if (_apiVersion < 0 && req.cmd != KXKM_STM32_Energy::GET_API_VERSION)
+        return; // Wait for the negotiation
+
+      sendRequest(req);
+
+      if (KXKM_STM32_Energy::hasAnswer((KXKM_STM32_Energy::CommandType)req.cmd))
+      {
+        req.sent = true;
+        req.sentTime = millis();
+        if (!pipelined())
+          return; // Waiting for the answer
+        i++;
+      }
+      else
+        remove(i);
+    }
+  }
+
+  void sendRequest(Request &req)
+  {
+    bool hasArg = KXKM_STM32_Energy::hasArgument((KXKM_STM32_Energy::CommandType)req.cmd);
+
+    if (!_binary)
+    {
+      _serial.write(KXKM_STM32_Energy::PREAMBLE);
+      _serial.write(req.cmd);
+      if (hasArg)
+      {
+        _serial.write(' ');
+        _serial.print(req.arg);
+      }
+      _serial.println();
+      return;
+    }
+
+    uint8_t payload[KXKM_STM32_Energy::FRAME_VALUE_SIZE];
+    KXKM_STM32_Energy::encodeValue(payload, req.arg);
+
+    int seq = KXKM_STM32_Energy::NO_SEQUENCE;
+    if (pipelined())
+      seq = req.seq = _nextSeq++;
+
+    uint8_t frame[KXKM_STM32_Energy::FRAME_MAX_SIZE];
+    if (req.cmd == KXKM_STM32_Energy::SET_LED_FRAME)
+      _serial.write(frame, KXKM_STM32_Energy::encodeFrame(frame, req.cmd, req.leds, sizeof(req.leds), seq));
+    else
+      _serial.write(frame, KXKM_STM32_Energy::encodeFrame(frame, req.cmd, payload, hasArg ? sizeof(payload) : 0, seq));
+  }
+
+  void remove(uint8_t index)
+  {
+    for (uint8_t i = index; i + 1 < _queueCount; i++)
+      _queue[i] = _queue[i + 1];
+    _queueCount--;
+  }
+
+  /* Deliver an answer and remove the request from the queue */
+  void complete(uint8_t index, long value, bool timeout)
+  {
+    Request req = _queue[index];
+    remove(index);
+
+    if (req.cmd == KXKM_STM32_Energy::GET_API_VERSION && _apiVersion < 0)
+    {
+      _apiVersion = timeout ? 0 : value;
+      _binary = (_apiVersion >= 3);
+    }
+
+    if (req.cmd == KXKM_STM32_Energy::GET_BUTTON_EVENT && !timeout)
+      reportButtonEvent(value);
+
+    if (req.callback != NULL)
+      req.callback((KXKM_STM32_Energy::CommandType)req.cmd, value, timeout);
+  }
+
+  /* Find the request matching an answer. Without sequence number, this is the oldest request sent. */
+  int findRequest(uint8_t cmd, int seq)
+  {
+    for (uint8_t i = 0; i < _queueCount; i++)
+    {
+      if (!_queue[i].sent)
+        break;
+      if ((seq == KXKM_STM32_Energy::NO_SEQUENCE || _queue[i].seq == seq) && _queue[i].cmd == cmd)
+        return i;
+    }
+    return -1;
+  }
+
+  void reportButtonEvent(long event)
+  {
+    if (event != KXKM_STM32_Energy::NO_EVENT && _eventCallback != NULL)
+      _eventCallback((KXKM_STM32_Energy::PushEvent)event);
+  }
+
+  void updateTelemetry(const KXKM_STM32_Energy::Telemetry &telemetry)
+  {
+    _telemetry = telemetry;
+    _telemetryTime = millis();
+    if (_telemetryCallback != NULL)
+      _telemetryCallback(_telemetry);
+  }
+
+  void updateLoadStats(const KXKM_STM32_Energy::LoadStats &stats)
+  {
+    _loadStats = stats;
+    if (_loadStatsCallback != NULL)
+      _loadStatsCallback(_loadStats);
+  }
+
+  /* Handle a complete binary frame */
+  void handleFrame()
+  {
+    if (_framePayload[_frameLen] != KXKM_STM32_Energy::frameCrc(_frameCmd, _framePayload, _frameLen, _frameSeq))
+      return;
+
+    long value = (_frameLen >= KXKM_STM32_Energy::FRAME_VALUE_SIZE) ? KXKM_STM32_Energy::decodeValue(_framePayload) : 0;
+    bool isTelemetry = (_frameLen == KXKM_STM32_Energy::TELEMETRY_SIZE &&
+      (_frameCmd == KXKM_STM32_Energy::GET_TELEMETRY || _frameCmd == KXKM_STM32_Energy::PUSH_TELEMETRY));
+
+    if (isTelemetry)
+    {
+      KXKM_STM32_Energy::Telemetry telemetry;
+      KXKM_STM32_Energy::decodeTelemetry(_framePayload, telemetry);
+      updateTelemetry(telemetry);
+      value = 0;
+    }
+
+    if (_frameCmd == KXKM_STM32_Energy::GET_LOAD_STATS && _frameLen == KXKM_STM32_Energy::LOAD_STATS_SIZE)
+    {
+      KXKM_STM32_Energy::LoadStats stats;
+      KXKM_STM32_Energy::decodeLoadStats(_framePayload, stats);
+      updateLoadStats(stats);
+      value = 0;
+    }
+
+    if (_frameCmd == KXKM_STM32_Energy::PUSH_EVENT)
+    {
+      if (_eventCallback != NULL)
+        _eventCallback((KXKM_STM32_Energy::PushEvent)value);
+      return;
+    }
+
+    if (_frameCmd == KXKM_STM32_Energy::PUSH_TELEMETRY)
+      return;
+
+    if (isTelemetry)
+      reportButtonEvent(_telemetry.buttonEvent);
+
+    int index = findRequest(_frameCmd, _frameSeq);
+    if (index >= 0)
+      complete(index, value, false);
+  }
+
+  /* Handle a complete text answer. Text answers don't carry the command type : this is the oldest request sent.
+     Ignored once the binary protocol is negotiated : a text line (a late negotiation answer, debug output) would
+     complete a binary request with its value. */
+  void handleTextAnswer()
+  {
+    if (_binary || _queueCount == 0 || !_queue[0].sent || _textCount == 0)
+      return;
+
+    if (_queue[0].cmd == KXKM_STM32_Energy::GET_TELEMETRY)
+    {
+      if (_textCount < KXKM_STM32_Energy::TELEMETRY_FIELDS)
+        return;
+
+      KXKM_STM32_Energy::Telemetry telemetry;
+      telemetry.batteryVoltage = _textValues[0];
+      telemetry.avgBatteryVoltage = _textValues[1];
+      telemetry.batteryPercentage = _textValues[2];
+      telemetry.loadCurrent = _textValues[3];
+      telemetry.temperature = _textValues[4];
+      telemetry.buttonEvent = _textValues[5];
+      telemetry.state = _textValues[6];
+      telemetry.uptime = _textValues[7];
+      updateTelemetry(telemetry);
+      reportButtonEvent(telemetry.buttonEvent);
+      complete(0, 0, false);
+      return;
+    }
+
+    if (_queue[0].cmd == KXKM_STM32_Energy::GET_LOAD_STATS)
+    {
+      if (_textCount < KXKM_STM32_Energy::LOAD_STATS_FIELDS)
+        return;
+
+      KXKM_STM32_Energy::LoadStats stats;
+      stats.peakCurrent = _textValues[0];
+      stats.minCurrent = _textValues[1];
+      stats.meanCurrent = _textValues[2];
+      stats.rmsCurrent = _textValues[3];
+      stats.charge = _textValues[4];
+      stats.energy = _textValues[5];
+      updateLoadStats(stats);
+      complete(0, 0, false);
+      return;
+    }
+
+    complete(0, _textValues[0], false);
+  }
+
+  void endTextValue()
+  {
+    if (_textDigits && _textCount < KXKM_STM32_Energy::TELEMETRY_FIELDS)
+      _textValues[_textCount++] = _textNegative ? -_textValue : _textValue;
+    _textValue = 0;
+    _textDigits = false;
+    _textNegative = false;
+  }
+
+  /* Incremental answer parser (text and binary) */
+  void parseByte(uint8_t c)
+  {
+    switch (_parserState)
+    {
+      case IDLE:
+        _parserIndex = 1;
+        if (c == KXKM_STM32_Energy::PREAMBLE[0])
+          _parserState = PREAMBLE;
+        else if (c == KXKM_STM32_Energy::FRAME_SYNC || c == KXKM_STM32_Energy::FRAME_SYNC_SEQ)
+        {
+          _frameSeq = (c == KXKM_STM32_Energy::FRAME_SYNC_SEQ) ? 0 : KXKM_STM32_Energy::NO_SEQUENCE;
+          _parserState = FRAME_CMD;
+        }
+        return;
+
+      case PREAMBLE:
+        if (c != KXKM_STM32_Energy::PREAMBLE[_parserIndex])
+          break; // Not a preamble, try to resync on this byte
+
+        if (++_parserIndex >= strlen(KXKM_STM32_Energy::PREAMBLE))
+        {
+          _textCount = 0;
+          _textValue = 0;
+          _textDigits = false;
+          _textNegative = false;
+          _parserState = TEXT_VALUES;
+        }
+        return;
+
+      case TEXT_VALUES:
+        if (c >= '0' && c <= '9')
+        {
+          _textValue = _textValue * 10 + (c - '0');
+          _textDigits = true;
+        }
+        else if (c == '-' && !_textDigits)
+          _textNegative = true;
+        else if (c == ' ')
+          endTextValue();
+        else if (c == '\r' || c == '\n')
+        {
+          endTextValue();
+          _parserState = IDLE;
+          handleTextAnswer();
+        }
+        else
+          break; // Unexpected character
+        return;
+
+      case FRAME_CMD:
+        _frameCmd = c;
+        _parserState = (_frameSeq == KXKM_STM32_Energy::NO_SEQUENCE) ? FRAME_LEN : FRAME_SEQ;
+        return;
+
+      case FRAME_SEQ:
+        _frameSeq = c;
+        _parserState = FRAME_LEN;
+        return;
+
+      case FRAME_LEN:
+        _frameLen = c;
+        _parserIndex = 0;
+        _parserState = (c <= KXKM_STM32_Energy::FRAME_MAX_PAYLOAD) ? FRAME_PAYLOAD : IDLE;
+        return;
+
+      case FRAME_PAYLOAD:
+        _framePayload[_parserIndex++] = c;
+        if (_parserIndex <= _frameLen)
+          return; // Payload + CRC
+
+        _parserState = IDLE;
+        handleFrame();
+        return;
+    }
+
+    _parserState = IDLE;
+    parseByte(c);
+  }
+};
+
+#endif //KXKM_STM32_ENERGY_CLIENT_H
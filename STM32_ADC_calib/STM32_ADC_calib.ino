@@ -2,8 +2,15 @@
 KXKM - ESP32 audio & battery module
 STM32 ADC calib test
 REMEMBER TO SET THE SUPPLY VOLTAGE TO 24V BEFORE SWITCHING TO THE BATT CALIB !
+
+The battery voltage reading is measured at 24V (CALIBRATION_VOLTAGE) on startup, then at 12V (CALIBRATION_LOW_VOLTAGE)
+when a character is received on the serial port. The load current reading is measured with the load switch off.
+The calibration record (gain, offset, see calibration.h) is appended to the storage pages of the firmware, the 24V
+reading is also stored in the option bytes for the older firmwares.
 */
 
+#include "calibration.h"
+#include "profile_storage.h"
 
 const uint8_t LED_PINS[] = {4,3,2,1};
 const uint8_t POWER_ENABLE_PIN = 12; //Self power enable. Keep HIGH to stay powered
@@ -14,11 +21,19 @@ const uint8_t BATT_TYPE_SELECTOR_PINS[] = {10,11}; //3-way selector
 const uint8_t LOAD_CURRENT_SENSE_PIN = A0; //Load switch current measurement
 const uint8_t BATT_VOLTAGE_SENSE_PIN = A1; //Battery voltage measurement
 const uint8_t ESP32_TX_PIN = 8;
+#if HW_REVISION > 1
+const uint8_t TEMP_MEAS_PIN = 4; //Thermistor measurement
+#endif
 
 const uint8_t LED_ORDERING[] = {1,0,3,5,4,2};
 
 const int ADC_AVG_COUNT = 256;
 
+// Drift of the battery voltage reading (ppm/°C), characterized on a board in a climatic chamber. 0 : not compensated.
+const int16_t VOLTAGE_TEMP_COEFFICIENT = 0;
+
+const uint32_t BOARD_ID_ADDRESS = 0x08003FFC; // Last word of the flash, see board_id.h in the firmware
+
 void setup() {
   pinMode(POWER_ENABLE_PIN, OUTPUT);
   pinMode(ESP32_ENABLE_PIN, OUTPUT);
@@ -31,6 +46,7 @@ void setup() {
   pinMode(ESP32_TX_PIN, INPUT); // Switch TX to High Z (shared with ESP32 programmation connector)
 
   digitalWrite(POWER_ENABLE_PIN, HIGH); //Keep 3.3V regulator enabled
+  digitalWrite(MAIN_OUT_ENABLE_PIN, LOW); //No load current during the calibration
 
   analogReadResolution(12);
 
@@ -39,29 +55,71 @@ void setup() {
   Serial1.print("OB : ");
   Serial1.println(readCalibrationValue());
 
+  AdcCalibration calibration;
+  calibration.currentGain = CALIBRATION_GAIN_ONE;
+  calibration.currentOffset = readAverage(LOAD_CURRENT_SENSE_PIN);
+  calibration.thermistorOffset = 0;
+  calibration.tempCoefficient = VOLTAGE_TEMP_COEFFICIENT;
+  calibration.referenceTempAdc = CALIBRATION_NO_TEMPERATURE;
+
+  #if HW_REVISION > 1
+    pinMode(TEMP_MEAS_PIN, INPUT_ANALOG);
+    calibration.referenceTempAdc = readAverage(TEMP_MEAS_PIN) >> CALIBRATION_FRAC_BITS;
+    pinMode(TEMP_MEAS_PIN, OUTPUT); // Avoid self heating
+    digitalWrite(TEMP_MEAS_PIN, LOW);
+  #endif
+
   // Store into option byte the current ADC read
-  uint32_t adcRead = 0;
-  for (int i = 0; i < ADC_AVG_COUNT; i++)
-  {
-    adcRead += analogRead(BATT_VOLTAGE_SENSE_PIN);
-  }
-  adcRead /= ADC_AVG_COUNT;
+  uint16_t highRead = readAverage(BATT_VOLTAGE_SENSE_PIN);
 
   delay(2000);
 
   Serial1.print("Storing ");
-  Serial1.println(adcRead);
+  Serial1.println(highRead >> CALIBRATION_FRAC_BITS);
 
   delay(1000);
 
-  storeCalibrationValue(adcRead);
+  storeCalibrationValue(highRead >> CALIBRATION_FRAC_BITS);
+
+  Serial1.println("Set the supply voltage to 12V then send any character");
+  while (Serial1.available() == 0);
+
+  uint16_t lowRead = readAverage(BATT_VOLTAGE_SENSE_PIN);
 
+  // Straight line through both points
+  long long offset = ((long long)lowRead * CALIBRATION_VOLTAGE - (long long)highRead * CALIBRATION_LOW_VOLTAGE)
+                     / (CALIBRATION_VOLTAGE - CALIBRATION_LOW_VOLTAGE);
+  calibration.voltageOffset = offset;
+  calibration.voltageGain = highRead - offset;
+
+  Serial1.print("Gain ");
+  Serial1.print(calibration.voltageGain);
+  Serial1.print(" offset ");
+  Serial1.print(calibration.voltageOffset);
+  Serial1.print(" current offset ");
+  Serial1.println(calibration.currentOffset);
+
+  if (storeCalibrationRecord(calibration))
+    Serial1.println("Calibration stored");
+  else
+    Serial1.println("Storage error");
 }
 
 void loop() {
 
 }
 
+/* Average ADC_AVG_COUNT readings, with CALIBRATION_FRAC_BITS fractional bits */
+uint16_t readAverage(uint8_t pin)
+{
+  uint32_t adcRead = 0;
+  for (int i = 0; i < ADC_AVG_COUNT; i++)
+  {
+    adcRead += analogRead(pin);
+  }
+  return (adcRead << CALIBRATION_FRAC_BITS) / ADC_AVG_COUNT;
+}
+
 
 void storeCalibrationValue(uint16_t calibValue)
 {
@@ -96,3 +154,130 @@ uint16_t readCalibrationValue()
 {
   return (HAL_FLASHEx_OBGetUserData(OB_DATA_ADDRESS_DATA1) << 8) + HAL_FLASHEx_OBGetUserData(OB_DATA_ADDRESS_DATA0);
 }
+
+/* Append the calibration to the log of the firmware storage pages (see profile_storage.ino in the firmware). If the
+   current page is full, the log goes on in the other page with the current records : the previous page stays valid
+   until the header of the new one is written. */
+bool storeCalibrationRecord(const AdcCalibration& calibration)
+{
+  const uint16_t recordsCount = (FLASH_PAGE_SIZE - sizeof(uint32_t)) / sizeof(ProfileRecord);
+
+  extern uint32_t _sidata, _sdata, _edata; // From the linker script
+  if ((uint32_t)&_sidata + ((uint32_t)&_edata - (uint32_t)&_sdata) > PROFILE_STORAGE_START)
+    return false; // This sketch reaches the storage pages
+
+  ProfileRecord record;
+  memset(&record, 0xFF, sizeof(record));
+  record.type = PROFILE_RECORD_CALIBRATION;
+  record.index = 0;
+  memcpy(record.values, &calibration, sizeof(calibration));
+  record.crc = recordCrc(record);
+
+  // Current page : valid header with the newest sequence number
+  const ProfileRecord* current = NULL;
+  for (uint8_t page = 0; page < PROFILE_STORAGE_PAGES; page++)
+  {
+    const ProfileRecord* header = (const ProfileRecord*)(PROFILE_STORAGE_START + page * FLASH_PAGE_SIZE);
+    if (header->type == PROFILE_RECORD_HEADER && header->values[3] == PROFILE_STORAGE_MAGIC && header->crc == recordCrc(*header) &&
+        (current == NULL || (int16_t)(header->values[0] - current->values[0]) > 0))
+      current = header;
+  }
+
+  uint16_t used = 0;
+  if (current != NULL)
+    while (used < recordsCount && current[used].type != PROFILE_RECORD_EMPTY)
+      used++;
+
+  HAL_FLASH_Unlock();
+  bool ok;
+  if (current != NULL && used < recordsCount)
+    ok = programRecord((uintptr_t)&current[used], record);
+  else
+    ok = switchStoragePage(current, used, record);
+  HAL_FLASH_Lock();
+  return ok;
+}
+
+/* Erase the other storage page, copy the last valid record of each kind and the new record, then write the header */
+bool switchStoragePage(const ProfileRecord* current, uint16_t used, const ProfileRecord& record)
+{
+  uint32_t pageAddress = (current == (const ProfileRecord*)PROFILE_STORAGE_START) ? PROFILE_STORAGE_START + FLASH_PAGE_SIZE : PROFILE_STORAGE_START;
+  uint32_t boardId = *(volatile uint32_t*)BOARD_ID_ADDRESS;
+  if (current != NULL && (boardId & 0xFFFF) == 0xFFFF) // Interrupted page switch : restored from the header
+    boardId = (boardId & 0xFFFF0000) | current->values[1];
+  if (current != NULL && (boardId >> 16) == 0xFFFF)
+    boardId = (boardId & 0xFFFF) | ((uint32_t)current->values[2] << 16);
+
+  FLASH_EraseInitTypeDef erase;
+  erase.TypeErase = FLASH_TYPEERASE_PAGES;
+  erase.PageAddress = pageAddress;
+  erase.NbPages = 1;
+  uint32_t pageError;
+  if (HAL_FLASHEx_Erase(&erase, &pageError) != HAL_OK)
+    return false;
+
+  if (pageAddress == (BOARD_ID_ADDRESS & ~(FLASH_PAGE_SIZE - 1)) && boardId != 0xFFFFFFFF &&
+      HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, BOARD_ID_ADDRESS, boardId) != HAL_OK)
+    return false;
+
+  const ProfileRecord* target = (const ProfileRecord*)pageAddress;
+  uint16_t count = 1;
+  for (uint16_t i = 1; i < used; i++)
+  {
+    if (current[i].crc != recordCrc(current[i]) || sameRecordKind(current[i], record))
+      continue;
+
+    bool replaced = false;
+    for (uint16_t j = i + 1; j < used; j++)
+      replaced = replaced || (sameRecordKind(current[i], current[j]) && current[j].crc == recordCrc(current[j]));
+
+    if (!replaced && !programRecord((uintptr_t)&target[count++], current[i]))
+      return false;
+  }
+
+  if (!programRecord((uintptr_t)&target[count], record))
+    return false;
+
+  ProfileRecord header;
+  memset(&header, 0xFF, sizeof(header));
+  header.type = PROFILE_RECORD_HEADER;
+  header.index = 0;
+  header.values[0] = (current != NULL) ? current->values[0] + 1 : 1;
+  header.values[1] = boardId;
+  header.values[2] = boardId >> 16;
+  header.values[3] = PROFILE_STORAGE_MAGIC;
+  header.crc = recordCrc(header);
+  return programRecord(pageAddress, header);
+}
+
+bool programRecord(uint32_t address, const ProfileRecord& record)
+{
+  const uint16_t* data = (const uint16_t*)&record;
+  for (uint8_t i = 0; i < sizeof(record) / 2; i++)
+    if (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 2 * i, data[i]) != HAL_OK)
+      return false;
+  return true;
+}
+
+/* Same kinds as the firmware : the index is ignored for the selection */
+bool sameRecordKind(const ProfileRecord& a, const ProfileRecord& b)
+{
+  return a.type == b.type && (a.type == PROFILE_RECORD_SELECTION || a.index == b.index);
+}
+
+uint8_t recordCrc(const ProfileRecord& record)
+{
+  uint8_t crc = 0;
+  for (uint8_t i = 0; i < offsetof(ProfileRecord, crc); i++)
+    crc = crc8(crc, ((const uint8_t*)&record)[i]);
+  return crc;
+}
+
+/* Same CRC-8 as KXKM_STM32_Energy::crc8 (polynomial 0x07) */
+uint8_t crc8(uint8_t crc, uint8_t data)
+{
+  crc ^= data;
+  for (uint8_t i = 0; i < 8; i++)
+    crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+  return crc;
+}
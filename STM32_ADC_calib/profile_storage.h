@@ -0,0 +1,31 @@
+#ifndef PROFILE_STORAGE_H
+#define PROFILE_STORAGE_H
+
+#include <Arduino.h>
+
+/* Battery profile storage record (see profile_storage.ino). 20 bytes, written as half-words.
+   This file is shared with STM32_ADC_calib : keep both copies identical. */
+enum ProfileRecordType {
+  PROFILE_RECORD_HEADER = 0x50, // First record of a page, written last : values[0] is the sequence number of the page,
+                                // values[1] and values[2] a copy of the board ID, values[3] PROFILE_STORAGE_MAGIC
+  PROFILE_RECORD_USER = 0x51, // User profile : index is the slot, values are the voltage breaks (mV)
+  PROFILE_RECORD_SELECTION = 0x52, // Selected profile : index is the BatteryProfile, values[0] the number of cells
+  PROFILE_RECORD_LAST_PACK = 0x53, // Last pack detected : index is the built-in BatteryProfile, values[0] the number of cells
+  PROFILE_RECORD_CALIBRATION = 0x54, // ADC calibration : index is 0, values are an AdcCalibration
+  PROFILE_RECORD_EMPTY = 0xFF // Erased flash : end of the log
+};
+
+struct ProfileRecord {
+  uint8_t type;
+  uint8_t index;
+  uint16_t values[7];
+  uint8_t crc; // CRC-8 of the previous bytes
+  uint8_t reserved[3];
+};
+
+/* The log alternates between two pages : the one below the board ID page, and the board ID page */
+const uint32_t PROFILE_STORAGE_START = 0x08003800;
+const uint8_t PROFILE_STORAGE_PAGES = 2;
+const uint16_t PROFILE_STORAGE_MAGIC = 0x4B58;
+
+#endif
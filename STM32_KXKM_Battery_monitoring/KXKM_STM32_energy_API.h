@@ -7,6 +7,8 @@ The basic transaction is as follows :
   * main processor > STM32 : ### <cmd type> [optional argument]\n
   * STM32 > main processor : ### [optional answer / ack]\n
 
+Since API version 3, the same commands can also be sent as binary frames (see FRAME_SYNC).
+
 Tom Magnier - 04/2018
 */
 
@@ -18,7 +20,28 @@ public:
   static constexpr char* PREAMBLE = "### ";
 
   /* API Version */
-  static constexpr uint8_t API_VERSION = 2;
+  static constexpr uint8_t API_VERSION = 21;
+
+  /* Binary protocol (API version >= 3).
+     The text protocol is always available. Once the main processor has checked the API version of the
+     STM32, it can switch to binary frames which are shorter and don't need any number parsing :
+       * FRAME_SYNC | cmd type | payload length | payload | CRC-8
+     The CRC-8 (polynomial 0x07, init 0) is computed over the cmd type, the payload length and the payload.
+     Arguments and answers are sent as 4-byte little endian signed integers. Commands without argument
+     have an empty payload.
+     The STM32 answers in the format used by the request, and binary answers carry the cmd type of the request.
+
+     Pipelining (API version >= 6) : a request can carry a sequence number, which is repeated in the answer.
+     The main processor can then send several requests without waiting for each answer :
+       * FRAME_SYNC_SEQ | cmd type | sequence number | payload length | payload | CRC-8
+     The CRC also covers the sequence number. */
+  static constexpr uint8_t FRAME_SYNC = 0xA5;
+  static constexpr uint8_t FRAME_SYNC_SEQ = 0xA6;
+  static constexpr uint8_t FRAME_HEADER_SIZE = 3; // Sync, cmd type, payload length
+  static constexpr uint8_t FRAME_MAX_PAYLOAD = 16;
+  static constexpr uint8_t FRAME_MAX_SIZE = FRAME_HEADER_SIZE + 1 + FRAME_MAX_PAYLOAD + 1; // With sequence number
+  static constexpr int NO_SEQUENCE = -1;
+  static constexpr uint8_t FRAME_VALUE_SIZE = 4;
 
   /* Command types (main processor > STM32) */
   enum CommandType {
@@ -49,13 +72,23 @@ public:
 
     /* Get battery percentage.
        No argument.
-       The STM32 will answer with the estimated battery level. */
+       The STM32 will answer with the estimated battery level. Since API version 9, the voltage drop under load is
+        compensated, and the delivered charge is integrated if the battery capacity is known. */
     GET_BATTERY_PERCENTAGE = '%',
 
     /* Get battery type as set by the 3-way selector.
        No argument.
        See enum BatteryType for the possible answers from the STM32. */
     GET_BATTERY_TYPE = 'T',
+
+    /* Get the number of cells of the battery and the detection confidence (API version >= 11).
+       No argument.
+       The STM32 will answer with cells + 100 * confidence (%), 0 cells if unknown. The confidence is 100 if only one
+       number of cells matches the voltage or if it was given with the profile, lower if the voltage range of two
+       numbers of cells overlap (5S / 6S, 6S / 7S). In these ranges, the last pack detected without ambiguity is preferred,
+       otherwise the larger number of cells (higher cut off voltage).
+        Example : 10006 is a 6 cells battery detected without ambiguity. */
+    GET_BATTERY_CELLS = 'n',
     
     /* Get load switch current.
        No argument.
@@ -78,6 +111,11 @@ public:
        No answer from the STM32. */
     SET_LED_GAUGE = 'G',
 
+    /* Set the brightness of all LEDs (API version >= 15). Binary protocol only.
+       Payload : LED_FRAME_SIZE bytes, the perceived brightness of each LED from 0 (Off) to 255 (On), first LED first.
+       No answer from the STM32. */
+    SET_LED_FRAME = 'l',
+
     /* Enable / disable main power switch. Default behavior is to switch it on 2s after startup.
        Send a disable command before to cancel this behavior.
        Argument : 1 to enable output, 0 to disable.
@@ -89,6 +127,13 @@ public:
        No answer from the STM32. */
     SHUTDOWN = 'S',
 
+    /* Enter the storage mode (API version >= 18) : the ESP32 and the load switch are turned off, the STM32 stays
+        powered in low power mode and keeps the battery state. A short press on the button resumes the board.
+        The board shuts down if the battery is empty (checked every 10 minutes) or after 7 days.
+       No argument.
+       No answer from the STM32. */
+    ENTER_STORAGE_MODE = 'x',
+
     /* Request a self reset.
        No argument.
        No answer from the STM32. */
@@ -107,6 +152,97 @@ public:
     SET_BATTERY_VOLTAGE_5   = '5',
     SET_BATTERY_VOLTAGE_6   = '6',
 
+    /* Set the battery capacity (API version >= 9). Used to integrate the delivered charge : the battery level
+        does not bounce with the load anymore. The voltage is only used when the battery is at rest.
+       Argument : the capacity in mAh, 0 if unknown (the battery level is then derived from the voltage only).
+        Max : 100000 mAh
+       No answer from the STM32. */
+    SET_BATTERY_CAPACITY = 'Q',
+
+    /* Set the battery internal resistance (API version >= 9), used to compensate the voltage drop under load.
+       Default : 30 mOhm per cell for LiPo / LiFe batteries, 0 for custom batteries.
+       Argument : the resistance in mOhm
+       No answer from the STM32. */
+    SET_BATTERY_RESISTANCE = 'X',
+
+    /* Select a battery profile (API version >= 10). Only accepted if the selector is on "Custom" position.
+       The selection is stored in flash and restored at startup : the profile doesn't need to be sent again.
+       Argument : profile + 100 * number of cells, see BatteryProfile. For built-in profiles, 0 cells means that the
+        number of cells is determined from the voltage (2 to 7 cells). The number of cells is ignored for
+        user profiles.
+        Example : 604 selects a 6 cells lead-acid battery.
+       No answer from the STM32. */
+    SELECT_BATTERY_PROFILE = 'Y',
+
+    /* Save the current battery characteristics (see SET_BATTERY_VOLTAGE_*) in a user profile and select it
+       (API version >= 10). Only accepted if the selector is on "Custom" position.
+       Argument : the user profile slot, 0 to USER_PROFILE_SLOTS - 1
+       No answer from the STM32. */
+    SAVE_BATTERY_PROFILE = 'y',
+
+    /* Get the state of the flash storage of the profiles and the calibration (API version >= 19).
+       No argument.
+       The STM32 answers with the number of changes that can still be stored before the next page switch, or -1 if
+       the storage is disabled (the firmware reaches the storage pages) : the profiles and the calibration are then
+       lost at power off. */
+    GET_STORAGE_STATE = 'm',
+
+    /* Measure a battery voltage calibration point (API version >= 12). Only accepted if the selector is on "Custom"
+       position. The reading is averaged over 256 samples (around 320ms), see GET_CALIBRATION_STATE.
+       Two points at least 5V apart give the gain and the offset, a single point only corrects the gain.
+       Argument : the reference battery voltage in mV
+       No answer from the STM32. */
+    CALIBRATE_VOLTAGE = 'v',
+
+    /* Measure a load current calibration point (API version >= 12). Only accepted if the selector is on "Custom"
+       position. Measure the offset first (0mA, load switch off), then the gain with a known load.
+       Argument : the reference load current in mA
+       No answer from the STM32. */
+    CALIBRATE_CURRENT = 'i',
+
+    /* Set the drift of the battery voltage reading with the temperature (API version >= 20), hardware revision 2.
+       Only accepted if the selector is on "Custom" position. The drift is compensated from the thermistor reading
+       of the voltage calibration points : commit it with COMMIT_CALIBRATION, with or without new points.
+       Argument : the drift in ppm/°C, from -1000 to 1000. 0 disables the compensation.
+       No answer from the STM32. */
+    SET_TEMP_COEFFICIENT = 'c',
+
+    /* Store the measured calibration in flash and use it (API version >= 12). Only accepted in the
+       CALIBRATION_MEASURED state (a measured point or SET_TEMP_COEFFICIENT). The previous calibration is kept if the
+       write is interrupted.
+       No argument.
+       No answer from the STM32. */
+    COMMIT_CALIBRATION = 'k',
+
+    /* Get the calibration state (API version >= 12).
+       No argument.
+       See CalibrationState for the possible answers from the STM32. */
+    GET_CALIBRATION_STATE = 'g',
+
+    /* Set the temperature threshold of a thermal protection level (API version >= 13). Defaults : 60, 70 and 80°C.
+       A level is left 5°C below its threshold. The thresholds are not stored : they are reset at startup.
+       Ignored unless warning < load cut < shutdown < 125°C, each threshold more than 5°C above the previous one : set
+       the shutdown threshold first to raise them, the warning threshold first to lower them.
+       Argument : 10 * threshold (deg. C) + level (THERMAL_WARNING to THERMAL_SHUTDOWN), e.g. 653 for a shutdown at 65°C
+       No answer from the STM32. */
+    SET_THERMAL_THRESHOLD = 't',
+
+    /* Get the thermal protection level (API version >= 13). Always THERMAL_NORMAL on hardware revision 1.
+       No argument.
+       See ThermalLevel for the possible answers from the STM32. */
+    GET_THERMAL_LEVEL = 'h',
+
+    /* Play a LED animation from the STM32 (API version >= 14). The battery level display is suspended while it plays.
+       Argument : the animation (see Animation) + 10 * the number of plays, 0 to loop forever. E.g. 15 : breathe once.
+       No answer from the STM32. */
+    PLAY_ANIMATION = 'p',
+
+    /* Append a keyframe to the custom animation (API version >= 14), up to ANIMATION_MAX_KEYFRAMES.
+       The custom animation is kept until the STM32 restarts.
+       Argument : the keyframe, see encodeKeyframe. A negative argument clears the custom animation.
+       No answer from the STM32. */
+    ADD_ANIMATION_KEYFRAME = 'f',
+
     /* Enter critical section.
        The board will stay powered while in a critical section (to avoid memory corruption for example).
        The critical section will end at the end of the timeout or when the "Leave critical section"
@@ -124,10 +260,70 @@ public:
        since the last call.
        No argument.
        See PushButtonEvents for the possible answers from the STM32. */
-    GET_BUTTON_EVENT = 'B'
+    GET_BUTTON_EVENT = 'B',
 
-    /* TODO Ping / Watchdog ??? */
+    /* Get a telemetry snapshot (API version >= 4). All values are sampled at the same time, in a single transaction.
+       Like GET_BUTTON_EVENT, the last button event is cleared.
+       No argument.
+       The STM32 will answer with the Telemetry fields in order, separated by spaces (text protocol)
+        or with a TELEMETRY_SIZE payload (binary protocol, see encodeTelemetry). */
+    GET_TELEMETRY = 'M',
 
+    /* Subscribe to pushed events and telemetry (API version >= 5).
+       Binary protocol only : pushed frames carry their own type (PUSH_EVENT / PUSH_TELEMETRY) so they can be
+        told apart from answers.
+       While subscribed, the STM32 pushes an event frame for each button event, low battery threshold crossing and
+        shutdown request (see PushEvent), and a telemetry frame at the requested period.
+       Button events are not stored for GET_BUTTON_EVENT anymore, they are only pushed.
+       The subscription is cancelled by UNSUBSCRIBE or REQUEST_RESET.
+       Argument : the telemetry period in ms, 0 for events only. Min : 100 ms
+       No answer from the STM32. */
+    SUBSCRIBE = 'U',
+
+    /* Stop pushing events and telemetry.
+       No argument.
+       No answer from the STM32. */
+    UNSUBSCRIBE = 'N',
+
+    /* Get the main loop time (API version >= 7). Used to check the firmware responsiveness.
+       No argument.
+       The STM32 will answer with the longest main loop iteration (including serial commands handling) in us
+        since the last call. */
+    GET_LOOP_TIME = 'K',
+
+    /* Get the scheduling statistics of a STM32 task (API version >= 16), since the last call for this task.
+       Argument : the task, see Task
+       The STM32 will answer with the number of deadline misses (bits 0-15) and the longest run time of the task
+        in us (bits 16-30).
+       With the TASK_UTILIZATION flag in the argument (API version >= 21), the STM32 will answer instead with the time
+        spent running the task since the last utilization request for this task, in 1/1000. */
+    GET_TASK_STATS = 'u',
+
+    /* Get the time spent asleep by the STM32 between its tasks (API version >= 17), since the last call.
+       No argument.
+       The STM32 will answer with the sleep time ratio, in 1/1000. */
+    GET_SLEEP_RATIO = 's',
+
+    /* Get the load current statistics (API version >= 8).
+       The load current is sampled every 1.25ms. Peak, min, mean and RMS currents are computed over the last
+        completed window (see SET_LOAD_STATS_WINDOW), so short current bursts are not hidden by the filtering.
+        Each sample is a single conversion (the STM32F030 has no hardware oversampling) : peak and min include the
+        ADC noise, bursts shorter than 1.25ms may fall between two samples and content above 400Hz is aliased.
+        The delivered charge and energy are integrated since the STM32 startup or RESET_ENERGY_COUNTERS.
+       No argument.
+       The STM32 will answer with the LoadStats fields in order, separated by spaces (text protocol)
+        or with a LOAD_STATS_SIZE payload (binary protocol, see encodeLoadStats). */
+    GET_LOAD_STATS = 'W',
+
+    /* Set the load current statistics window. The current window is restarted.
+       Argument : the window duration in ms. Min : 10 ms, max : 60000 ms, default : 1000 ms
+       No answer from the STM32. */
+    SET_LOAD_STATS_WINDOW = 'J',
+
+    /* Reset the delivered charge and energy counters.
+       No argument.
+       No answer from the STM32. */
+    RESET_ENERGY_COUNTERS = 'Z'
   };
 
   /* Possible answers to the "Get push button event" command. */
@@ -142,6 +338,38 @@ public:
     BUTTON_DOUBLE_CLICK_EVENT = 2
   };
 
+  /* Types of the frames pushed by the STM32 while subscribed. These are not commands. */
+  enum PushType {
+    /* 4-byte PushEvent value */
+    PUSH_EVENT = '!',
+
+    /* TELEMETRY_SIZE payload, see encodeTelemetry */
+    PUSH_TELEMETRY = '*'
+  };
+
+  /* Events pushed in PUSH_EVENT frames */
+  enum PushEvent {
+    PUSH_BUTTON_CLICK = BUTTON_CLICK_EVENT,
+    PUSH_BUTTON_DOUBLE_CLICK = BUTTON_DOUBLE_CLICK_EVENT,
+
+    /* The battery level went below the low level threshold (10%) */
+    PUSH_BATTERY_LOW = 3,
+
+    /* The battery level went back above the low level threshold */
+    PUSH_BATTERY_OK = 4,
+
+    /* The shutdown process has started (low battery, long press or overheating).
+       The board will be powered off at the end of the current critical section. */
+    PUSH_SHUTDOWN_PENDING = 5,
+
+    /* The board temperature reached the warning threshold (API version >= 13) : reduce the load.
+       See GET_THERMAL_LEVEL for the current level. */
+    PUSH_TEMPERATURE_HIGH = 6,
+
+    /* The board temperature went back below the warning threshold */
+    PUSH_TEMPERATURE_OK = 7
+  };
+
   /* Possible answers to the "Get battery type" command */
   enum BatteryType {
     BATTERY_LIPO = 0,
@@ -149,14 +377,259 @@ public:
     BATTERY_CUSTOM = 2
   };
 
+  /* Battery profiles for SELECT_BATTERY_PROFILE. Built-in profiles are given for one cell. */
+  enum BatteryProfile {
+    PROFILE_LIPO = 0, // Same as the LiPo selector position
+    PROFILE_LIFE = 1, // Same as the LiFe selector position
+    PROFILE_NIMH = 2,
+    PROFILE_LIION = 3, // Li-ion (NMC) cylindrical cells, like 18650
+    PROFILE_LEAD_ACID = 4, // 2V cells, 6 cells for a 12V battery
+    PROFILE_LIFE_DEEP = 5, // LiFePO4 discharged down to 2.7V per cell
+    PROFILE_USER_0 = 10 // User profiles : PROFILE_USER_0 to PROFILE_USER_0 + USER_PROFILE_SLOTS - 1
+  };
+  static constexpr uint8_t USER_PROFILE_SLOTS = 4;
+
+  /* Possible answers to the "Get calibration state" command */
+  enum CalibrationState {
+    CALIBRATION_IDLE = 0, // No calibration point measured since startup
+    CALIBRATION_MEASURING = 1,
+    CALIBRATION_MEASURED = 2, // Ready for COMMIT_CALIBRATION or another point
+    CALIBRATION_COMMITTED = 3,
+    CALIBRATION_ERROR = 4 // Implausible point or storage error : the measured points are discarded
+  };
+
+  /* Possible answers to the "Get thermal level" command */
+  enum ThermalLevel {
+    THERMAL_NORMAL = 0,
+    THERMAL_WARNING = 1, // PUSH_TEMPERATURE_HIGH is pushed
+    THERMAL_LOAD_CUT = 2, // The load switch is off, SET_LOAD_SWITCH is applied when the level goes down
+    THERMAL_SHUTDOWN = 3 // The shutdown process has started
+  };
+
+  /* STM32 tasks, for the "Get task stats" command. Period / deadline in ms. */
+  enum Task {
+    TASK_BATTERY_MONITORING = 0, // 1 / 5 : ADC blocks, battery state, load stats
+    TASK_BUTTON = 1, // 5 / 10
+    TASK_SERIAL = 2, // 1 / 5 : commands and pushes
+    TASK_STATE = 3, // 10 / 20 : state machine and LED gauge display
+    TASK_WATCHDOG = 4 // 50 / 100
+  };
+  static constexpr uint8_t TASK_UTILIZATION = 0x80; // "Get task stats" argument flag, see GET_TASK_STATS
+
+  /* Animations for the "Play animation" command */
+  enum Animation {
+    ANIMATION_STOP = 0, // Stop the current animation, the LEDs keep their values
+    ANIMATION_SWEEP_UP = 1, // Startup animation
+    ANIMATION_SWEEP_DOWN = 2, // Shutdown animation
+    ANIMATION_CHASE = 3, // Shutdown pending indicator
+    ANIMATION_BLINK = 4, // All LEDs, 1s period
+    ANIMATION_BREATHE = 5, // All LEDs fading in and out, 1s period
+    ANIMATION_CUSTOM = 6 // Keyframes sent with ADD_ANIMATION_KEYFRAME
+  };
+  static constexpr uint8_t ANIMATION_MAX_KEYFRAMES = 16;
+  static constexpr uint8_t LED_FRAME_SIZE = 6;
+
+  /* Animation keyframe : LED values (bits 0-23), duration (bits 24-29) and fade flag (bit 30) */
+  static constexpr uint32_t KEYFRAME_LEDS_MASK = 0xFFFFFF;
+  static constexpr uint8_t KEYFRAME_DURATION_SHIFT = 24;
+  static constexpr uint8_t KEYFRAME_MAX_DURATION = 63; // LED refresh periods (12ms)
+  static constexpr uint32_t KEYFRAME_FADE = 1UL << 30;
+
+  /* STM32 state, as reported in the telemetry */
+  enum BoardState {
+    STATE_INIT = 0,
+    STATE_ESP32_STARTUP = 1,
+    STATE_ACTIVE = 2,
+    STATE_CRITICAL_SECTION_WAIT = 3,
+    STATE_SHUTDOWN = 4,
+    STATE_STORAGE = 5
+  };
+
+  /* Answer to the "Get telemetry" command */
+  struct Telemetry {
+    uint16_t batteryVoltage; // Instant battery voltage (mV)
+    uint16_t avgBatteryVoltage; // Average battery voltage (mV)
+    int8_t batteryPercentage; // Battery level, -1 if unknown
+    uint16_t loadCurrent; // Load switch current (mA)
+    int8_t temperature; // Board temperature (deg. C)
+    uint8_t buttonEvent; // PushButtonEvent
+    uint8_t state; // BoardState
+    uint32_t uptime; // Time since the STM32 startup (ms)
+  };
+  static constexpr uint8_t TELEMETRY_FIELDS = 8;
+  static constexpr uint8_t TELEMETRY_SIZE = 14;
+
+  /* Answer to the "Get load stats" command */
+  struct LoadStats {
+    uint16_t peakCurrent; // Highest load current sample over the last window (mA)
+    uint16_t minCurrent; // Lowest load current sample over the last window (mA)
+    uint16_t meanCurrent; // Mean load current over the last window (mA)
+    uint16_t rmsCurrent; // RMS load current over the last window (mA)
+    uint32_t charge; // Delivered charge (mAh)
+    uint32_t energy; // Delivered energy (mWh)
+  };
+  static constexpr uint8_t LOAD_STATS_FIELDS = 6;
+  static constexpr uint8_t LOAD_STATS_SIZE = 16;
+
   static bool hasArgument(CommandType cmd)
   {
     return (cmd == SET_LEDS ||
             cmd == SET_LED_GAUGE ||
             cmd == SET_LOAD_SWITCH ||
             cmd == ENTER_CRITICAL_SECTION ||
+            cmd == SUBSCRIBE ||
+            cmd == SET_LOAD_STATS_WINDOW ||
+            cmd == SET_BATTERY_CAPACITY ||
+            cmd == SET_BATTERY_RESISTANCE ||
+            cmd == SELECT_BATTERY_PROFILE ||
+            cmd == SAVE_BATTERY_PROFILE ||
+            cmd == CALIBRATE_VOLTAGE ||
+            cmd == CALIBRATE_CURRENT ||
+            cmd == SET_TEMP_COEFFICIENT ||
+            cmd == SET_THERMAL_THRESHOLD ||
+            cmd == PLAY_ANIMATION ||
+            cmd == GET_TASK_STATS ||
+            cmd == ADD_ANIMATION_KEYFRAME ||
             (cmd >= SET_BATTERY_VOLTAGE_LOW && cmd <= SET_BATTERY_VOLTAGE_6));
   }
+
+  /* Return true if the STM32 answers to this command */
+  static bool hasAnswer(CommandType cmd)
+  {
+    return (cmd == GET_HW_REVISION ||
+            cmd == GET_BOARD_ID ||
+            cmd == GET_API_VERSION ||
+            cmd == GET_FW_VERSION ||
+            cmd == GET_BATTERY_VOLTAGE ||
+            cmd == GET_BATTERY_PERCENTAGE ||
+            cmd == GET_BATTERY_TYPE ||
+            cmd == GET_BATTERY_CELLS ||
+            cmd == GET_CALIBRATION_STATE ||
+            cmd == GET_STORAGE_STATE ||
+            cmd == GET_THERMAL_LEVEL ||
+            cmd == GET_LOAD_CURRENT ||
+            cmd == GET_TEMPERATURE ||
+            cmd == GET_BUTTON_EVENT ||
+            cmd == GET_TELEMETRY ||
+            cmd == GET_LOOP_TIME ||
+            cmd == GET_TASK_STATS ||
+            cmd == GET_SLEEP_RATIO ||
+            cmd == GET_LOAD_STATS);
+  }
+
+  /* Update a CRC-8 (polynomial 0x07) with one byte. Bitwise to keep the STM32 flash footprint small. */
+  static uint8_t crc8(uint8_t crc, uint8_t data)
+  {
+    crc ^= data;
+    for (uint8_t i = 0; i < 8; i++)
+      crc = (crc & 0x80) ? (crc << 1) ^ 0x07 : crc << 1;
+    return crc;
+  }
+
+  /* Compute the CRC of a binary frame */
+  static uint8_t frameCrc(uint8_t cmd, const uint8_t *payload, uint8_t len, int seq = NO_SEQUENCE)
+  {
+    uint8_t crc = crc8(0, cmd);
+    if (seq != NO_SEQUENCE)
+      crc = crc8(crc, seq);
+    crc = crc8(crc, len);
+    for (uint8_t i = 0; i < len; i++)
+      crc = crc8(crc, payload[i]);
+    return crc;
+  }
+
+  /* Build a binary frame into the given buffer (at least FRAME_MAX_SIZE bytes), with an optional sequence number.
+     Return the frame size. */
+  static uint8_t encodeFrame(uint8_t *frame, uint8_t cmd, const uint8_t *payload, uint8_t len, int seq = NO_SEQUENCE)
+  {
+    uint8_t size = 0;
+    frame[size++] = (seq == NO_SEQUENCE) ? FRAME_SYNC : FRAME_SYNC_SEQ;
+    frame[size++] = cmd;
+    if (seq != NO_SEQUENCE)
+      frame[size++] = seq;
+    frame[size++] = len;
+    for (uint8_t i = 0; i < len; i++)
+      frame[size++] = payload[i];
+    frame[size++] = frameCrc(cmd, payload, len, seq);
+    return size;
+  }
+
+  /* Animation keyframe, argument of ADD_ANIMATION_KEYFRAME.
+     leds : 4 bits per LED (0 Off to 15 On), the first LED in the lowest bits. E.g. 0x00F00F : first and fourth LEDs.
+     duration : in LED refresh periods (12ms), 1 to KEYFRAME_MAX_DURATION
+     fade : fade from the previous values during the keyframe, instead of setting the values at its start */
+  static constexpr uint32_t encodeKeyframe(uint32_t leds, uint8_t duration, bool fade)
+  {
+    return (leds & KEYFRAME_LEDS_MASK) | ((uint32_t)(duration & KEYFRAME_MAX_DURATION) << KEYFRAME_DURATION_SHIFT) | (fade ? KEYFRAME_FADE : 0);
+  }
+
+  /* Argument / answer value <> 4-byte little endian payload */
+  static void encodeValue(uint8_t *payload, long value)
+  {
+    for (uint8_t i = 0; i < FRAME_VALUE_SIZE; i++)
+      payload[i] = (uint32_t)value >> (8*i);
+  }
+
+  static long decodeValue(const uint8_t *payload)
+  {
+    uint32_t value = 0;
+    for (uint8_t i = 0; i < FRAME_VALUE_SIZE; i++)
+      value |= (uint32_t)payload[i] << (8*i);
+    return (int32_t)value;
+  }
+
+  /* Telemetry <> TELEMETRY_SIZE bytes little endian payload */
+  static void encodeTelemetry(uint8_t *payload, const Telemetry &telemetry)
+  {
+    payload[0] = telemetry.batteryVoltage;
+    payload[1] = telemetry.batteryVoltage >> 8;
+    payload[2] = telemetry.avgBatteryVoltage;
+    payload[3] = telemetry.avgBatteryVoltage >> 8;
+    payload[4] = telemetry.batteryPercentage;
+    payload[5] = telemetry.loadCurrent;
+    payload[6] = telemetry.loadCurrent >> 8;
+    payload[7] = telemetry.temperature;
+    payload[8] = telemetry.buttonEvent;
+    payload[9] = telemetry.state;
+    encodeValue(payload + 10, telemetry.uptime);
+  }
+
+  static void decodeTelemetry(const uint8_t *payload, Telemetry &telemetry)
+  {
+    telemetry.batteryVoltage = payload[0] | (payload[1] << 8);
+    telemetry.avgBatteryVoltage = payload[2] | (payload[3] << 8);
+    telemetry.batteryPercentage = (int8_t)payload[4];
+    telemetry.loadCurrent = payload[5] | (payload[6] << 8);
+    telemetry.temperature = (int8_t)payload[7];
+    telemetry.buttonEvent = payload[8];
+    telemetry.state = payload[9];
+    telemetry.uptime = decodeValue(payload + 10);
+  }
+
+  /* LoadStats <> LOAD_STATS_SIZE bytes little endian payload */
+  static void encodeLoadStats(uint8_t *payload, const LoadStats &stats)
+  {
+    payload[0] = stats.peakCurrent;
+    payload[1] = stats.peakCurrent >> 8;
+    payload[2] = stats.minCurrent;
+    payload[3] = stats.minCurrent >> 8;
+    payload[4] = stats.meanCurrent;
+    payload[5] = stats.meanCurrent >> 8;
+    payload[6] = stats.rmsCurrent;
+    payload[7] = stats.rmsCurrent >> 8;
+    encodeValue(payload + 8, stats.charge);
+    encodeValue(payload + 12, stats.energy);
+  }
+
+  static void decodeLoadStats(const uint8_t *payload, LoadStats &stats)
+  {
+    stats.peakCurrent = payload[0] | (payload[1] << 8);
+    stats.minCurrent = payload[2] | (payload[3] << 8);
+    stats.meanCurrent = payload[4] | (payload[5] << 8);
+    stats.rmsCurrent = payload[6] | (payload[7] << 8);
+    stats.charge = decodeValue(payload + 8);
+    stats.energy = decodeValue(payload + 12);
+  }
 };
 
 #endif //KXKM_STM32_ENERGY_API_H
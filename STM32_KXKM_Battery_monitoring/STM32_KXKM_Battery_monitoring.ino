@@ -6,13 +6,17 @@ The processor is in charge of the following tasks :
   * Keep the 3.3V enable line high on power up (self power)
   * Control the ESP32 enable line and the main load switch
   * Monitor the input voltage and shut down the whole board (3.3V, load switch, ESP32) on low battery
+  * Monitor the board temperature : warn the ESP32, cut the load switch or shut down above thresholds
   * Push button monitoring :
     * on short press, display the battery level on the LED gauge
     * on long press, shut down the whole board
+    * on short press in storage mode, resume the board
   * Communication with the ESP32 processor :
     * battery level reporting
+    * load current statistics and delivered energy reporting
     * custom battery profile input
     * push button reporting
+    * event and telemetry push to a subscribed main processor
     * critical section handling (the board will stay powered if the main processor requests it)
     * display arbitrary data on the LED gauge
 
@@ -22,13 +26,19 @@ Tom Magnier - 04/2018
 */
 
 #include <AceButton.h>
+#include "firmware_features.h"
 #include "KXKM_STM32_energy_API.h"
 #include "pin_mapping.h"
 #include "board_id.h"
-#include "AdcToTemperature.h"
+#include "ntc_table.h"
+#include "led_gamma.h"
+#include "filters.h"
+#include "batt_state.h"
+#include "profile_storage.h"
+#include "calibration.h"
 
 // Firmware version
-const int FIRMWARE_VERSION = 3;
+const int FIRMWARE_VERSION = 4;
 
 // Timing configuration
 const unsigned long STARTUP_GUARD_TIME_MS = 5000; // Ignore long presses during this period after startup
@@ -38,12 +48,14 @@ const unsigned long LOAD_SWITCH_START_DELAY_MS = 2000; // Start the load switch
 const unsigned long MAX_CRITICAL_SECTION_DURATION_MS = 10000; // Maximum critical section duration.
 const unsigned long CUSTOM_LED_DISPLAY_TIME_MS = 2000; // Display the custom LED display during this period (set by serial API)
 
+// Values are reported in the telemetry
 enum state_t {
-  INIT,
-  ESP32_STARTUP,
-  ACTIVE,
-  CRITICAL_SECTION_WAIT,
-  SHUTDOWN
+  INIT = KXKM_STM32_Energy::STATE_INIT,
+  ESP32_STARTUP = KXKM_STM32_Energy::STATE_ESP32_STARTUP,
+  ACTIVE = KXKM_STM32_Energy::STATE_ACTIVE,
+  CRITICAL_SECTION_WAIT = KXKM_STM32_Energy::STATE_CRITICAL_SECTION_WAIT,
+  SHUTDOWN = KXKM_STM32_Energy::STATE_SHUTDOWN,
+  STORAGE = KXKM_STM32_Energy::STATE_STORAGE
 };
 
 state_t currentState;
@@ -54,7 +66,10 @@ KXKM_STM32_Energy::PushButtonEvent buttonEvent = KXKM_STM32_Energy::NO_EVENT;
 unsigned long battLevelDisplayStartTime;
 unsigned long customLedSetTime;
 unsigned long lastStateChangeTime;
+unsigned long startupTime; // Startup or end of the storage mode
+bool storageModeRequested;
 unsigned long criticalSectionEndTime;
+unsigned long maxLoopTimeUs; // Longest loop iteration since the last GET_LOOP_TIME command
 
 #define SERIAL_DEBUG(str) \
   beginSerial(); \
@@ -101,7 +116,7 @@ void setup() {
     //Blink red LED while the board is powered (button pressed)
     while(1)
     {
-      setSingleLed(0, 1);
+      setSingleLed(0, LED_DIM_VAL);
       delay(50);
       clearLeds();
       delay(50);
@@ -111,24 +126,38 @@ void setup() {
   // Power up the board
   set3V3RegState(true); //Keep 3.3V regulator enabled
 
-  // Start up LED animation
-  for (uint8_t i = 0; i <= 100; i++)
-  {
-    setLedGaugePercentage(i);
-    delay(4);
-  }
-  clearLeds();
+  playAnimation(KXKM_STM32_Energy::ANIMATION_SWEEP_UP, 1); // Start up LED animation
 
   initWatchdog();
   enterState(ESP32_STARTUP);
+  initScheduler();
 }
 
 void loop()
 {
-  refreshWatchdog();
+  if (currentState == STORAGE)
+  {
+    loopStorage();
+    return;
+  }
+
+  // Measure the iteration time without the sleep : the longest one delays the tasks which are due
+  unsigned long loopStartTime = micros();
+  runScheduler();
+  maxLoopTimeUs = max(maxLoopTimeUs, micros() - loopStartTime);
+
+  sleepUntilNextTask();
+}
+
+/* Button task (see scheduler.ino) */
+void loopButton()
+{
   button.check();
-  loopBatteryMonitoring();
+}
 
+/* State machine task (see scheduler.ino) */
+void loopState()
+{
   switch (currentState)
   {
     case ESP32_STARTUP:
@@ -140,28 +169,29 @@ void loop()
       break;
 
     case ACTIVE:
-      if (millis() - customLedSetTime > CUSTOM_LED_DISPLAY_TIME_MS)
+    {
+      const BatteryState &battery = getBatteryState();
+
+      if (millis() - customLedSetTime > CUSTOM_LED_DISPLAY_TIME_MS && !isAnimationPlaying())
       {
         // Display the battery level if battery is low or the push button has been pressed
-        if ((millis() - battLevelDisplayStartTime > 0 && millis() - battLevelDisplayStartTime < BATT_DISPLAY_TIME_MS) || (getBatteryPercentage() >= 0 && getBatteryPercentage() < 10))
-          displayBatteryLevel(getBatteryPercentage());
+        if ((millis() - battLevelDisplayStartTime > 0 && millis() - battLevelDisplayStartTime < BATT_DISPLAY_TIME_MS) || battery.low)
+          displayBatteryLevel(battery.percentage);
         else if (millis() - battLevelDisplayStartTime > BATT_DISPLAY_TIME_MS)
-          displaySingleLedBatteryLevel(getBatteryPercentage());
+          displaySingleLedBatteryLevel(battery.percentage);
       }
 
-      if (getBatteryPercentage() == 0)
+      if (battery.percentage == 0 || getThermalLevel() == KXKM_STM32_Energy::THERMAL_SHUTDOWN)
         enterState(CRITICAL_SECTION_WAIT); //Start shutdown process
+      else if (storageModeRequested)
+        enterState(STORAGE);
       break;
+    }
 
     case CRITICAL_SECTION_WAIT:
-      // Display a wait indicator
-      {
-        uint8_t idx = ((millis() - lastStateChangeTime) % 1100) / 100;
-        if (idx < 6)
-          setSingleLed(idx);
-        else
-          setSingleLed(10 - idx);
-      }
+      // Display a wait indicator, after the shutdown animation
+      if (getAnimation() != KXKM_STM32_Energy::ANIMATION_SWEEP_DOWN && getAnimation() != KXKM_STM32_Energy::ANIMATION_CHASE)
+        playAnimation(KXKM_STM32_Energy::ANIMATION_CHASE, 0);
 
       if (millis() > criticalSectionEndTime || millis() - lastStateChangeTime > MAX_CRITICAL_SECTION_DURATION_MS)
         enterState(SHUTDOWN);
@@ -172,6 +202,23 @@ void loop()
   }
 }
 
+/* Storage state, out of the scheduler : the time spent in Stop mode is not counted as a task or loop iteration.
+   Blocks until the button is pressed, then restarts the tasks and their statistics. */
+void loopStorage()
+{
+  if (!runStorageMode())
+  {
+    enterState(SHUTDOWN);
+    return;
+  }
+
+  startupTime = millis();
+  playAnimation(KXKM_STM32_Energy::ANIMATION_SWEEP_UP, 1);
+  enterState(ESP32_STARTUP);
+  initScheduler();
+  maxLoopTimeUs = 0;
+}
+
 
 void handleButtonEvent(ace_button::AceButton* button, uint8_t eventType, uint8_t buttonState) {
   switch (eventType) {
@@ -182,23 +229,19 @@ void handleButtonEvent(ace_button::AceButton* button, uint8_t eventType, uint8_t
       else 
         battLevelDisplayStartTime = millis() + BATT_DISPLAY_DELAY_MS;
       
-      buttonEvent = KXKM_STM32_Energy::BUTTON_CLICK_EVENT;
+      if (!pushEvent(KXKM_STM32_Energy::PUSH_BUTTON_CLICK))
+        buttonEvent = KXKM_STM32_Energy::BUTTON_CLICK_EVENT;
       break;
 
     case ace_button::AceButton::kEventDoubleClicked:
-    buttonEvent = KXKM_STM32_Energy::BUTTON_DOUBLE_CLICK_EVENT;
+      if (!pushEvent(KXKM_STM32_Energy::PUSH_BUTTON_DOUBLE_CLICK))
+        buttonEvent = KXKM_STM32_Energy::BUTTON_DOUBLE_CLICK_EVENT;
       break;
 
     case ace_button::AceButton::kEventLongPressed:
-      if (millis() > STARTUP_GUARD_TIME_MS)
+      if (millis() - startupTime > STARTUP_GUARD_TIME_MS)
       {
-        //Shut down LED animation
-        for (int i = 100; i >= 0; i--)
-        {
-          setLedGaugePercentage(i);
-          delay(4);
-        }
-
+        playAnimation(KXKM_STM32_Energy::ANIMATION_SWEEP_DOWN, 1); //Shut down LED animation
         enterState(CRITICAL_SECTION_WAIT); //Start shutdown process
       }
       break;
@@ -224,10 +267,22 @@ void enterState(enum state_t newState)
       setESP32State(true); //Enable ESP32
       break;
 
+    case CRITICAL_SECTION_WAIT:
+      pushEvent(KXKM_STM32_Energy::PUSH_SHUTDOWN_PENDING);
+      break;
+
     case SHUTDOWN:
       shutdown();
       break;
 
+    case STORAGE:
+      storageModeRequested = false;
+      unsubscribe();
+      clearLeds();
+      setLoadSwitchState(false);
+      setESP32State(false);
+      break;
+
     default:
       break;
   }
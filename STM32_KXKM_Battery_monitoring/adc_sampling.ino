@@ -0,0 +1,114 @@
+/* ADC sampling functions
+ *
+ * The battery voltage, load current and thermistor (HW revision 2) channels are scanned together, each time TIM3
+ * overflows. The DMA stores the conversions in a circular buffer made of two blocks of ADC_BLOCK_SCANS scans :
+ * while one block is being written, the other one is complete and can be filtered by the main loop.
+ * The sampling rate does not depend on the main loop timing (serial parsing, LED updates, etc).
+ *
+ * The ADC, DMA and timer are set up through registers : the HAL DMA and timer drivers don't fit in flash.
+ * analogRead() must not be used once sampling is started, it would reconfigure the ADC.
+ */
+
+const unsigned long ADC_SAMPLE_PERIOD_US = 1250; // Scan all channels every 1.25ms
+const unsigned int ADC_BLOCK_SCANS = 4; // Averaged scans per block : a block is completed every 5ms
+
+#if HW_REVISION == 1
+  const uint8_t ADC_CHANNELS_COUNT = 2;
+#else
+  const uint8_t ADC_CHANNELS_COUNT = 3;
+#endif
+
+const unsigned int ADC_BLOCK_SIZE = ADC_BLOCK_SCANS * ADC_CHANNELS_COUNT;
+
+volatile uint16_t _adcBuffer[2 * ADC_BLOCK_SIZE]; // Written by the DMA. Don't change directly !
+uint8_t _adcVoltageIndex; // Position of each channel in a scan
+uint8_t _adcCurrentIndex;
+uint8_t _adcTempIndex;
+
+/* Configure the ADC, DMA and timer and start sampling */
+void initAdcSampling()
+{
+  uint32_t channels = (1UL << getAdcChannel(BATT_VOLTAGE_SENSE_PIN)) | (1UL << getAdcChannel(LOAD_CURRENT_SENSE_PIN));
+  #if HW_REVISION > 1
+    channels |= 1UL << getAdcChannel(TEMP_MEAS_PIN);
+    _adcTempIndex = getAdcScanIndex(channels, getAdcChannel(TEMP_MEAS_PIN));
+  #endif
+  _adcVoltageIndex = getAdcScanIndex(channels, getAdcChannel(BATT_VOLTAGE_SENSE_PIN));
+  _adcCurrentIndex = getAdcScanIndex(channels, getAdcChannel(LOAD_CURRENT_SENSE_PIN));
+
+  pinMode(BATT_VOLTAGE_SENSE_PIN, INPUT_ANALOG);
+  pinMode(LOAD_CURRENT_SENSE_PIN, INPUT_ANALOG);
+
+  __HAL_RCC_ADC1_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  __HAL_RCC_TIM3_CLK_ENABLE();
+
+  // ADC clocked by PCLK / 4 (12MHz max) : conversions are synchronous with the trigger
+  ADC1->CFGR2 = ADC_CFGR2_CKMODE_1;
+  ADC1->CR = ADC_CR_ADCAL;
+  while (ADC1->CR & ADC_CR_ADCAL);
+
+  ADC1->CHSELR = channels;
+  ADC1->SMPR = ADC_SMPR_SMP; // 239.5 cycles : the voltage divider has a high impedance
+  ADC1->CFGR1 = ADC_CFGR1_DMAEN | ADC_CFGR1_DMACFG // DMA circular mode
+              | ADC_CFGR1_EXTEN_0 | ADC_CFGR1_EXTSEL_1 | ADC_CFGR1_EXTSEL_0; // Triggered by TIM3 TRGO rising edge
+
+  // 16-bit transfers from the data register to the buffer, circular mode
+  DMA1_Channel1->CPAR = (uintptr_t)&ADC1->DR;
+  DMA1_Channel1->CMAR = (uintptr_t)_adcBuffer;
+  DMA1_Channel1->CNDTR = 2 * ADC_BLOCK_SIZE;
+  DMA1_Channel1->CCR = DMA_CCR_MINC | DMA_CCR_PSIZE_0 | DMA_CCR_MSIZE_0 | DMA_CCR_CIRC | DMA_CCR_EN;
+
+  // The configuration above also provides the few ADC cycles required between calibration and enable
+  ADC1->ISR = ADC_ISR_ADRDY;
+  ADC1->CR = ADC_CR_ADEN;
+  while (!(ADC1->ISR & ADC_ISR_ADRDY));
+  ADC1->CR |= ADC_CR_ADSTART; // Conversions now start on each trigger
+
+  // 1MHz counter, update event as trigger output
+  TIM3->PSC = HAL_RCC_GetHCLKFreq() / 1000000 - 1;
+  TIM3->ARR = ADC_SAMPLE_PERIOD_US - 1;
+  TIM3->CR2 = TIM_CR2_MMS_1;
+  TIM3->EGR = TIM_EGR_UG; // Load the prescaler
+  TIM3->CR1 = TIM_CR1_CEN;
+}
+
+/* Return the ADC channel of a pin. Taken from analog.c */
+uint8_t getAdcChannel(uint8_t pin)
+{
+  return STM_PIN_CHANNEL(pinmap_function(digitalPinToPinName(pin), PinMap_ADC));
+}
+
+/* Return the position of a channel in a scan. Channels are converted in ascending order. */
+uint8_t getAdcScanIndex(uint32_t channels, uint8_t channel)
+{
+  uint8_t index = 0;
+  for (uint8_t i = 0; i < channel; i++)
+    if (channels & (1UL << i))
+      index++;
+
+  return index;
+}
+
+/* Return the last completed block, or NULL if no block was completed since the last call.
+   If the main loop is late, the older blocks are dropped. */
+const volatile uint16_t* getCompletedAdcBlock()
+{
+  if (!(DMA1->ISR & (DMA_ISR_HTIF1 | DMA_ISR_TCIF1)))
+    return NULL;
+
+  DMA1->IFCR = DMA_IFCR_CHTIF1 | DMA_IFCR_CTCIF1;
+
+  // The DMA counter goes down from the buffer size : the block which is not being written is complete
+  return DMA1_Channel1->CNDTR > ADC_BLOCK_SIZE ? _adcBuffer + ADC_BLOCK_SIZE : _adcBuffer;
+}
+
+/* Return the average reading of a channel over a block */
+unsigned int getAdcBlockAverage(const volatile uint16_t* block, uint8_t index)
+{
+  unsigned int adcRead = 0;
+  for (unsigned int i = 0; i < ADC_BLOCK_SCANS; i++)
+    adcRead += block[i * ADC_CHANNELS_COUNT + index];
+
+  return adcRead / ADC_BLOCK_SCANS;
+}
@@ -6,12 +6,15 @@
  *    * pos 1 : Li-Po batteries - Nominal cell voltage 3.7V, max cell voltage 4.2V, min cell voltage 3.0V
  *    * pos 2 : Li-Fe batteries - Nominal cell voltage 3.3V, max cell voltage 3.6V, min cell voltage 2.8V
  *    * pos 3 : custom. By default the battery voltage is not monitored, except if custom min/max voltages are
- *              received on the serial port.
+ *              received on the serial port, or a battery profile has been selected (it is stored in flash, see
+ *              profile_storage.ino).
  *
- * The number of cells is determined at startup by measuring the initial voltage.
+ * The number of cells is determined at startup by measuring the initial voltage, averaged over CELLS_DETECTION_BLOCKS.
  * As the number of cells increase, voltage ranges will overlap. To address this issue, the initial min cell voltage is
  * 3.5V for LiPo batteries, e.g. a minimum state of charge is required to start up the device.
- * Additionnally, some combinations are not recognized (5S, 6S for LiPo and LiFe) and are supported only in custom mode.
+ * Some ranges still overlap (5S / 6S and 6S / 7S). The last pack detected without ambiguity is stored in flash and
+ * preferred in these ranges, otherwise the number of cells leaving the largest margin to the cell voltage limits is
+ * chosen. The detection confidence is reported to the ESP32.
  *
  * The following document has been used for LiPo voltage breaks (0.5C):
  * https://learn.adafruit.com/li-ion-and-lipoly-batteries/voltages
@@ -19,29 +22,44 @@
  *
  * LiFePo4 : http://gwl-power.tumblr.com/post/98740855201/winston-battery-lifeypo4-discharge
  *
- * The voltage is interpolated linearly between voltage breaks.
+ * Other built-in profiles (custom position only) use resting voltages from the manufacturers discharge curves.
+ *
+ * The voltage is interpolated linearly between voltage breaks. The interpolation is compiled into a lookup table
+ * each time the breaks change, so that reading the percentage needs no division. The battery level itself is
+ * estimated from this voltage level and the load current (see state_of_charge.ino).
  */
 
 /* All voltages are given in mV */
 const unsigned int LIPO_VOLTAGE_BREAKS[] = {3500, 3650, 3700, 3750, 3825, 3950, 4200}; //For one cell
 const unsigned int LIFE_VOLTAGE_BREAKS[] = {2920, 3140, 3200, 3220, 3240, 3260, 3600}; //For one cell
+const unsigned int NIMH_VOLTAGE_BREAKS[] = {1100, 1180, 1210, 1240, 1270, 1310, 1400}; //For one cell
+const unsigned int LIION_VOLTAGE_BREAKS[] = {3300, 3550, 3650, 3720, 3820, 3950, 4200}; //For one cell
+const unsigned int LEAD_ACID_VOLTAGE_BREAKS[] = {1960, 1990, 2010, 2030, 2060, 2090, 2130}; //For one cell
+const unsigned int LIFE_DEEP_VOLTAGE_BREAKS[] = {2700, 3000, 3150, 3220, 3250, 3280, 3600}; //For one cell
 
-const unsigned int INITIAL_CELL_VOLTAGE_TOLERANCE = 50; // Tolerance added to the cell charged voltage
+// Indexed by KXKM_STM32_Energy::BatteryProfile
+const unsigned int* const BUILTIN_PROFILES[] = {LIPO_VOLTAGE_BREAKS, LIFE_VOLTAGE_BREAKS, NIMH_VOLTAGE_BREAKS,
+  LIION_VOLTAGE_BREAKS, LEAD_ACID_VOLTAGE_BREAKS, LIFE_DEEP_VOLTAGE_BREAKS};
+const uint8_t BUILTIN_PROFILES_COUNT = sizeof(BUILTIN_PROFILES) / sizeof(BUILTIN_PROFILES[0]);
 
-const unsigned int ADC_READS_COUNT = 4; // Averaging readings to improve resolution
-const unsigned int CALIBRATION_VOLTAGE = 24000; // Voltage used for the calibration
+const unsigned int INITIAL_CELL_VOLTAGE_TOLERANCE = 50; // Tolerance added to the cell charged voltage
+const uint8_t MIN_CELLS = 2;
+const uint8_t MAX_CELLS = 7;
+const uint8_t CELLS_DETECTION_BLOCKS = 40; // Settling measurement at startup : 200ms
+const uint8_t CELLS_CONFIDENCE_HINT = 80; // Confidence (%) when an ambiguous voltage is resolved by the last known pack
+const uint8_t CELLS_CONFIDENCE_MARGIN = 50; // Minimum confidence (%) when resolved without the last known pack
+const unsigned int DEFAULT_CELL_RESISTANCE = 30; // Internal resistance (mOhm) of a LiPo / LiFe cell, wiring included
 
-const unsigned long ADC_READ_PERIOD_MS = 5; // ADC read every 5ms
+const unsigned long TEMP_MEAS_PERIOD_MS = 1000; // The thermistor is only powered during measurements to avoid self heating
 
 const int BATT_LOW_LEVEL = 10; // Low battery level (%)
+const int BATT_LOW_HYSTERESIS = 2; // The battery is not low anymore above BATT_LOW_LEVEL + BATT_LOW_HYSTERESIS (%)
 
-// ADC reading : exponential averaging
-// Time constant (samples) =  -1 / ln(OLD_WEIGHT/(OLD_WEIGHT+NEW_WEIGHT))
-// Time constant (seconds) =  - ADC_READ_PERIOD_MS / 1000 * ln(OLD_WEIGHT/(OLD_WEIGHT+NEW_WEIGHT))
-const unsigned int LONG_TERM_OLD_WEIGHT = 999; //Time constant : around 5s
-const unsigned int LONG_TERM_NEW_WEIGHT = 1;
-const unsigned int SHORT_TERM_OLD_WEIGHT = 95; //Time constant : around 0.1s
-const unsigned int SHORT_TERM_NEW_WEIGHT = 5;
+// ADC reading : filtering of the ADC blocks (see adc_sampling.ino and filters.h), one block every 5ms
+// Exponential averaging time constant (seconds) = 2^SHIFT * ADC_SAMPLE_PERIOD_US * ADC_BLOCK_SCANS / 1000000
+const uint8_t LONG_TERM_SHIFT = 10; //Time constant : around 5s
+const uint8_t SHORT_TERM_SHIFT = 4; //Time constant : around 0.1s
+const uint8_t SPIKE_REJECTION_BLOCKS = 3; // Median filter on the battery voltage (load switching spikes)
 
 //Load switch current reading : V (mV) = R (ohm) * I_load (mA) / 10000
 #if HW_REVISION == 1
@@ -58,11 +76,30 @@ const unsigned long CURRENT_MEAS_MULTIPLIER2 = 100;
 const unsigned int VOLTAGE_MEAS_DECIMAL_PART = 5; // 2^5
 const unsigned int CURRENT_MEAS_DECIMAL_PART = 5; // 2^5
 
-unsigned int _battVoltageBreaks[7];
-unsigned int _avgBattVoltage;
-unsigned int _instantBattVoltage;
-unsigned int _instantLoadCurrent;
+unsigned int _battVoltageBreaks[7]; // Use setBatteryVoltageBreak() to change the breaks after startup
+MedianFilter<unsigned int, SPIKE_REJECTION_BLOCKS> _battVoltageSpikeFilter;
+EmaFilter<SHORT_TERM_SHIFT> _instantBattVoltage;
+EmaFilter<LONG_TERM_SHIFT> _avgBattVoltage;
+LoadCurrentFilter _instantLoadCurrent; // Butterworth low-pass, fc = 1.6Hz (see filters.h)
+AdcCalibration _adcCalibration; // See calibration.ino
+uint32_t _battVoltageScale; // Fixed point mV per calibrated reading (Q16), temperature compensated
+uint32_t _loadCurrentScale; // Fixed point mA per calibrated reading (Q16)
+unsigned int _tempAdcRead;
+uint8_t _tempMeasBlocks; // ADC blocks left before the thermistor reading, 0 if the thermistor is not powered
 KXKM_STM32_Energy::BatteryType _battType;
+uint8_t _battCells; // 0 if unknown
+uint8_t _cellsConfidence; // Cells count detection confidence (%)
+BatteryState _battState; // Don't change directly ! Updated once per ADC block.
+
+// Voltage to percentage lookup table
+const uint8_t VOLTAGE_TABLE_SIZE = 128;
+uint16_t _percentageVoltages[101]; // Lowest voltage (mV) giving each percentage
+uint8_t _voltageTable[VOLTAGE_TABLE_SIZE]; // Percentage at the start of each voltage step, from break 0
+uint8_t _voltageTableShift; // Voltage step : 2^shift mV
+const uint8_t VOLTAGE_TABLE_BUILD_STEP = 10; // Percentages searched per lookup while the table is built
+const uint8_t VOLTAGE_TABLE_IDLE = 0xFF;
+bool _voltageTableValid;
+uint8_t _voltageTableNextPercentage = 0; // Next percentage searched by buildVoltageTable(), VOLTAGE_TABLE_IDLE if none
 
 /* Initialize battery monitoring resources and determine the type and voltage of
  the attached battery.
@@ -72,166 +109,420 @@ KXKM_STM32_Energy::BatteryType _battType;
  */
 bool initBatteryMonitoring()
 {
-  analogReadResolution(12);
+  #if HW_REVISION > 1
+    setThermistorPower(true);
+  #endif
 
-  _avgBattVoltage = _instantBattVoltage = readBatteryVoltage();
-  _instantLoadCurrent = readLoadCurrent();
-  
-  _battType = getBatteryTypeSelectorState();
+  initAdcSampling();
 
-  switch (_battType)
-  {
-    case KXKM_STM32_Energy::BATTERY_LIPO: //LiPo
-    {
-      uint8_t cells = findCellCount(getAverageBatteryVoltage(), LIPO_VOLTAGE_BREAKS[0], LIPO_VOLTAGE_BREAKS[6]);
+  const volatile uint16_t* block;
+  while ((block = getCompletedAdcBlock()) == NULL);
 
-      //SERIAL_DEBUG("LiPo");
-      //SERIAL_DEBUG(cells);
+  #if HW_REVISION > 1
+    _tempAdcRead = getAdcBlockAverage(block, _adcTempIndex);
+    setThermistorPower(false);
+  #endif
 
-      for (int i = 0; i < 7; i++)
-        _battVoltageBreaks[i] = cells * LIPO_VOLTAGE_BREAKS[i];
+  initProfileStorage();
+  initAdcCalibration();
+  initThermalProtection();
+  #if HW_REVISION > 1
+    updateThermalProtection();
+  #endif
 
-      if (cells == 0)
-        return false; // The selector is on the LiPo / LiFe state but the voltage doesn't match !
+  // Settling measurement, used for the cells count detection
+  unsigned long voltageSum = 0, currentSum = 0;
+  for (uint8_t i = 0; i < CELLS_DETECTION_BLOCKS; i++)
+  {
+    while ((block = getCompletedAdcBlock()) == NULL);
+    voltageSum += getAdcBlockAverage(block, _adcVoltageIndex);
+    currentSum += getAdcBlockAverage(block, _adcCurrentIndex);
+  }
 
-      break;
-    }
+  unsigned int battVoltage = adcToBatteryVoltage(voltageSum / CELLS_DETECTION_BLOCKS);
+  _battVoltageSpikeFilter.reset(battVoltage);
+  _instantBattVoltage.reset(battVoltage);
+  _avgBattVoltage.reset(battVoltage);
+  _instantLoadCurrent.reset(adcToLoadCurrent(currentSum / CELLS_DETECTION_BLOCKS));
+  initLoadStats();
+
+  _battType = getBatteryTypeSelectorState();
+  _battCells = 0;
+  _cellsConfidence = 0;
 
+  switch (_battType)
+  {
+    case KXKM_STM32_Energy::BATTERY_LIPO: //LiPo
     case KXKM_STM32_Energy::BATTERY_LIFE: //LiFe
     {
-      uint8_t cells = findCellCount(getAverageBatteryVoltage(), LIFE_VOLTAGE_BREAKS[0], LIFE_VOLTAGE_BREAKS[6]);
+      // The battery types match the built-in profiles
+      _battCells = applyBuiltinProfile(_battType, 0);
 
-      //SERIAL_DEBUG("LiFe");
-      //SERIAL_DEBUG(cells);
-
-      for (int i = 0; i < 7; i++)
-        _battVoltageBreaks[i] = cells * LIFE_VOLTAGE_BREAKS[i];
+      //SERIAL_DEBUG(_battType);
+      //SERIAL_DEBUG(_battCells);
 
-      if (cells == 0)
+      if (_battCells == 0)
         return false; // The selector is on the LiPo / LiFe state but the voltage doesn't match !
 
       break;
     }
+
     case KXKM_STM32_Energy::BATTERY_CUSTOM: //Custom. Battery monitoring disabled or will be set later.
     default:
       // SERIAL_DEBUG("custom");
       for (int i = 0; i < 7; i++)
         _battVoltageBreaks[i] = 0;
+
+      _battCells = restoreBatteryProfile();
       break;
   }
 
+  initStateOfCharge(_battCells);
+  updateBatteryState();
   return true;
 }
 
-/* Perform regular battery monitoring actions (update ADC reading, check voltage, etc) */
+/* Perform regular battery monitoring actions (filter ADC readings, check voltage, etc) */
 void loopBatteryMonitoring()
 {
-  static unsigned long lastAdcRead = millis();
-  if (millis() - lastAdcRead > ADC_READ_PERIOD_MS)
-  {
-    lastAdcRead = millis();
-    
-    //Exponential smoothing
-    _instantBattVoltage = (_instantBattVoltage * SHORT_TERM_OLD_WEIGHT + readBatteryVoltage() * SHORT_TERM_NEW_WEIGHT) / (SHORT_TERM_OLD_WEIGHT + SHORT_TERM_NEW_WEIGHT);
-    _instantLoadCurrent = (_instantLoadCurrent * SHORT_TERM_OLD_WEIGHT + readLoadCurrent() * SHORT_TERM_NEW_WEIGHT) / (SHORT_TERM_OLD_WEIGHT + SHORT_TERM_NEW_WEIGHT);
-    _avgBattVoltage = (_avgBattVoltage * LONG_TERM_OLD_WEIGHT + _instantBattVoltage * LONG_TERM_NEW_WEIGHT) / (LONG_TERM_OLD_WEIGHT + LONG_TERM_NEW_WEIGHT);
-  }
+  const volatile uint16_t* block = getCompletedAdcBlock();
+  if (block == NULL)
+    return;
+
+  unsigned int blockBattVoltage = adcToBatteryVoltage(getAdcBlockAverage(block, _adcVoltageIndex));
+  unsigned int blockLoadCurrent = adcToLoadCurrent(getAdcBlockAverage(block, _adcCurrentIndex));
+  loopLoadStats(block, blockBattVoltage >> VOLTAGE_MEAS_DECIMAL_PART);
+  loopCalibration(block);
+  loopStateOfCharge(blockBattVoltage, blockLoadCurrent);
+
+  _instantBattVoltage.update(_battVoltageSpikeFilter.update(blockBattVoltage));
+  _avgBattVoltage.update(_instantBattVoltage.value());
+  _instantLoadCurrent.update(blockLoadCurrent);
+
+  updateBatteryState();
+
+  #if HW_REVISION > 1
+    static unsigned long lastTempMeas = millis();
+    if (_tempMeasBlocks > 0)
+    {
+      if (--_tempMeasBlocks == 0)
+      {
+        _tempAdcRead = getAdcBlockAverage(block, _adcTempIndex);
+        setThermistorPower(false);
+        lastTempMeas = millis();
+        updateCalibrationTemperature();
+        updateThermalProtection();
+      }
+    }
+    else if (millis() - lastTempMeas > TEMP_MEAS_PERIOD_MS)
+    {
+      setThermistorPower(true);
+      _tempMeasBlocks = 2; // The block being written is incomplete, the next one will be read
+    }
+  #endif
 }
 
-/* Take a battery voltage measurement and return the result in mV */
-unsigned int readBatteryVoltage()
+/* Take the battery state snapshot, after the measurements are updated */
+void updateBatteryState()
 {
-  unsigned int adcRead = 0;
-
-  // unsigned long millisStart = millis();
+  _battState.voltage = getInstantBatteryVoltage();
+  _battState.avgVoltage = getAverageBatteryVoltage();
+  _battState.percentage = getBatteryPercentage();
+  _battState.breaksValid = (_battVoltageBreaks[0] != 0 && _battVoltageBreaks[6] != 0);
+
+  if (_battState.percentage < 0)
+    _battState.low = false;
+  else if (_battState.percentage < BATT_LOW_LEVEL)
+    _battState.low = true;
+  else if (_battState.percentage >= BATT_LOW_LEVEL + BATT_LOW_HYSTERESIS)
+    _battState.low = false;
+}
 
-  for (int i = 0; i < ADC_READS_COUNT; i++)
-    adcRead += analogRead(BATT_VOLTAGE_SENSE_PIN);
+/* Return the last battery state snapshot */
+const BatteryState& getBatteryState()
+{
+  return _battState;
+}
 
-  adcRead /= ADC_READS_COUNT;
+/* Convert a battery voltage ADC reading to mV (fixed point) */
+unsigned int adcToBatteryVoltage(unsigned int adcRead)
+{
+  long reading = ((long)adcRead << CALIBRATION_FRAC_BITS) - _adcCalibration.voltageOffset;
+  if (reading <= 0)
+    return 0;
 
-  // unsigned long millisEnd = millis();
+  return ((unsigned long long)reading * _battVoltageScale) >> 16;
+}
 
-  // SERIAL_DEBUG(adcRead);
-  // SERIAL_DEBUG(millisEnd - millisStart);
+/* Measure the battery voltage (mV) on new ADC blocks, without the filters : used after the Stop mode, when the
+   filtered values are outdated */
+unsigned int measureBatteryVoltage()
+{
+  getCompletedAdcBlock(); // Completed before the Stop mode
+  const volatile uint16_t* block;
+  for (uint8_t i = 0; i < 2; i++) // The block being written when the sampling stopped is not used either
+    while ((block = getCompletedAdcBlock()) == NULL);
 
-  return (adcRead << VOLTAGE_MEAS_DECIMAL_PART) * CALIBRATION_VOLTAGE / readCalibrationValue();
+  return adcToBatteryVoltage(getAdcBlockAverage(block, _adcVoltageIndex)) >> VOLTAGE_MEAS_DECIMAL_PART;
 }
 
 /* Return the average battery voltage */
 unsigned int getAverageBatteryVoltage()
 {
-  return _avgBattVoltage >> VOLTAGE_MEAS_DECIMAL_PART;
+  return _avgBattVoltage.value() >> VOLTAGE_MEAS_DECIMAL_PART;
 }
 
 unsigned int getInstantBatteryVoltage()
 {
-  return _instantBattVoltage >> VOLTAGE_MEAS_DECIMAL_PART;
+  return _instantBattVoltage.value() >> VOLTAGE_MEAS_DECIMAL_PART;
 }
 
-/* Take a load current measurement and return the result in mA */
-unsigned int readLoadCurrent()
+/* Convert a load current ADC reading to mA (fixed point) */
+unsigned int adcToLoadCurrent(unsigned long adcRead)
 {
-  unsigned long adcRead = 0;
-
-  // unsigned long millisStart = millis();
-
-  for (int i = 0; i < ADC_READS_COUNT; i++)
-    adcRead += analogRead(LOAD_CURRENT_SENSE_PIN);
-
-  adcRead /= ADC_READS_COUNT;
-
-  // unsigned long millisEnd = millis();
+  return calibratedToLoadCurrent(((long)adcRead << CALIBRATION_FRAC_BITS) - _adcCalibration.currentOffset);
+}
 
-  // SERIAL_DEBUG(adcRead);
-  // SERIAL_DEBUG(millisEnd - millisStart);
+/* Convert an offset corrected load current reading (ADC units << CALIBRATION_FRAC_BITS) to mA (fixed point) */
+unsigned int calibratedToLoadCurrent(long reading)
+{
+  if (reading <= 0)
+    return 0;
 
-  return (adcRead * CURRENT_MEAS_MULTIPLIER1 / CURRENT_MEAS_DIVIDER * CURRENT_MEAS_MULTIPLIER2) << CURRENT_MEAS_DECIMAL_PART;
+  return ((unsigned long long)reading * _loadCurrentScale) >> 16;
 }
 
 /* Return the load current */
 unsigned int getInstantLoadCurrent()
 {
-  return _instantLoadCurrent >> CURRENT_MEAS_DECIMAL_PART;
+  return max(_instantLoadCurrent.value(), (int32_t)0) >> CURRENT_MEAS_DECIMAL_PART;
 }
 
-/* Return the approximate temperature in degree Celsius from the on-board thermistor.
+/* Return the temperature in 0.1 degree Celsius from the on-board thermistor (see ntc_table.h).
+ * The thermistor is read every TEMP_MEAS_PERIOD_MS.
  * Not supported on hardware revision 1.
  */
-int readApproxTempDegC()
+int readTempDeciDegC()
 {
   #if HW_REVISION == 1
-    return 25;
+    return 250;
   #else
-    pinMode(TEMP_MEAS_PIN, INPUT);
-    delayMicroseconds(10);
-
-    unsigned long adcRead = 0;
-    for (int i = 0; i < ADC_READS_COUNT; i++)
-      adcRead += analogRead(TEMP_MEAS_PIN);
-    adcRead /= ADC_READS_COUNT;
-    
-    pinMode(TEMP_MEAS_PIN, OUTPUT);
-    digitalWrite(TEMP_MEAS_PIN, LOW); // Avoid thermistor self heating
-    
-    return approximateTemperatureInt(adcRead);
+    return adcToTemperature(constrain((int)_tempAdcRead + _adcCalibration.thermistorOffset, 0, 4095));
   #endif
 }
 
-/* Return the battery percentage using the average reading.
+/* Return the temperature in degree Celsius, rounded */
+int readTempDegC()
+{
+  int temperature = readTempDeciDegC();
+  return (temperature + (temperature >= 0 ? 5 : -5)) / 10;
+}
+
+#if HW_REVISION > 1
+/* Release the thermistor pin for a measurement, or pull it low to avoid self heating */
+void setThermistorPower(bool state)
+{
+  if (state)
+  {
+    ledPortPinMode(TEMP_MEAS_PIN, INPUT_ANALOG);
+  }
+  else
+  {
+    ledPortPinMode(TEMP_MEAS_PIN, OUTPUT);
+    digitalWrite(TEMP_MEAS_PIN, LOW);
+  }
+}
+#endif
+
+/* Apply a built-in profile. If the number of cells is 0, it is determined from the voltage.
+   Return the number of cells, 0 if it could not be determined (the battery voltage is then not monitored). */
+uint8_t applyBuiltinProfile(uint8_t profile, uint8_t cells)
+{
+  const unsigned int* breaks = BUILTIN_PROFILES[profile];
+  if (cells == 0)
+  {
+    uint8_t lastPackCells = loadLastPackCells(profile);
+    cells = findCellCount(getAverageBatteryVoltage(), getInstantLoadCurrent(), breaks[0], breaks[6], lastPackCells);
+
+    // Only a certain detection is stored as the last known pack
+    if (_cellsConfidence == 100)
+      storeLastPackCells(profile, cells);
+  }
+  else
+    _cellsConfidence = 100;
+
+  for (int i = 0; i < 7; i++)
+    setBatteryVoltageBreak(i, cells * breaks[i]);
+
+  return cells;
+}
+
+/* Apply a built-in or user profile. Return the number of cells, 0 if unknown. */
+uint8_t applyBatteryProfile(uint8_t profile, uint8_t cells)
+{
+  if (profile < BUILTIN_PROFILES_COUNT)
+    return applyBuiltinProfile(profile, cells);
+
+  unsigned int breaks[7];
+  if (profile >= KXKM_STM32_Energy::PROFILE_USER_0 && loadUserProfile(profile - KXKM_STM32_Energy::PROFILE_USER_0, breaks))
+  {
+    for (int i = 0; i < 7; i++)
+      setBatteryVoltageBreak(i, breaks[i]);
+  }
+
+  return 0;
+}
+
+/* Apply the profile stored in flash, if any. Return the number of cells, 0 if unknown. */
+uint8_t restoreBatteryProfile()
+{
+  uint8_t profile, cells;
+  if (!loadProfileSelection(profile, cells))
+    return 0;
+
+  return applyBatteryProfile(profile, cells);
+}
+
+/* Select a profile (custom position) and store the selection */
+void selectBatteryProfile(uint8_t profile, uint8_t cells)
+{
+  if (profile >= BUILTIN_PROFILES_COUNT &&
+      (profile < KXKM_STM32_Energy::PROFILE_USER_0 || profile >= KXKM_STM32_Energy::PROFILE_USER_0 + KXKM_STM32_Energy::USER_PROFILE_SLOTS))
+    return;
+
+  _cellsConfidence = 0;
+  _battCells = applyBatteryProfile(profile, cells);
+  setBatteryCellsCount(_battCells);
+  storeProfileSelection(profile, cells);
+}
+
+/* Store the current voltage breaks in a user profile and select it */
+void saveBatteryProfile(uint8_t slot)
+{
+  if (slot >= KXKM_STM32_Energy::USER_PROFILE_SLOTS)
+    return;
+
+  storeUserProfile(slot, _battVoltageBreaks);
+  storeProfileSelection(KXKM_STM32_Energy::PROFILE_USER_0 + slot, 0);
+}
+
+/* Set a battery voltage break (mV). The lookup table is rebuilt once all breaks are set. */
+void setBatteryVoltageBreak(uint8_t index, unsigned int voltage)
+{
+  _battVoltageBreaks[index] = voltage;
+  _voltageTableValid = false;
+  _voltageTableNextPercentage = 0; // Restart the build
+}
+
+/* Return the battery percentage matching a voltage (mV) on the battery voltage breaks, from the lookup table.
    At least the low and high voltage breaks are required.
 
    If the percentage could not be determined, return -1
  */
-int getBatteryPercentage()
+int getVoltagePercentage(unsigned int battVoltage)
+{
+  if (!_voltageTableValid)
+  {
+    buildVoltageTable();
+    return interpolateVoltagePercentage(battVoltage);
+  }
+
+  if (battVoltage < _percentageVoltages[0])
+    return 0;
+
+  if (battVoltage >= _percentageVoltages[100])
+    return 100;
+
+  // Start from the percentage at the beginning of the voltage step, only a few percentages fit in a step
+  uint8_t percentage = _voltageTable[(battVoltage - _percentageVoltages[0]) >> _voltageTableShift];
+  while (battVoltage >= _percentageVoltages[percentage + 1])
+    percentage++;
+
+  return percentage;
+}
+
+/* Compile the voltage breaks into the lookup table, VOLTAGE_TABLE_BUILD_STEP percentages per call : the 101
+   bisections don't fit in one ADC block slot. The table is valid after the last call, the interpolation is used
+   until then.
+   The table gives the same results as the interpolation : the lowest voltage of each percentage is searched by
+   bisection on the interpolation, which is monotonic if the defined breaks are increasing. Otherwise the
+   interpolation is used directly. */
+void buildVoltageTable()
+{
+  if (_voltageTableNextPercentage == VOLTAGE_TABLE_IDLE)
+    return;
+
+  if (_voltageTableNextPercentage == 0)
+  {
+    _voltageTableNextPercentage = VOLTAGE_TABLE_IDLE; // Until the breaks change, if they are not valid
+    if (_battVoltageBreaks[0] == 0 || _battVoltageBreaks[6] == 0)
+      return;
+
+    unsigned int lastBreak = 0;
+    for (uint8_t i = 0; i < 7; i++)
+    {
+      if (_battVoltageBreaks[i] == 0)
+        continue;
+      if (_battVoltageBreaks[i] <= lastBreak)
+        return;
+      lastBreak = _battVoltageBreaks[i];
+    }
+    _voltageTableNextPercentage = 0;
+  }
+
+  uint8_t end = min(_voltageTableNextPercentage + VOLTAGE_TABLE_BUILD_STEP, 101);
+  for (uint8_t percentage = _voltageTableNextPercentage; percentage < end; percentage++)
+  {
+    // The voltages increase with the percentage : start from the previous one
+    unsigned int low = percentage > 0 ? _percentageVoltages[percentage - 1] : _battVoltageBreaks[0];
+    unsigned int high = _battVoltageBreaks[6];
+    while (low < high)
+    {
+      unsigned int mid = (low + high) / 2;
+      if (interpolateVoltagePercentage(mid) >= percentage)
+        high = mid;
+      else
+        low = mid + 1;
+    }
+    _percentageVoltages[percentage] = low;
+  }
+
+  _voltageTableNextPercentage = end;
+  if (end <= 100)
+    return;
+
+  unsigned int range = _battVoltageBreaks[6] - _battVoltageBreaks[0];
+  _voltageTableShift = 0;
+  while ((range >> _voltageTableShift) >= VOLTAGE_TABLE_SIZE)
+    _voltageTableShift++;
+
+  uint8_t percentage = 0;
+  for (uint8_t i = 0; i < VOLTAGE_TABLE_SIZE; i++)
+  {
+    unsigned int voltage = _battVoltageBreaks[0] + (i << _voltageTableShift);
+    while (percentage < 100 && voltage >= _percentageVoltages[percentage + 1])
+      percentage++;
+    _voltageTable[i] = percentage;
+  }
+
+  _voltageTableNextPercentage = VOLTAGE_TABLE_IDLE;
+  _voltageTableValid = true;
+}
+
+/* Interpolate the battery percentage between the voltage breaks (mV). Used to build the lookup table.
+   At least the low and high voltage breaks are required.
+
+   If the percentage could not be determined, return -1
+ */
+int interpolateVoltagePercentage(unsigned int battVoltage)
 {
   if (_battVoltageBreaks[0] == 0 || _battVoltageBreaks[6] == 0)
     return -1;
 
-  if (getAverageBatteryVoltage() < _battVoltageBreaks[0])
+  if (battVoltage < _battVoltageBreaks[0])
     return 0;
 
-  if (getAverageBatteryVoltage() >= _battVoltageBreaks[6])
+  if (battVoltage >= _battVoltageBreaks[6])
     return 100;
 
   // Find out the first defined voltage break above 0 and interpolate between break 0 and this break.
@@ -243,7 +534,6 @@ int getBatteryPercentage()
     while (_battVoltageBreaks[upperIdx] == 0 && upperIdx <= 6)
       upperIdx++;
 
-    unsigned int battVoltage = getAverageBatteryVoltage();
     if (battVoltage >= _battVoltageBreaks[lowerIdx] && battVoltage < _battVoltageBreaks[upperIdx])
       return (lowerIdx * 100 / 6) + (battVoltage - _battVoltageBreaks[lowerIdx]) * (upperIdx - lowerIdx) * (100 / 6) / (_battVoltageBreaks[upperIdx] - _battVoltageBreaks[lowerIdx]);
 
@@ -266,33 +556,57 @@ KXKM_STM32_Energy::BatteryType getBatteryTypeSelectorState()
     return KXKM_STM32_Energy::BATTERY_CUSTOM;
 }
 
-/* Read the calibration value stored in the option byte.
+/* Determine the number of cells based on the battery voltage (mV), the load current (mA) and the given min and max
+ * cell voltages. The voltage drop in the cells is compensated for each number of cells.
+ * If two numbers of cells match, the last known pack (hint, 0 if none) is preferred. Otherwise the larger number of
+ * cells is chosen : its cut off voltage is higher, a pack taken for one cell less would be over-discharged. The
+ * confidence (%) then grows with its margin to the cell voltage limits, compared to the other candidate. The confidence
+ * is stored in _cellsConfidence.
+ * Return 0 if the voltage doesn't match any number of cells.
+ *
+ * 2 to 7 cells are supported.
  */
-uint16_t readCalibrationValue()
+uint8_t findCellCount(unsigned int voltage, unsigned int current, unsigned int cellMin, unsigned int cellMax, uint8_t hint)
 {
-  uint16_t ob = (HAL_FLASHEx_OBGetUserData(OB_DATA_ADDRESS_DATA1) << 8) + HAL_FLASHEx_OBGetUserData(OB_DATA_ADDRESS_DATA0);
+  uint8_t candidates[2];
+  unsigned int margins[2];
+  uint8_t count = 0;
 
-  if (ob == 0xFFFF) //Unprogrammed
-    ob = 24000 * 316 / (316+2700) * 4095 / 3300; // Default value : voltage is sensed through a 31.6k / 270k resistive divider, referenced to 3.3V
+  for (uint8_t i = MIN_CELLS; i <= MAX_CELLS && count < 2; i++)
+  {
+    unsigned int cellVoltage = (voltage + current * i * DEFAULT_CELL_RESISTANCE / 1000) / i;
+    if (cellVoltage > cellMin && cellVoltage <= cellMax + INITIAL_CELL_VOLTAGE_TOLERANCE)
+    {
+      candidates[count] = i;
+      margins[count] = min(cellVoltage - cellMin, cellMax + INITIAL_CELL_VOLTAGE_TOLERANCE - cellVoltage);
+      count++;
+    }
+  }
 
-  return ob;
-}
+  if (count == 0)
+  {
+    _cellsConfidence = 0;
+    return 0;
+  }
 
-/* Determine the number of cells based on the battery voltage and the given min and max cell voltages.
- * Return 0 if the voltage doesn't match any number of cells.
- *
- * 2, 3, 4 and 7 cells are supported.
- */
-uint8_t findCellCount(unsigned int voltage, unsigned int cellMin, unsigned int cellMax)
-{
-  for (int i = 2; i <= 7; i++)
+  if (count == 1)
   {
-    if (i == 5 || i == 6)
-      continue;
+    _cellsConfidence = 100;
+    return candidates[0];
+  }
 
-    if (voltage > i * cellMin && voltage <= i * (cellMax + INITIAL_CELL_VOLTAGE_TOLERANCE))
-      return i;
+  if (hint == candidates[0] || hint == candidates[1])
+  {
+    _cellsConfidence = CELLS_CONFIDENCE_HINT;
+    return hint;
   }
 
-  return 0;
+  _cellsConfidence = CELLS_CONFIDENCE_MARGIN + (CELLS_CONFIDENCE_HINT - CELLS_CONFIDENCE_MARGIN - 1) * margins[1] / (margins[0] + margins[1] + 1);
+  return candidates[1];
+}
+
+/* Return the number of cells + 100 * detection confidence (%), as reported to the ESP32 */
+int getCellsDetection()
+{
+  return _battCells + 100 * _cellsConfidence;
 }
@@ -0,0 +1,17 @@
+#ifndef BATT_STATE_H
+#define BATT_STATE_H
+
+#include <Arduino.h>
+
+/* Battery state snapshot, updated once per ADC block by loopBatteryMonitoring().
+ * The state machine, LED gauge and serial commands all read the same values during a loop iteration.
+ */
+struct BatteryState {
+  unsigned int voltage; // Instant battery voltage (mV)
+  unsigned int avgVoltage; // Average battery voltage (mV)
+  int percentage; // Estimated battery level, -1 if unknown
+  bool low; // Below BATT_LOW_LEVEL, until the level goes back above BATT_LOW_LEVEL + BATT_LOW_HYSTERESIS
+  bool breaksValid; // The cut off and fully charged voltages are known
+};
+
+#endif
@@ -0,0 +1,27 @@
+#ifndef CALIBRATION_H
+#define CALIBRATION_H
+
+#include <Arduino.h>
+
+/* ADC calibration record (see calibration.ino), written by STM32_ADC_calib.
+ * This file is shared with STM32_ADC_calib : keep both copies identical.
+ *
+ * Readings are given with CALIBRATION_FRAC_BITS fractional bits (averages of many samples).
+ * The record is stored as the values of a PROFILE_RECORD_CALIBRATION storage record : 14 bytes. */
+struct AdcCalibration {
+  uint16_t voltageGain; // Battery voltage reading at CALIBRATION_VOLTAGE, offset removed
+  int16_t voltageOffset; // Battery voltage reading at 0V
+  uint16_t currentGain; // Measured / nominal load current (CALIBRATION_GAIN_ONE = 1)
+  int16_t currentOffset; // Load current reading at 0A
+  int16_t thermistorOffset; // Added to the thermistor readings (LSB)
+  int16_t tempCoefficient; // Battery voltage reading drift (ppm/°C)
+  uint16_t referenceTempAdc; // Thermistor reading during the calibration (LSB), CALIBRATION_NO_TEMPERATURE if unknown
+};
+
+const uint16_t CALIBRATION_VOLTAGE = 24000; // High calibration point (mV)
+const uint16_t CALIBRATION_LOW_VOLTAGE = 12000; // Low calibration point (mV), near the 3S cut off voltage
+const uint8_t CALIBRATION_FRAC_BITS = 4;
+const uint16_t CALIBRATION_GAIN_ONE = 16384;
+const uint16_t CALIBRATION_NO_TEMPERATURE = 0xFFFF;
+
+#endif
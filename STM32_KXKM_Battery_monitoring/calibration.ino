@@ -0,0 +1,260 @@
+/* ADC calibration
+ *
+ * The battery voltage reading is corrected with a gain and an offset, measured at CALIBRATION_LOW_VOLTAGE and
+ * CALIBRATION_VOLTAGE by STM32_ADC_calib : the offset matters at the low end, where the shutdown decisions are made.
+ * The load current and thermistor readings can also be corrected, and the drift of the voltage reading with the
+ * temperature is compensated using the thermistor (hardware revision 2).
+ *
+ * The record is kept in the profile storage page (see profile_storage.ino). Boards calibrated by older versions of
+ * STM32_ADC_calib only have the gain at CALIBRATION_VOLTAGE, in the option bytes.
+ *
+ * The board can also be calibrated by the ESP32, without flashing STM32_ADC_calib (CALIBRATE_* commands) :
+ *  * each CALIBRATE_VOLTAGE / CALIBRATE_CURRENT command averages CALIBRATION_BLOCKS ADC blocks of the channel, then
+ *    updates a pending calibration from the given reference value. Two voltage points at least CALIBRATION_MIN_SPAN
+ *    apart give the gain and the offset, a single point only corrects the gain. A 0mA reference gives the current
+ *    offset (load switch off), other references the current gain (known load).
+ *  * implausible results (gain more than 25% off) are rejected : the pending calibration is discarded.
+ *  * the thermistor reading is kept with each voltage point (hardware revision 2) : the drift given by
+ *    SET_TEMP_COEFFICIENT is compensated from the temperature of the points, not from the temperature at commit time.
+ *  * COMMIT_CALIBRATION appends the pending calibration to the storage log. Until the record is complete and its CRC
+ *    valid, the previous calibration is used : a power loss during the write doesn't corrupt it.
+ * These commands are optional (FEATURE_CALIBRATION_COMMANDS, see firmware_features.h).
+ *
+ * The conversion factors are computed here : converting a reading only takes a subtraction, a multiply and a shift.
+ */
+
+uint32_t _battVoltageBaseScale; // Without temperature compensation
+int _calibrationTemperature; // 0.1°C
+
+#if FEATURE_CALIBRATION_COMMANDS
+const uint8_t CALIBRATION_BLOCKS = 64; // ADC_BLOCK_SCANS samples per block : 256 samples, like STM32_ADC_calib
+const unsigned int CALIBRATION_MIN_SPAN = 5000; // mV between two voltage points to measure the offset
+const uint8_t CALIBRATION_TOLERANCE_SHIFT = 2; // Accepted gain error : 1/4
+const long CALIBRATION_MAX_CURRENT_OFFSET = 256L << CALIBRATION_FRAC_BITS; // 1/16 of the ADC range
+const int CALIBRATION_MAX_TEMP_COEFFICIENT = 1000; // ppm/°C : 2.5% over the operating range
+
+AdcCalibration _pendingCalibration;
+uint8_t _calibrationState; // KXKM_STM32_Energy::CalibrationState
+uint8_t _calibrationChannel; // ADC index being measured
+unsigned int _calibrationReference; // mV or mA
+unsigned long _calibrationSum;
+uint8_t _calibrationBlocks; // Blocks left
+long _lastVoltageReading; // Previous voltage point, 0 if none
+unsigned int _lastVoltageReference;
+unsigned int _lastVoltageTempAdc; // Thermistor reading of the previous voltage point
+#endif
+
+void initAdcCalibration()
+{
+  if (!loadAdcCalibration(_adcCalibration))
+  {
+    _adcCalibration.voltageGain = readCalibrationValue() << CALIBRATION_FRAC_BITS;
+    _adcCalibration.voltageOffset = 0;
+    _adcCalibration.currentGain = CALIBRATION_GAIN_ONE;
+    _adcCalibration.currentOffset = 0;
+    _adcCalibration.thermistorOffset = 0;
+    _adcCalibration.tempCoefficient = 0;
+    _adcCalibration.referenceTempAdc = CALIBRATION_NO_TEMPERATURE;
+  }
+
+  applyAdcCalibration();
+
+  #if FEATURE_CALIBRATION_COMMANDS
+    _pendingCalibration = _adcCalibration;
+    _calibrationState = KXKM_STM32_Energy::CALIBRATION_IDLE;
+    _lastVoltageReading = 0;
+  #endif
+}
+
+/* Compute the conversion factors of _adcCalibration */
+void applyAdcCalibration()
+{
+  _battVoltageBaseScale = ((unsigned long long)CALIBRATION_VOLTAGE << (VOLTAGE_MEAS_DECIMAL_PART + 16)) / _adcCalibration.voltageGain;
+
+  // Nominal : I (mA) = reading * CURRENT_MEAS_MULTIPLIER1 * CURRENT_MEAS_MULTIPLIER2 / CURRENT_MEAS_DIVIDER
+  _loadCurrentScale = ((unsigned long long)CURRENT_MEAS_MULTIPLIER1 * CURRENT_MEAS_MULTIPLIER2 * CALIBRATION_GAIN_ONE
+                       << (CURRENT_MEAS_DECIMAL_PART + 16 - CALIBRATION_FRAC_BITS))
+                      / ((unsigned long long)CURRENT_MEAS_DIVIDER * _adcCalibration.currentGain);
+
+  #if HW_REVISION > 1
+    _calibrationTemperature = adcToTemperature(constrain((int)_adcCalibration.referenceTempAdc + _adcCalibration.thermistorOffset, 0, 4095));
+  #endif
+
+  updateCalibrationTemperature();
+}
+
+/* Update the battery voltage conversion after a thermistor reading */
+void updateCalibrationTemperature()
+{
+  _battVoltageScale = _battVoltageBaseScale;
+
+  #if HW_REVISION > 1
+    if (_adcCalibration.tempCoefficient == 0 || _adcCalibration.referenceTempAdc == CALIBRATION_NO_TEMPERATURE)
+      return;
+
+    long drift = (long)_adcCalibration.tempCoefficient * (readTempDeciDegC() - _calibrationTemperature) / 10; // ppm
+    _battVoltageScale = (unsigned long long)_battVoltageBaseScale * 1000000 / (1000000 + drift);
+  #endif
+}
+
+/* Read the calibration value stored in the option byte : battery voltage reading at CALIBRATION_VOLTAGE.
+ */
+uint16_t readCalibrationValue()
+{
+  uint16_t ob = (HAL_FLASHEx_OBGetUserData(OB_DATA_ADDRESS_DATA1) << 8) + HAL_FLASHEx_OBGetUserData(OB_DATA_ADDRESS_DATA0);
+
+  if (ob == 0xFFFF) //Unprogrammed
+    ob = getNominalCalibrationValue();
+
+  return ob;
+}
+
+uint16_t getNominalCalibrationValue()
+{
+  return 24000 * 316 / (316+2700) * 4095 / 3300; // Voltage is sensed through a 31.6k / 270k resistive divider, referenced to 3.3V
+}
+
+#if FEATURE_CALIBRATION_COMMANDS
+/* Start measuring a calibration point. Reference : battery voltage (mV) or load current (mA). */
+void startCalibration(uint8_t channel, unsigned int reference)
+{
+  if (_calibrationState == KXKM_STM32_Energy::CALIBRATION_MEASURING)
+    return;
+
+  _calibrationChannel = channel;
+  _calibrationReference = reference;
+  _calibrationSum = 0;
+  _calibrationBlocks = CALIBRATION_BLOCKS;
+  _calibrationState = KXKM_STM32_Energy::CALIBRATION_MEASURING;
+}
+
+/* Accumulate the samples of a completed ADC block while measuring */
+void loopCalibration(const volatile uint16_t* block)
+{
+  if (_calibrationState != KXKM_STM32_Energy::CALIBRATION_MEASURING)
+    return;
+
+  for (unsigned int i = 0; i < ADC_BLOCK_SCANS; i++)
+    _calibrationSum += block[i * ADC_CHANNELS_COUNT + _calibrationChannel];
+
+  if (--_calibrationBlocks == 0)
+  {
+    long reading = (_calibrationSum << CALIBRATION_FRAC_BITS) / (CALIBRATION_BLOCKS * ADC_BLOCK_SCANS);
+    bool valid = (_calibrationChannel == _adcVoltageIndex) ? updateVoltageCalibration(reading) : updateCurrentCalibration(reading);
+
+    if (valid)
+      _calibrationState = KXKM_STM32_Energy::CALIBRATION_MEASURED;
+    else
+      discardCalibration();
+  }
+}
+
+bool updateVoltageCalibration(long reading)
+{
+  long gain, offset;
+  long span = (long)_calibrationReference - _lastVoltageReference;
+
+  if (_lastVoltageReading != 0 && abs(span) >= CALIBRATION_MIN_SPAN)
+  {
+    offset = ((long long)_lastVoltageReading * _calibrationReference - (long long)reading * _lastVoltageReference) / span;
+    gain = (long long)(reading - _lastVoltageReading) * CALIBRATION_VOLTAGE / span;
+  }
+  else
+  {
+    if (_calibrationReference == 0)
+      return false;
+
+    offset = _pendingCalibration.voltageOffset;
+    gain = (long long)(reading - offset) * CALIBRATION_VOLTAGE / _calibrationReference;
+  }
+
+  #if HW_REVISION > 1
+    // Temperature of the measured line : the average of both points
+    uint16_t tempAdc = (_lastVoltageReading != 0 && abs(span) >= CALIBRATION_MIN_SPAN) ? (_lastVoltageTempAdc + _tempAdcRead) / 2 : _tempAdcRead;
+    _lastVoltageTempAdc = _tempAdcRead;
+  #endif
+
+  _lastVoltageReading = reading;
+  _lastVoltageReference = _calibrationReference;
+
+  long nominal = (long)getNominalCalibrationValue() << CALIBRATION_FRAC_BITS;
+  if (abs(gain - nominal) > (nominal >> CALIBRATION_TOLERANCE_SHIFT) || abs(offset) > (nominal >> CALIBRATION_TOLERANCE_SHIFT))
+    return false;
+
+  _pendingCalibration.voltageGain = gain;
+  _pendingCalibration.voltageOffset = offset;
+  #if HW_REVISION > 1
+    _pendingCalibration.referenceTempAdc = tempAdc;
+  #endif
+  return true;
+}
+
+bool updateCurrentCalibration(long reading)
+{
+  if (_calibrationReference == 0)
+  {
+    // Load switch off. The offset should be a few LSB.
+    if (reading > CALIBRATION_MAX_CURRENT_OFFSET)
+      return false;
+
+    _pendingCalibration.currentOffset = reading;
+    return true;
+  }
+
+  // Nominal reading : I (mA) * CURRENT_MEAS_DIVIDER / (CURRENT_MEAS_MULTIPLIER1 * CURRENT_MEAS_MULTIPLIER2)
+  long gain = (long long)(reading - _pendingCalibration.currentOffset) * CURRENT_MEAS_MULTIPLIER1 * CURRENT_MEAS_MULTIPLIER2 * CALIBRATION_GAIN_ONE
+              / ((long long)_calibrationReference * CURRENT_MEAS_DIVIDER << CALIBRATION_FRAC_BITS);
+
+  if (abs(gain - CALIBRATION_GAIN_ONE) > (CALIBRATION_GAIN_ONE >> CALIBRATION_TOLERANCE_SHIFT))
+    return false;
+
+  _pendingCalibration.currentGain = gain;
+  return true;
+}
+
+/* Set the battery voltage reading drift of the pending calibration (ppm/°C) */
+void setCalibrationTempCoefficient(long coefficient)
+{
+  if (_calibrationState == KXKM_STM32_Energy::CALIBRATION_MEASURING || abs(coefficient) > CALIBRATION_MAX_TEMP_COEFFICIENT)
+    return;
+
+  _pendingCalibration.tempCoefficient = coefficient;
+  _calibrationState = KXKM_STM32_Energy::CALIBRATION_MEASURED;
+}
+
+/* Store the pending calibration and use it */
+void commitCalibration()
+{
+  if (_calibrationState != KXKM_STM32_Energy::CALIBRATION_MEASURED)
+    return;
+
+  AdcCalibration stored;
+  if (!storeAdcCalibration(_pendingCalibration) || !loadAdcCalibration(stored) ||
+      memcmp(&stored, &_pendingCalibration, sizeof(stored)) != 0)
+  {
+    discardCalibration();
+    return;
+  }
+
+  _adcCalibration = _pendingCalibration;
+  applyAdcCalibration();
+  _calibrationState = KXKM_STM32_Energy::CALIBRATION_COMMITTED;
+}
+
+void discardCalibration()
+{
+  _pendingCalibration = _adcCalibration;
+  _lastVoltageReading = 0;
+  _calibrationState = KXKM_STM32_Energy::CALIBRATION_ERROR;
+}
+
+uint8_t getCalibrationState()
+{
+  return _calibrationState;
+}
+
+#else
+
+void loopCalibration(const volatile uint16_t* block) {}
+
+#endif
@@ -0,0 +1,113 @@
+/* Fixed point filters
+ *
+ * The STM32F030 has no hardware divider : the coefficients are template parameters, so that updating a filter
+ * only takes shifts, additions and multiplies.
+ *
+ * All filters are updated with one sample at a time and keep their output in the input format.
+ * reset() sets the filter in a steady state at the given value.
+ */
+
+#ifndef FILTERS_H
+#define FILTERS_H
+
+#include <Arduino.h>
+
+/* Exponential moving average : y += (x - y) / 2^SHIFT
+   Time constant : around 2^SHIFT samples.
+   The output is stored with SHIFT more fractional bits to avoid a dead band : the input should fit in 32 - SHIFT bits. */
+template <uint8_t SHIFT>
+class EmaFilter {
+public:
+  void reset(uint32_t value) { _acc = value << SHIFT; }
+
+  uint32_t update(uint32_t sample)
+  {
+    _acc += sample - (_acc >> SHIFT);
+    return value();
+  }
+
+  uint32_t value() const { return _acc >> SHIFT; }
+
+private:
+  uint32_t _acc;
+};
+
+/* Moving window median, to reject isolated spikes. Delay : N/2 samples.
+   N should be odd and small, the window is sorted on each sample. */
+template <typename T, uint8_t N>
+class MedianFilter {
+public:
+  void reset(T value)
+  {
+    for (uint8_t i = 0; i < N; i++)
+      _samples[i] = value;
+    _index = 0;
+  }
+
+  T update(T sample)
+  {
+    _samples[_index] = sample;
+    if (++_index >= N)
+      _index = 0;
+
+    // Insertion sort of a copy of the window
+    T sorted[N];
+    for (uint8_t i = 0; i < N; i++)
+    {
+      uint8_t j = i;
+      for (; j > 0 && sorted[j - 1] > _samples[i]; j--)
+        sorted[j] = sorted[j - 1];
+      sorted[j] = _samples[i];
+    }
+
+    return sorted[N / 2];
+  }
+
+private:
+  T _samples[N];
+  uint8_t _index;
+};
+
+/* Biquad (2nd order IIR) filter, direct form I :
+   y[n] = b0 x[n] + b1 x[n-1] + b2 x[n-2] - a1 y[n-1] - a2 y[n-2]
+   Coefficients are given as signed fixed point numbers with FRAC fractional bits (Q28 by default : range +/-8).
+   The rounding error is fed back into the next sample, so low cut-off frequencies don't leave a dead band.
+   The sum is computed on 64 bits : inputs up to +/-2^28 are safe. */
+template <int32_t B0, int32_t B1, int32_t B2, int32_t A1, int32_t A2, uint8_t FRAC = 28>
+class BiquadFilter {
+public:
+  static const int32_t COEFF_B0 = B0, COEFF_B1 = B1, COEFF_B2 = B2, COEFF_A1 = A1, COEFF_A2 = A2;
+  static const uint8_t COEFF_FRAC = FRAC;
+
+  void reset(int32_t value)
+  {
+    _x1 = _x2 = _y1 = _y2 = value;
+    _error = 0;
+  }
+
+  int32_t update(int32_t sample)
+  {
+    int64_t acc = (int64_t)B0 * sample + (int64_t)B1 * _x1 + (int64_t)B2 * _x2
+                - (int64_t)A1 * _y1 - (int64_t)A2 * _y2 + _error;
+    int32_t y = acc >> FRAC;
+    _error = acc - ((int64_t)y << FRAC);
+
+    _x2 = _x1;
+    _x1 = sample;
+    _y2 = _y1;
+    _y1 = y;
+    return y;
+  }
+
+  int32_t value() const { return _y1; }
+
+private:
+  int32_t _x1, _x2, _y1, _y2;
+  int32_t _error;
+};
+
+// Load current (batt_monitoring.ino) : 2nd order Butterworth low-pass, fc = 1.6Hz at 200Hz (one sample per ADC block),
+// Q28 coefficients. Smoother than an exponential average with the same settling time (around 0.2s) on audio bursts.
+typedef BiquadFilter<163707, 327414, 163707, -517796496, 250015868> LoadCurrentFilter;
+
+#endif //FILTERS_H
@@ -0,0 +1,31 @@
+#ifndef FIRMWARE_FEATURES_H
+#define FIRMWARE_FEATURES_H
+
+/* Optional features (1 : built in, 0 : left out of the image).
+ *
+ * The STM32F030F4 has 16kB of flash and the profile storage uses the last two pages (see profile_storage.h) : the
+ * code must end below 0x08003800. The Makefile checks it after each build and passes FEATURES to the compiler, e.g.
+ * make v2 FEATURES="-DFEATURE_LOAD_STATS=1". The host tests build every feature.
+ *
+ * A command of a feature left out is ignored like an unknown command : no answer.
+ */
+
+// Built-in and custom LED animations (led_animation.ino), PLAY_ANIMATION and ADD_ANIMATION_KEYFRAME.
+// Without them, there is no startup, shutdown nor critical section wait indicator.
+#ifndef FEATURE_LED_ANIMATIONS
+#define FEATURE_LED_ANIMATIONS 0
+#endif
+
+// ADC calibration from the ESP32 (CALIBRATE_VOLTAGE, CALIBRATE_CURRENT, SET_TEMP_COEFFICIENT, COMMIT_CALIBRATION).
+// The stored calibration (STM32_ADC_calib) is always applied.
+#ifndef FEATURE_CALIBRATION_COMMANDS
+#define FEATURE_CALIBRATION_COMMANDS 0
+#endif
+
+// Load current statistics and energy counters (load_stats.ino) : GET_LOAD_STATS, SET_LOAD_STATS_WINDOW,
+// RESET_ENERGY_COUNTERS
+#ifndef FEATURE_LOAD_STATS
+#define FEATURE_LOAD_STATS 0
+#endif
+
+#endif
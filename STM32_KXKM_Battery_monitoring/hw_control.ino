@@ -7,10 +7,18 @@ void set3V3RegState(bool state)
   digitalWrite(POWER_ENABLE_PIN, state);
 }
 
+bool _loadSwitchRequested; // The load switch stays off while the thermal protection cuts the load
+
 /* Main out load switch */
 void setLoadSwitchState(bool state)
 {
-  digitalWrite(MAIN_OUT_ENABLE_PIN, state);
+  _loadSwitchRequested = state;
+  applyLoadSwitchState();
+}
+
+void applyLoadSwitchState()
+{
+  digitalWrite(MAIN_OUT_ENABLE_PIN, _loadSwitchRequested && getThermalLevel() < KXKM_STM32_Energy::THERMAL_LOAD_CUT);
 }
 
 /* ESP32 enable */
@@ -25,5 +33,5 @@ void shutdown()
   clearLeds();
   setLoadSwitchState(false);
   setESP32State(false);
-  pinMode(POWER_ENABLE_PIN, INPUT); //Bye bye !
+  ledPortPinMode(POWER_ENABLE_PIN, INPUT); //Bye bye !
 }
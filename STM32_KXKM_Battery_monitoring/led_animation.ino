@@ -0,0 +1,226 @@
+/* LED gauge animations
+ *
+ * An animation is a list of keyframes, played from the LED timer interrupt at each refresh period (12ms) :
+ * the main loop is never blocked. Each keyframe gives the value of the 6 LEDs (0-15, 4 bits per LED, scaled to the
+ * 0-255 LED values), a duration in refresh periods and whether the LEDs fade from their current values or jump to the
+ * new ones. Fades are computed on the full LED values, with 8 more fractional bits.
+ * See KXKM_STM32_Energy::encodeKeyframe for the format.
+ *
+ * The built-in animations are kept in flash. The ESP32 can upload a custom animation (ADD_ANIMATION_KEYFRAME, kept
+ * in RAM until the next startup) and play any animation once, a number of times or forever (PLAY_ANIMATION).
+ *
+ * Optional (FEATURE_LED_ANIMATIONS, see firmware_features.h) : without it, nothing is ever played.
+ */
+
+#if FEATURE_LED_ANIMATIONS
+
+const uint32_t ANIMATION_SWEEP_UP_KEYFRAMES[] = { // Startup
+  KXKM_STM32_Energy::encodeKeyframe(0x00000F, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x0000FF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x000FFF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x00FFFF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x0FFFFF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0xFFFFFF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x000000, 1, false)
+};
+
+const uint32_t ANIMATION_SWEEP_DOWN_KEYFRAMES[] = { // Long press shutdown
+  KXKM_STM32_Energy::encodeKeyframe(0xFFFFFF, 1, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x0FFFFF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x00FFFF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x000FFF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x0000FF, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x00000F, 6, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x000000, 6, true)
+};
+
+const uint32_t ANIMATION_CHASE_KEYFRAMES[] = { // Critical section wait indicator
+  KXKM_STM32_Energy::encodeKeyframe(0x00000F, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x0000F0, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x000F00, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x00F000, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x0F0000, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0xF00000, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x0F0000, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x00F000, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x000F00, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x0000F0, 8, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x00000F, 8, false)
+};
+
+const uint32_t ANIMATION_BLINK_KEYFRAMES[] = {
+  KXKM_STM32_Energy::encodeKeyframe(0xFFFFFF, 42, false),
+  KXKM_STM32_Energy::encodeKeyframe(0x000000, 42, false)
+};
+
+const uint32_t ANIMATION_BREATHE_KEYFRAMES[] = {
+  KXKM_STM32_Energy::encodeKeyframe(0xFFFFFF, 42, true),
+  KXKM_STM32_Energy::encodeKeyframe(0x000000, 42, true)
+};
+
+uint32_t _customAnimation[KXKM_STM32_Energy::ANIMATION_MAX_KEYFRAMES];
+uint8_t _customAnimationLength;
+
+const uint32_t* volatile _animation; // Keyframes being played, NULL if none
+volatile uint8_t _animationId; // KXKM_STM32_Energy::Animation
+uint8_t _animationLength;
+uint8_t _animationRepeats; // Left, 0 : forever
+uint8_t _keyframeIndex;
+uint8_t _keyframeFrames; // Refresh periods left in the current keyframe
+uint32_t _keyframeLeds;
+uint16_t _animationValues[LED_COUNT]; // LED values with 8 fractional bits
+int16_t _animationSteps[LED_COUNT];
+
+/* Play an animation once, repeats times or forever (0). The LEDs start from their current values. */
+void playAnimation(uint8_t id, uint8_t repeats)
+{
+  const uint32_t* keyframes;
+  uint8_t length;
+
+  switch (id)
+  {
+    case KXKM_STM32_Energy::ANIMATION_SWEEP_UP:
+      keyframes = ANIMATION_SWEEP_UP_KEYFRAMES;
+      length = sizeof(ANIMATION_SWEEP_UP_KEYFRAMES) / sizeof(uint32_t);
+      break;
+
+    case KXKM_STM32_Energy::ANIMATION_SWEEP_DOWN:
+      keyframes = ANIMATION_SWEEP_DOWN_KEYFRAMES;
+      length = sizeof(ANIMATION_SWEEP_DOWN_KEYFRAMES) / sizeof(uint32_t);
+      break;
+
+    case KXKM_STM32_Energy::ANIMATION_CHASE:
+      keyframes = ANIMATION_CHASE_KEYFRAMES;
+      length = sizeof(ANIMATION_CHASE_KEYFRAMES) / sizeof(uint32_t);
+      break;
+
+    case KXKM_STM32_Energy::ANIMATION_BLINK:
+      keyframes = ANIMATION_BLINK_KEYFRAMES;
+      length = sizeof(ANIMATION_BLINK_KEYFRAMES) / sizeof(uint32_t);
+      break;
+
+    case KXKM_STM32_Energy::ANIMATION_BREATHE:
+      keyframes = ANIMATION_BREATHE_KEYFRAMES;
+      length = sizeof(ANIMATION_BREATHE_KEYFRAMES) / sizeof(uint32_t);
+      break;
+
+    case KXKM_STM32_Energy::ANIMATION_CUSTOM:
+      keyframes = _customAnimation;
+      length = _customAnimationLength;
+      break;
+
+    default:
+      keyframes = NULL;
+      length = 0;
+      break;
+  }
+
+  stopAnimation();
+  if (length == 0)
+    return;
+
+  // The interrupt only reads the animation once _animation is set. The other variables are not volatile : the
+  // compiler may move their stores after it, so the LED timer interrupt is masked.
+  noInterrupts();
+  _animationLength = length;
+  _animationRepeats = repeats;
+  _keyframeIndex = 0;
+  _keyframeFrames = 0;
+  _animationId = id;
+  _animation = keyframes;
+  interrupts();
+}
+
+void stopAnimation()
+{
+  _animation = NULL;
+  _animationId = KXKM_STM32_Energy::ANIMATION_STOP;
+}
+
+bool isAnimationPlaying()
+{
+  return _animation != NULL;
+}
+
+/* Current animation, ANIMATION_STOP once it is over */
+uint8_t getAnimation()
+{
+  return _animationId;
+}
+
+/* Append a keyframe to the custom animation. A negative value clears it. */
+void addAnimationKeyframe(long keyframe)
+{
+  if (_animationId == KXKM_STM32_Energy::ANIMATION_CUSTOM)
+    stopAnimation();
+
+  if (keyframe < 0)
+    _customAnimationLength = 0;
+  else if (_customAnimationLength < KXKM_STM32_Energy::ANIMATION_MAX_KEYFRAMES)
+    _customAnimation[_customAnimationLength++] = keyframe;
+}
+
+/* Update the LED values for the next refresh period. Called from the LED timer interrupt.
+ * A refresh period costs a few additions, a new keyframe one division per fading LED. */
+void nextAnimationFrame(volatile uint8_t* values)
+{
+  if (_keyframeFrames == 0)
+  {
+    if (_keyframeIndex >= _animationLength)
+    {
+      if (_animationRepeats == 1)
+      {
+        stopAnimation();
+        return;
+      }
+      if (_animationRepeats > 1)
+        _animationRepeats--;
+      _keyframeIndex = 0;
+    }
+
+    uint32_t keyframe = _animation[_keyframeIndex++];
+    _keyframeLeds = keyframe & KXKM_STM32_Energy::KEYFRAME_LEDS_MASK;
+    _keyframeFrames = max((uint8_t)((keyframe >> KXKM_STM32_Energy::KEYFRAME_DURATION_SHIFT) & KXKM_STM32_Energy::KEYFRAME_MAX_DURATION), (uint8_t)1);
+
+    for (uint8_t i = 0; i < LED_COUNT; i++)
+    {
+      int target = keyframeValue(i) << 8;
+      int current = values[i] << 8; // The LEDs may have been changed since the last keyframe
+
+      if (keyframe & KXKM_STM32_Energy::KEYFRAME_FADE)
+      {
+        _animationValues[i] = current;
+        _animationSteps[i] = (target - current) / _keyframeFrames;
+      }
+      else
+      {
+        _animationValues[i] = target;
+        _animationSteps[i] = 0;
+      }
+    }
+  }
+
+  bool last = (--_keyframeFrames == 0);
+  for (uint8_t i = 0; i < LED_COUNT; i++)
+  {
+    _animationValues[i] += _animationSteps[i];
+    values[i] = last ? keyframeValue(i) : (_animationValues[i] + 0x80) >> 8; // No rounding error at the end of a fade
+  }
+}
+
+/* Value of a LED in the current keyframe (0-255) */
+uint8_t keyframeValue(uint8_t index)
+{
+  return ((_keyframeLeds >> (4*index)) & 0x0F) * 17;
+}
+
+#else
+
+void playAnimation(uint8_t id, uint8_t repeats) {}
+void stopAnimation() {}
+bool isAnimationPlaying() { return false; }
+uint8_t getAnimation() { return KXKM_STM32_Energy::ANIMATION_STOP; }
+void addAnimationKeyframe(long keyframe) {}
+void nextAnimationFrame(volatile uint8_t* values) {}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef LED_GAMMA_H
+#define LED_GAMMA_H
+
+#include <Arduino.h>
+
+/* LED brightness to duty cycle conversion
+ *
+ * The LED values (0-255) are perceived brightness : they are converted to a duty cycle with the CIE 1931 lightness
+ * curve, so that fades look even. The duty cycle is given in 1/16 of a modulation unit (0 to LED_GAMMA_MAX), see
+ * led_gauge.ino.
+ *
+ * The curve is evaluated at compile time every LED_GAMMA_STEP values and interpolated linearly : below 0.15% of the
+ * full scale error, exact in the linear part of the curve (dim values).
+ */
+
+const uint16_t LED_GAMMA_MAX = 63 << 4; // 63 modulation units, 4 dithering bits
+const uint8_t LED_GAMMA_SHIFT = 3;
+const uint8_t LED_GAMMA_STEP = 1 << LED_GAMMA_SHIFT;
+const uint8_t LED_GAMMA_SIZE = 256 / LED_GAMMA_STEP + 1;
+
+const uint8_t LED_DIM_VAL = 145; // 'ON' indicator : 1/4 duty cycle. Also used by setup(), before led_gauge.ino.
+
+/* CIE 1931 : luminance from lightness L* (0-100) */
+constexpr double ledLuminance(double lightness)
+{
+  return lightness > 8 ? ((lightness + 16) / 116) * ((lightness + 16) / 116) * ((lightness + 16) / 116) : lightness / 903.3;
+}
+
+constexpr uint16_t ledGammaEntry(unsigned int value)
+{
+  return (uint16_t)(ledLuminance(value * 100.0 / 255) * LED_GAMMA_MAX + 0.5);
+}
+
+template <unsigned int... I> struct LedGammaIndices {};
+template <unsigned int N, unsigned int... I> struct LedGammaMakeIndices : LedGammaMakeIndices<N - 1, N - 1, I...> {};
+template <unsigned int... I> struct LedGammaMakeIndices<0, I...> { typedef LedGammaIndices<I...> type; };
+
+template <typename Indices> struct LedGammaTable;
+template <unsigned int... I> struct LedGammaTable<LedGammaIndices<I...> > {
+  static const uint16_t values[sizeof...(I)];
+};
+template <unsigned int... I>
+const uint16_t LedGammaTable<LedGammaIndices<I...> >::values[sizeof...(I)] = { ledGammaEntry(I * LED_GAMMA_STEP)... };
+
+typedef LedGammaTable<LedGammaMakeIndices<LED_GAMMA_SIZE>::type> LedGamma; // In flash : 2 * LED_GAMMA_SIZE bytes
+
+/* Convert a LED value (0-255) to a duty cycle (0 to LED_GAMMA_MAX) */
+inline uint16_t ledGamma(uint8_t value)
+{
+  const uint16_t* table = LedGamma::values;
+  uint8_t index = value >> LED_GAMMA_SHIFT;
+  uint8_t fraction = value & (LED_GAMMA_STEP - 1);
+
+  if (value == 255)
+    return LED_GAMMA_MAX; // The last table entry (256) is above the full scale
+  return table[index] + (((table[index + 1] - table[index]) * fraction + LED_GAMMA_STEP / 2) >> LED_GAMMA_SHIFT);
+}
+
+#endif
@@ -1,34 +1,115 @@
 /* LED gauge functions
- * Each LED can be set individually, with 5 PWM levels (0-4).
+ * Each LED can be set individually, with 256 brightness levels (0-255), perceived brightness (see led_gamma.h).
  *
  * There are multiple helper functions to light up a single LED, use the gauge as a floating point number display, etc.
- * Internally, the LED state is stored as a single unsigned long int. Each LED uses 4 bits.
+ * Internally, the LED state is stored as one byte per LED.
+ *
+ * The LEDs are charlieplexed : one LED is lit at a time, for a 2ms slot. The slot is split in 6 periods of 1, 2, 4,
+ * ..., 32 units, the LED is lit during the periods matching the bits of its level (bit angle modulation) : 64 levels
+ * with 6 timer interrupts per LED. The fractional part of the duty cycle (4 bits) is dithered over the refresh periods
+ * (first order sigma-delta), the levels are computed once per refresh period. The GPIO register masks of each LED are
+ * computed once at startup, the interrupt only writes the port registers.
  */
 
-const uint8_t LED_PWM_MAX_VAL = 4;
+const uint8_t LED_PWM_MAX_VAL = 255;
+const uint8_t LED_PWM_BITS = 6;
+const uint8_t LED_DITHER_BITS = 4;
+const uint8_t LED_API_MAX_VAL = 4; // SET_LEDS values : 0 to 4
+
+const uint32_t LED_TIMER_FREQ = 1000000; // Hz
+const uint16_t LED_PWM_UNIT = 31; // Timer ticks. 63 units : 2ms per LED, 12ms refresh period.
 
-volatile uint32_t _ledGaugeState; // LED state. Don't change directly ! Use the helper functions. Update should be atomic because the timer interrupt may trigger at any time.
+volatile uint8_t _ledValues[LED_COUNT]; // LED state. Don't change directly ! Use the helper functions. The timer interrupt may trigger at any time.
 
 stimer_t _timer;
 volatile uint8_t _currentLedIndex = 0;
-volatile uint8_t _currentCycleIndex = 0; //For each LED there are LED_PWM_MAX_VAL cycles
+volatile uint8_t _currentBitIndex = 0; //For each LED there are LED_PWM_BITS periods
+uint8_t _ledLevels[LED_COUNT]; // Modulation units during the current refresh period
+uint8_t _ledDither[LED_COUNT]; // Sigma-delta accumulators
+
+GPIO_TypeDef* _ledPort; // All the LED pins are on the same port
+uint32_t _ledModerMask; // MODER bits of all the LED pins
+uint32_t _ledModer[LED_COUNT]; // MODER bits lighting each LED (2 outputs, the other pins as inputs)
+uint32_t _ledBsrr[LED_COUNT]; // BSRR value lighting each LED
 
 /** Initialize LED gauge display */
 void initLedGauge()
 {
-  _ledGaugeState = 0;
+  // Configure the pins (clock, no pull-up) and compute the register masks
+  _ledPort = get_GPIO_Port(STM_PORT(digitalPinToPinName(LED_PINS[0])));
+  _ledModerMask = 0;
+  for (int i = 0; i < LED_PINS_COUNT; i++)
+  {
+    pinMode(LED_PINS[i], INPUT);
+    _ledModerMask |= 3UL << (2 * STM_PIN(digitalPinToPinName(LED_PINS[i])));
+  }
+
+  for (int i = 0; i < LED_COUNT; i++)
+  {
+    uint8_t phyIndex = LED_ORDERING[i]; //Physical ordering
+    PinName high = digitalPinToPinName(LED_PINS[phyIndex/2 + (phyIndex % 2)]);
+    PinName low = digitalPinToPinName(LED_PINS[phyIndex/2 + 1 - (phyIndex % 2)]);
+
+    _ledModer[i] = (1UL << (2 * STM_PIN(high))) | (1UL << (2 * STM_PIN(low))); // General purpose outputs
+    _ledBsrr[i] = STM_GPIO_PIN(high) | ((uint32_t)STM_GPIO_PIN(low) << 16);
+  }
 
   _timer.timer = TIM16;
   attachIntHandle(&_timer, ledTimerInterrupt);
-  TimerHandleInit(&_timer, 1, (uint16_t)(HAL_RCC_GetHCLKFreq() / 1000) / 4); // ~1ms
+  startLedGauge();
 }
 
-void clearLeds()
+/* Start the LED timer, from the first period of the first LED */
+void startLedGauge()
 {
-  for (int i = 0; i < LED_PINS_COUNT; i++)
-    pinMode(LED_PINS[i], INPUT);
+  _currentLedIndex = 0;
+  _currentBitIndex = 0;
+  TimerHandleInit(&_timer, LED_PWM_UNIT - 1, (uint16_t)(HAL_RCC_GetHCLKFreq() / LED_TIMER_FREQ) - 1);
+  _timer.timer->CR1 |= TIM_CR1_ARPE; // The interrupt sets the duration of the next period
+}
+
+/* Stop the LED timer and turn off all LEDs, the pins are left floating (Stop mode) */
+void stopLedGauge()
+{
+  TimerHandleDeinit(&_timer);
+  ledPinsOff();
+  for (uint8_t i = 0; i < LED_COUNT; i++)
+    _ledLevels[i] = 0; // Not lit again by the levels of the last refresh period when restarted
+}
+
+/* Set all LEDs at once */
+void setLedValues(const uint8_t* values)
+{
+  noInterrupts();
+  for (uint8_t i = 0; i < LED_COUNT; i++)
+    _ledValues[i] = values[i];
+  interrupts();
+}
+
+/* Turn off all LEDs (pins as inputs) */
+void ledPinsOff()
+{
+  noInterrupts();
+  _ledPort->MODER &= ~_ledModerMask;
+  interrupts();
+}
+
+/* pinMode() from the main context, for the pins on the LED port. The LED timer interrupt rewrites the MODER register :
+   if it occurred during the read-modify-write of pinMode(), the LED pins of the previous period would be written back
+   (two LEDs lit until the next period). */
+void ledPortPinMode(uint32_t pin, uint32_t mode)
+{
+  noInterrupts();
+  pinMode(pin, mode);
+  interrupts();
+}
 
-  _ledGaugeState = 0;
+void clearLeds()
+{
+  stopAnimation();
+  for (uint8_t i = 0; i < LED_COUNT; i++)
+    _ledValues[i] = 0;
+  ledPinsOff();
 }
 
 /** Light up a single LED at full brightness */
@@ -40,9 +121,9 @@ void setSingleLed(uint8_t index)
 /** Light up a single LED at the specified value */
 void setSingleLed(uint8_t index, uint8_t value)
 {
-  index = constrain(index, 0, LED_COUNT-1);
-  value = constrain(value, 0, LED_PWM_MAX_VAL);
-  _ledGaugeState = value << (4*index);
+  uint8_t values[LED_COUNT] = {0};
+  values[constrain(index, 0, LED_COUNT-1)] = value;
+  setLedValues(values);
 }
 
 /** Set a LED at full brightness without clearing the others */
@@ -54,31 +135,23 @@ void setLed(uint8_t index)
 /** Set a LED at the specified value without clearing the others */
 void setLed(uint8_t index, uint8_t value)
 {
-  index = constrain(index, 0, LED_COUNT-1);
-  value = constrain(value, 0, LED_PWM_MAX_VAL);
-
-  uint32_t state = _ledGaugeState;
-
-  state &= ~(0x0F << (4*index));
-  state |= value << (4*index);
-
-  _ledGaugeState = state;
+  _ledValues[constrain(index, 0, LED_COUNT-1)] = value;
 }
 
 /** Use the gauge to display a number in the range [0 - 100] */
 void setLedGaugePercentage(int value)
 {
   value = constrain(value, 0, 100) * LED_COUNT;
-  uint32_t state = 0;
+  uint8_t values[LED_COUNT] = {0};
 
   uint8_t i;
   for (i = 0; i < value / 100; i++)
-    state |= (LED_PWM_MAX_VAL << (4*i));
+    values[i] = LED_PWM_MAX_VAL;
 
-  state |= (((value - (value / 100) * 100) * LED_PWM_MAX_VAL / 100) << (4*i));
+  if (i < LED_COUNT)
+    values[i] = (value - (value / 100) * 100) * LED_PWM_MAX_VAL / 100;
 
-  //Atomic update
-  _ledGaugeState = state;
+  setLedValues(values);
 }
 
 /** Use the gauge to display the battery level :
@@ -111,55 +184,48 @@ void displayBatteryLevel(int value)
 void displaySingleLedBatteryLevel(int value)
 {
   if (value < 0)
-    setSingleLed(0, 1);
+    setSingleLed(0, LED_DIM_VAL);
   else
-    setSingleLed(value * 6 / 100, 1);
+    setSingleLed(value * 6 / 100, LED_DIM_VAL);
 }
 
-// Timer interrupt
+// Timer interrupt : start of the next period
 void ledTimerInterrupt(stimer_t *timer)
 {
-  uint8_t value = (uint8_t)(_ledGaugeState >> (4*_currentLedIndex) ) & 0x0F;
+  uint8_t led = _currentLedIndex;
+  uint8_t bit = _currentBitIndex;
 
-  if (_currentCycleIndex == 0 && value > 0)
+  uint32_t moder = _ledPort->MODER & ~_ledModerMask;
+  if (_ledLevels[led] & (1 << bit))
   {
-    //Turn off all LEDs
-    for (int i = 0; i < LED_PINS_COUNT; i++)
-      pinMode(LED_PINS[i], INPUT);
-
-    // Light up the current LED
-    uint8_t phyIndex = LED_ORDERING[_currentLedIndex]; //Physical ordering
-
-    pinMode(LED_PINS[phyIndex/2], OUTPUT);
-    pinMode(LED_PINS[phyIndex/2 + 1], OUTPUT);
-
-    if (phyIndex % 2 == 1)
-    {
-      digitalWrite(LED_PINS[phyIndex/2], LOW);
-      digitalWrite(LED_PINS[phyIndex/2 + 1], HIGH);
-    }
-    else
-    {
-      digitalWrite(LED_PINS[phyIndex/2], HIGH);
-      digitalWrite(LED_PINS[phyIndex/2 + 1], LOW);
-    }
+    _ledPort->MODER = moder; // No glitch on the previous LED while switching
+    _ledPort->BSRR = _ledBsrr[led];
+    moder |= _ledModer[led];
   }
+  _ledPort->MODER = moder;
 
-  if (_currentCycleIndex >= value)
+  if (++bit >= LED_PWM_BITS)
   {
-    //Turn off all LEDs
-    for (int i = 0; i < LED_PINS_COUNT; i++)
-      pinMode(LED_PINS[i], INPUT);
+    bit = 0;
+    if (++led >= LED_COUNT)
+    {
+      led = 0;
+      if (isAnimationPlaying())
+        nextAnimationFrame(_ledValues);
+
+      // Levels of the next refresh period
+      for (uint8_t i = 0; i < LED_COUNT; i++)
+      {
+        uint16_t duty = _ledDither[i] + ledGamma(_ledValues[i]);
+        _ledLevels[i] = duty >> LED_DITHER_BITS;
+        _ledDither[i] = duty & ((1 << LED_DITHER_BITS) - 1);
+      }
+    }
+    _currentLedIndex = led;
   }
+  _currentBitIndex = bit;
 
-  _currentCycleIndex++;
-
-  if (_currentCycleIndex >= LED_PWM_MAX_VAL)
-  {
-    _currentCycleIndex = 0;
-    _currentLedIndex++;
-
-    if (_currentLedIndex >= LED_COUNT)
-      _currentLedIndex = 0;
-  }
+  // The auto-reload register is preloaded : this is the duration of the next period, the current one is unchanged
+  // even if the interrupt is late.
+  timer->timer->ARR = (LED_PWM_UNIT << bit) - 1;
 }
@@ -0,0 +1,163 @@
+/* Load current statistics
+ *
+ * The load is an audio amplifier : its current is bursty and the filtered reading (getInstantLoadCurrent) hides the
+ * peaks. Each load current sample of the ADC blocks (one every ADC_SAMPLE_PERIOD_US) is accumulated here :
+ *  * peak, min, mean and RMS currents over a window of configurable length. The results of the last completed
+ *    window are kept until the next one is completed.
+ *  * delivered charge and energy, integrated over each ADC block since startup or the last reset.
+ *
+ * The scans run at 800Hz with one conversion per sample : there is no hardware oversampling on the STM32F030 and
+ * averaging several conversions per sample would flatten the peaks. Bursts shorter than ADC_SAMPLE_PERIOD_US may be
+ * missed and the peak / min include the ADC noise.
+ *
+ * Samples are accumulated in raw ADC units : the per sample cost is a few comparisons, additions and a multiply.
+ * The conversion to mA (and the square root) is done once per window. The RMS is the one of the offset corrected
+ * samples : mean((x - offset)^2) = mean(x^2) - 2 * offset * mean(x) + offset^2.
+ *
+ * Optional (FEATURE_LOAD_STATS, see firmware_features.h).
+ */
+
+const unsigned long ADC_BLOCK_PERIOD_MS = ADC_SAMPLE_PERIOD_US * ADC_BLOCK_SCANS / 1000;
+const unsigned long long MS_PER_HOUR = 3600000ULL;
+
+#if FEATURE_LOAD_STATS
+const unsigned long LOAD_STATS_DEFAULT_WINDOW_MS = 1000;
+const unsigned long LOAD_STATS_MIN_WINDOW_MS = 10;
+const unsigned long LOAD_STATS_MAX_WINDOW_MS = 60000; // Sum of squares : 4095^2 * 48000 samples needs 64 bits
+
+unsigned long _loadStatsWindowSamples;
+
+// Current window, in ADC units
+unsigned int _loadWindowCount;
+uint16_t _loadWindowMax;
+uint16_t _loadWindowMin;
+unsigned long _loadWindowSum;
+unsigned long long _loadWindowSumSquares;
+
+// Last completed window, in mA
+uint16_t _loadPeakCurrent;
+uint16_t _loadMinCurrent;
+uint16_t _loadMeanCurrent;
+uint16_t _loadRmsCurrent;
+
+unsigned long long _deliveredCharge; // mA.ms
+unsigned long long _deliveredEnergy; // uW.ms
+
+void initLoadStats()
+{
+  setLoadStatsWindow(LOAD_STATS_DEFAULT_WINDOW_MS);
+  resetEnergyCounters();
+}
+
+/* Set the statistics window length and restart the current window */
+void setLoadStatsWindow(unsigned long windowMs)
+{
+  windowMs = constrain(windowMs, LOAD_STATS_MIN_WINDOW_MS, LOAD_STATS_MAX_WINDOW_MS);
+  _loadStatsWindowSamples = windowMs * 1000 / ADC_SAMPLE_PERIOD_US;
+  startLoadStatsWindow();
+}
+
+void startLoadStatsWindow()
+{
+  _loadWindowCount = 0;
+  _loadWindowMax = 0;
+  _loadWindowMin = 0xFFFF;
+  _loadWindowSum = 0;
+  _loadWindowSumSquares = 0;
+}
+
+void resetEnergyCounters()
+{
+  _deliveredCharge = 0;
+  _deliveredEnergy = 0;
+}
+
+/* Accumulate the load current samples of a completed ADC block. The battery voltage (mV) is used for the energy. */
+void loopLoadStats(const volatile uint16_t* block, unsigned int battVoltage)
+{
+  unsigned long blockSum = 0;
+  for (unsigned int i = 0; i < ADC_BLOCK_SCANS; i++)
+  {
+    uint16_t sample = block[i * ADC_CHANNELS_COUNT + _adcCurrentIndex];
+
+    if (sample > _loadWindowMax)
+      _loadWindowMax = sample;
+    if (sample < _loadWindowMin)
+      _loadWindowMin = sample;
+
+    blockSum += sample;
+    _loadWindowSumSquares += (unsigned long)sample * sample;
+  }
+
+  _loadWindowSum += blockSum;
+  _loadWindowCount += ADC_BLOCK_SCANS;
+
+  unsigned long blockCurrent = adcToLoadCurrent(blockSum / ADC_BLOCK_SCANS) >> CURRENT_MEAS_DECIMAL_PART;
+  _deliveredCharge += blockCurrent * ADC_BLOCK_PERIOD_MS;
+  _deliveredEnergy += (unsigned long long)(blockCurrent * battVoltage) * ADC_BLOCK_PERIOD_MS;
+
+  if (_loadWindowCount >= _loadStatsWindowSamples)
+  {
+    _loadPeakCurrent = adcToLoadCurrent(_loadWindowMax) >> CURRENT_MEAS_DECIMAL_PART;
+    _loadMinCurrent = adcToLoadCurrent(_loadWindowMin) >> CURRENT_MEAS_DECIMAL_PART;
+    _loadMeanCurrent = adcToLoadCurrent(_loadWindowSum / _loadWindowCount) >> CURRENT_MEAS_DECIMAL_PART;
+    _loadRmsCurrent = calibratedToLoadCurrent(getLoadWindowRms()) >> CURRENT_MEAS_DECIMAL_PART;
+    startLoadStatsWindow();
+  }
+}
+
+/* RMS of the offset corrected samples of the current window, in ADC units << CALIBRATION_FRAC_BITS.
+   The offset is positive : the mean square is below (4095 << CALIBRATION_FRAC_BITS)^2 and fits in 32 bits. */
+unsigned long getLoadWindowRms()
+{
+  long long offset = _adcCalibration.currentOffset;
+  long long meanSquare = ((long long)_loadWindowSumSquares << (2 * CALIBRATION_FRAC_BITS)) / _loadWindowCount
+                         - 2 * offset * (((long long)_loadWindowSum << CALIBRATION_FRAC_BITS) / _loadWindowCount)
+                         + offset * offset;
+  if (meanSquare <= 0)
+    return 0;
+
+  return squareRoot(meanSquare);
+}
+
+/* Return the statistics of the last completed window and the delivered charge and energy */
+void getLoadStats(KXKM_STM32_Energy::LoadStats &stats)
+{
+  stats.peakCurrent = _loadPeakCurrent;
+  stats.minCurrent = _loadMinCurrent;
+  stats.meanCurrent = _loadMeanCurrent;
+  stats.rmsCurrent = _loadRmsCurrent;
+  stats.charge = _deliveredCharge / MS_PER_HOUR;
+  stats.energy = _deliveredEnergy / (MS_PER_HOUR * 1000);
+}
+
+/* Integer square root (bit by bit, no division) */
+unsigned long squareRoot(unsigned long value)
+{
+  unsigned long root = 0;
+  unsigned long bit = 1UL << 30;
+
+  while (bit > value)
+    bit >>= 2;
+
+  while (bit != 0)
+  {
+    if (value >= root + bit)
+    {
+      value -= root + bit;
+      root = (root >> 1) + bit;
+    }
+    else
+      root >>= 1;
+    bit >>= 2;
+  }
+
+  return root;
+}
+
+#else
+
+void initLoadStats() {}
+void loopLoadStats(const volatile uint16_t* block, unsigned int battVoltage) {}
+
+#endif
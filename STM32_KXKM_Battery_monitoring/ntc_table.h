@@ -0,0 +1,88 @@
+#ifndef NTC_TABLE_H
+#define NTC_TABLE_H
+
+#include <Arduino.h>
+
+/* Thermistor reading to temperature conversion
+ *
+ * The thermistor (10k at 25°C, Beta 3380) is read through a 10k pull-up :
+ *   Vcc -> [10k] -> thermistor -> Gnd, the ADC reads the middle point.
+ *
+ * The Beta equation needs a logarithm in floating point, too slow and too large for the STM32F030. It is evaluated at
+ * compile time (constexpr) for one ADC reading every NTC_TABLE_STEP, and the table is interpolated linearly.
+ * Range : -40 to 125°C (clamped), resolution 0.1°C. Interpolation error : below 0.2°C (hot end), 0.13°C under 100°C.
+ */
+
+constexpr double NTC_NOMINAL_RESISTANCE = 10000; // Ohm at 25°C
+constexpr double NTC_BETA = 3380;
+constexpr double NTC_PULLUP_RESISTANCE = 10000; // Ohm
+constexpr double NTC_NOMINAL_TEMPERATURE = 298.15; // K
+const int NTC_MIN_TEMPERATURE = -400; // 0.1°C
+const int NTC_MAX_TEMPERATURE = 1250; // 0.1°C
+
+const uint8_t NTC_TABLE_SHIFT = 5;
+const unsigned int NTC_TABLE_STEP = 1 << NTC_TABLE_SHIFT; // ADC LSB
+const unsigned int NTC_TABLE_SIZE = 4096 / NTC_TABLE_STEP + 1;
+
+// Compile time helpers. C++11 constexpr functions : recursion only.
+
+/* ln((1 + y) / (1 - y)) / 2 = y + y^3/3 + y^5/5 + ... */
+constexpr double ntcAtanhSeries(double y2, double power, int n)
+{
+  return n > 41 ? 0 : power / n + ntcAtanhSeries(y2, power * y2, n + 2);
+}
+
+/* Natural logarithm : the argument is brought in [1, 2) then the series converges quickly */
+constexpr double ntcLog(double x)
+{
+  return x >= 2 ? ntcLog(x / 2) + 0.69314718055994531 :
+         x < 1 ? ntcLog(x * 2) - 0.69314718055994531 :
+         2 * ntcAtanhSeries(((x - 1) / (x + 1)) * ((x - 1) / (x + 1)), (x - 1) / (x + 1), 1);
+}
+
+constexpr double ntcResistance(unsigned int adcRead)
+{
+  return NTC_PULLUP_RESISTANCE * adcRead / (4095 - adcRead);
+}
+
+constexpr int ntcRound(double value)
+{
+  return (int)(value >= 0 ? value + 0.5 : value - 0.5);
+}
+
+/* Beta equation, 0.1°C. Not clamped : the segments at both ends of the range are interpolated properly. */
+constexpr int ntcTemperature(unsigned int adcRead)
+{
+  return adcRead < 1 ? ntcTemperature(1) :
+         adcRead > 4094 ? ntcTemperature(4094) :
+         ntcRound(10 * (1 / (ntcLog(ntcResistance(adcRead) / NTC_NOMINAL_RESISTANCE) / NTC_BETA
+                             + 1 / NTC_NOMINAL_TEMPERATURE) - 273.15));
+}
+
+template <unsigned int... I> struct NtcIndices {};
+template <unsigned int N, unsigned int... I> struct NtcMakeIndices : NtcMakeIndices<N - 1, N - 1, I...> {};
+template <unsigned int... I> struct NtcMakeIndices<0, I...> { typedef NtcIndices<I...> type; };
+
+template <typename Indices> struct NtcTable;
+template <unsigned int... I> struct NtcTable<NtcIndices<I...> > {
+  static const int16_t values[sizeof...(I)];
+};
+template <unsigned int... I>
+const int16_t NtcTable<NtcIndices<I...> >::values[sizeof...(I)] = { (int16_t)ntcTemperature(I * NTC_TABLE_STEP)... };
+
+typedef NtcTable<NtcMakeIndices<NTC_TABLE_SIZE>::type> NtcTemperatureTable; // In flash : 2 * NTC_TABLE_SIZE bytes
+
+/* Convert a thermistor reading (0 to 4095) to 0.1°C */
+inline int adcToTemperature(unsigned int adcRead)
+{
+  if (adcRead > 4095)
+    adcRead = 4095;
+
+  const int16_t* table = NtcTemperatureTable::values;
+  unsigned int index = adcRead >> NTC_TABLE_SHIFT;
+  int fraction = adcRead & (NTC_TABLE_STEP - 1);
+  int temperature = table[index] + (((table[index + 1] - table[index]) * fraction + (int)NTC_TABLE_STEP / 2) >> NTC_TABLE_SHIFT);
+  return constrain(temperature, NTC_MIN_TEMPERATURE, NTC_MAX_TEMPERATURE);
+}
+
+#endif
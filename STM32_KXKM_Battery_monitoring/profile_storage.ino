@@ -0,0 +1,307 @@
+/* Battery profile storage
+ *
+ * The user profiles, the profile selected in "Custom" position, the last pack detected for each built-in profile (used
+ * to resolve the ambiguous cells counts) and the ADC calibration are stored in the last two flash pages : the board ID
+ * page and the page below (PROFILE_STORAGE_START). The current page is a log of records : each change appends a
+ * record, and the last valid record of each kind is used. Records are checked with a CRC-8, so a record interrupted by
+ * a power loss is ignored.
+ *
+ * When the current page is full (around 50 changes), the other page is erased and the current records are copied
+ * into it. Its header record is written last, with the next sequence number : until then, the previous page is still
+ * the current one. A power loss at any point keeps either the old or the new set of records, never none. The board ID
+ * is written back right after erasing its page, and restored at startup from the header of the current page if the
+ * power was lost before the end of this write. A record identical to the current one is not written again, so the
+ * ESP32 can send the same profile at each boot without wearing the flash.
+ *
+ * The storage is disabled if the code reaches PROFILE_STORAGE_START (the Makefile refuses to build such an image) :
+ * GET_STORAGE_STATE answers -1, and the profiles and the calibration have to be sent again at each boot.
+ *
+ * The J-Link flash download (make flash) only rewrites the board ID in the last page, and keeps the records. Other
+ * tools may erase both pages : the profiles must then be sent again, and only the ADC calibration gain (stored in the
+ * option bytes by STM32_ADC_calib) is kept.
+ */
+
+const uint16_t PROFILE_RECORDS_COUNT = (FLASH_PAGE_SIZE - sizeof(BOARD_ID)) / sizeof(ProfileRecord); // Header included
+const uint8_t PROFILE_NO_PAGE = 0xFF;
+
+static_assert(sizeof(ProfileRecord) == 20 && sizeof(ProfileRecord) % 2 == 0, "Records are written as half-words");
+static_assert(sizeof(AdcCalibration) <= sizeof(ProfileRecord::values), "The calibration must fit in a record");
+static_assert(PROFILE_STORAGE_START + PROFILE_STORAGE_PAGES * FLASH_PAGE_SIZE == 0x08004000, "The board ID page must be the last storage page");
+
+bool _profileStorageAvailable;
+uint8_t _profilePage; // Current page, PROFILE_NO_PAGE before the first write
+uint16_t _profileSequence; // Sequence number of the current page
+uint16_t _profileRecordsUsed; // Written records of the current page, valid or not
+
+/* Check that the code doesn't reach the storage pages, find the current page and the end of its log */
+void initProfileStorage()
+{
+  extern uint32_t _sidata, _sdata, _edata; // From the linker script
+  uint32_t flashEnd = (uintptr_t)&_sidata + ((uintptr_t)&_edata - (uintptr_t)&_sdata);
+  _profileStorageAvailable = (flashEnd <= PROFILE_STORAGE_START);
+  _profilePage = PROFILE_NO_PAGE;
+  _profileRecordsUsed = 0;
+
+  if (!_profileStorageAvailable)
+    return;
+
+  for (uint8_t page = 0; page < PROFILE_STORAGE_PAGES; page++)
+  {
+    const ProfileRecord* header = getProfileRecord(page, 0);
+    if (isProfilePageHeader(header) && (_profilePage == PROFILE_NO_PAGE || (int16_t)(header->values[0] - _profileSequence) > 0))
+    {
+      _profilePage = page;
+      _profileSequence = header->values[0];
+    }
+  }
+
+  if (_profilePage == PROFILE_NO_PAGE)
+    return;
+
+  _profileRecordsUsed = 1;
+  while (_profileRecordsUsed < PROFILE_RECORDS_COUNT && getProfileRecord(_profilePage, _profileRecordsUsed)->type != PROFILE_RECORD_EMPTY)
+    _profileRecordsUsed++;
+
+  // Power lost between the erase of the board ID page and the end of the board ID write
+  uint32_t boardId = getStoredBoardId();
+  HAL_FLASH_Unlock();
+  for (uint8_t i = 0; i < 2; i++)
+    if (((*(volatile uint32_t*)&BOARD_ID >> (16 * i)) & 0xFFFF) == 0xFFFF && ((boardId >> (16 * i)) & 0xFFFF) != 0xFFFF)
+      HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, (uintptr_t)&BOARD_ID + 2 * i, boardId >> (16 * i));
+  HAL_FLASH_Lock();
+}
+
+/* The board ID, its erased half-words being restored from the header of the current page */
+uint32_t getStoredBoardId()
+{
+  uint32_t boardId = *(volatile uint32_t*)&BOARD_ID;
+  if (_profilePage == PROFILE_NO_PAGE)
+    return boardId;
+
+  const ProfileRecord* header = getProfileRecord(_profilePage, 0);
+  if ((boardId & 0xFFFF) == 0xFFFF)
+    boardId = (boardId & 0xFFFF0000) | header->values[1];
+  if ((boardId >> 16) == 0xFFFF)
+    boardId = (boardId & 0xFFFF) | ((uint32_t)header->values[2] << 16);
+  return boardId;
+}
+
+/* Free records before the next page switch, -1 if the storage is disabled (GET_STORAGE_STATE) */
+int getProfileStorageState()
+{
+  if (!_profileStorageAvailable)
+    return -1;
+
+  if (_profilePage == PROFILE_NO_PAGE)
+    return PROFILE_RECORDS_COUNT - 1;
+
+  return PROFILE_RECORDS_COUNT - _profileRecordsUsed;
+}
+
+uint32_t getProfilePageAddress(uint8_t page)
+{
+  return PROFILE_STORAGE_START + page * FLASH_PAGE_SIZE;
+}
+
+const ProfileRecord* getProfileRecord(uint8_t page, uint16_t index)
+{
+  return (const ProfileRecord*)(getProfilePageAddress(page) + index * sizeof(ProfileRecord));
+}
+
+uint8_t getProfileRecordCrc(const ProfileRecord* record)
+{
+  uint8_t crc = 0;
+  for (uint8_t i = 0; i < offsetof(ProfileRecord, crc); i++)
+    crc = KXKM_STM32_Energy::crc8(crc, ((const uint8_t*)record)[i]);
+  return crc;
+}
+
+bool isProfilePageHeader(const ProfileRecord* record)
+{
+  return record->type == PROFILE_RECORD_HEADER && record->values[3] == PROFILE_STORAGE_MAGIC && record->crc == getProfileRecordCrc(record);
+}
+
+/* Records of the same kind replace each other. The index is ignored for the selection. */
+bool isSameProfileRecordKind(const ProfileRecord* a, const ProfileRecord* b)
+{
+  return a->type == b->type && (a->type == PROFILE_RECORD_SELECTION || a->index == b->index);
+}
+
+/* Return the last valid record of a kind, NULL if there is none */
+const ProfileRecord* findProfileRecord(uint8_t type, uint8_t index)
+{
+  if (_profilePage == PROFILE_NO_PAGE)
+    return NULL;
+
+  ProfileRecord key;
+  key.type = type;
+  key.index = index;
+
+  for (uint16_t i = _profileRecordsUsed - 1; i > 0; i--)
+  {
+    const ProfileRecord* record = getProfileRecord(_profilePage, i);
+    if (isSameProfileRecordKind(record, &key) && record->crc == getProfileRecordCrc(record))
+      return record;
+  }
+
+  return NULL;
+}
+
+/* Append a record, switching to the other page if the current one is full. Skipped if the current record is
+   identical. Return false if the storage is disabled or the record couldn't be written. */
+bool writeProfileRecord(uint8_t type, uint8_t index, const uint16_t* values)
+{
+  if (!_profileStorageAvailable)
+    return false;
+
+  ProfileRecord record;
+  memset(&record, 0xFF, sizeof(record));
+  record.type = type;
+  record.index = index;
+  memcpy(record.values, values, sizeof(record.values));
+  record.crc = getProfileRecordCrc(&record);
+
+  const ProfileRecord* current = findProfileRecord(type, index);
+  if (current != NULL && memcmp(current, &record, sizeof(record)) == 0)
+    return true;
+
+  if (_profilePage == PROFILE_NO_PAGE || _profileRecordsUsed >= PROFILE_RECORDS_COUNT)
+    return switchProfilePage(record);
+
+  return programProfileRecord(_profilePage, _profileRecordsUsed++, record);
+}
+
+/* Start a new log in the other page with the current records and the given one, then make it the current page */
+bool switchProfilePage(const ProfileRecord& record)
+{
+  uint8_t page = (_profilePage == 0) ? 1 : 0;
+  uint32_t boardId = getStoredBoardId();
+
+  FLASH_EraseInitTypeDef erase;
+  erase.TypeErase = FLASH_TYPEERASE_PAGES;
+  erase.PageAddress = getProfilePageAddress(page);
+  erase.NbPages = 1;
+  uint32_t pageError;
+
+  HAL_FLASH_Unlock();
+  bool ok = (HAL_FLASHEx_Erase(&erase, &pageError) == HAL_OK);
+  if (ok && erase.PageAddress == ((uintptr_t)&BOARD_ID & ~(FLASH_PAGE_SIZE - 1)) && boardId != 0xFFFFFFFF)
+    ok = (HAL_FLASH_Program(FLASH_TYPEPROGRAM_WORD, (uintptr_t)&BOARD_ID, boardId) == HAL_OK);
+  HAL_FLASH_Lock();
+
+  // Last valid record of each kind, except the one replaced : the previous page is left untouched
+  uint16_t used = 1;
+  for (uint16_t i = (_profilePage == PROFILE_NO_PAGE) ? 0 : _profileRecordsUsed - 1; ok && i > 0; i--)
+  {
+    const ProfileRecord* old = getProfileRecord(_profilePage, i);
+    if (old->crc != getProfileRecordCrc(old) || isSameProfileRecordKind(old, &record) || findProfileRecord(old->type, old->index) != old)
+      continue;
+    ok = programProfileRecord(page, used++, *old);
+  }
+  ok = ok && programProfileRecord(page, used++, record);
+
+  ProfileRecord header;
+  memset(&header, 0xFF, sizeof(header));
+  header.type = PROFILE_RECORD_HEADER;
+  header.index = 0;
+  header.values[0] = _profileSequence + 1;
+  header.values[1] = boardId;
+  header.values[2] = boardId >> 16;
+  header.values[3] = PROFILE_STORAGE_MAGIC;
+  header.crc = getProfileRecordCrc(&header);
+  ok = ok && programProfileRecord(page, 0, header);
+
+  if (!ok)
+    return false;
+
+  _profilePage = page;
+  _profileSequence++;
+  _profileRecordsUsed = used;
+  return true;
+}
+
+bool programProfileRecord(uint8_t page, uint16_t index, const ProfileRecord& record)
+{
+  uint32_t address = (uintptr_t)getProfileRecord(page, index);
+  const uint16_t* data = (const uint16_t*)&record;
+  bool ok = true;
+
+  HAL_FLASH_Unlock();
+  for (uint8_t i = 0; ok && i < sizeof(record) / 2; i++)
+    ok = (HAL_FLASH_Program(FLASH_TYPEPROGRAM_HALFWORD, address + 2 * i, data[i]) == HAL_OK);
+  HAL_FLASH_Lock();
+  return ok;
+}
+
+/* Store the voltage breaks (mV) of a user profile */
+bool storeUserProfile(uint8_t slot, const unsigned int* breaks)
+{
+  uint16_t values[7];
+  for (uint8_t i = 0; i < 7; i++)
+    values[i] = breaks[i];
+  return writeProfileRecord(PROFILE_RECORD_USER, slot, values);
+}
+
+/* Read the voltage breaks (mV) of a user profile. Return false if the slot is empty. */
+bool loadUserProfile(uint8_t slot, unsigned int* breaks)
+{
+  const ProfileRecord* record = findProfileRecord(PROFILE_RECORD_USER, slot);
+  if (record == NULL)
+    return false;
+
+  for (uint8_t i = 0; i < 7; i++)
+    breaks[i] = record->values[i];
+  return true;
+}
+
+void storeProfileSelection(uint8_t profile, uint8_t cells)
+{
+  uint16_t values[7] = {cells, 0, 0, 0, 0, 0, 0};
+  writeProfileRecord(PROFILE_RECORD_SELECTION, profile, values);
+}
+
+/* Read the selected profile. Return false if no profile was selected. */
+bool loadProfileSelection(uint8_t& profile, uint8_t& cells)
+{
+  const ProfileRecord* record = findProfileRecord(PROFILE_RECORD_SELECTION, 0);
+  if (record == NULL)
+    return false;
+
+  profile = record->index;
+  cells = record->values[0];
+  return true;
+}
+
+void storeLastPackCells(uint8_t profile, uint8_t cells)
+{
+  uint16_t values[7] = {cells, 0, 0, 0, 0, 0, 0};
+  writeProfileRecord(PROFILE_RECORD_LAST_PACK, profile, values);
+}
+
+/* Return the number of cells of the last pack detected with a built-in profile, 0 if unknown */
+uint8_t loadLastPackCells(uint8_t profile)
+{
+  const ProfileRecord* record = findProfileRecord(PROFILE_RECORD_LAST_PACK, profile);
+  if (record == NULL)
+    return 0;
+
+  return record->values[0];
+}
+
+bool storeAdcCalibration(const AdcCalibration& calibration)
+{
+  uint16_t values[7];
+  memcpy(values, &calibration, sizeof(values));
+  return writeProfileRecord(PROFILE_RECORD_CALIBRATION, 0, values);
+}
+
+/* Read the ADC calibration. Return false if the board was not calibrated, or with an older STM32_ADC_calib. */
+bool loadAdcCalibration(AdcCalibration& calibration)
+{
+  const ProfileRecord* record = findProfileRecord(PROFILE_RECORD_CALIBRATION, 0);
+  if (record == NULL)
+    return false;
+
+  memcpy(&calibration, record->values, sizeof(calibration));
+  return true;
+}
@@ -0,0 +1,145 @@
+/* Cooperative scheduler
+ *
+ * The main loop runs each task below when it is due, instead of calling every function at each iteration : the period
+ * of a task doesn't depend on the others any more. A task completing more than its deadline after it was due is
+ * counted as a miss. A task late by more than its period is not run several times in a row : it is rescheduled one
+ * period later. The misses, the longest run time and the utilization (run time / elapsed time) of each task are read
+ * by the ESP32 (GET_TASK_STATS).
+ *
+ * With 5 tasks, scanning the table is cheaper than maintaining a timer wheel. No task ever waits : once no task is
+ * due, the CPU sleeps until the next interrupt (SysTick every 1ms, LED timer, ADC DMA, UART RX). The sleep mode only
+ * stops the CPU clock : the ADC sampling, LED refresh and watchdog keep running, the watchdog task keeps its period.
+ */
+
+struct Task {
+  void (*run)();
+  uint16_t period; // ms
+  uint16_t deadline; // ms after the due time
+};
+
+const Task TASKS[] = { // Same order as KXKM_STM32_Energy::Task
+  {loopBatteryMonitoring, 1, 5}, // Polls the ADC : a block completed every 5ms must be read before the next one
+  {loopButton, 5, 10},
+  {loopSerial, 1, 5}, // The receive buffer (64 bytes) is filled in 5ms at 115200 bauds
+  {loopState, 10, 20},
+  {refreshWatchdog, 50, 100} // 250ms timeout
+};
+const uint8_t TASKS_COUNT = sizeof(TASKS) / sizeof(Task);
+
+#ifndef TASK_RUN_HOOK
+  #define TASK_RUN_HOOK(index) // The host simulation charges a run time to the task here (see test/sim/Arduino.h)
+#endif
+
+unsigned long _taskDueTime[TASKS_COUNT]; // ms
+uint16_t _taskMisses[TASKS_COUNT]; // Since the last GET_TASK_STATS
+uint16_t _taskMaxRunTime[TASKS_COUNT]; // us, since the last GET_TASK_STATS
+unsigned long _taskRunTime[TASKS_COUNT]; // us, since the last utilization request. Overflows after 71 minutes.
+unsigned long _taskStatsStartTime[TASKS_COUNT]; // us
+unsigned long _sleepTime; // us, since the last GET_SLEEP_RATIO
+unsigned long _sleepStatsStartTime; // us
+
+/* Start the tasks, with their statistics reset */
+void initScheduler()
+{
+  for (uint8_t i = 0; i < TASKS_COUNT; i++)
+  {
+    _taskDueTime[i] = millis();
+    _taskMisses[i] = 0;
+    _taskMaxRunTime[i] = 0;
+    _taskRunTime[i] = 0;
+    _taskStatsStartTime[i] = micros();
+  }
+
+  _sleepTime = 0;
+  _sleepStatsStartTime = micros();
+}
+
+/* Run the tasks which are due, once each */
+void runScheduler()
+{
+  for (uint8_t i = 0; i < TASKS_COUNT; i++)
+  {
+    if ((long)(millis() - _taskDueTime[i]) < 0)
+      continue;
+
+    unsigned long startTime = micros();
+    TASKS[i].run();
+    TASK_RUN_HOOK(i);
+    unsigned long runTime = micros() - startTime;
+    _taskMaxRunTime[i] = max(_taskMaxRunTime[i], (uint16_t)min(runTime, 0x7FFFUL));
+    _taskRunTime[i] += runTime;
+
+    unsigned long now = millis();
+    if (now - _taskDueTime[i] > TASKS[i].deadline && _taskMisses[i] < 0xFFFF)
+      _taskMisses[i]++;
+
+    _taskDueTime[i] += TASKS[i].period;
+    if ((long)(now - _taskDueTime[i]) >= 0)
+      _taskDueTime[i] = now + TASKS[i].period; // Late by more than a period
+  }
+}
+
+/* Sleep until the next interrupt if no task is due */
+void sleepUntilNextTask()
+{
+  unsigned long sleepStartTime = micros();
+
+  noInterrupts(); // An interrupt handled between the check and the sleep would not wake the CPU up
+  bool idle = (getSchedulerIdleTime() > 0);
+  if (idle)
+    __WFI(); // Pending interrupts wake the CPU up, even masked
+  interrupts();
+
+  if (idle)
+    _sleepTime += micros() - sleepStartTime;
+}
+
+/* Time asleep since the last call (1/1000) */
+unsigned int getSleepRatio()
+{
+  unsigned long now = micros();
+  unsigned long elapsed = (now - _sleepStatsStartTime) / 1000; // ms
+  unsigned int ratio = (elapsed > 0) ? _sleepTime / elapsed : 0; // us / ms
+
+  _sleepTime = 0;
+  _sleepStatsStartTime = now;
+  return min(ratio, 1000U);
+}
+
+/* Time (ms) until the next task is due, 0 if a task is due */
+unsigned long getSchedulerIdleTime()
+{
+  unsigned long now = millis();
+  long idleTime = _taskDueTime[0] - now;
+  for (uint8_t i = 1; i < TASKS_COUNT; i++)
+    idleTime = min(idleTime, (long)(_taskDueTime[i] - now));
+
+  return max(idleTime, 0L);
+}
+
+/* Deadline misses (bits 0-15) and longest run time in us (bits 16-30) of a task, then reset them */
+long getTaskStats(uint8_t index)
+{
+  if (index >= TASKS_COUNT)
+    return 0;
+
+  long stats = ((long)_taskMaxRunTime[index] << 16) | _taskMisses[index];
+  _taskMaxRunTime[index] = 0;
+  _taskMisses[index] = 0;
+  return stats;
+}
+
+/* Time spent running a task since the last call (1/1000) */
+unsigned int getTaskUtilization(uint8_t index)
+{
+  if (index >= TASKS_COUNT)
+    return 0;
+
+  unsigned long now = micros();
+  unsigned long elapsed = (now - _taskStatsStartTime[index]) / 1000; // ms
+  unsigned int ratio = (elapsed > 0) ? _taskRunTime[index] / elapsed : 0; // us / ms
+
+  _taskRunTime[index] = 0;
+  _taskStatsStartTime[index] = now;
+  return min(ratio, 1000U);
+}
@@ -8,10 +8,47 @@
  */
 #include "KXKM_STM32_energy_API.h"
 
+bool _binaryAnswer = false; // The current request was a binary frame : answer with a binary frame too
+uint8_t _answerCmd; // Command type of the current request, repeated in binary answers
+int _answerSeq; // Sequence number of the current request, repeated in binary answers
+
+bool _subscribed = false; // Push events and telemetry (binary protocol only)
+unsigned long _telemetryPushPeriod; // 0 : push events only
+unsigned long _lastTelemetryPush;
+bool _battLowPushed;
+bool _tempHighPushed;
+
+const unsigned long MIN_TELEMETRY_PUSH_PERIOD_MS = 100;
+
+// Command parser state
+enum parser_state_t {
+  PARSER_IDLE, // Waiting for a preamble or a frame sync byte
+  PARSER_PREAMBLE,
+  PARSER_TEXT_CMD,
+  PARSER_TEXT_ARG, // Until the end of line
+  PARSER_FRAME_CMD,
+  PARSER_FRAME_SEQ,
+  PARSER_FRAME_LEN,
+  PARSER_FRAME_PAYLOAD // Payload and CRC
+};
+
+const unsigned long PARSER_TIMEOUT_MS = 10; // Incomplete commands are dropped after this delay without data
+const uint8_t PARSER_FRAME_SIZE = KXKM_STM32_Energy::FRAME_MAX_SIZE - 1; // Without the sync byte
+
+parser_state_t _parserState = PARSER_IDLE;
+unsigned long _parserLastByteTime;
+uint8_t _parserIndex; // Preamble position, or payload start in _parserFrame
+uint8_t _parserCmd;
+int _parserSeq;
+uint8_t _parserLen;
+uint8_t _parserFrame[PARSER_FRAME_SIZE]; // Bytes received since the frame sync byte, parsed again if it is rejected
+uint8_t _parserFrameSize;
+long _parserArg;
+int8_t _parserArgSign;
+
 void initSerial()
 {
   Serial1.begin(115200);
-  Serial1.setTimeout(2);
   endSerial();
 }
 
@@ -29,153 +66,563 @@ void beginSerial()
   GPIO_InitStruct.Speed       = GPIO_SPEED_FREQ_HIGH;
   GPIO_InitStruct.Pull        = STM_PIN_PUPD(function);
   GPIO_InitStruct.Alternate   = STM_PIN_AFNUM(function);
+  noInterrupts(); // Same port as the LEDs, see ledPortPinMode()
   HAL_GPIO_Init(port, &GPIO_InitStruct);
+  interrupts();
 }
 
 void endSerial()
 {
   Serial1.flush();
-  pinMode(ESP32_TX_PIN, INPUT_PULLUP); //Set TX pin to Hi Z to allow ESP32 programmation from external connector
+  ledPortPinMode(ESP32_TX_PIN, INPUT_PULLUP); //Set TX pin to Hi Z to allow ESP32 programmation from external connector
+}
+
+/* Serial task (see scheduler.ino). The UART RX interrupt fills the receive buffer, each received byte is fed to the
+   parser and complete commands are executed. Then the events and telemetry are pushed. */
+void loopSerial()
+{
+  if (Serial1.available())
+  {
+    while (Serial1.available())
+      receiveSerialByte(Serial1.read());
+
+    _parserLastByteTime = millis();
+  }
+  else if (millis() - _parserLastByteTime > PARSER_TIMEOUT_MS)
+    _parserState = PARSER_IDLE; // Drop incomplete commands. Not while bytes are waiting : the task may have been late.
+
+  loopSerialPush();
 }
 
-void serialEvent1()
+/* Feed a received byte to the parser. When a frame is rejected (CRC, length), its sync byte may have been noise :
+   the bytes after it are parsed again, so that a command starting among them is not lost. */
+void receiveSerialByte(uint8_t c)
 {
-  //SERIAL_DEBUG(Serial1.readStringUntil('\n'));
+  uint8_t pending[PARSER_FRAME_SIZE]; // Each rejected frame starts after the previous sync byte : this is enough
+  uint8_t count = 1, next = 0;
+  pending[0] = c;
 
-  while (Serial1.available())
+  while (next < count)
   {
-    char rdChar = Serial1.peek();
-    if (rdChar == KXKM_STM32_Energy::PREAMBLE[0])
-      break;
-    else
-      Serial1.read();
+    if (!parseSerialByte(pending[next++]))
+      continue;
+
+    memmove(pending + _parserFrameSize, pending + next, count - next);
+    memcpy(pending, _parserFrame, _parserFrameSize);
+    count = _parserFrameSize + count - next;
+    next = 0;
   }
+}
+
+/* Incremental command parser (text and binary). Never waits for data. Return true if a frame was rejected. */
+bool parseSerialByte(uint8_t c)
+{
+  if (_parserState >= PARSER_FRAME_CMD)
+    _parserFrame[_parserFrameSize++] = c;
 
-  if (Serial1.findUntil(KXKM_STM32_Energy::PREAMBLE, "\n"))
+  switch (_parserState)
   {
-    char cmd;
-    Serial1.readBytesUntil(' ', &cmd, 1); //Wait if necessary for data to arrive
-    long arg = 0;
+    case PARSER_IDLE:
+      _parserIndex = 1;
+      if (c == KXKM_STM32_Energy::PREAMBLE[0])
+        _parserState = PARSER_PREAMBLE;
+      else if (c == KXKM_STM32_Energy::FRAME_SYNC || c == KXKM_STM32_Energy::FRAME_SYNC_SEQ)
+      {
+        _parserSeq = (c == KXKM_STM32_Energy::FRAME_SYNC_SEQ) ? 0 : KXKM_STM32_Energy::NO_SEQUENCE;
+        _parserFrameSize = 0;
+        _parserState = PARSER_FRAME_CMD;
+      }
+      return false;
 
-    // SERIAL_DEBUG(cmd);
-    // SERIAL_DEBUG(Serial1.available());
-    // SERIAL_DEBUG(Serial1.readStringUntil('\n'));
+    case PARSER_PREAMBLE:
+      if (c != KXKM_STM32_Energy::PREAMBLE[_parserIndex])
+      {
+        if (c == KXKM_STM32_Energy::PREAMBLE[0] && _parserIndex == strlen(KXKM_STM32_Energy::PREAMBLE) - 1)
+          return false; // Extra '#' : still a valid preamble
+        break; // Not a preamble, try to resync on this byte
+      }
 
-    if (KXKM_STM32_Energy::hasArgument((KXKM_STM32_Energy::CommandType)cmd))
-    {
-      char tmp;
-      arg = Serial1.parseInt();
-      //SERIAL_DEBUG(arg);
-    }
+      if (++_parserIndex >= strlen(KXKM_STM32_Energy::PREAMBLE))
+        _parserState = PARSER_TEXT_CMD;
+      return false;
+
+    case PARSER_TEXT_CMD:
+      if (c == KXKM_STM32_Energy::PREAMBLE[0] || c == KXKM_STM32_Energy::FRAME_SYNC || c == KXKM_STM32_Energy::FRAME_SYNC_SEQ)
+        break; // Empty command : resync on the new one
+      _parserCmd = c;
+      _parserArg = 0;
+      _parserArgSign = 1;
+      _parserState = PARSER_TEXT_ARG;
+      return false;
+
+    case PARSER_TEXT_ARG:
+      // The argument (if any) ends with the line. Other characters are skipped, like Stream::parseInt().
+      if (c >= '0' && c <= '9')
+        _parserArg = _parserArg * 10 + (c - '0');
+      else if (c == '-' && _parserArg == 0)
+        _parserArgSign = -1;
+      else if (c == '\r' || c == '\n')
+      {
+        _parserState = PARSER_IDLE;
+        long arg = KXKM_STM32_Energy::hasArgument((KXKM_STM32_Energy::CommandType)_parserCmd) ? _parserArg * _parserArgSign : 0;
+        handleCommand(_parserCmd, arg, NULL, 0, false, KXKM_STM32_Energy::NO_SEQUENCE);
+      }
+      else if (c == KXKM_STM32_Energy::PREAMBLE[0] || c == KXKM_STM32_Energy::FRAME_SYNC || c == KXKM_STM32_Energy::FRAME_SYNC_SEQ)
+        break; // Unterminated line : resync on the new command
+      return false;
+
+    case PARSER_FRAME_CMD:
+      _parserCmd = c;
+      _parserState = (_parserSeq == KXKM_STM32_Energy::NO_SEQUENCE) ? PARSER_FRAME_LEN : PARSER_FRAME_SEQ;
+      return false;
+
+    case PARSER_FRAME_SEQ:
+      _parserSeq = c;
+      _parserState = PARSER_FRAME_LEN;
+      return false;
 
-    switch (cmd)
+    case PARSER_FRAME_LEN:
+      _parserLen = c;
+      _parserIndex = _parserFrameSize;
+      if (c <= KXKM_STM32_Energy::FRAME_MAX_PAYLOAD)
+      {
+        _parserState = PARSER_FRAME_PAYLOAD;
+        return false;
+      }
+      _parserState = PARSER_IDLE;
+      return true;
+
+    case PARSER_FRAME_PAYLOAD:
     {
-      case KXKM_STM32_Energy::GET_HW_REVISION:
-        sendAnswer(HW_REVISION);
-        break;
-        
-      case KXKM_STM32_Energy::GET_BOARD_ID:
-        sendAnswer(BOARD_ID);
-        break;
-        
-      case KXKM_STM32_Energy::GET_API_VERSION:
-        sendAnswer(KXKM_STM32_Energy::API_VERSION);
-        break;
+      if (_parserFrameSize <= _parserIndex + _parserLen)
+        return false; // Payload + CRC
 
-      case KXKM_STM32_Energy::GET_FW_VERSION:
-        sendAnswer(FIRMWARE_VERSION);
-        break;
+      _parserState = PARSER_IDLE;
+      const uint8_t* payload = _parserFrame + _parserIndex;
+      if (payload[_parserLen] != KXKM_STM32_Energy::frameCrc(_parserCmd, payload, _parserLen, _parserSeq))
+        return true;
 
-      case KXKM_STM32_Energy::GET_BATTERY_VOLTAGE:
-        sendAnswer(getInstantBatteryVoltage());
-        break;
+      long arg = (_parserLen >= KXKM_STM32_Energy::FRAME_VALUE_SIZE) ? KXKM_STM32_Energy::decodeValue(payload) : 0;
+      handleCommand(_parserCmd, arg, payload, _parserLen, true, _parserSeq);
+      return false;
+    }
+  }
 
-      case KXKM_STM32_Energy::GET_BATTERY_PERCENTAGE:
-        sendAnswer(getBatteryPercentage());
-        break;
+  _parserState = PARSER_IDLE;
+  return parseSerialByte(c);
+}
 
-      case KXKM_STM32_Energy::GET_BATTERY_TYPE:
-        sendAnswer(_battType);
-        break;
+/* Execute a command received in text or binary format, with an optional sequence number.
+   payload / len : the raw payload of a binary frame (NULL / 0 for a text command), for the commands which are not a
+   single value. */
+void handleCommand(uint8_t cmd, long arg, const uint8_t* payload, uint8_t len, bool binary, int seq)
+{
+  _binaryAnswer = binary;
+  _answerCmd = cmd;
+  _answerSeq = seq;
+
+  switch (cmd)
+  {
+    case KXKM_STM32_Energy::GET_HW_REVISION:
+      sendAnswer(HW_REVISION);
+      break;
       
-      case KXKM_STM32_Energy::GET_LOAD_CURRENT:
-        sendAnswer(getInstantLoadCurrent());
-        break;
+    case KXKM_STM32_Energy::GET_BOARD_ID:
+      sendAnswer(BOARD_ID);
+      break;
       
-      case KXKM_STM32_Energy::GET_TEMPERATURE:
-        sendAnswer(readApproxTempDegC());
-        break;
+    case KXKM_STM32_Energy::GET_API_VERSION:
+      sendAnswer(KXKM_STM32_Energy::API_VERSION);
+      break;
 
-      case KXKM_STM32_Energy::SET_LEDS:
-        customLedSetTime = millis();
-        for (int i = 0; i < 6; i++)
-        {
-          // SERIAL_DEBUG(arg % 10);
-          setLed(i, arg % 10);
-          arg /= 10;
-        }
-        break;
+    case KXKM_STM32_Energy::GET_FW_VERSION:
+      sendAnswer(FIRMWARE_VERSION);
+      break;
+
+    case KXKM_STM32_Energy::GET_BATTERY_VOLTAGE:
+      sendAnswer(getBatteryState().voltage);
+      break;
 
-      case KXKM_STM32_Energy::SET_LED_GAUGE:
+    case KXKM_STM32_Energy::GET_BATTERY_PERCENTAGE:
+      sendAnswer(getBatteryState().percentage);
+      break;
+
+    case KXKM_STM32_Energy::GET_BATTERY_TYPE:
+      sendAnswer(_battType);
+      break;
+
+    case KXKM_STM32_Energy::GET_BATTERY_CELLS:
+      sendAnswer(getCellsDetection());
+      break;
+    
+    case KXKM_STM32_Energy::GET_LOAD_CURRENT:
+      sendAnswer(getInstantLoadCurrent());
+      break;
+    
+    case KXKM_STM32_Energy::GET_TEMPERATURE:
+      sendAnswer(readTempDegC());
+      break;
+
+    case KXKM_STM32_Energy::SET_LEDS:
+      customLedSetTime = millis();
+      stopAnimation();
+      for (int i = 0; i < 6; i++)
+      {
+        // SERIAL_DEBUG(arg % 10);
+        setLed(i, min(arg % 10, (long)LED_API_MAX_VAL) * LED_PWM_MAX_VAL / LED_API_MAX_VAL);
+        arg /= 10;
+      }
+      break;
+
+    case KXKM_STM32_Energy::SET_LED_GAUGE:
+      customLedSetTime = millis();
+      stopAnimation();
+      setLedGaugePercentage(arg);
+      break;
+
+    case KXKM_STM32_Energy::SET_LED_FRAME:
+      if (payload != NULL && len == KXKM_STM32_Energy::LED_FRAME_SIZE)
+      {
         customLedSetTime = millis();
-        setLedGaugePercentage(arg);
-        break;
+        stopAnimation();
+        setLedValues(payload);
+      }
+      break;
 
-      case KXKM_STM32_Energy::SET_LOAD_SWITCH:
-        setLoadSwitchState(arg > 0);
+#if FEATURE_LED_ANIMATIONS
+    case KXKM_STM32_Energy::PLAY_ANIMATION:
+      customLedSetTime = millis();
+      if (arg >= 0)
+        playAnimation(arg % 10, min(arg / 10, 255L));
+      break;
 
-        //Override default behavior if still in ESP32 startup time
-        if (currentState == ESP32_STARTUP)
-          enterState(ACTIVE);
-        break;
+    case KXKM_STM32_Energy::ADD_ANIMATION_KEYFRAME:
+      addAnimationKeyframe(arg);
+      break;
+#endif
 
-      case KXKM_STM32_Energy::SHUTDOWN:
-        enterState(SHUTDOWN);
-        break;
+    case KXKM_STM32_Energy::SET_LOAD_SWITCH:
+      setLoadSwitchState(arg > 0);
 
-      case KXKM_STM32_Energy::REQUEST_RESET:
-        setESP32State(false);
-        delay(10);
-        setESP32State(true);
-        break;
+      //Override default behavior if still in ESP32 startup time
+      if (currentState == ESP32_STARTUP)
+        enterState(ACTIVE);
+      break;
 
-      case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_LOW:
-      case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_1:
-      case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_2:
-      case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_3:
-      case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_4:
-      case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_5:
-      case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_6:
-        //Accept custom batt characteristics only if the selector is on "Custom" position
-        if (_battType == KXKM_STM32_Energy::BATTERY_CUSTOM)
-          _battVoltageBreaks[cmd - KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_LOW] = arg;
-        break;
+    case KXKM_STM32_Energy::SHUTDOWN:
+      enterState(SHUTDOWN);
+      break;
 
-      case KXKM_STM32_Energy::ENTER_CRITICAL_SECTION:
-        criticalSectionEndTime = millis() + constrain(arg, 0, MAX_CRITICAL_SECTION_DURATION_MS);
-        //SERIAL_DEBUG(millis());
-        //SERIAL_DEBUG(criticalSectionEndTime);
-        break;
+    case KXKM_STM32_Energy::ENTER_STORAGE_MODE:
+      storageModeRequested = true; // Entered from the ACTIVE state
+      break;
 
-      case KXKM_STM32_Energy::LEAVE_CRITICAL_SECTION:
-        criticalSectionEndTime = millis();
-        break;
+    case KXKM_STM32_Energy::REQUEST_RESET:
+      unsubscribe();
+      setESP32State(false);
+      delay(10);
+      setESP32State(true);
+      break;
 
-      case KXKM_STM32_Energy::GET_BUTTON_EVENT:
-        sendAnswer((int)buttonEvent);
-        buttonEvent = KXKM_STM32_Energy::NO_EVENT;
-        break;
+    case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_LOW:
+    case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_1:
+    case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_2:
+    case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_3:
+    case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_4:
+    case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_5:
+    case KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_6:
+      //Accept custom batt characteristics only if the selector is on "Custom" position
+      if (_battType == KXKM_STM32_Energy::BATTERY_CUSTOM)
+        setBatteryVoltageBreak(cmd - KXKM_STM32_Energy::SET_BATTERY_VOLTAGE_LOW, arg);
+      break;
+
+    case KXKM_STM32_Energy::SELECT_BATTERY_PROFILE:
+      if (_battType == KXKM_STM32_Energy::BATTERY_CUSTOM && arg >= 0)
+        selectBatteryProfile(arg % 100, arg / 100);
+      break;
+
+    case KXKM_STM32_Energy::SAVE_BATTERY_PROFILE:
+      if (_battType == KXKM_STM32_Energy::BATTERY_CUSTOM && arg >= 0)
+        saveBatteryProfile(arg);
+      break;
+
+#if FEATURE_CALIBRATION_COMMANDS
+    case KXKM_STM32_Energy::CALIBRATE_VOLTAGE:
+      if (_battType == KXKM_STM32_Energy::BATTERY_CUSTOM && arg > 0)
+        startCalibration(_adcVoltageIndex, arg);
+      break;
+
+    case KXKM_STM32_Energy::CALIBRATE_CURRENT:
+      if (_battType == KXKM_STM32_Energy::BATTERY_CUSTOM && arg >= 0)
+        startCalibration(_adcCurrentIndex, arg);
+      break;
+
+    case KXKM_STM32_Energy::SET_TEMP_COEFFICIENT:
+      if (_battType == KXKM_STM32_Energy::BATTERY_CUSTOM)
+        setCalibrationTempCoefficient(arg);
+      break;
+
+    case KXKM_STM32_Energy::COMMIT_CALIBRATION:
+      if (_battType == KXKM_STM32_Energy::BATTERY_CUSTOM)
+        commitCalibration();
+      break;
+
+    case KXKM_STM32_Energy::GET_CALIBRATION_STATE:
+      sendAnswer(getCalibrationState());
+      break;
+#endif
+
+    case KXKM_STM32_Energy::GET_STORAGE_STATE:
+      sendAnswer(getProfileStorageState());
+      break;
+
+    case KXKM_STM32_Energy::GET_THERMAL_LEVEL:
+      sendAnswer(getThermalLevel());
+      break;
+
+    case KXKM_STM32_Energy::SET_THERMAL_THRESHOLD:
+      if (arg >= 0)
+        setThermalThreshold(arg % 10, (arg / 10) * 10);
+      break;
 
-      default:
+    case KXKM_STM32_Energy::SET_BATTERY_CAPACITY:
+      setBatteryCapacity(max(arg, 0L));
+      break;
+
+    case KXKM_STM32_Energy::SET_BATTERY_RESISTANCE:
+      setBatteryResistance(max(arg, 0L));
+      break;
+
+    case KXKM_STM32_Energy::ENTER_CRITICAL_SECTION:
+      criticalSectionEndTime = millis() + constrain(arg, 0L, (long)MAX_CRITICAL_SECTION_DURATION_MS);
+      //SERIAL_DEBUG(millis());
+      //SERIAL_DEBUG(criticalSectionEndTime);
+      break;
+
+    case KXKM_STM32_Energy::LEAVE_CRITICAL_SECTION:
+      criticalSectionEndTime = millis();
+      break;
+
+    case KXKM_STM32_Energy::GET_BUTTON_EVENT:
+      sendAnswer((int)buttonEvent);
+      buttonEvent = KXKM_STM32_Energy::NO_EVENT;
+      break;
+
+    case KXKM_STM32_Energy::GET_TELEMETRY:
+      sendTelemetry();
+      buttonEvent = KXKM_STM32_Energy::NO_EVENT;
+      break;
+
+    case KXKM_STM32_Energy::GET_TASK_STATS:
+      if (arg & KXKM_STM32_Energy::TASK_UTILIZATION)
+        sendAnswer(getTaskUtilization(arg & ~KXKM_STM32_Energy::TASK_UTILIZATION));
+      else
+        sendAnswer(getTaskStats(arg));
+      break;
+
+    case KXKM_STM32_Energy::GET_SLEEP_RATIO:
+      sendAnswer(getSleepRatio());
+      break;
+
+    case KXKM_STM32_Energy::GET_LOOP_TIME:
+      sendAnswer(maxLoopTimeUs);
+      maxLoopTimeUs = 0;
+      break;
+
+#if FEATURE_LOAD_STATS
+    case KXKM_STM32_Energy::GET_LOAD_STATS:
+      sendLoadStats();
+      break;
+
+    case KXKM_STM32_Energy::SET_LOAD_STATS_WINDOW:
+      setLoadStatsWindow(max(arg, 0L));
+      break;
+
+    case KXKM_STM32_Energy::RESET_ENERGY_COUNTERS:
+      resetEnergyCounters();
+      break;
+#endif
+
+    case KXKM_STM32_Energy::SUBSCRIBE:
+      if (!binary)
         break;
-    };
+
+      _subscribed = true;
+      _telemetryPushPeriod = (arg > 0) ? max(arg, (long)MIN_TELEMETRY_PUSH_PERIOD_MS) : 0;
+      _lastTelemetryPush = millis();
+      _battLowPushed = false; // Push the battery state right away if it is low
+      _tempHighPushed = false;
+      break;
+
+    case KXKM_STM32_Energy::UNSUBSCRIBE:
+      unsubscribe();
+      break;
+
+    default:
+      break;
+  };
+}
+
+/* Stop the pushes. Also when the main processor is reset or turned off : it subscribes again after its startup. */
+void unsubscribe()
+{
+  _subscribed = false;
+}
+
+/* Push events to a subscribed main processor.
+   Return false if nobody is subscribed (the event should then be kept for polling). */
+bool pushEvent(KXKM_STM32_Energy::PushEvent event)
+{
+  if (!_subscribed)
+    return false;
+
+  uint8_t payload[KXKM_STM32_Energy::FRAME_VALUE_SIZE];
+  KXKM_STM32_Energy::encodeValue(payload, event);
+
+  beginSerial();
+  sendFrame(KXKM_STM32_Energy::PUSH_EVENT, KXKM_STM32_Energy::NO_SEQUENCE, payload, sizeof(payload));
+  endSerial();
+  return true;
+}
+
+/* Periodic pushes : low battery and high temperature threshold crossings, and telemetry */
+void loopSerialPush()
+{
+  if (!_subscribed)
+    return;
+
+  if (!_battLowPushed && getBatteryState().low)
+  {
+    _battLowPushed = true;
+    pushEvent(KXKM_STM32_Energy::PUSH_BATTERY_LOW);
+  }
+  else if (_battLowPushed && !getBatteryState().low)
+  {
+    _battLowPushed = false;
+    pushEvent(KXKM_STM32_Energy::PUSH_BATTERY_OK);
+  }
+
+  if (!_tempHighPushed && getThermalLevel() >= KXKM_STM32_Energy::THERMAL_WARNING)
+  {
+    _tempHighPushed = true;
+    pushEvent(KXKM_STM32_Energy::PUSH_TEMPERATURE_HIGH);
+  }
+  else if (_tempHighPushed && getThermalLevel() == KXKM_STM32_Energy::THERMAL_NORMAL)
+  {
+    _tempHighPushed = false;
+    pushEvent(KXKM_STM32_Energy::PUSH_TEMPERATURE_OK);
+  }
+
+  if (_telemetryPushPeriod > 0 && millis() - _lastTelemetryPush >= _telemetryPushPeriod)
+  {
+    _lastTelemetryPush = millis();
+
+    KXKM_STM32_Energy::Telemetry telemetry;
+    getTelemetry(telemetry);
+
+    uint8_t payload[KXKM_STM32_Energy::TELEMETRY_SIZE];
+    KXKM_STM32_Energy::encodeTelemetry(payload, telemetry);
+
+    beginSerial();
+    sendFrame(KXKM_STM32_Energy::PUSH_TELEMETRY, KXKM_STM32_Energy::NO_SEQUENCE, payload, sizeof(payload));
+    endSerial();
   }
 }
 
 void sendAnswer(int value)
 {
   beginSerial();
-  Serial1.write(KXKM_STM32_Energy::PREAMBLE);
-  Serial1.println(value);
+  if (_binaryAnswer)
+  {
+    uint8_t payload[KXKM_STM32_Energy::FRAME_VALUE_SIZE];
+    KXKM_STM32_Energy::encodeValue(payload, value);
+    sendFrame(_answerCmd, _answerSeq, payload, sizeof(payload));
+  }
+  else
+  {
+    Serial1.write(KXKM_STM32_Energy::PREAMBLE);
+    Serial1.println(value);
+  }
   endSerial();
 }
+
+/* Take a consistent snapshot of all measurements */
+void getTelemetry(KXKM_STM32_Energy::Telemetry &telemetry)
+{
+  const BatteryState &battery = getBatteryState();
+  telemetry.batteryVoltage = battery.voltage;
+  telemetry.avgBatteryVoltage = battery.avgVoltage;
+  telemetry.batteryPercentage = battery.percentage;
+  telemetry.loadCurrent = getInstantLoadCurrent();
+  telemetry.temperature = readTempDegC();
+  telemetry.buttonEvent = buttonEvent;
+  telemetry.state = currentState;
+  telemetry.uptime = millis();
+}
+
+/* Answer to the "Get telemetry" command in a single transaction */
+void sendTelemetry()
+{
+  KXKM_STM32_Energy::Telemetry telemetry;
+  getTelemetry(telemetry);
+
+  beginSerial();
+  if (_binaryAnswer)
+  {
+    uint8_t payload[KXKM_STM32_Energy::TELEMETRY_SIZE];
+    KXKM_STM32_Energy::encodeTelemetry(payload, telemetry);
+    sendFrame(_answerCmd, _answerSeq, payload, sizeof(payload));
+  }
+  else
+  {
+    long values[KXKM_STM32_Energy::TELEMETRY_FIELDS] = {telemetry.batteryVoltage, telemetry.avgBatteryVoltage,
+      telemetry.batteryPercentage, telemetry.loadCurrent, telemetry.temperature, telemetry.buttonEvent,
+      telemetry.state, (long)telemetry.uptime};
+
+    Serial1.write(KXKM_STM32_Energy::PREAMBLE);
+    for (uint8_t i = 0; i < KXKM_STM32_Energy::TELEMETRY_FIELDS; i++)
+    {
+      Serial1.print(values[i]);
+      Serial1.write(i < KXKM_STM32_Energy::TELEMETRY_FIELDS - 1 ? ' ' : '\n');
+    }
+  }
+  endSerial();
+}
+
+#if FEATURE_LOAD_STATS
+/* Answer to the "Get load stats" command in a single transaction */
+void sendLoadStats()
+{
+  KXKM_STM32_Energy::LoadStats stats;
+  getLoadStats(stats);
+
+  beginSerial();
+  if (_binaryAnswer)
+  {
+    uint8_t payload[KXKM_STM32_Energy::LOAD_STATS_SIZE];
+    KXKM_STM32_Energy::encodeLoadStats(payload, stats);
+    sendFrame(_answerCmd, _answerSeq, payload, sizeof(payload));
+  }
+  else
+  {
+    unsigned long values[KXKM_STM32_Energy::LOAD_STATS_FIELDS] = {stats.peakCurrent, stats.minCurrent,
+      stats.meanCurrent, stats.rmsCurrent, stats.charge, stats.energy};
+
+    Serial1.write(KXKM_STM32_Energy::PREAMBLE);
+    for (uint8_t i = 0; i < KXKM_STM32_Energy::LOAD_STATS_FIELDS; i++)
+    {
+      Serial1.print(values[i]);
+      Serial1.write(i < KXKM_STM32_Energy::LOAD_STATS_FIELDS - 1 ? ' ' : '\n');
+    }
+  }
+  endSerial();
+}
+
+#endif
+
+/* Write a binary frame, with an optional sequence number. Should be called between beginSerial() and endSerial(). */
+void sendFrame(uint8_t cmd, int seq, const uint8_t *payload, uint8_t len)
+{
+  uint8_t frame[KXKM_STM32_Energy::FRAME_MAX_SIZE];
+  Serial1.write(frame, KXKM_STM32_Energy::encodeFrame(frame, cmd, payload, len, seq));
+}
@@ -0,0 +1,122 @@
+/* State of charge estimation
+ *
+ * The battery voltage sags under load and jumps back when the amplifier stops : the voltage alone gives a bouncing
+ * battery level, and may trigger an early shutdown. The battery level is estimated as follows :
+ *  * the voltage drop in the battery internal resistance is compensated using the measured load current, which
+ *    gives an estimate of the open circuit voltage (OCV)
+ *  * if the battery capacity is known (SET_BATTERY_CAPACITY), the charge delivered to the load is integrated
+ *    (coulomb counting). The remaining charge is initialized from the voltage, then only pulled back towards the
+ *    voltage estimate when the battery is at rest (low current for some time) : the voltage curve is accurate then.
+ *  * otherwise the battery level is derived from the OCV.
+ *
+ * The battery is considered empty as soon as the OCV is below the cut off voltage, whatever the coulomb counter says.
+ * The ESP32 consumption is not measured, it is small compared to the load.
+ *
+ * The update runs for each ADC block : the divisions (64 bits ones are long on the Cortex-M0) are done when the
+ * capacity or the resistance is set. The percentage is stepped from its last value against the charge per percent.
+ */
+
+const unsigned int REST_CURRENT = 150; // The battery is at rest below this load current (mA)...
+const unsigned long REST_TIME_MS = 30000; // ... after this time (voltage relaxation)
+const uint8_t SOC_CORRECTION_SHIFT = 12; // At rest, 1/4096 of the error is corrected per ADC block : around 20s
+const unsigned int MAX_BATT_CAPACITY = 100000; // mAh : the charge per percent fits in 32 bits
+
+unsigned int _battCapacity; // mAh, 0 if unknown
+unsigned long _chargePerPercent; // mA.ms
+long long _fullCharge; // mA.ms
+unsigned int _battResistance; // mOhm
+unsigned long _battResistanceScale; // mOhm / 1000, 16 bits fixed point
+EmaFilter<LONG_TERM_SHIFT> _ocvBattVoltage; // Same fixed point format and filtering as _avgBattVoltage
+long long _remainingCharge; // mA.ms, -1 until initialized from the voltage
+unsigned long _restStartTime;
+int _socPercentage;
+
+/* Initialize the estimation once the battery type and cells count (0 if unknown) are known */
+void initStateOfCharge(uint8_t cells)
+{
+  setBatteryCapacity(0);
+  setBatteryCellsCount(cells);
+  _ocvBattVoltage.reset(_avgBattVoltage.value()); // The load switch is still off
+  _remainingCharge = -1;
+  _restStartTime = millis() - REST_TIME_MS;
+  _socPercentage = getVoltagePercentage(getOcvBatteryVoltage());
+}
+
+/* Update the estimation with the battery voltage and load current of an ADC block (fixed point) */
+void loopStateOfCharge(unsigned int battVoltage, unsigned int loadCurrent)
+{
+  _ocvBattVoltage.update(battVoltage + (((unsigned long long)loadCurrent * _battResistanceScale) >> 16));
+
+  int voltagePercentage = getVoltagePercentage(getOcvBatteryVoltage());
+  if (voltagePercentage < 0 || _battCapacity == 0)
+  {
+    _remainingCharge = -1;
+    _socPercentage = voltagePercentage;
+    return;
+  }
+
+  long long voltageCharge = (long long)_chargePerPercent * voltagePercentage;
+  if (_remainingCharge < 0)
+  {
+    _remainingCharge = voltageCharge;
+    _socPercentage = voltagePercentage;
+  }
+
+  unsigned long current = loadCurrent >> CURRENT_MEAS_DECIMAL_PART;
+  _remainingCharge -= current * ADC_BLOCK_PERIOD_MS;
+
+  if (current > REST_CURRENT)
+    _restStartTime = millis();
+  else if (millis() - _restStartTime > REST_TIME_MS)
+    _remainingCharge += (voltageCharge - _remainingCharge) >> SOC_CORRECTION_SHIFT;
+
+  _remainingCharge = constrain(_remainingCharge, 0, _fullCharge);
+
+  // Only the voltage can tell that the battery is empty
+  if (voltagePercentage == 0)
+  {
+    _socPercentage = 0;
+    return;
+  }
+
+  // _remainingCharge * 100 / _fullCharge, at least 1. The charge changes little per block : one step at most, usually.
+  _socPercentage = constrain(_socPercentage, 1, 100);
+  while (_socPercentage > 1 && _remainingCharge < (long long)_chargePerPercent * _socPercentage)
+    _socPercentage--;
+  while (_socPercentage < 100 && _remainingCharge >= (long long)_chargePerPercent * (_socPercentage + 1))
+    _socPercentage++;
+}
+
+/* Return the estimated battery percentage, -1 if unknown */
+int getBatteryPercentage()
+{
+  return _socPercentage;
+}
+
+/* Return the battery voltage compensated for the internal resistance drop (mV) */
+unsigned int getOcvBatteryVoltage()
+{
+  return _ocvBattVoltage.value() >> VOLTAGE_MEAS_DECIMAL_PART;
+}
+
+/* Set the battery capacity (mAh), 0 if unknown. The remaining charge is estimated again from the voltage. */
+void setBatteryCapacity(unsigned int capacity)
+{
+  _battCapacity = min(capacity, MAX_BATT_CAPACITY);
+  _chargePerPercent = _battCapacity * (MS_PER_HOUR / 100);
+  _fullCharge = (long long)_chargePerPercent * 100;
+  _remainingCharge = -1;
+}
+
+/* Use the default internal resistance for this number of cells (LiPo / LiFe), 0 if unknown */
+void setBatteryCellsCount(uint8_t cells)
+{
+  setBatteryResistance(cells * DEFAULT_CELL_RESISTANCE);
+}
+
+/* Set the battery internal resistance (mOhm) */
+void setBatteryResistance(unsigned int resistance)
+{
+  _battResistance = resistance;
+  _battResistanceScale = ((unsigned long long)resistance << 16) / 1000;
+}
@@ -0,0 +1,115 @@
+/* Storage mode
+ *
+ * Alternative to the full shutdown, requested by the ESP32 (ENTER_STORAGE_MODE) : the ESP32, the load switch and the
+ * LEDs are turned off but the 3.3V regulator is kept on, and the STM32 waits for the button in Stop mode (a few uA).
+ * A short press resumes the board : the RAM is kept in Stop mode, so the battery type, the state of charge estimator
+ * and the energy counters go on from where they were, without measuring the battery again nor waiting for a long press.
+ *
+ * Standby mode (RAM lost, state kept in the RTC registers) can't be used on this board : the I/Os are released in
+ * Standby and the regulator enable line with them. The watchdog can't be stopped either : the RTC alarm wakes the
+ * STM32 up every second to refresh it, with a longer timeout. Both run from the LSI, their drift is the same.
+ * Every STORAGE_BATTERY_CHECK_PERIOD_S, the system clock is restored for a voltage measurement (around 10ms) : the board
+ * is shut down once the battery is empty (0%), like in the ACTIVE state. The load is off, the voltage is a resting one.
+ * After STORAGE_MAX_DURATION_S without a button press, the board is shut down to protect the battery.
+ */
+
+const unsigned long STORAGE_MAX_DURATION_S = 7UL * 24 * 3600;
+const unsigned long STORAGE_BATTERY_CHECK_PERIOD_S = 600; // Self discharge is slow : a few measurements per hour
+const uint16_t STORAGE_WATCHDOG_RELOAD = 2500; // 4s with the /64 prescaler : 4 RTC alarms
+
+extern "C" void SystemClock_Config(void); // Variant clock setup : Stop mode leaves the STM32 on the HSI
+
+/* Wait for a button press in Stop mode. Return false if the battery is empty or the maximum duration has elapsed. */
+bool runStorageMode()
+{
+  stopLedGauge(); // The timer clock stops in Stop mode : a LED could stay lit until the wake up
+  initStorageWakeUp();
+  setWatchdogTimeout(IWDG_PRESCALER_64, STORAGE_WATCHDOG_RELOAD);
+
+  unsigned long alarms = 0;
+  bool batteryEmpty = false;
+  while (digitalRead(PUSH_BUTTON_DETECT_PIN) == LOW && alarms < STORAGE_MAX_DURATION_S) // Button pressed : HIGH
+  {
+    refreshWatchdog();
+    enterStopMode();
+
+    if (RTC->ISR & RTC_ISR_ALRAF)
+    {
+      RTC->ISR &= ~RTC_ISR_ALRAF; // A new rising edge is needed for the next wake up event
+      alarms++;
+
+      if (alarms % STORAGE_BATTERY_CHECK_PERIOD_S == 0 && isStoredBatteryEmpty())
+      {
+        batteryEmpty = true;
+        break;
+      }
+    }
+  }
+
+  SystemClock_Config();
+  EXTI->EMR &= ~(EXTI_EMR_MR17 | (1UL << STM_PIN(digitalPinToPinName(PUSH_BUTTON_DETECT_PIN))));
+  initWatchdog();
+
+  // The press which resumed the board is not a click : the button task only sees it released
+  while (digitalRead(PUSH_BUTTON_DETECT_PIN) == HIGH)
+  {
+    refreshWatchdog();
+    delay(10);
+  }
+  startLedGauge();
+
+  return alarms < STORAGE_MAX_DURATION_S && !batteryEmpty;
+}
+
+/* Measure the battery voltage after a wake up. Return true at 0%, false if the level is unknown (Custom, no profile) */
+bool isStoredBatteryEmpty()
+{
+  SystemClock_Config(); // ADC sampling period, until the next Stop mode
+  return getVoltagePercentage(measureBatteryVoltage()) == 0;
+}
+
+/* Wake up events : button press (rising edge) and RTC alarm A every second (EXTI line 17) */
+void initStorageWakeUp()
+{
+  PinName pin = digitalPinToPinName(PUSH_BUTTON_DETECT_PIN);
+  uint32_t line = 1UL << STM_PIN(pin);
+
+  __HAL_RCC_SYSCFG_CLK_ENABLE();
+  SYSCFG->EXTICR[STM_PIN(pin) / 4] = (SYSCFG->EXTICR[STM_PIN(pin) / 4] & ~(0xFUL << (4 * (STM_PIN(pin) % 4))))
+                                     | ((uint32_t)STM_PORT(pin) << (4 * (STM_PIN(pin) % 4)));
+  EXTI->RTSR |= line | EXTI_RTSR_TR17;
+  EXTI->EMR |= line | EXTI_EMR_MR17;
+
+  // RTC from the LSI (already running for the watchdog) : 40kHz / 128 / 312 = 1Hz
+  __HAL_RCC_PWR_CLK_ENABLE();
+  PWR->CR |= PWR_CR_DBP;
+  if (!(RCC->BDCR & RCC_BDCR_RTCEN))
+    RCC->BDCR = (RCC->BDCR & ~RCC_BDCR_RTCSEL) | RCC_BDCR_RTCSEL_LSI | RCC_BDCR_RTCEN;
+
+  RTC->WPR = 0xCA; // Unlock the RTC registers
+  RTC->WPR = 0x53;
+  RTC->ISR |= RTC_ISR_INIT;
+  while (!(RTC->ISR & RTC_ISR_INITF));
+  RTC->PRER = (127UL << 16) | 311;
+  RTC->ISR &= ~RTC_ISR_INIT;
+
+  // Alarm at each second : date, hours, minutes, seconds and sub-seconds are ignored
+  RTC->CR &= ~RTC_CR_ALRAE;
+  while (!(RTC->ISR & RTC_ISR_ALRAWF));
+  RTC->ALRMAR = RTC_ALRMAR_MSK4 | RTC_ALRMAR_MSK3 | RTC_ALRMAR_MSK2 | RTC_ALRMAR_MSK1;
+  RTC->ALRMASSR = 0;
+  RTC->ISR &= ~RTC_ISR_ALRAF;
+  RTC->CR |= RTC_CR_ALRAIE | RTC_CR_ALRAE; // The RTC interrupt stays disabled in the NVIC : event only
+  RTC->WPR = 0xFF;
+}
+
+/* Stop mode with the regulator in low power, until the next wake up event */
+void enterStopMode()
+{
+  PWR->CR = (PWR->CR & ~PWR_CR_PDDS) | PWR_CR_LPDS;
+  SCB->SCR |= SCB_SCR_SLEEPDEEP_Msk;
+  __SEV();
+  __WFE(); // Clear the event register
+  __WFE();
+  SCB->SCR &= ~(uint32_t)SCB_SCR_SLEEPDEEP_Msk;
+}
@@ -0,0 +1,62 @@
+/* Thermal protection (hardware revision 2)
+ *
+ * The board sits in closed flight cases, next to the amplifier. After each thermistor reading (every
+ * TEMP_MEAS_PERIOD_MS, see loopBatteryMonitoring), the temperature is compared to the threshold of each level :
+ *  * THERMAL_WARNING : the ESP32 is warned (PUSH_TEMPERATURE_HIGH) and should reduce the volume
+ *  * THERMAL_LOAD_CUT : the load switch is turned off. It is turned back on (if requested) when the level goes down.
+ *  * THERMAL_SHUTDOWN : the board is shut down, through the critical section wait
+ * A level is left THERMAL_HYSTERESIS below its threshold. The ESP32 can change the thresholds (SET_THERMAL_THRESHOLD) :
+ * they must stay in order and more than THERMAL_HYSTERESIS apart, so each level is left before the one below.
+ */
+
+const int THERMAL_HYSTERESIS = 50; // 0.1°C
+const int DEFAULT_THERMAL_THRESHOLDS[] = {600, 700, 800}; // 0.1°C : warning, load cut, shutdown
+
+int _thermalThresholds[3];
+uint8_t _thermalLevel; // KXKM_STM32_Energy::ThermalLevel
+
+void initThermalProtection()
+{
+  for (uint8_t i = 0; i < 3; i++)
+    _thermalThresholds[i] = DEFAULT_THERMAL_THRESHOLDS[i];
+  _thermalLevel = KXKM_STM32_Energy::THERMAL_NORMAL;
+}
+
+/* Update the level after a thermistor reading */
+void updateThermalProtection()
+{
+  int temperature = readTempDeciDegC();
+  uint8_t level = _thermalLevel;
+
+  while (level < KXKM_STM32_Energy::THERMAL_SHUTDOWN && temperature >= _thermalThresholds[level])
+    level++;
+  while (level > KXKM_STM32_Energy::THERMAL_NORMAL && temperature < _thermalThresholds[level - 1] - THERMAL_HYSTERESIS)
+    level--;
+
+  if (level != _thermalLevel)
+  {
+    _thermalLevel = level;
+    applyLoadSwitchState();
+  }
+}
+
+uint8_t getThermalLevel()
+{
+  return _thermalLevel;
+}
+
+/* Set the threshold (0.1°C) of a level, from THERMAL_WARNING to THERMAL_SHUTDOWN. Ignored if the thresholds would be
+   out of order, too close to each other, or above the thermistor range (never reached). */
+void setThermalThreshold(uint8_t level, int temperature)
+{
+  if (level < KXKM_STM32_Energy::THERMAL_WARNING || level > KXKM_STM32_Energy::THERMAL_SHUTDOWN || temperature >= NTC_MAX_TEMPERATURE)
+    return;
+
+  uint8_t index = level - 1;
+  if (index > 0 && temperature - _thermalThresholds[index - 1] <= THERMAL_HYSTERESIS)
+    return;
+  if (index < 2 && _thermalThresholds[index + 1] - temperature <= THERMAL_HYSTERESIS)
+    return;
+
+  _thermalThresholds[index] = temperature;
+}
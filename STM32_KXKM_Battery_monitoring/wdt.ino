@@ -27,3 +27,11 @@ void refreshWatchdog()
 {
   HAL_IWDG_Refresh(&IwdgHandle);
 }
+
+/* Change the watchdog timeout while it is running (see storage_mode.ino). initWatchdog() restores 250ms. */
+void setWatchdogTimeout(uint32_t prescaler, uint16_t reload)
+{
+  IwdgHandle.Init.Prescaler = prescaler;
+  IwdgHandle.Init.Reload = reload;
+  HAL_IWDG_Init(&IwdgHandle);
+}
@@ -0,0 +1,142 @@
+/* Timer driven ADC scans with DMA (adc_sampling.ino) and the filter path of batt_monitoring.ino */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+#include <vector>
+
+/* Scan times : the battery voltage channel is converted once per scan */
+static std::vector<uint64_t> scanTimes;
+
+static void recordScans(unsigned int voltage)
+{
+  uint16_t reading = batteryVoltageReading(voltage);
+  sim::setAnalogInput(BATT_VOLTAGE_SENSE_PIN, [reading]() {
+    scanTimes.push_back(sim::now());
+    return reading;
+  });
+}
+
+TEST(scans_are_periodic_whatever_the_main_loop_does)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(100);
+
+    scanTimes.clear();
+    recordScans(15600);
+    uint64_t blockSeen = 0, maxBlockDelay = 0;
+    unsigned long start = millis(), lastRequest = start;
+    while (millis() - start < 1000)
+    {
+      // Busy main loop : serial requests with blocking answers
+      if (millis() - lastRequest >= 20)
+      {
+        sendCommand(KXKM_STM32_Energy::GET_TELEMETRY);
+        lastRequest = millis();
+      }
+      if (DMA1->ISR & (DMA_ISR_HTIF1 | DMA_ISR_TCIF1))
+      {
+        if (blockSeen == 0)
+          blockSeen = sim::now();
+      }
+      else if (blockSeen != 0)
+      {
+        maxBlockDelay = max(maxBlockDelay, sim::now() - blockSeen);
+        blockSeen = 0;
+      }
+      loop();
+    }
+
+    CHECK_NEAR(1000000 / ADC_SAMPLE_PERIOD_US, scanTimes.size(), 1);
+    uint64_t minPeriod = UINT64_MAX, maxPeriod = 0;
+    for (size_t i = 1; i < scanTimes.size(); i++)
+    {
+      minPeriod = min(minPeriod, scanTimes[i] - scanTimes[i - 1]);
+      maxPeriod = max(maxPeriod, scanTimes[i] - scanTimes[i - 1]);
+    }
+    printf("Scan period %lu - %lu us, block processed up to %lu us after completion\n", (unsigned long)minPeriod,
+           (unsigned long)maxPeriod, (unsigned long)maxBlockDelay);
+    CHECK_EQUAL(ADC_SAMPLE_PERIOD_US, minPeriod);
+    CHECK_EQUAL(ADC_SAMPLE_PERIOD_US, maxPeriod);
+    // The main loop delay only shifts the filtering, never the samples : each block is processed before the next one
+    CHECK(maxBlockDelay < ADC_BLOCK_SCANS * ADC_SAMPLE_PERIOD_US);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(blocks_hold_each_channel_at_its_scan_position)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    sim::setAnalogValue(BATT_VOLTAGE_SENSE_PIN, 1111);
+    sim::setAnalogValue(LOAD_CURRENT_SENSE_PIN, 222);
+#if HW_REVISION > 1
+    sim::setAnalogValue(TEMP_MEAS_PIN, 3333);
+#endif
+    delay(2 * ADC_BLOCK_SCANS * ADC_SAMPLE_PERIOD_US / 1000 + 1); // A full block with the new values
+    DMA1->IFCR = DMA_IFCR_CHTIF1 | DMA_IFCR_CTCIF1;
+    delay(ADC_BLOCK_SCANS * ADC_SAMPLE_PERIOD_US / 1000);
+
+    const volatile uint16_t *block = getCompletedAdcBlock();
+    CHECK(block != NULL);
+    if (block == NULL)
+      return;
+    CHECK_EQUAL(1111, getAdcBlockAverage(block, _adcVoltageIndex));
+    CHECK_EQUAL(222, getAdcBlockAverage(block, _adcCurrentIndex));
+#if HW_REVISION > 1
+    CHECK_EQUAL(3333, getAdcBlockAverage(block, _adcTempIndex));
+#endif
+    CHECK(getCompletedAdcBlock() == NULL); // Until the next block
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(steady_state_output_matches_the_readings)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(5000);
+
+    unsigned int voltage = adcToBatteryVoltage(batteryVoltageReading(15600)) >> VOLTAGE_MEAS_DECIMAL_PART;
+    unsigned int current = adcToLoadCurrent(loadCurrentReading(500)) >> CURRENT_MEAS_DECIMAL_PART;
+    CHECK_EQUAL(voltage, getInstantBatteryVoltage());
+    CHECK_EQUAL(voltage, getAverageBatteryVoltage());
+    CHECK_EQUAL(current, getInstantLoadCurrent());
+    CHECK_NEAR(15600, voltage, 20);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(noise_is_filtered)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+
+    // +/- 40 LSB of noise on the voltage : the output stays within a few LSB of the mean
+    srand(42);
+    uint16_t reading = batteryVoltageReading(15600);
+    sim::setAnalogInput(BATT_VOLTAGE_SENSE_PIN, [reading]() { return reading - 40 + rand() % 81; });
+    runFor(5000);
+
+    unsigned int voltage = adcToBatteryVoltage(reading) >> VOLTAGE_MEAS_DECIMAL_PART;
+    unsigned int lsb = (adcToBatteryVoltage(reading + 1) - adcToBatteryVoltage(reading)) >> VOLTAGE_MEAS_DECIMAL_PART;
+    unsigned int minVoltage = UINT_MAX, maxVoltage = 0;
+    unsigned long start = millis();
+    while (millis() - start < 2000)
+    {
+      loop();
+      minVoltage = min(minVoltage, getAverageBatteryVoltage());
+      maxVoltage = max(maxVoltage, getAverageBatteryVoltage());
+    }
+    CHECK_NEAR(voltage, minVoltage, 5 * lsb + 1);
+    CHECK_NEAR(voltage, maxVoltage, 5 * lsb + 1);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
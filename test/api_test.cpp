@@ -0,0 +1,120 @@
+/* Binary frame encoding of the STM32 energy API (KXKM_STM32_energy_API.h) */
+
+#include <Arduino.h>
+#include "KXKM_STM32_energy_API.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+TEST(crc8_check_value)
+{
+  // CRC-8 (polynomial 0x07, init 0) of "123456789"
+  uint8_t crc = 0;
+  for (const char *c = "123456789"; *c; c++)
+    crc = API::crc8(crc, *c);
+  CHECK_EQUAL(0xF4, crc);
+}
+
+TEST(frame_without_sequence)
+{
+  uint8_t payload[API::FRAME_VALUE_SIZE];
+  API::encodeValue(payload, 1234);
+
+  uint8_t frame[API::FRAME_MAX_SIZE];
+  uint8_t size = API::encodeFrame(frame, API::SET_LED_GAUGE, payload, sizeof(payload));
+  CHECK_EQUAL(API::FRAME_HEADER_SIZE + API::FRAME_VALUE_SIZE + 1, size);
+  CHECK_EQUAL(API::FRAME_SYNC, frame[0]);
+  CHECK_EQUAL(API::SET_LED_GAUGE, frame[1]);
+  CHECK_EQUAL(API::FRAME_VALUE_SIZE, frame[2]);
+  CHECK_EQUAL(1234, API::decodeValue(frame + 3));
+  CHECK_EQUAL(API::frameCrc(frame[1], frame + 3, frame[2]), frame[size - 1]);
+
+  // The CRC covers the command, the length and the payload
+  uint8_t crc = 0;
+  for (uint8_t i = 1; i < size - 1; i++)
+    crc = API::crc8(crc, frame[i]);
+  CHECK_EQUAL(crc, frame[size - 1]);
+}
+
+TEST(frame_with_sequence)
+{
+  uint8_t frame[API::FRAME_MAX_SIZE];
+  uint8_t size = API::encodeFrame(frame, API::GET_API_VERSION, NULL, 0, 200);
+  CHECK_EQUAL(API::FRAME_HEADER_SIZE + 2, size);
+  CHECK_EQUAL(API::FRAME_SYNC_SEQ, frame[0]);
+  CHECK_EQUAL(200, frame[2]);
+  CHECK_EQUAL(0, frame[3]);
+  CHECK_EQUAL(API::frameCrc(API::GET_API_VERSION, NULL, 0, 200), frame[4]);
+  CHECK(API::frameCrc(API::GET_API_VERSION, NULL, 0, 201) != frame[4]);
+  CHECK(API::frameCrc(API::GET_API_VERSION, NULL, 0) != frame[4]);
+}
+
+TEST(largest_frame_fits)
+{
+  uint8_t payload[API::FRAME_MAX_PAYLOAD];
+  for (uint8_t i = 0; i < sizeof(payload); i++)
+    payload[i] = i;
+
+  uint8_t frame[API::FRAME_MAX_SIZE + 1];
+  frame[API::FRAME_MAX_SIZE] = 0x5A;
+  CHECK_EQUAL(API::FRAME_MAX_SIZE, API::encodeFrame(frame, API::SET_LED_FRAME, payload, sizeof(payload), 255));
+  CHECK_EQUAL(0x5A, frame[API::FRAME_MAX_SIZE]);
+}
+
+TEST(values_are_little_endian_signed)
+{
+  const long values[] = {0, 1, -1, 255, 256, 65535, -32768, 2147483647L, -2147483647L - 1};
+  for (long value : values)
+  {
+    uint8_t payload[API::FRAME_VALUE_SIZE];
+    API::encodeValue(payload, value);
+    CHECK_EQUAL(value, API::decodeValue(payload));
+    CHECK_EQUAL(value & 0xFF, payload[0]);
+  }
+
+  uint8_t payload[API::FRAME_VALUE_SIZE] = {0x78, 0x56, 0x34, 0x12};
+  CHECK_EQUAL(0x12345678, API::decodeValue(payload));
+}
+
+TEST(telemetry_round_trip)
+{
+  API::Telemetry telemetry = {15600, 15590, -1, 2500, -12, API::BUTTON_DOUBLE_CLICK_EVENT, API::STATE_ACTIVE, 4000000000UL};
+  uint8_t payload[API::TELEMETRY_SIZE];
+  API::encodeTelemetry(payload, telemetry);
+
+  API::Telemetry decoded;
+  API::decodeTelemetry(payload, decoded);
+  CHECK_EQUAL(telemetry.batteryVoltage, decoded.batteryVoltage);
+  CHECK_EQUAL(telemetry.avgBatteryVoltage, decoded.avgBatteryVoltage);
+  CHECK_EQUAL(-1, decoded.batteryPercentage);
+  CHECK_EQUAL(telemetry.loadCurrent, decoded.loadCurrent);
+  CHECK_EQUAL(-12, decoded.temperature);
+  CHECK_EQUAL(telemetry.buttonEvent, decoded.buttonEvent);
+  CHECK_EQUAL(telemetry.state, decoded.state);
+  CHECK_EQUAL(4000000000UL, decoded.uptime);
+  CHECK(API::TELEMETRY_SIZE <= API::FRAME_MAX_PAYLOAD);
+}
+
+TEST(load_stats_round_trip)
+{
+  API::LoadStats stats = {65535, 0, 1200, 1500, 123456, 3000000000UL};
+  uint8_t payload[API::LOAD_STATS_SIZE];
+  API::encodeLoadStats(payload, stats);
+
+  API::LoadStats decoded;
+  API::decodeLoadStats(payload, decoded);
+  CHECK_EQUAL(65535, decoded.peakCurrent);
+  CHECK_EQUAL(0, decoded.minCurrent);
+  CHECK_EQUAL(1200, decoded.meanCurrent);
+  CHECK_EQUAL(1500, decoded.rmsCurrent);
+  CHECK_EQUAL(123456, decoded.charge);
+  CHECK_EQUAL(3000000000UL, decoded.energy);
+  CHECK(API::LOAD_STATS_SIZE <= API::FRAME_MAX_PAYLOAD);
+}
+
+TEST(answered_commands_take_no_argument_except_task_stats)
+{
+  for (int cmd = 0; cmd < 128; cmd++)
+    if (API::hasAnswer((API::CommandType)cmd) && API::hasArgument((API::CommandType)cmd))
+      CHECK_EQUAL(API::GET_TASK_STATS, cmd);
+}
@@ -0,0 +1,110 @@
+/* Battery state snapshot (batt_state.h), taken once per ADC block by loopBatteryMonitoring() */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "bench.h"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+/* Battery voltage in the middle of a percentage step, and enough time for the average to settle on it.
+   Without load : no internal resistance compensation. */
+static void settleOnPercentage(int percentage)
+{
+  setLoadCurrent(0);
+  setBatteryVoltage((_percentageVoltages[percentage] + _percentageVoltages[percentage + 1]) / 2);
+  runFor(40000);
+}
+
+TEST(snapshot_matches_the_measurements)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+
+    // Taken at the end of each block : the getters give the same values until the next one
+    for (int i = 0; i < 50; i++)
+    {
+      runUntil([]() { return (DMA1->ISR & (DMA_ISR_HTIF1 | DMA_ISR_TCIF1)) != 0; }, 10);
+      loop();
+      const BatteryState &state = getBatteryState();
+      CHECK_EQUAL(getInstantBatteryVoltage(), state.voltage);
+      CHECK_EQUAL(getAverageBatteryVoltage(), state.avgVoltage);
+      CHECK_EQUAL(getBatteryPercentage(), state.percentage);
+      CHECK(state.breaksValid);
+    }
+
+    CHECK_EQUAL(getBatteryState().voltage, query(API::GET_BATTERY_VOLTAGE));
+    CHECK_EQUAL(getBatteryState().percentage, query(API::GET_BATTERY_PERCENTAGE));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(low_battery_has_a_hysteresis)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+    CHECK(!getBatteryState().low);
+
+    settleOnPercentage(BATT_LOW_LEVEL - 1);
+    CHECK_EQUAL(BATT_LOW_LEVEL - 1, getBatteryState().percentage);
+    CHECK(getBatteryState().low);
+
+    settleOnPercentage(BATT_LOW_LEVEL + BATT_LOW_HYSTERESIS - 1);
+    CHECK_EQUAL(BATT_LOW_LEVEL + BATT_LOW_HYSTERESIS - 1, getBatteryState().percentage);
+    CHECK(getBatteryState().low);
+
+    settleOnPercentage(BATT_LOW_LEVEL + BATT_LOW_HYSTERESIS);
+    CHECK(!getBatteryState().low);
+
+    settleOnPercentage(BATT_LOW_LEVEL);
+    CHECK(!getBatteryState().low);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(unknown_battery_is_never_low)
+{
+  wireBoard();
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[0], HIGH); // Custom, no profile
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[1], HIGH);
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+    CHECK(!getBatteryState().breaksValid);
+    CHECK_EQUAL(-1, getBatteryState().percentage);
+    CHECK(!getBatteryState().low);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(loop_profile)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+
+    // Host cost of the battery state : taken once per ADC block, or computed for each reader as before the snapshot
+    double update = benchPerCall([](unsigned long) { updateBatteryState(); return getBatteryState().percentage; },
+                                 100000);
+    double read = benchPerCall([](unsigned long) { return getBatteryState().percentage; }, 100000);
+    double interpolation = benchPerCall([](unsigned long) {
+      return interpolateVoltagePercentage(getAverageBatteryVoltage());
+    }, 100000);
+
+    // Per second in ACTIVE : 200 ADC blocks, 100 state task runs reading the percentage up to 5 times, the ESP32
+    // polling it every 20ms
+    const unsigned long blocks = 1000 / ADC_BLOCK_PERIOD_MS, reads = 1000 / TASKS[API::TASK_STATE].period * 5 + 50;
+    double snapshotCost = blocks * update + reads * read, onDemandCost = reads * interpolation;
+    printf("Per call : snapshot update %.1f, read %.1f, interpolation %.1f %s\n", update, read, interpolation,
+           BENCH_UNIT);
+    printf("Per second : %lu reads, snapshot %.0f, on demand %.0f %s\n", reads, snapshotCost, onDemandCost,
+           BENCH_UNIT);
+    CHECK(read < interpolation);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
@@ -0,0 +1,49 @@
+/* Micro-benchmarks on the host : average cost of a call, the best of several runs to leave out the host noise.
+ *
+ * The time stamp counter (cycles) is used on x86, nanoseconds elsewhere. The host has a hardware divider and an FPU,
+ * the STM32F030 has neither : a division costs tens of cycles and a float log() thousands on the target. The results
+ * compare two implementations, they are not STM32 cycle counts. Configure with -DCMAKE_BUILD_TYPE=MinSizeRel to
+ * build at the firmware optimization level (-Os).
+ */
+
+#ifndef TEST_BENCH_H
+#define TEST_BENCH_H
+
+#include <stdint.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+  #include <x86intrin.h>
+  #define BENCH_UNIT "host cycles"
+  inline uint64_t benchTicks() { return __rdtsc(); }
+#else
+  #define BENCH_UNIT "host ns"
+  inline uint64_t benchTicks()
+  {
+    timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+  }
+#endif
+
+/* Average ticks per call of call(i), i from 0 to calls - 1. The results are summed so that the calls are kept. */
+template <typename Call> double benchPerCall(Call call, unsigned long calls, int runs = 5)
+{
+  static volatile long sink;
+  double best = 0;
+  for (int run = 0; run < runs; run++)
+  {
+    long sum = 0;
+    uint64_t start = benchTicks();
+    for (unsigned long i = 0; i < calls; i++)
+      sum += call(i);
+    double perCall = (double)(benchTicks() - start) / calls;
+    sink = sum;
+    if (run == 0 || perCall < best)
+      best = perCall;
+  }
+  (void)sink;
+  return best;
+}
+
+#endif
@@ -0,0 +1,204 @@
+/* Board level helpers for the firmware tests : included after the sketch (STM32_KXKM_Battery_monitoring.ino.cpp), they
+ * use its pin mapping and conversion constants.
+ */
+
+#ifndef TEST_BOARD_H
+#define TEST_BOARD_H
+
+#include "sim.h"
+
+#include <climits>
+
+/* Nominal ADC readings, before the calibration */
+inline uint16_t batteryVoltageReading(unsigned int voltage)
+{
+  return (unsigned long)voltage * getNominalCalibrationValue() / CALIBRATION_VOLTAGE;
+}
+
+inline uint16_t loadCurrentReading(unsigned int current)
+{
+  return (unsigned long long)current * CURRENT_MEAS_DIVIDER / (CURRENT_MEAS_MULTIPLIER1 * CURRENT_MEAS_MULTIPLIER2);
+}
+
+inline void setBatteryVoltage(unsigned int voltage)
+{
+  sim::setAnalogValue(BATT_VOLTAGE_SENSE_PIN, batteryVoltageReading(voltage));
+}
+
+inline void setLoadCurrent(unsigned int current)
+{
+  sim::setAnalogValue(LOAD_CURRENT_SENSE_PIN, loadCurrentReading(current));
+}
+
+#if HW_REVISION > 1
+/* Thermistor reading closest to the temperature (0.1°C) */
+inline uint16_t temperatureReading(int temperature)
+{
+  uint16_t best = 0;
+  for (uint16_t reading = 0; reading < 4096; reading++)
+    if (abs(adcToTemperature(reading) - temperature) < abs(adcToTemperature(best) - temperature))
+      best = reading;
+  return best;
+}
+
+inline void setTemperature(int temperature)
+{
+  sim::setAnalogValue(TEMP_MEAS_PIN, temperatureReading(temperature));
+}
+#endif
+
+/* Default board : LiPo selector, 4S pack at 3.9V per cell, 500mA load, 25°C */
+inline void wireBoard()
+{
+  sim::setWiring({POWER_ENABLE_PIN, PUSH_BUTTON_DETECT_PIN, ESP32_TX_PIN, LED_PINS, LED_PINS_COUNT});
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[0], LOW);
+  setBatteryVoltage(15600);
+  setLoadCurrent(500);
+#if HW_REVISION > 1
+  setTemperature(250);
+#endif
+}
+
+/* Power up with a long press, as a user does : setup() returns with the board powered, the button released */
+inline void startBoard()
+{
+  sim::pressButton();
+  sim::after(1500000, sim::releaseButton);
+  setup();
+}
+
+/* Run the main loop for the given time */
+inline void runFor(unsigned long ms)
+{
+  unsigned long start = millis();
+  while (millis() - start < ms)
+    loop();
+}
+
+/* Run the main loop until the condition is true, at most for the given time. Return false on timeout. */
+template <typename Condition> bool runUntil(Condition condition, unsigned long timeoutMs)
+{
+  unsigned long start = millis();
+  while (!condition())
+  {
+    if (millis() - start >= timeoutMs)
+      return false;
+    loop();
+  }
+  return true;
+}
+
+/* Send a text command ("### <cmd><arg>\n") as the ESP32 does */
+inline void sendCommand(char cmd)
+{
+  sim::esp32.write(KXKM_STM32_Energy::PREAMBLE);
+  sim::esp32.write(cmd);
+  sim::esp32.println();
+}
+
+inline void sendCommand(char cmd, long arg)
+{
+  sim::esp32.write(KXKM_STM32_Energy::PREAMBLE);
+  sim::esp32.write(cmd);
+  sim::esp32.println(arg);
+}
+
+/* Run the main loop until a text answer is received. Return LONG_MIN on timeout. */
+inline long readAnswer(unsigned long timeoutMs = 100)
+{
+  std::string answer;
+  bool complete = runUntil([&answer]() {
+    answer += sim::esp32.readAll();
+    return answer.find('\n') != std::string::npos;
+  }, timeoutMs);
+
+  size_t start = answer.find(KXKM_STM32_Energy::PREAMBLE);
+  if (!complete || start == std::string::npos)
+    return LONG_MIN;
+  return strtol(answer.c_str() + start + strlen(KXKM_STM32_Energy::PREAMBLE), NULL, 10);
+}
+
+inline long query(char cmd)
+{
+  sim::esp32.readAll();
+  sendCommand(cmd);
+  return readAnswer();
+}
+
+/* Binary frames */
+struct Frame {
+  uint8_t cmd;
+  int seq;
+  uint8_t len;
+  uint8_t payload[KXKM_STM32_Energy::FRAME_MAX_PAYLOAD];
+
+  long value() const { return KXKM_STM32_Energy::decodeValue(payload); }
+};
+
+inline void sendFrame(uint8_t cmd, const uint8_t *payload, uint8_t len, int seq = KXKM_STM32_Energy::NO_SEQUENCE)
+{
+  uint8_t frame[KXKM_STM32_Energy::FRAME_MAX_SIZE];
+  sim::esp32.write(frame, KXKM_STM32_Energy::encodeFrame(frame, cmd, payload, len, seq));
+}
+
+inline void sendFrame(uint8_t cmd, int seq = KXKM_STM32_Energy::NO_SEQUENCE)
+{
+  sendFrame(cmd, NULL, 0, seq);
+}
+
+inline void sendValueFrame(uint8_t cmd, long value, int seq = KXKM_STM32_Energy::NO_SEQUENCE)
+{
+  uint8_t payload[KXKM_STM32_Energy::FRAME_VALUE_SIZE];
+  KXKM_STM32_Energy::encodeValue(payload, value);
+  sendFrame(cmd, payload, sizeof(payload), seq);
+}
+
+/* Bytes received from the STM32 and not parsed yet */
+inline std::string &receivedBytes()
+{
+  static std::string bytes;
+  bytes += sim::esp32.readAll();
+  return bytes;
+}
+
+/* Extract the first complete frame of the received bytes. Invalid bytes and frames are dropped. */
+inline bool extractFrame(Frame &frame)
+{
+  std::string &bytes = receivedBytes();
+  while (!bytes.empty())
+  {
+    uint8_t sync = bytes[0];
+    if (sync != KXKM_STM32_Energy::FRAME_SYNC && sync != KXKM_STM32_Energy::FRAME_SYNC_SEQ)
+    {
+      bytes.erase(0, 1);
+      continue;
+    }
+
+    size_t header = (sync == KXKM_STM32_Energy::FRAME_SYNC_SEQ) ? 4 : 3;
+    if (bytes.size() < header || bytes.size() < header + (uint8_t)bytes[header - 1] + 1)
+      return false;
+
+    frame.cmd = bytes[1];
+    frame.seq = (header == 4) ? (uint8_t)bytes[2] : KXKM_STM32_Energy::NO_SEQUENCE;
+    frame.len = bytes[header - 1];
+    if (frame.len > KXKM_STM32_Energy::FRAME_MAX_PAYLOAD)
+    {
+      bytes.erase(0, 1);
+      continue;
+    }
+    memcpy(frame.payload, bytes.data() + header, frame.len);
+    uint8_t crc = bytes[header + frame.len];
+    bytes.erase(0, header + frame.len + 1);
+    if (crc == KXKM_STM32_Energy::frameCrc(frame.cmd, frame.payload, frame.len, frame.seq))
+      return true;
+  }
+  return false;
+}
+
+/* Run the main loop until a frame is received. Return false on timeout. */
+inline bool readFrame(Frame &frame, unsigned long timeoutMs = 100)
+{
+  return runUntil([&frame]() { return extractFrame(frame); }, timeoutMs);
+}
+
+#endif
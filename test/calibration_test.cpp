@@ -0,0 +1,271 @@
+/* ADC calibration (calibration.ino) : conversion of the readings, option bytes fallback of the older boards */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+static const uint16_t NOMINAL_GAIN = getNominalCalibrationValue() << CALIBRATION_FRAC_BITS;
+
+/* Nominal, gain and offset on both sides */
+static const AdcCalibration CALIBRATIONS[] = {
+  {NOMINAL_GAIN, 0, CALIBRATION_GAIN_ONE, 0, 0, 0, CALIBRATION_NO_TEMPERATURE},
+  {(uint16_t)(NOMINAL_GAIN * 11 / 10), 480, CALIBRATION_GAIN_ONE * 11 / 10, 40, 0, 0, CALIBRATION_NO_TEMPERATURE},
+  {(uint16_t)(NOMINAL_GAIN * 92 / 100), -320, CALIBRATION_GAIN_ONE * 92 / 100, -25, 0, 0, CALIBRATION_NO_TEMPERATURE}
+};
+
+static void useCalibration(const AdcCalibration &calibration)
+{
+  _adcCalibration = calibration;
+  applyAdcCalibration();
+}
+
+TEST(voltage_reading_follows_the_calibration_line)
+{
+  for (const AdcCalibration &calibration : CALIBRATIONS)
+  {
+    useCalibration(calibration);
+    for (unsigned int adc = 0; adc < 4096; adc++)
+    {
+      double reading = (double)adc * (1 << CALIBRATION_FRAC_BITS) - calibration.voltageOffset;
+      double expected = (reading > 0) ? reading * CALIBRATION_VOLTAGE / calibration.voltageGain : 0; // mV
+      CHECK_NEAR(expected, adcToBatteryVoltage(adc) / (double)(1 << VOLTAGE_MEAS_DECIMAL_PART), 0.1);
+    }
+  }
+
+  // The calibration points
+  useCalibration(CALIBRATIONS[1]);
+  CHECK_NEAR(CALIBRATION_VOLTAGE, adcToBatteryVoltage((CALIBRATIONS[1].voltageGain + CALIBRATIONS[1].voltageOffset) >> CALIBRATION_FRAC_BITS) >> VOLTAGE_MEAS_DECIMAL_PART, 10);
+  CHECK_EQUAL(0, adcToBatteryVoltage(CALIBRATIONS[1].voltageOffset >> CALIBRATION_FRAC_BITS));
+}
+
+TEST(load_current_reading_follows_the_calibration_line)
+{
+  for (const AdcCalibration &calibration : CALIBRATIONS)
+  {
+    useCalibration(calibration);
+    for (unsigned int adc = 0; adc < 4096; adc++)
+    {
+      double reading = (double)adc - (double)calibration.currentOffset / (1 << CALIBRATION_FRAC_BITS);
+      double expected = (reading > 0) ? reading * CURRENT_MEAS_MULTIPLIER1 * CURRENT_MEAS_MULTIPLIER2 / CURRENT_MEAS_DIVIDER
+                                        * CALIBRATION_GAIN_ONE / calibration.currentGain : 0; // mA
+      CHECK_NEAR(expected, adcToLoadCurrent(adc) / (double)(1 << CURRENT_MEAS_DECIMAL_PART), 0.1);
+    }
+  }
+}
+
+#if HW_REVISION > 1
+TEST(thermistor_offset_is_applied)
+{
+  AdcCalibration calibration = CALIBRATIONS[0];
+  calibration.thermistorOffset = 25;
+  useCalibration(calibration);
+  _tempAdcRead = temperatureReading(250);
+  CHECK_EQUAL(adcToTemperature(_tempAdcRead + 25), readTempDeciDegC());
+}
+
+TEST(voltage_drift_is_compensated_from_the_calibration_temperature)
+{
+  AdcCalibration calibration = CALIBRATIONS[1];
+  calibration.tempCoefficient = 200; // ppm/°C
+  calibration.referenceTempAdc = temperatureReading(250);
+  const unsigned int adc = 3000;
+
+  _tempAdcRead = calibration.referenceTempAdc;
+  useCalibration(calibration);
+  unsigned int reference = adcToBatteryVoltage(adc);
+
+  for (int temperature = -100; temperature <= 600; temperature += 100)
+  {
+    _tempAdcRead = temperatureReading(temperature);
+    updateCalibrationTemperature();
+    double drift = 200e-6 * (readTempDeciDegC() - _calibrationTemperature) / 10;
+    CHECK_NEAR(reference / (1 + drift), adcToBatteryVoltage(adc), 2);
+  }
+
+  // Unknown calibration temperature : not compensated
+  calibration.referenceTempAdc = CALIBRATION_NO_TEMPERATURE;
+  useCalibration(calibration);
+  CHECK_EQUAL(reference, adcToBatteryVoltage(adc));
+}
+#endif
+
+TEST(option_bytes_give_the_gain_without_a_record)
+{
+  wireBoard();
+  sim::setOptionBytes(0x34, 0x0C); // Older STM32_ADC_calib : reading of 0x0C34 at CALIBRATION_VOLTAGE
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK_EQUAL(0x0C34 << CALIBRATION_FRAC_BITS, _adcCalibration.voltageGain);
+    CHECK_EQUAL(0, _adcCalibration.voltageOffset);
+    CHECK_EQUAL(CALIBRATION_GAIN_ONE, _adcCalibration.currentGain);
+    CHECK_EQUAL(CALIBRATION_NO_TEMPERATURE, _adcCalibration.referenceTempAdc);
+    CHECK_NEAR(CALIBRATION_VOLTAGE, adcToBatteryVoltage(0x0C34) >> VOLTAGE_MEAS_DECIMAL_PART, 1);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(unprogrammed_option_bytes_give_the_nominal_gain)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK_EQUAL(NOMINAL_GAIN, _adcCalibration.voltageGain);
+    CHECK_NEAR(15600, query(API::GET_BATTERY_VOLTAGE), 10);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(stored_record_overrides_the_option_bytes)
+{
+  wireBoard();
+  sim::setOptionBytes(0x34, 0x0C);
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK(storeAdcCalibration(CALIBRATIONS[1]));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+  result = sim::boot([]() {
+    startBoard();
+    CHECK(memcmp(&_adcCalibration, &CALIBRATIONS[1], sizeof(AdcCalibration)) == 0);
+    CHECK_EQUAL(CALIBRATIONS[1].voltageGain, _pendingCalibration.voltageGain);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+/* Custom selector : the calibration commands are accepted */
+static void wireCustomBoard()
+{
+  wireBoard();
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[0], HIGH);
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[1], HIGH);
+}
+
+#if HW_REVISION > 1
+static void measureVoltagePoint(unsigned int voltage)
+{
+  setBatteryVoltage(voltage);
+  runFor(100);
+  sendCommand(API::CALIBRATE_VOLTAGE, voltage);
+  runFor(10);
+  CHECK_EQUAL(API::CALIBRATION_MEASURING, _calibrationState);
+  CHECK(runUntil([]() { return _calibrationState != API::CALIBRATION_MEASURING; }, 1000));
+  CHECK_EQUAL(API::CALIBRATION_MEASURED, query(API::GET_CALIBRATION_STATE));
+}
+
+TEST(reference_temperature_is_taken_with_the_voltage_points)
+{
+  wireCustomBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    setTemperature(200);
+    runFor(2 * TEMP_MEAS_PERIOD_MS);
+    measureVoltagePoint(CALIBRATION_LOW_VOLTAGE);
+    CHECK_EQUAL(temperatureReading(200), _pendingCalibration.referenceTempAdc);
+
+    setTemperature(300);
+    runFor(2 * TEMP_MEAS_PERIOD_MS);
+    measureVoltagePoint(CALIBRATION_VOLTAGE);
+
+    // Committed later, warmer : the temperature of the points is kept
+    setTemperature(450);
+    runFor(2 * TEMP_MEAS_PERIOD_MS);
+    sendCommand(API::COMMIT_CALIBRATION);
+    runFor(10);
+    CHECK_EQUAL(API::CALIBRATION_COMMITTED, query(API::GET_CALIBRATION_STATE));
+    CHECK_EQUAL((temperatureReading(200) + temperatureReading(300)) / 2, _adcCalibration.referenceTempAdc);
+    CHECK_NEAR(250, _calibrationTemperature, 5);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+#endif
+
+TEST(temperature_coefficient_is_committed)
+{
+  wireCustomBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    sendCommand(API::SET_TEMP_COEFFICIENT, CALIBRATION_MAX_TEMP_COEFFICIENT + 1);
+    runFor(10);
+    CHECK_EQUAL(API::CALIBRATION_IDLE, query(API::GET_CALIBRATION_STATE));
+
+    sendCommand(API::SET_TEMP_COEFFICIENT, -150);
+    runFor(10);
+    CHECK_EQUAL(API::CALIBRATION_MEASURED, query(API::GET_CALIBRATION_STATE));
+    CHECK_EQUAL(0, _adcCalibration.tempCoefficient); // Not used before the commit
+
+    sendCommand(API::COMMIT_CALIBRATION);
+    runFor(10);
+    CHECK_EQUAL(API::CALIBRATION_COMMITTED, query(API::GET_CALIBRATION_STATE));
+    CHECK_EQUAL(-150, _adcCalibration.tempCoefficient);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+  result = sim::boot([]() {
+    startBoard();
+    CHECK_EQUAL(-150, _adcCalibration.tempCoefficient);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+  // Only in the Custom position
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[0], LOW);
+  result = sim::boot([]() {
+    startBoard();
+    sendCommand(API::SET_TEMP_COEFFICIENT, 100);
+    runFor(10);
+    CHECK_EQUAL(API::CALIBRATION_IDLE, query(API::GET_CALIBRATION_STATE));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+/* Previous calibration stored, then the log filled : the next record switches the page */
+static void prepareFullLog()
+{
+  sim::resetFlash();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK(storeAdcCalibration(CALIBRATIONS[1]));
+    for (uint8_t i = 0; getProfileStorageState() > 0; i++)
+      storeLastPackCells(API::PROFILE_LIPO, 4 + (i & 1));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(commit_is_atomic_when_the_log_is_full)
+{
+  wireCustomBoard();
+  bool completed = false;
+  for (unsigned long operations = 1; !completed && operations < 500; operations++)
+  {
+    prepareFullLog();
+    sim::powerLossAfterFlashOperations(operations);
+    sim::BootResult result = sim::boot([]() {
+      startBoard();
+      sendCommand(API::SET_TEMP_COEFFICIENT, 150);
+      sendCommand(API::COMMIT_CALIBRATION);
+      runFor(10);
+      CHECK_EQUAL(API::CALIBRATION_COMMITTED, query(API::GET_CALIBRATION_STATE));
+    });
+    sim::powerLossAfterFlashOperations(0);
+    completed = (result == sim::BOOT_RETURNED);
+    if (!completed)
+      CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+
+    // Either the previous or the new calibration, never the option bytes fallback
+    result = sim::boot([completed]() {
+      startBoard();
+      AdcCalibration expected = CALIBRATIONS[1];
+      if (_adcCalibration.tempCoefficient == 150 || completed)
+        expected.tempCoefficient = 150;
+      CHECK(memcmp(&_adcCalibration, &expected, sizeof(AdcCalibration)) == 0);
+      CHECK_EQUAL(0, sim::flashErrors());
+    });
+    CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+    if (completed)
+      CHECK(operations > 10); // The page was switched
+  }
+  CHECK(completed);
+}
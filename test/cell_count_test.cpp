@@ -0,0 +1,132 @@
+/* Cells count detection (findCellCount() in batt_monitoring.ino), for every built-in profile, cells count and state
+ * of charge. The ambiguous zones are reported on the standard output.
+ */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+static const char *const PROFILE_NAMES[] = {"LiPo", "LiFe", "NiMH", "Li-ion", "Lead-acid", "LiFe deep"};
+static const unsigned int LOAD_CURRENTS[] = {0, 2000, 5000}; // mA
+
+/* Resting cell voltage (mV) at a state of charge (%), interpolated between the breaks like the battery level */
+static unsigned int cellVoltage(const unsigned int *breaks, int percentage)
+{
+  int segment = min(percentage * 6 / 100, 5);
+  int start = segment * 100 / 6;
+  int end = (segment + 1) * 100 / 6;
+  return breaks[segment] + (breaks[segment + 1] - breaks[segment]) * (percentage - start) / (end - start);
+}
+
+TEST(every_pack_is_detected_with_its_confidence)
+{
+  for (uint8_t profile = 0; profile < BUILTIN_PROFILES_COUNT; profile++)
+  {
+    const unsigned int *breaks = BUILTIN_PROFILES[profile];
+    for (uint8_t cells = MIN_CELLS; cells <= MAX_CELLS; cells++)
+    {
+      int ambiguousStart = -1, ambiguousEnd = -1, points = 0, wrong = 0, lowestConfidence = 100;
+      for (int percentage = 1; percentage <= 100; percentage++)
+      {
+        for (unsigned int current : LOAD_CURRENTS)
+        {
+          // Voltage drop in the cells at the default resistance : compensated
+          unsigned int voltage = cells * cellVoltage(breaks, percentage) - current * cells * DEFAULT_CELL_RESISTANCE / 1000;
+          uint8_t found = findCellCount(voltage, current, breaks[0], breaks[6], 0);
+          uint8_t confidence = _cellsConfidence;
+          points++;
+
+          CHECK(found != 0); // Above the cut off voltage and below the charged voltage : always a candidate
+          if (confidence == 100)
+            CHECK_EQUAL(cells, found);
+          else
+          {
+            CHECK(confidence >= CELLS_CONFIDENCE_MARGIN && confidence < CELLS_CONFIDENCE_HINT);
+            CHECK(found >= cells); // Never fewer cells : the cut off voltage would be too low
+            ambiguousStart = (ambiguousStart < 0) ? percentage : ambiguousStart;
+            ambiguousEnd = percentage;
+            wrong += (found != cells);
+            lowestConfidence = min(lowestConfidence, (int)confidence);
+
+            // The last known pack resolves the ambiguity
+            CHECK_EQUAL(cells, findCellCount(voltage, current, breaks[0], breaks[6], cells));
+            CHECK_EQUAL(CELLS_CONFIDENCE_HINT, _cellsConfidence);
+          }
+        }
+      }
+
+      if (ambiguousStart >= 0)
+        printf("%-9s %dS : ambiguous from %3d%% to %3d%%, confidence >= %d%%, wrong without hint : %d / %d\n",
+               PROFILE_NAMES[profile], cells, ambiguousStart, ambiguousEnd, lowestConfidence, wrong, points);
+    }
+  }
+}
+
+TEST(small_lipo_and_life_packs_are_never_ambiguous)
+{
+  // Selector positions : the ranges only overlap from 5 cells
+  for (uint8_t profile = API::PROFILE_LIPO; profile <= API::PROFILE_LIFE; profile++)
+  {
+    const unsigned int *breaks = BUILTIN_PROFILES[profile];
+    for (uint8_t cells = MIN_CELLS; cells <= 4; cells++)
+      for (int percentage = 1; percentage <= 100; percentage++)
+      {
+        findCellCount(cells * cellVoltage(breaks, percentage), 0, breaks[0], breaks[6], 0);
+        CHECK_EQUAL(100, _cellsConfidence);
+      }
+  }
+}
+
+TEST(ambiguous_voltage_without_hint_takes_the_larger_count)
+{
+  // Depleted 7S LiPo at 3.57V per cell, or 6S at 4.17V per cell : a 7S pack run with the 6S cut off would be
+  // discharged down to 2.57V per cell
+  const unsigned int *breaks = BUILTIN_PROFILES[API::PROFILE_LIPO];
+  for (unsigned int voltage = 24600; voltage <= 25500; voltage += 100) // Overlap of the 6S and 7S ranges
+  {
+    CHECK_EQUAL(7, findCellCount(voltage, 0, breaks[0], breaks[6], 0));
+    CHECK(_cellsConfidence >= CELLS_CONFIDENCE_MARGIN && _cellsConfidence < CELLS_CONFIDENCE_HINT);
+    CHECK_EQUAL(6, findCellCount(voltage, 0, breaks[0], breaks[6], 6)); // Known 6S pack
+  }
+}
+
+TEST(outside_of_every_range_is_not_detected)
+{
+  const unsigned int *breaks = BUILTIN_PROFILES[API::PROFILE_LIPO];
+  CHECK_EQUAL(0, findCellCount(MIN_CELLS * breaks[0], 0, breaks[0], breaks[6], 0)); // Empty 2S pack
+  CHECK_EQUAL(0, _cellsConfidence);
+  CHECK_EQUAL(0, findCellCount(MAX_CELLS * (breaks[6] + INITIAL_CELL_VOLTAGE_TOLERANCE) + 100, 0, breaks[0], breaks[6], 0));
+  CHECK_EQUAL(0, findCellCount(10000, 0, breaks[0], breaks[6], 0)); // Between 2S and 3S
+}
+
+TEST(last_pack_is_stored_and_resolves_the_next_startup)
+{
+  // 6S LiPo at 3.9V per cell : unambiguous, stored as the last pack
+  wireBoard();
+  setBatteryVoltage(6 * 3900);
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK_EQUAL(6 + 100 * 100, query(API::GET_BATTERY_CELLS));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+  // 25V : 6S at 4.17V or 7S at 3.57V per cell
+  setBatteryVoltage(25000);
+  result = sim::boot([]() {
+    startBoard();
+    CHECK_EQUAL(6 + 100 * CELLS_CONFIDENCE_HINT, query(API::GET_BATTERY_CELLS));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+  // Without the hint : the larger number of cells, with a lower confidence
+  sim::resetFlash();
+  result = sim::boot([]() {
+    startBoard();
+    long detection = query(API::GET_BATTERY_CELLS);
+    CHECK_EQUAL(7, detection % 100);
+    CHECK(detection / 100 >= CELLS_CONFIDENCE_MARGIN && detection / 100 < CELLS_CONFIDENCE_HINT);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
@@ -0,0 +1,284 @@
+/* ESP32 client of the STM32 energy API (KXKM_STM32_energy_client.h), against a fake STM32 on a mock serial port */
+
+#include <Arduino.h>
+#include "KXKM_STM32_energy_client.h"
+#include "test.h"
+
+#include <deque>
+#include <string>
+
+typedef KXKM_STM32_Energy API;
+
+/* Fake STM32 : answers the requests written by the client, as the firmware does. The answers are available at once. */
+class FakeStm32 : public Stream {
+public:
+  int apiVersion = API::API_VERSION;
+  int ignoredRequests = 0; // Requests dropped before answering, like a booting STM32
+  int requests = 0;
+  std::string commands; // Command types received, in order
+
+  int available() override { return _answers.size(); }
+  int read() override
+  {
+    if (_answers.empty())
+      return -1;
+    uint8_t c = _answers.front();
+    _answers.pop_front();
+    return c;
+  }
+  int peek() override { return _answers.empty() ? -1 : _answers.front(); }
+
+  size_t write(uint8_t c) override
+  {
+    _request += (char)c;
+    parseRequest();
+    return 1;
+  }
+  using Print::write;
+
+  /* Bytes sent by the STM32 without request, e.g. debug output */
+  void sendUnrequested(const std::string &bytes) { _answers.insert(_answers.end(), bytes.begin(), bytes.end()); }
+
+  /* Answer value of the commands other than GET_API_VERSION */
+  static long valueOf(uint8_t cmd) { return 1000 + cmd; }
+
+private:
+  std::string _request;
+  std::deque<uint8_t> _answers;
+
+  void parseRequest()
+  {
+    const size_t preamble = strlen(API::PREAMBLE);
+    if (_request.compare(0, preamble, API::PREAMBLE, 0, min(_request.size(), preamble)) == 0)
+    {
+      if (_request.back() == '\n')
+      {
+        uint8_t cmd = _request[preamble];
+        _request.clear();
+        answer(cmd, false, API::NO_SEQUENCE);
+      }
+      return;
+    }
+
+    uint8_t sync = _request[0];
+    if (sync != API::FRAME_SYNC && sync != API::FRAME_SYNC_SEQ)
+    {
+      _request.clear();
+      return;
+    }
+    size_t header = (sync == API::FRAME_SYNC_SEQ) ? 4 : 3;
+    if (_request.size() < header || _request.size() < header + (uint8_t)_request[header - 1] + 1)
+      return;
+    uint8_t cmd = _request[1];
+    int seq = (header == 4) ? (uint8_t)_request[2] : API::NO_SEQUENCE;
+    _request.clear();
+    answer(cmd, true, seq);
+  }
+
+  void answer(uint8_t cmd, bool binary, int seq)
+  {
+    requests++;
+    commands += (char)cmd;
+    if (ignoredRequests > 0)
+    {
+      ignoredRequests--;
+      return;
+    }
+    if (!API::hasAnswer((API::CommandType)cmd))
+      return;
+
+    long value = (cmd == API::GET_API_VERSION) ? apiVersion : valueOf(cmd);
+    if (!binary)
+    {
+      std::string text = API::PREAMBLE + std::to_string(value) + "\r\n";
+      _answers.insert(_answers.end(), text.begin(), text.end());
+      return;
+    }
+
+    uint8_t payload[API::FRAME_VALUE_SIZE];
+    API::encodeValue(payload, value);
+    uint8_t frame[API::FRAME_MAX_SIZE];
+    uint8_t size = API::encodeFrame(frame, cmd, payload, sizeof(payload), seq);
+    _answers.insert(_answers.end(), frame, frame + size);
+  }
+};
+
+struct Answer {
+  int count;
+  long value;
+  bool timeout;
+};
+static Answer lastAnswer;
+
+static void storeAnswer(API::CommandType, long value, bool timeout)
+{
+  lastAnswer.count++;
+  lastAnswer.value = value;
+  lastAnswer.timeout = timeout;
+}
+
+/* Update the client every millisecond for the given time */
+static void runClient(KXKM_STM32_Client &client, unsigned long ms)
+{
+  for (unsigned long i = 0; i < ms; i++)
+  {
+    client.update();
+    delay(1);
+  }
+}
+
+TEST(negotiation_selects_the_pipelined_binary_protocol)
+{
+  FakeStm32 stm32;
+  KXKM_STM32_Client client(stm32);
+  client.begin();
+  runClient(client, 10);
+
+  CHECK_EQUAL(API::API_VERSION, client.apiVersion());
+  CHECK(client.isBinary());
+  CHECK_EQUAL(1, stm32.requests);
+}
+
+TEST(negotiation_selects_the_text_protocol_for_old_versions)
+{
+  FakeStm32 stm32;
+  stm32.apiVersion = 2;
+  KXKM_STM32_Client client(stm32);
+  client.begin();
+  client.request(API::GET_BATTERY_VOLTAGE, storeAnswer);
+  runClient(client, 10);
+
+  CHECK_EQUAL(2, client.apiVersion());
+  CHECK(!client.isBinary());
+  CHECK_EQUAL(1, lastAnswer.count);
+  CHECK_EQUAL(FakeStm32::valueOf(API::GET_BATTERY_VOLTAGE), lastAnswer.value);
+}
+
+TEST(negotiation_is_retried_while_the_stm32_boots)
+{
+  FakeStm32 stm32;
+  stm32.ignoredRequests = KXKM_STM32_Client::NEGOTIATION_ATTEMPTS - 1;
+  KXKM_STM32_Client client(stm32);
+  client.begin();
+  client.request(API::GET_BATTERY_VOLTAGE, storeAnswer);
+  runClient(client, KXKM_STM32_Client::NEGOTIATION_ATTEMPTS * (KXKM_STM32_Client::ANSWER_TIMEOUT_MS + 10));
+
+  CHECK_EQUAL(API::API_VERSION, client.apiVersion());
+  CHECK(client.isBinary());
+  CHECK(std::string(KXKM_STM32_Client::NEGOTIATION_ATTEMPTS, API::GET_API_VERSION) + (char)API::GET_BATTERY_VOLTAGE ==
+        stm32.commands);
+  CHECK_EQUAL(1, lastAnswer.count);
+  CHECK(!lastAnswer.timeout);
+  CHECK_EQUAL(FakeStm32::valueOf(API::GET_BATTERY_VOLTAGE), lastAnswer.value);
+}
+
+TEST(negotiation_falls_back_to_text_without_answer)
+{
+  FakeStm32 stm32;
+  stm32.ignoredRequests = 1000;
+  KXKM_STM32_Client client(stm32);
+  client.begin();
+  client.request(API::GET_API_VERSION, storeAnswer);
+
+  runClient(client, (KXKM_STM32_Client::NEGOTIATION_ATTEMPTS - 1) * (KXKM_STM32_Client::ANSWER_TIMEOUT_MS + 10));
+  CHECK_EQUAL(-1, client.apiVersion()); // Still trying
+
+  runClient(client, 2 * (KXKM_STM32_Client::ANSWER_TIMEOUT_MS + 10));
+  CHECK_EQUAL(0, client.apiVersion());
+  CHECK(!client.isBinary());
+  CHECK_EQUAL(KXKM_STM32_Client::NEGOTIATION_ATTEMPTS + 1, stm32.requests); // Then the queued request, in text
+  CHECK_EQUAL(1, lastAnswer.count);
+  CHECK(lastAnswer.timeout);
+}
+
+TEST(pipelined_requests_are_matched_to_their_answers)
+{
+  static const API::CommandType commands[] = {API::GET_BATTERY_VOLTAGE, API::GET_LOAD_CURRENT, API::GET_BATTERY_PERCENTAGE,
+                                              API::GET_BOARD_ID};
+  static long values[4];
+  static int answers;
+
+  FakeStm32 stm32;
+  KXKM_STM32_Client client(stm32);
+  client.begin();
+  runClient(client, 10);
+
+  for (API::CommandType cmd : commands)
+    client.request(cmd, [](API::CommandType cmd, long value, bool timeout) {
+      for (int i = 0; i < 4; i++)
+        if (commands[i] == cmd && !timeout)
+          values[i] = value;
+      answers++;
+    });
+  CHECK_EQUAL(4, stm32.requests - 1); // All sent before any answer is read
+  runClient(client, 10);
+
+  CHECK_EQUAL(4, answers);
+  for (int i = 0; i < 4; i++)
+    CHECK_EQUAL(FakeStm32::valueOf(commands[i]), values[i]);
+  CHECK_EQUAL(0, client.pending());
+}
+
+TEST(unanswered_request_times_out)
+{
+  FakeStm32 stm32;
+  KXKM_STM32_Client client(stm32);
+  client.begin();
+  runClient(client, 10);
+
+  stm32.ignoredRequests = 1;
+  client.request(API::GET_BATTERY_VOLTAGE, storeAnswer);
+  runClient(client, KXKM_STM32_Client::ANSWER_TIMEOUT_MS + 10);
+
+  CHECK_EQUAL(1, lastAnswer.count);
+  CHECK(lastAnswer.timeout);
+  CHECK_EQUAL(API::API_VERSION, client.apiVersion()); // Only the negotiation is retried
+  CHECK_EQUAL(2, stm32.requests);
+}
+
+TEST(text_line_does_not_complete_a_binary_request)
+{
+  FakeStm32 stm32;
+  KXKM_STM32_Client client(stm32);
+  client.begin();
+  runClient(client, 10);
+  CHECK(client.isBinary());
+
+  stm32.ignoredRequests = 1;
+  client.request(API::GET_BATTERY_VOLTAGE, storeAnswer);
+  stm32.sendUnrequested(std::string(API::PREAMBLE) + "123\r\n");
+  runClient(client, 10);
+  CHECK_EQUAL(0, lastAnswer.count);
+
+  runClient(client, KXKM_STM32_Client::ANSWER_TIMEOUT_MS);
+  CHECK_EQUAL(1, lastAnswer.count);
+  CHECK(lastAnswer.timeout);
+
+  // The binary answers are still received
+  client.request(API::GET_BATTERY_VOLTAGE, storeAnswer);
+  runClient(client, 10);
+  CHECK_EQUAL(2, lastAnswer.count);
+  CHECK(!lastAnswer.timeout);
+  CHECK_EQUAL(FakeStm32::valueOf(API::GET_BATTERY_VOLTAGE), lastAnswer.value);
+}
+
+TEST(lock_step_requests_are_sent_one_at_a_time)
+{
+  FakeStm32 stm32;
+  stm32.apiVersion = 5; // Binary, without sequence numbers
+  KXKM_STM32_Client client(stm32);
+  client.begin();
+  runClient(client, 10);
+  CHECK(client.isBinary());
+
+  stm32.ignoredRequests = 1000;
+  client.request(API::GET_BATTERY_VOLTAGE, storeAnswer);
+  client.request(API::GET_LOAD_CURRENT, storeAnswer);
+  client.request(API::GET_BOARD_ID, storeAnswer);
+  runClient(client, 10);
+  CHECK_EQUAL(2, stm32.requests);
+
+  runClient(client, KXKM_STM32_Client::ANSWER_TIMEOUT_MS); // The first one times out
+  CHECK_EQUAL(3, stm32.requests);
+  CHECK_EQUAL(1, lastAnswer.count);
+}
@@ -0,0 +1,131 @@
+/* Fixed point filters (filters.h), against floating point references */
+
+#include <Arduino.h>
+#include "filters.h"
+#include "test.h"
+
+#include <cmath>
+
+// LoadCurrentFilter design : Butterworth low-pass, fc = 1.6Hz at 200Hz
+static const double SAMPLE_RATE = 200;
+static const double CUTOFF = 1.6;
+
+TEST(ema_matches_the_floating_point_average)
+{
+  EmaFilter<4> filter;
+  filter.reset(1000 << 5);
+  double reference = 1000 << 5;
+
+  srand(1);
+  for (int i = 0; i < 10000; i++)
+  {
+    uint32_t sample = (1000 + rand() % 200) << 5;
+    filter.update(sample);
+    reference += (sample - reference) / 16;
+    CHECK_NEAR(reference, filter.value(), 1);
+  }
+}
+
+TEST(ema_settles_on_the_input_without_dead_band)
+{
+  EmaFilter<10> filter;
+  filter.reset(0);
+  for (int i = 0; i < 1024; i++)
+    filter.update(100000);
+  CHECK_NEAR(100000 * (1 - exp(-1.0)), filter.value(), 100); // Time constant : 2^SHIFT samples
+
+  for (int i = 0; i < 30 * 1024; i++)
+    filter.update(100000);
+  CHECK_EQUAL(100000, filter.value());
+
+  for (int i = 0; i < 30 * 1024; i++)
+    filter.update(99999); // One LSB below
+  CHECK_EQUAL(99999, filter.value());
+}
+
+TEST(median_rejects_isolated_spikes)
+{
+  MedianFilter<unsigned int, 3> filter;
+  filter.reset(15000);
+  CHECK_EQUAL(15000, filter.update(9000)); // Load switching spike
+  CHECK_EQUAL(15000, filter.update(15000));
+  CHECK_EQUAL(15000, filter.update(21000));
+  CHECK_EQUAL(15000, filter.update(15000));
+
+  // A step passes after N/2 samples
+  CHECK_EQUAL(15000, filter.update(14000));
+  CHECK_EQUAL(14000, filter.update(14000));
+
+  MedianFilter<int, 5> wide;
+  wide.reset(0);
+  CHECK_EQUAL(0, wide.update(100));
+  CHECK_EQUAL(0, wide.update(-100));
+  CHECK_EQUAL(0, wide.update(50));
+  CHECK_EQUAL(50, wide.update(60));
+}
+
+TEST(biquad_coefficients_are_a_butterworth_low_pass)
+{
+  // Bilinear transform of the 2nd order Butterworth prototype
+  double k = tan(M_PI * CUTOFF / SAMPLE_RATE);
+  double norm = 1 / (1 + sqrt(2.0) * k + k * k);
+  double b0 = k * k * norm, a1 = 2 * (k * k - 1) * norm, a2 = (1 - sqrt(2.0) * k + k * k) * norm;
+  typedef LoadCurrentFilter F;
+  const long long one = 1LL << F::COEFF_FRAC;
+
+  CHECK_NEAR(b0 * one, F::COEFF_B0, 2);
+  CHECK_NEAR(2 * b0 * one, F::COEFF_B1, 4);
+  CHECK_NEAR(b0 * one, F::COEFF_B2, 2);
+  CHECK_NEAR(a1 * one, F::COEFF_A1, 2);
+  CHECK_NEAR(a2 * one, F::COEFF_A2, 2);
+  // Unity DC gain
+  CHECK_EQUAL(one, ((long long)F::COEFF_B0 + F::COEFF_B1 + F::COEFF_B2) * one / (one + F::COEFF_A1 + F::COEFF_A2));
+}
+
+TEST(biquad_step_response)
+{
+  LoadCurrentFilter filter;
+  filter.reset(0);
+  int32_t peak = 0;
+  int settling = -1;
+  for (int i = 0; i < 400; i++)
+  {
+    int32_t y = filter.update(500 << 5);
+    peak = max(peak, y);
+    if (settling < 0 && y >= (500 << 5) * 95 / 100)
+      settling = i;
+  }
+  CHECK_EQUAL(500 << 5, filter.value()); // Settles exactly, the rounding error is fed back
+  CHECK(peak <= (500 << 5) * 105 / 100); // Butterworth overshoot : around 4%
+  CHECK(settling > 0 && settling < 0.4 * SAMPLE_RATE);
+}
+
+TEST(biquad_attenuation)
+{
+  // Amplitude after settling for a sine at the given frequency
+  auto gain = [](double frequency) {
+    LoadCurrentFilter filter;
+    filter.reset(0);
+    double amplitude = 0;
+    for (int i = 0; i < 20 * SAMPLE_RATE; i++)
+    {
+      int32_t y = filter.update(lround(100000 * sin(2 * M_PI * frequency * i / SAMPLE_RATE)));
+      if (i > 10 * SAMPLE_RATE)
+        amplitude = max(amplitude, fabs(y));
+    }
+    return amplitude / 100000;
+  };
+
+  CHECK_NEAR(1, gain(0.1), 0.01);
+  CHECK_NEAR(1 / sqrt(2.0), gain(CUTOFF), 0.01);
+  CHECK(gain(50) < 0.002); // Audio bursts
+}
+
+TEST(biquad_has_no_dead_band)
+{
+  LoadCurrentFilter filter;
+  filter.reset(1000);
+  for (int i = 0; i < 2000; i++)
+    filter.update(1001);
+  CHECK_EQUAL(1001, filter.value());
+}
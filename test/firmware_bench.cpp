@@ -0,0 +1,59 @@
+/* Main loop cost on the host : a 10 minutes discharge at 2A, with the ESP32 polling the telemetry every 100ms.
+ * Host times only show the relative cost of the tasks between two versions of the sketch : the execution times on the
+ * STM32 are read with GET_LOOP_TIME / GET_TASK_STATS.
+ */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+#include <time.h>
+
+static uint64_t hostTimeNs()
+{
+  timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+TEST(discharge_loop_cost)
+{
+  wireBoard();
+  setLoadCurrent(2000);
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(3000);
+
+    uint64_t start = sim::now();
+    sim::setAnalogInput(BATT_VOLTAGE_SENSE_PIN, [start]() {
+      return batteryVoltageReading(15600 - 1200 * (sim::now() - start) / 600000000);
+    });
+
+    unsigned long loops = 0, lastPoll = millis();
+    uint64_t loopTimeNs = 0, maxLoopTimeNs = 0;
+    uint64_t benchStart = hostTimeNs();
+    while (sim::now() - start < 600000000)
+    {
+      if (millis() - lastPoll >= 100)
+      {
+        lastPoll = millis();
+        sim::esp32.readAll();
+        sendCommand(KXKM_STM32_Energy::GET_TELEMETRY);
+      }
+
+      uint64_t loopStart = hostTimeNs();
+      loop();
+      uint64_t loopTime = hostTimeNs() - loopStart;
+      loopTimeNs += loopTime;
+      maxLoopTimeNs = max(maxLoopTimeNs, loopTime);
+      loops++;
+    }
+    uint64_t benchTime = hostTimeNs() - benchStart;
+
+    printf("HW_REVISION %d : %lu loops in %.1fs of simulated time, %.2fs on the host (x%.0f)\n", HW_REVISION, loops,
+           (sim::now() - start) / 1e6, benchTime / 1e9, (sim::now() - start) * 1e3 / benchTime);
+    printf("Host time per loop : %.2fus average, %.2fus max\n", loopTimeNs / 1e3 / loops, maxLoopTimeNs / 1e3);
+    CHECK_EQUAL(ACTIVE, currentState);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
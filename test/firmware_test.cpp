@@ -0,0 +1,179 @@
+/* Power cycle scenarios of the STM32 firmware on the simulated board */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+TEST(startup_powers_the_esp32_then_the_load)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK_EQUAL(HIGH, sim::pinOutput(POWER_ENABLE_PIN));
+    CHECK_EQUAL(HIGH, sim::pinOutput(ESP32_ENABLE_PIN));
+    CHECK_EQUAL(LOW, sim::pinOutput(MAIN_OUT_ENABLE_PIN));
+    CHECK_EQUAL(4, _battCells);
+
+    runFor(LOAD_SWITCH_START_DELAY_MS + 100);
+    CHECK_EQUAL(ACTIVE, currentState);
+    CHECK_EQUAL(HIGH, sim::pinOutput(MAIN_OUT_ENABLE_PIN));
+    CHECK(sim::isPowered());
+    CHECK(sim::uartTxWhileReleased() == 0);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(short_press_at_startup_does_not_power_the_board)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    sim::pressButton();
+    sim::after(300000, sim::releaseButton);
+    setup();
+  });
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+}
+
+TEST(wrong_battery_type_is_refused)
+{
+  wireBoard();
+  setBatteryVoltage(5000); // No LiPo pack matches
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+  });
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+  CHECK(!sim::isPowered());
+}
+
+TEST(discharged_battery_shuts_down)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(3000);
+    CHECK_EQUAL(ACTIVE, currentState);
+
+    // Down to 3.4V per cell in 20s
+    uint64_t start = sim::now();
+    sim::setAnalogInput(BATT_VOLTAGE_SENSE_PIN, [start]() {
+      uint64_t elapsed = min(sim::now() - start, (uint64_t)20000000);
+      return batteryVoltageReading(15600 - (15600 - 13600) * elapsed / 20000000);
+    });
+
+    runFor(60000);
+  }, [](sim::BootResult) {
+    CHECK_EQUAL(LOW, sim::pinOutput(ESP32_ENABLE_PIN));
+    CHECK_EQUAL(LOW, sim::pinOutput(MAIN_OUT_ENABLE_PIN));
+    CHECK(sim::now() < 60000000);
+  });
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+}
+
+TEST(long_press_shuts_down_after_the_critical_section)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(STARTUP_GUARD_TIME_MS + 1000);
+
+    sendCommand(KXKM_STM32_Energy::ENTER_CRITICAL_SECTION, MAX_CRITICAL_SECTION_DURATION_MS);
+    runFor(100);
+
+    sim::pressButton();
+    sim::after(2000000, sim::releaseButton);
+    runFor(3000);
+    CHECK_EQUAL(CRITICAL_SECTION_WAIT, currentState);
+    CHECK(sim::isPowered());
+
+    sendCommand(KXKM_STM32_Energy::LEAVE_CRITICAL_SECTION);
+    runFor(1000);
+    CHECK(false); // Not reached
+  }, [](sim::BootResult) {
+    CHECK_EQUAL(LOW, sim::pinOutput(ESP32_ENABLE_PIN));
+  });
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+}
+
+TEST(critical_section_is_limited)
+{
+  wireBoard();
+  static unsigned long requestTime;
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(STARTUP_GUARD_TIME_MS + 1000);
+
+    requestTime = millis();
+    sendCommand(KXKM_STM32_Energy::ENTER_CRITICAL_SECTION, 60000);
+    runFor(100);
+    sim::pressButton();
+    sim::after(2000000, sim::releaseButton);
+    runFor(MAX_CRITICAL_SECTION_DURATION_MS + 3000);
+  }, [](sim::BootResult) {
+    CHECK_EQUAL(CRITICAL_SECTION_WAIT, currentState); // Left by the shutdown
+    CHECK_NEAR(requestTime + MAX_CRITICAL_SECTION_DURATION_MS, millis(), 20);
+  });
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+}
+
+TEST(watchdog_is_refreshed)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(10000);
+    CHECK(sim::isPowered());
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(stuck_main_loop_resets)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+    while (true)
+      delay(10); // No more tasks
+  });
+  CHECK_EQUAL(sim::BOOT_WATCHDOG_RESET, result);
+}
+
+TEST(battery_level_is_displayed_on_click)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(STARTUP_GUARD_TIME_MS);
+
+    sim::pressButton();
+    sim::after(100000, sim::releaseButton);
+    runFor(1000);
+
+    sim::resetLedOnTimes();
+    runFor(1000);
+    uint64_t total = 0;
+    for (uint8_t high = 0; high < 16; high++)
+      for (uint8_t low = 0; low < 16; low++)
+        total += sim::ledOnTime(high, low);
+    CHECK(total > 100000); // Several LEDs lit in turn
+
+    CHECK_EQUAL(KXKM_STM32_Energy::BUTTON_CLICK_EVENT, query(KXKM_STM32_Energy::GET_BUTTON_EVENT));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(api_answers)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK_EQUAL(KXKM_STM32_Energy::API_VERSION, query(KXKM_STM32_Energy::GET_API_VERSION));
+    CHECK_EQUAL(HW_REVISION, query(KXKM_STM32_Energy::GET_HW_REVISION));
+    CHECK_EQUAL(1, query(KXKM_STM32_Energy::GET_BOARD_ID));
+    CHECK_NEAR(15600, query(KXKM_STM32_Energy::GET_BATTERY_VOLTAGE), 50);
+    CHECK_NEAR(500, query(KXKM_STM32_Energy::GET_LOAD_CURRENT), 10);
+    CHECK_EQUAL(4 + 100 * 100, query(KXKM_STM32_Energy::GET_BATTERY_CELLS));
+    CHECK(sim::uartTxWhileReleased() == 0);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
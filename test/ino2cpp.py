@@ -0,0 +1,66 @@
+#!/usr/bin/env python3
+"""Arduino sketch to C++ translation unit, as the Arduino builder does it :
+the main .ino first then the other .ino files in alphabetical order, with the function prototypes inserted before the
+first function definition. Functions which already have a prototype are skipped.
+
+Usage : ino2cpp.py <sketch directory> <output .cpp>
+"""
+
+import os
+import re
+import sys
+
+DEFINITION = re.compile(r'^(?!(?:if|else|for|while|switch|return|do)\b)([A-Za-z_][\w:<>,\*& ]*?[\s\*&]+([A-Za-z_]\w*)\s*\([^;{}]*\))\s*\{?\s*(?://.*)?$')
+PROTOTYPE = re.compile(r'^[A-Za-z_][\w:<>,\*& ]*?[\s\*&]+([A-Za-z_]\w*)\s*\([^{}]*\)\s*;')
+
+
+def main():
+    sketch_dir, output = sys.argv[1], sys.argv[2]
+    name = os.path.basename(os.path.normpath(sketch_dir))
+    main_ino = name + '.ino'
+    files = [main_ino] + sorted(f for f in os.listdir(sketch_dir) if f.endswith('.ino') and f != main_ino)
+
+    sources = []
+    for f in files:
+        path = os.path.abspath(os.path.join(sketch_dir, f))
+        with open(path) as source:
+            sources.append((path, source.read().splitlines()))
+
+    declared = set()
+    for _, lines in sources:
+        for line in lines:
+            match = PROTOTYPE.match(line)
+            if match:
+                declared.add(match.group(1))
+
+    prototypes = []
+    first_definition = None
+    for index, (_, lines) in enumerate(sources):
+        for number, line in enumerate(lines):
+            match = DEFINITION.match(line)
+            if not match:
+                continue
+            # The body must follow : "{" on the same line or on the next one
+            following = lines[number + 1].strip() if number + 1 < len(lines) else ''
+            if not line.rstrip().endswith('{') and not following.startswith('{'):
+                continue
+            if first_definition is None:
+                first_definition = (index, number)
+            if match.group(2) not in declared:
+                prototypes.append(match.group(1) + ';')
+
+    out = ['#include <Arduino.h>']
+    for index, (path, lines) in enumerate(sources):
+        out.append('#line 1 "%s"' % path)
+        for number, line in enumerate(lines):
+            if first_definition == (index, number):
+                out.extend(prototypes)
+                out.append('#line %d "%s"' % (number + 1, path))
+            out.append(line)
+
+    with open(output, 'w') as cpp:
+        cpp.write('\n'.join(out) + '\n')
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,214 @@
+/* LED animations (led_animation.ino) : keyframes, fades and repeats, played from the LED timer interrupt */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "bench.h"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+static const double REFRESH_PERIOD_MS = LED_COUNT * ((1 << LED_PWM_BITS) - 1) * LED_PWM_UNIT / 1000.0;
+
+static void uploadAnimation(const uint32_t *keyframes, uint8_t length)
+{
+  addAnimationKeyframe(-1);
+  for (uint8_t i = 0; i < length; i++)
+    addAnimationKeyframe(keyframes[i]);
+}
+
+/* Frames played until the animation stops (the call which stops it doesn't change the values), at most maxFrames */
+static int playFrames(volatile uint8_t *values, int maxFrames)
+{
+  int frames = 0;
+  while (isAnimationPlaying() && frames < maxFrames)
+  {
+    nextAnimationFrame(values);
+    frames += isAnimationPlaying();
+  }
+  return frames;
+}
+
+TEST(fade_reaches_the_keyframe_values)
+{
+  const uint32_t keyframes[] = {
+    API::encodeKeyframe(0xF0000F, 7, true),
+    API::encodeKeyframe(0x3000F0, 5, true)
+  };
+  uploadAnimation(keyframes, 2);
+  volatile uint8_t values[LED_COUNT] = {0, 0, 0, 0, 0, 200};
+  playAnimation(API::ANIMATION_CUSTOM, 1);
+
+  uint8_t previous[LED_COUNT] = {0, 0, 0, 0, 0, 200};
+  for (int frame = 1; frame <= 7; frame++)
+  {
+    nextAnimationFrame(values);
+    CHECK(values[0] > previous[0]); // Up to 255
+    CHECK(values[5] > previous[5]);
+    CHECK_EQUAL(0, values[1]);
+    CHECK_NEAR(255 * frame / 7.0, values[0], 1);
+    for (uint8_t i = 0; i < LED_COUNT; i++)
+      previous[i] = values[i];
+  }
+  CHECK_EQUAL(255, values[0]);
+  CHECK_EQUAL(255, values[5]);
+
+  for (int frame = 1; frame <= 5; frame++)
+  {
+    nextAnimationFrame(values);
+    CHECK(values[0] < previous[0]); // Down to 0
+    CHECK(values[1] > previous[1]);
+    for (uint8_t i = 0; i < LED_COUNT; i++)
+      previous[i] = values[i];
+  }
+  CHECK_EQUAL(0, values[0]);
+  CHECK_EQUAL(255, values[1]);
+  CHECK_EQUAL(3 * 17, values[5]);
+
+  nextAnimationFrame(values);
+  CHECK(!isAnimationPlaying());
+  CHECK_EQUAL(API::ANIMATION_STOP, getAnimation());
+}
+
+TEST(jump_sets_the_values_for_the_whole_keyframe)
+{
+  const uint32_t keyframes[] = {API::encodeKeyframe(0x00F0F0, 3, false), API::encodeKeyframe(0x000000, 0, false)};
+  uploadAnimation(keyframes, 2);
+  volatile uint8_t values[LED_COUNT] = {};
+  playAnimation(API::ANIMATION_CUSTOM, 1);
+
+  for (int frame = 0; frame < 3; frame++)
+  {
+    nextAnimationFrame(values);
+    CHECK_EQUAL(255, values[1]);
+    CHECK_EQUAL(255, values[3]);
+    CHECK_EQUAL(0, values[0]);
+  }
+  nextAnimationFrame(values); // 0 : one frame
+  CHECK_EQUAL(0, values[1]);
+  CHECK_EQUAL(0, playFrames(values, 100)); // Over
+  CHECK(!isAnimationPlaying());
+}
+
+TEST(animations_are_repeated)
+{
+  volatile uint8_t values[LED_COUNT] = {};
+  const int blinkFrames = 2 * 42;
+
+  playAnimation(API::ANIMATION_BLINK, 1);
+  CHECK_EQUAL(blinkFrames, playFrames(values, 1000));
+
+  playAnimation(API::ANIMATION_BLINK, 3);
+  CHECK_EQUAL(3 * blinkFrames, playFrames(values, 1000));
+
+  playAnimation(API::ANIMATION_BREATHE, 0); // Forever
+  CHECK_EQUAL(1000, playFrames(values, 1000));
+  CHECK_EQUAL(API::ANIMATION_BREATHE, getAnimation());
+  stopAnimation();
+  CHECK(!isAnimationPlaying());
+}
+
+TEST(custom_animation_is_bounded)
+{
+  for (int i = 0; i < API::ANIMATION_MAX_KEYFRAMES + 4; i++)
+    addAnimationKeyframe(API::encodeKeyframe(i, 1, false));
+  CHECK_EQUAL(API::ANIMATION_MAX_KEYFRAMES, _customAnimationLength);
+
+  playAnimation(API::ANIMATION_CUSTOM, 0);
+  addAnimationKeyframe(-1); // Changed while playing : stopped
+  CHECK(!isAnimationPlaying());
+  CHECK_EQUAL(0, _customAnimationLength);
+
+  playAnimation(API::ANIMATION_CUSTOM, 1); // Empty
+  CHECK(!isAnimationPlaying());
+  playAnimation(API::ANIMATION_CUSTOM + 1, 1); // Unknown
+  CHECK(!isAnimationPlaying());
+}
+
+TEST(animation_is_played_by_the_led_interrupt)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+
+    sendCommand(API::ADD_ANIMATION_KEYFRAME, -1);
+    sendCommand(API::ADD_ANIMATION_KEYFRAME, API::encodeKeyframe(0x00000F, 40, true));
+    sendCommand(API::ADD_ANIMATION_KEYFRAME, API::encodeKeyframe(0xF00000, 40, false));
+    sendCommand(API::PLAY_ANIMATION, API::ANIMATION_CUSTOM + 10 * 2);
+    CHECK(runUntil([]() { return isAnimationPlaying(); }, 100));
+    unsigned long start = millis();
+
+    // The main loop keeps running
+    CHECK_EQUAL(API::API_VERSION, query(API::GET_API_VERSION));
+    CHECK(runUntil([]() { return !isAnimationPlaying(); }, 5000));
+    CHECK_NEAR(2 * 80 * REFRESH_PERIOD_MS, millis() - start, 3 * REFRESH_PERIOD_MS);
+    CHECK_EQUAL(255, _ledValues[5]);
+    CHECK_EQUAL(0, _ledValues[0]);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(built_in_animations_frame_dump)
+{
+  // Rendered from the LEDs off, one line per refresh period : the 6 LED values
+  const uint8_t animations[] = {API::ANIMATION_SWEEP_UP, API::ANIMATION_SWEEP_DOWN, API::ANIMATION_CHASE,
+                                API::ANIMATION_BLINK, API::ANIMATION_BREATHE};
+  const char *names[] = {"SWEEP_UP", "SWEEP_DOWN", "CHASE", "BLINK", "BREATHE"};
+  char fileName[32];
+  snprintf(fileName, sizeof(fileName), "led_animation_frames_v%d.txt", HW_REVISION);
+  FILE *dump = fopen(fileName, "w");
+  CHECK(dump != NULL);
+
+  for (uint8_t a = 0; a < sizeof(animations); a++)
+  {
+    volatile uint8_t values[LED_COUNT] = {};
+    playAnimation(animations[a], 1);
+    unsigned int expected = 0;
+    for (uint8_t i = 0; i < _animationLength; i++)
+      expected += (_animation[i] >> API::KEYFRAME_DURATION_SHIFT) & API::KEYFRAME_MAX_DURATION;
+
+    unsigned int frames = 0;
+    while (isAnimationPlaying() && frames <= expected)
+    {
+      nextAnimationFrame(values);
+      if (!isAnimationPlaying())
+        break;
+      frames++;
+      if (dump != NULL)
+        fprintf(dump, "%-10s %3u : %3d %3d %3d %3d %3d %3d\n", names[a], frames, values[0], values[1], values[2],
+                values[3], values[4], values[5]);
+    }
+    CHECK_EQUAL(expected, frames);
+    printf("%-10s : %3u frames, %4.0f ms\n", names[a], frames, frames * REFRESH_PERIOD_MS);
+  }
+
+  if (dump != NULL)
+    fclose(dump);
+  printf("Frames written to %s\n", fileName);
+}
+
+TEST(refresh_interrupt_budget)
+{
+  // The animation frame is computed by the LED interrupt starting the longest modulation period : it must end before
+  // the next interrupt, 32 units later
+  const double budgetUs = LED_PWM_UNIT << (LED_PWM_BITS - 1);
+
+  // Worst case : a new keyframe at each frame, the 6 LEDs fading (one division each)
+  uint32_t keyframes[API::ANIMATION_MAX_KEYFRAMES];
+  for (uint8_t i = 0; i < API::ANIMATION_MAX_KEYFRAMES; i++)
+    keyframes[i] = API::encodeKeyframe(i % 2 ? 0x000000 : 0xFFFFFF, 1, true);
+  uploadAnimation(keyframes, API::ANIMATION_MAX_KEYFRAMES);
+  static volatile uint8_t values[LED_COUNT];
+  playAnimation(API::ANIMATION_CUSTOM, 0);
+  double newKeyframe = benchPerCall([](unsigned long) { nextAnimationFrame(values); return values[0]; }, 100000);
+
+  // Usual case : inside a fade
+  keyframes[0] = API::encodeKeyframe(0xFFFFFF, API::KEYFRAME_MAX_DURATION, true);
+  uploadAnimation(keyframes, 1);
+  playAnimation(API::ANIMATION_CUSTOM, 0);
+  double fade = benchPerCall([](unsigned long) { nextAnimationFrame(values); return values[0]; }, 100000);
+  stopAnimation();
+
+  printf("Animation frame : new keyframe %.1f, fade %.1f %s per refresh period (budget %.0fus, every %.1fms)\n",
+         newKeyframe, fade, BENCH_UNIT, budgetUs, REFRESH_PERIOD_MS);
+}
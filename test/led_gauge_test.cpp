@@ -0,0 +1,171 @@
+/* LED gauge (led_gauge.ino) : GPIO masks of the charlieplexed LEDs written by the LED timer interrupt, duty cycles */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+// Board wiring : LED_PINS indexes (high, low) of each physical LED
+static const uint8_t CHARLIEPLEX[LED_COUNT][2] = {{0, 1}, {1, 0}, {1, 2}, {2, 1}, {2, 3}, {3, 2}};
+
+static uint64_t totalLedOnTime()
+{
+  uint64_t total = 0;
+  for (uint8_t high = 0; high < 16; high++)
+    for (uint8_t low = 0; low < 16; low++)
+      total += sim::ledOnTime(high, low);
+  return total;
+}
+
+/* Start the board, without the battery level display for CUSTOM_LED_DISPLAY_TIME_MS */
+static void startWithLeds(long setLedsArg)
+{
+  startBoard();
+  runFor(1000);
+  sendCommand(API::SET_LEDS, setLedsArg);
+  runFor(100);
+  sim::resetLedOnTimes();
+}
+
+TEST(masks_drive_two_led_pins)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    for (uint8_t i = 0; i < LED_COUNT; i++)
+    {
+      // Two general purpose outputs, among the LED pins
+      CHECK_EQUAL(0, _ledModer[i] & ~_ledModerMask);
+      CHECK_EQUAL(2, __builtin_popcount(_ledModer[i]));
+      CHECK_EQUAL(0, _ledModer[i] & 0xAAAAAAAA);
+
+      // One pin set, the other one reset, both outputs
+      uint32_t set = _ledBsrr[i] & 0xFFFF, reset = _ledBsrr[i] >> 16;
+      CHECK_EQUAL(1, __builtin_popcount(set));
+      CHECK_EQUAL(1, __builtin_popcount(reset));
+      CHECK(set != reset);
+      CHECK_EQUAL(_ledModer[i], (1UL << (2 * __builtin_ctz(set))) | (1UL << (2 * __builtin_ctz(reset))));
+    }
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(each_led_lights_its_pin_pair)
+{
+  for (uint8_t i = 0; i < LED_COUNT; i++)
+  {
+    wireBoard();
+    sim::BootResult result = sim::boot([i]() {
+      long arg = LED_API_MAX_VAL;
+      for (uint8_t j = 0; j < i; j++)
+        arg *= 10;
+      startWithLeds(arg);
+      runFor(600);
+
+      // Full brightness : lit during its whole slot, one slot out of LED_COUNT
+      uint8_t phyIndex = LED_ORDERING[i];
+      uint8_t high = LED_PINS[CHARLIEPLEX[phyIndex][0]], low = LED_PINS[CHARLIEPLEX[phyIndex][1]];
+      CHECK_NEAR(600000 / LED_COUNT, sim::ledOnTime(high, low), 600000 / LED_COUNT / 20);
+      CHECK_EQUAL(sim::ledOnTime(high, low), totalLedOnTime());
+    });
+    CHECK_EQUAL(sim::BOOT_RETURNED, result);
+  }
+}
+
+TEST(interrupt_only_changes_the_led_pins)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startWithLeds(444444);
+    uint32_t moder = GPIOA->MODER & ~_ledModerMask;
+    uint32_t odr = GPIOA->ODR & ~_ledModerMask;
+    unsigned long interrupts = sim::ledInterruptCount();
+
+    runFor(500);
+    CHECK(sim::ledInterruptCount() - interrupts > 1000);
+    CHECK(totalLedOnTime() > 400000);
+    CHECK_EQUAL(moder, GPIOA->MODER & ~_ledModerMask);
+    CHECK_EQUAL(odr, GPIOA->ODR & ~_ledModerMask);
+    CHECK_EQUAL(HIGH, sim::pinOutput(POWER_ENABLE_PIN));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(leds_off_release_the_pins)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startWithLeds(0);
+    runFor(500);
+    CHECK_EQUAL(0, totalLedOnTime());
+    for (uint8_t i = 0; i < LED_PINS_COUNT; i++)
+      CHECK(sim::pinFloating(LED_PINS[i]));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(duty_cycle_follows_the_gamma_curve)
+{
+  const uint8_t VALUES[] = {1, 8, 32, 64, 128, 200, 255};
+  for (uint8_t value : VALUES)
+  {
+    wireBoard();
+    sim::BootResult result = sim::boot([value]() {
+      startWithLeds(0);
+      const uint8_t frame[API::LED_FRAME_SIZE] = {value, 0, 0, 0, 0, 0};
+      sendFrame(API::SET_LED_FRAME, frame, sizeof(frame));
+      runFor(100);
+      CHECK_EQUAL(value, _ledValues[0]);
+
+      sim::resetLedOnTimes();
+      runFor(1200);
+      uint8_t phyIndex = LED_ORDERING[0];
+      uint8_t high = LED_PINS[CHARLIEPLEX[phyIndex][0]], low = LED_PINS[CHARLIEPLEX[phyIndex][1]];
+      double expected = 1200000.0 * ledGamma(value) / LED_GAMMA_MAX / LED_COUNT; // Dithered : the average duty cycle
+      CHECK_NEAR(expected, sim::ledOnTime(high, low), max(expected / 50, 200.0));
+      CHECK_EQUAL(sim::ledOnTime(high, low), totalLedOnTime());
+    });
+    CHECK_EQUAL(sim::BOOT_RETURNED, result);
+  }
+}
+
+TEST(led_frame_needs_its_payload)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startWithLeds(0);
+    const uint8_t frame[API::LED_FRAME_SIZE + 1] = {255, 255, 255, 255, 255, 255, 255};
+    sendFrame(API::SET_LED_FRAME, frame, API::LED_FRAME_SIZE - 1);
+    sendFrame(API::SET_LED_FRAME, frame, API::LED_FRAME_SIZE + 1);
+    sendCommand(API::SET_LED_FRAME); // Text : no payload
+    runFor(100);
+    for (uint8_t i = 0; i < LED_COUNT; i++)
+      CHECK_EQUAL(0, _ledValues[i]);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(pin_changes_from_the_main_loop_keep_the_led_slots)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startWithLeds(4); // First LED only
+    uint64_t start = sim::now();
+
+    // Pins of the LED port changed by the main context while the LEDs are driven
+    for (int i = 0; sim::now() - start < 1000000; i++)
+    {
+      beginSerial();
+      endSerial();
+    #if HW_REVISION > 1
+      setThermistorPower(i & 1);
+    #endif
+      refreshWatchdog();
+    }
+
+    // Lit during its slot only : not left on during the next ones by a stale MODER value
+    CHECK_NEAR((sim::now() - start) / LED_COUNT, totalLedOnTime(), 2000);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
@@ -0,0 +1,155 @@
+/* Load current statistics (load_stats.ino) : one conversion per sample, 800 samples per second */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+#include <cmath>
+
+typedef KXKM_STM32_Energy API;
+
+/* Current (mA) seen by the firmware for a given current : the ADC quantization */
+static unsigned int measuredCurrent(unsigned int current)
+{
+  return adcToLoadCurrent(loadCurrentReading(current)) >> CURRENT_MEAS_DECIMAL_PART;
+}
+
+/* RMS current (mA) of the bursts : burstSamples out of 8 at high, the others at low (ADC readings) */
+static double burstRmsCurrent(uint16_t high, uint16_t low, int burstSamples)
+{
+  double offset = (double)_adcCalibration.currentOffset / (1 << CALIBRATION_FRAC_BITS);
+  double highReading = high - offset, lowReading = low - offset;
+  double rms = sqrt((burstSamples * highReading * highReading + (8 - burstSamples) * lowReading * lowReading) / 8);
+  return rms * CURRENT_MEAS_MULTIPLIER1 * CURRENT_MEAS_MULTIPLIER2 / CURRENT_MEAS_DIVIDER * CALIBRATION_GAIN_ONE
+         / _adcCalibration.currentGain;
+}
+
+static bool readLoadStats(API::LoadStats &stats)
+{
+  sendFrame(API::GET_LOAD_STATS);
+  Frame frame;
+  if (!readFrame(frame) || frame.len != API::LOAD_STATS_SIZE)
+    return false;
+  API::decodeLoadStats(frame.payload, stats);
+  return true;
+}
+
+TEST(bursty_load_statistics)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+
+    // 2A bursts of 2.5ms every 10ms over 200mA : 2 samples out of 8 at 2A, whatever the scan phase
+    uint16_t high = loadCurrentReading(2000), low = loadCurrentReading(200);
+    sim::setAnalogInput(LOAD_CURRENT_SENSE_PIN, [high, low]() { return sim::now() % 10000 < 2500 ? high : low; });
+    runFor(2 * LOAD_STATS_DEFAULT_WINDOW_MS + 100);
+
+    API::LoadStats stats;
+    CHECK(readLoadStats(stats));
+    CHECK_EQUAL(measuredCurrent(2000), stats.peakCurrent);
+    CHECK_EQUAL(measuredCurrent(200), stats.minCurrent);
+    // Computed in ADC units, then converted
+    unsigned long mean = (2 * high + 6 * low) / 8;
+    CHECK_EQUAL(adcToLoadCurrent(mean) >> CURRENT_MEAS_DECIMAL_PART, stats.meanCurrent);
+    CHECK_NEAR(burstRmsCurrent(high, low, 2), stats.rmsCurrent, 2);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(rms_current_is_offset_corrected)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+
+    // Same bursts : the offset is subtracted from each sample, not from the RMS of the raw samples
+    uint16_t high = loadCurrentReading(2000), low = loadCurrentReading(200);
+    _adcCalibration.currentOffset = (long)(low / 2) << CALIBRATION_FRAC_BITS;
+    applyAdcCalibration();
+    sim::setAnalogInput(LOAD_CURRENT_SENSE_PIN, [high, low]() { return sim::now() % 10000 < 2500 ? high : low; });
+    runFor(2 * LOAD_STATS_DEFAULT_WINDOW_MS + 100);
+
+    API::LoadStats stats;
+    CHECK(readLoadStats(stats));
+    CHECK_NEAR(burstRmsCurrent(high, low, 2), stats.rmsCurrent, 2);
+    CHECK(stats.rmsCurrent > stats.meanCurrent);
+
+    // Constant current : the RMS is the mean
+    sim::setAnalogInput(LOAD_CURRENT_SENSE_PIN, [low]() { return low; });
+    runFor(2 * LOAD_STATS_DEFAULT_WINDOW_MS + 100);
+    CHECK(readLoadStats(stats));
+    CHECK_NEAR(stats.meanCurrent, stats.rmsCurrent, 1);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(burst_shorter_than_the_sample_period_can_be_missed)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+
+    // 0.5ms bursts between two scans : documented limitation, there is no oversampling
+    static uint64_t lastScan;
+    uint16_t high = loadCurrentReading(3000), low = loadCurrentReading(200);
+    sim::setAnalogInput(LOAD_CURRENT_SENSE_PIN, [low]() {
+      lastScan = sim::now();
+      return low;
+    });
+    runFor(10);
+    uint64_t phase = lastScan % ADC_SAMPLE_PERIOD_US;
+    sim::setAnalogInput(LOAD_CURRENT_SENSE_PIN, [high, low, phase]() {
+      uint64_t position = (sim::now() + ADC_SAMPLE_PERIOD_US - phase) % ADC_SAMPLE_PERIOD_US;
+      return (position > 400 && position < 900) ? high : low; // Never true at the scan times
+    });
+    runFor(2 * LOAD_STATS_DEFAULT_WINDOW_MS + 100);
+
+    API::LoadStats stats;
+    CHECK(readLoadStats(stats));
+    CHECK_EQUAL(measuredCurrent(200), stats.peakCurrent);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(window_length_is_applied)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    sendValueFrame(API::SET_LOAD_STATS_WINDOW, 100);
+    runFor(50);
+    CHECK_EQUAL(100 * 1000 / ADC_SAMPLE_PERIOD_US, _loadStatsWindowSamples);
+
+    // A 2A step is in the statistics after one short window, not after the default one
+    setLoadCurrent(2000);
+    runFor(2 * 100 + 10);
+    API::LoadStats stats;
+    CHECK(readLoadStats(stats));
+    CHECK_EQUAL(measuredCurrent(2000), stats.minCurrent);
+
+    sendValueFrame(API::SET_LOAD_STATS_WINDOW, 1);
+    runFor(50);
+    CHECK_EQUAL(LOAD_STATS_MIN_WINDOW_MS * 1000 / ADC_SAMPLE_PERIOD_US, _loadStatsWindowSamples);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(delivered_charge_and_energy)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    setLoadCurrent(1000);
+    runFor(100);
+    sendFrame(API::RESET_ENERGY_COUNTERS);
+
+    runFor(36000); // 10mAh at 1A
+    API::LoadStats stats;
+    CHECK(readLoadStats(stats));
+    double charge = measuredCurrent(1000) * 36000.0 / 3600000;
+    CHECK_NEAR(charge, stats.charge, 1);
+    CHECK_NEAR(charge * 15.6, stats.energy, 2);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
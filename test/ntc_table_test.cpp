@@ -0,0 +1,82 @@
+/* Thermistor conversion (ntc_table.h) : compile time table, against the Beta equation in floating point */
+
+#include <Arduino.h>
+#include "ntc_table.h"
+#include "bench.h"
+#include "test.h"
+
+#include <cmath>
+
+// Evaluated by the compiler : 10k thermistor and 10k pull-up, half of the range at 25°C
+static_assert(ntcTemperature(2048) == 250, "Beta equation at the nominal temperature");
+static_assert(ntcTemperature(0) == ntcTemperature(1) && ntcTemperature(4095) == ntcTemperature(4094), "Ends of the range");
+
+/* Beta equation, 0.1°C */
+static double betaTemperature(unsigned int adcRead)
+{
+  double resistance = NTC_PULLUP_RESISTANCE * adcRead / (4095 - adcRead);
+  return 10 * (1 / (std::log(resistance / NTC_NOMINAL_RESISTANCE) / NTC_BETA + 1 / NTC_NOMINAL_TEMPERATURE) - 273.15);
+}
+
+TEST(compile_time_logarithm_matches_the_library)
+{
+  for (double x = 0.01; x < 100; x *= 1.07)
+    CHECK_NEAR(std::log(x), ntcLog(x), 1e-9);
+}
+
+TEST(table_matches_the_beta_equation)
+{
+  double worstError = 0, worstErrorBelow100 = 0;
+  for (unsigned int adc = 1; adc < 4095; adc++)
+  {
+    double expected = betaTemperature(adc);
+    if (expected < NTC_MIN_TEMPERATURE || expected > NTC_MAX_TEMPERATURE)
+      continue;
+
+    double error = std::fabs(adcToTemperature(adc) - expected);
+    worstError = std::max(worstError, error);
+    if (expected < 1000)
+      worstErrorBelow100 = std::max(worstErrorBelow100, error);
+  }
+
+  // Documented in ntc_table.h : 0.2°C, 0.13°C under 100°C (rounding to 0.1°C included)
+  CHECK(worstError <= 2.0);
+  CHECK(worstErrorBelow100 <= 1.3);
+  printf("Worst error : %.2f, under 100°C : %.2f (0.1°C)\n", worstError, worstErrorBelow100);
+}
+
+TEST(table_entries_are_the_beta_equation)
+{
+  for (unsigned int i = 0; i < NTC_TABLE_SIZE; i++)
+  {
+    unsigned int adc = min(max(i * NTC_TABLE_STEP, 1u), 4094u);
+    CHECK_NEAR(betaTemperature(adc), NtcTemperatureTable::values[i], 0.5);
+  }
+}
+
+TEST(temperature_falls_with_the_reading_and_is_clamped)
+{
+  // Colder : higher thermistor resistance, higher reading
+  for (unsigned int adc = 1; adc < 4096; adc++)
+    CHECK(adcToTemperature(adc) <= adcToTemperature(adc - 1));
+
+  CHECK_EQUAL(NTC_MAX_TEMPERATURE, adcToTemperature(0));
+  CHECK_EQUAL(NTC_MIN_TEMPERATURE, adcToTemperature(4095));
+  CHECK_EQUAL(NTC_MIN_TEMPERATURE, adcToTemperature(5000)); // Out of range reading
+}
+
+/* The removed convertAnalogToTemperature() (AdcToTemperature.h), in 0.1°C */
+static int floatPathTemperature(unsigned int adcRead)
+{
+  if (adcRead == 4095)
+    return 10000;
+  return 10 * ((1 / ((log(((10000.0 * adcRead) / (4095.0 - adcRead)) / 10000.0) / 3380.0) + (1 / (273.15 + 25.000))))
+               - 273.15);
+}
+
+TEST(table_benchmark)
+{
+  double table = benchPerCall([](unsigned long i) { return adcToTemperature(1 + i % 4094); }, 100000);
+  double floatPath = benchPerCall([](unsigned long i) { return floatPathTemperature(1 + i % 4094); }, 100000);
+  printf("Temperature conversion : table %.1f, log() %.1f %s per call\n", table, floatPath, BENCH_UNIT);
+}
@@ -0,0 +1,26 @@
+/* STM32 supply current model : average current from the share of time spent in Run, Sleep and Stop modes.
+ *
+ * The mode currents are assumptions of the order of the STM32F030 datasheet typical values at 48MHz, with the
+ * peripherals used by the firmware running : they were not measured on the board, replace them once they are.
+ * The ESP32, the LEDs, the regulator and the load are not included.
+ */
+
+#ifndef TEST_POWER_MODEL_H
+#define TEST_POWER_MODEL_H
+
+struct ModeCurrents {
+  double runMa;
+  double sleepMa; // CPU clock stopped : ADC sampling, timers, DMA and UART running
+  double stopUa; // Low power regulator, RTC and watchdog on the LSI
+};
+
+const ModeCurrents STM32_MODE_CURRENTS = {12.0, 4.0, 5.0};
+
+/* Average current (mA) from the sleep and stop ratios (1/1000), e.g. GET_SLEEP_RATIO. The rest of the time is run. */
+inline double averageCurrentMa(double sleepRatio, double stopRatio, const ModeCurrents &currents = STM32_MODE_CURRENTS)
+{
+  double runRatio = 1000 - sleepRatio - stopRatio;
+  return (runRatio * currents.runMa + sleepRatio * currents.sleepMa + stopRatio * currents.stopUa / 1000) / 1000;
+}
+
+#endif
@@ -0,0 +1,223 @@
+/* Profile storage (profile_storage.ino) : log in two alternating flash pages, power loss at each flash operation */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+static const unsigned int USER_BREAKS[KXKM_STM32_Energy::USER_PROFILE_SLOTS][7] = {
+  {10500, 11000, 11300, 11600, 11900, 12200, 12600},
+  {12800, 14200, 14600, 15000, 15400, 15800, 16800},
+  {20000, 21000, 21500, 22000, 22500, 23000, 24000},
+  {6000, 0, 6400, 0, 0, 7000, 7200}
+};
+static const unsigned int NEW_BREAKS[7] = {13000, 14000, 14500, 15000, 15500, 16000, 17000};
+static const AdcCalibration CALIBRATION = {1200 << CALIBRATION_FRAC_BITS, 35, CALIBRATION_GAIN_ONE + 100, 20, -3, 0, 2000};
+
+static uint32_t boardId()
+{
+  return *(volatile uint32_t*)&BOARD_ID;
+}
+
+/* Power up and keep the board powered, as setup() does, then find the current page */
+static void startStorage()
+{
+  sim::pressButton();
+  set3V3RegState(true);
+  pinMode(POWER_ENABLE_PIN, OUTPUT);
+  sim::releaseButton();
+  initProfileStorage();
+}
+
+/* Known records, then last pack changes until the current page is full */
+static void fillStorage()
+{
+  for (uint8_t slot = 0; slot < KXKM_STM32_Energy::USER_PROFILE_SLOTS; slot++)
+    CHECK(storeUserProfile(slot, USER_BREAKS[slot]));
+  storeProfileSelection(KXKM_STM32_Energy::PROFILE_USER_0 + 2, 0);
+  CHECK(storeAdcCalibration(CALIBRATION));
+
+  for (uint8_t i = 0; getProfileStorageState() > 0; i++)
+    storeLastPackCells(KXKM_STM32_Energy::PROFILE_LIPO, 4 + (i & 1));
+  storeLastPackCells(KXKM_STM32_Energy::PROFILE_LIFE, 3);
+}
+
+/* All the records of fillStorage(), user profile 0 being either the old or the new one */
+static void checkRecords(bool allowNewBreaks)
+{
+  unsigned int breaks[7];
+  for (uint8_t slot = 0; slot < KXKM_STM32_Energy::USER_PROFILE_SLOTS; slot++)
+  {
+    CHECK(loadUserProfile(slot, breaks));
+    bool expected = memcmp(breaks, USER_BREAKS[slot], sizeof(breaks)) == 0 ||
+                    (slot == 0 && allowNewBreaks && memcmp(breaks, NEW_BREAKS, sizeof(breaks)) == 0);
+    CHECK(expected);
+  }
+
+  uint8_t profile, cells;
+  CHECK(loadProfileSelection(profile, cells));
+  CHECK_EQUAL(KXKM_STM32_Energy::PROFILE_USER_0 + 2, profile);
+
+  AdcCalibration calibration;
+  CHECK(loadAdcCalibration(calibration));
+  CHECK(memcmp(&calibration, &CALIBRATION, sizeof(calibration)) == 0);
+
+  CHECK_EQUAL(3, loadLastPackCells(KXKM_STM32_Energy::PROFILE_LIFE));
+  CHECK(loadLastPackCells(KXKM_STM32_Energy::PROFILE_LIPO) == 4 || loadLastPackCells(KXKM_STM32_Energy::PROFILE_LIPO) == 5);
+  CHECK_EQUAL(1, boardId());
+}
+
+TEST(records_are_kept_across_power_cycles)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startStorage();
+    CHECK_EQUAL(PROFILE_RECORDS_COUNT - 1, getProfileStorageState());
+    AdcCalibration calibration;
+    CHECK(!loadAdcCalibration(calibration));
+
+    CHECK(storeUserProfile(1, USER_BREAKS[1]));
+    CHECK(storeAdcCalibration(CALIBRATION));
+    CHECK_EQUAL(PROFILE_RECORDS_COUNT - 3, getProfileStorageState()); // Header and two records
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+  result = sim::boot([]() {
+    startStorage();
+    CHECK_EQUAL(PROFILE_RECORDS_COUNT - 3, getProfileStorageState());
+    unsigned int breaks[7];
+    CHECK(loadUserProfile(1, breaks));
+    CHECK(memcmp(breaks, USER_BREAKS[1], sizeof(breaks)) == 0);
+    CHECK(!loadUserProfile(0, breaks));
+
+    // The same record again is not written
+    unsigned long operations = sim::flashOperations();
+    CHECK(storeUserProfile(1, USER_BREAKS[1]));
+    CHECK_EQUAL(operations, sim::flashOperations());
+    CHECK_EQUAL(1, boardId());
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(full_page_switches_to_the_other_page)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startStorage();
+    fillStorage();
+    CHECK_EQUAL(1, _profilePage); // Started in the lower page, full : now in the board ID page
+    checkRecords(false);
+
+    for (uint8_t i = 0; i < 2 * PROFILE_RECORDS_COUNT; i++)
+      storeLastPackCells(KXKM_STM32_Energy::PROFILE_LIFE, 3 + (i & 1));
+    storeLastPackCells(KXKM_STM32_Energy::PROFILE_LIFE, 3);
+    CHECK_EQUAL(0, sim::flashErrors());
+    CHECK(_profileSequence >= 4);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+  result = sim::boot([]() {
+    startStorage();
+    CHECK(_profileSequence >= 4);
+    checkRecords(false);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+/* Records of fillStorage(), the given page being the current one and full : the next write switches the page */
+static void prepareFullPage(uint8_t page)
+{
+  sim::resetFlash();
+  sim::BootResult result = sim::boot([page]() {
+    startStorage();
+    fillStorage();
+    for (uint8_t i = 0; _profilePage != page || getProfileStorageState() > 0; i++)
+      storeLastPackCells(KXKM_STM32_Energy::PROFILE_LIPO, 4 + (i & 1));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+/* Interrupt the write which switches to the other page at each of its flash operations */
+static void checkPowerLossDuringPageSwitch(uint8_t page)
+{
+  bool completed = false;
+  for (unsigned long operations = 1; !completed && operations < 500; operations++)
+  {
+    prepareFullPage(page);
+    sim::powerLossAfterFlashOperations(operations);
+    sim::BootResult result = sim::boot([]() {
+      startStorage();
+      CHECK(storeUserProfile(0, NEW_BREAKS));
+    });
+    sim::powerLossAfterFlashOperations(0);
+    completed = (result == sim::BOOT_RETURNED);
+    if (!completed)
+      CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+
+    // Either set of records, and the storage still works
+    result = sim::boot([completed]() {
+      startStorage();
+      checkRecords(true);
+      unsigned int breaks[7];
+      if (completed)
+        CHECK(loadUserProfile(0, breaks) && memcmp(breaks, NEW_BREAKS, sizeof(breaks)) == 0);
+
+      CHECK(storeUserProfile(3, NEW_BREAKS));
+      CHECK(loadUserProfile(3, breaks) && memcmp(breaks, NEW_BREAKS, sizeof(breaks)) == 0);
+      CHECK_EQUAL(0, sim::flashErrors());
+    });
+    CHECK_EQUAL(sim::BOOT_RETURNED, result);
+
+    if (completed)
+      CHECK(operations > 50); // The records were copied
+  }
+  CHECK(completed);
+}
+
+TEST(power_loss_while_switching_to_the_board_id_page)
+{
+  wireBoard();
+  checkPowerLossDuringPageSwitch(0);
+}
+
+TEST(power_loss_while_switching_to_the_lower_page)
+{
+  wireBoard();
+  checkPowerLossDuringPageSwitch(1);
+}
+
+TEST(board_id_is_restored_after_a_power_loss)
+{
+  wireBoard();
+  prepareFullPage(0);
+  sim::powerLossAfterFlashOperations(2); // Board ID page erased, board ID not written back
+  sim::BootResult result = sim::boot([]() {
+    startStorage();
+    storeUserProfile(0, NEW_BREAKS);
+  });
+  sim::powerLossAfterFlashOperations(0);
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+
+  result = sim::boot([]() {
+    CHECK_EQUAL(0xFFFFFFFF, boardId());
+    startStorage();
+    CHECK_EQUAL(1, boardId());
+    checkRecords(false);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(storage_state_is_reported)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK(getProfileStorageState() > 0);
+    CHECK_EQUAL(getProfileStorageState(), query(API::GET_STORAGE_STATE));
+
+    storeUserProfile(0, NEW_BREAKS);
+    CHECK_EQUAL(PROFILE_RECORDS_COUNT - _profileRecordsUsed, query(API::GET_STORAGE_STATE));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
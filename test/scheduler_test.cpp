@@ -0,0 +1,159 @@
+/* Cooperative scheduler (scheduler.ino) : task periods, deadline misses and run times (GET_TASK_STATS) */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+static long taskStats(uint8_t task)
+{
+  sim::esp32.readAll();
+  sendCommand(API::GET_TASK_STATS, task);
+  return readAnswer();
+}
+
+TEST(tasks_run_at_their_period)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(100);
+
+    // A task is run when its due time moves forward
+    unsigned long dueTimes[TASKS_COUNT];
+    int runs[TASKS_COUNT] = {};
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+      dueTimes[i] = _taskDueTime[i];
+
+    unsigned long start = millis();
+    while (millis() - start < 1000)
+    {
+      loop();
+      for (uint8_t i = 0; i < TASKS_COUNT; i++)
+      {
+        if (_taskDueTime[i] != dueTimes[i])
+        {
+          CHECK_EQUAL(dueTimes[i] + TASKS[i].period, _taskDueTime[i]); // Never late by a period
+          dueTimes[i] = _taskDueTime[i];
+          runs[i]++;
+        }
+      }
+    }
+
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+      CHECK_NEAR(1000 / TASKS[i].period, runs[i], 1);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(stats_are_reported_then_reset)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+      taskStats(i);
+
+    runFor(1000);
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+    {
+      long stats = taskStats(i);
+      CHECK_EQUAL(0, stats & 0xFFFF); // No miss
+      CHECK((stats >> 16) < TASKS[i].deadline * 1000L);
+    }
+    CHECK((taskStats(API::TASK_BATTERY_MONITORING) >> 16) > 0); // Register reads take time in the simulation
+    CHECK_EQUAL(0, taskStats(TASKS_COUNT));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(late_tasks_are_counted_and_rescheduled)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+      taskStats(i);
+
+    // The main loop blocked for 30ms : the tasks run once, one period later
+    delay(30);
+    loop();
+    unsigned long now = millis();
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+      CHECK((long)(_taskDueTime[i] - now) > 0);
+
+    // Misses of the tasks with a deadline below 30ms
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+      CHECK_EQUAL(TASKS[i].deadline < 30 ? 1 : 0, taskStats(i) & 0xFFFF);
+    CHECK_EQUAL(0, taskStats(API::TASK_SERIAL) & 0xFFFF); // Reset by the previous request
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+static long taskUtilization(uint8_t task)
+{
+  return taskStats(task | API::TASK_UTILIZATION);
+}
+
+TEST(utilization_is_the_run_time_ratio)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    sim::setTaskCost(API::TASK_STATE, 2000); // 2ms every 10ms
+    startBoard();
+    runFor(1000);
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+      taskUtilization(i);
+
+    runFor(2000);
+    long utilization = taskUtilization(API::TASK_STATE);
+    printf("State task utilization : %ld / 1000\n", utilization);
+    CHECK_NEAR(200, utilization, 10);
+    CHECK(taskUtilization(API::TASK_WATCHDOG) < 10);
+    CHECK_EQUAL(0, taskStats(API::TASK_STATE) & 0xFFFF); // Within its deadline
+    CHECK_EQUAL(0, taskUtilization(TASKS_COUNT));
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(task_over_its_deadline_misses_each_run)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+    {
+      taskStats(i);
+      taskUtilization(i);
+    }
+
+    // 25ms over a 20ms deadline : rescheduled one period after each run, every 35ms
+    sim::setTaskCost(API::TASK_STATE, 25000);
+    unsigned long runs = 0, dueTime = _taskDueTime[API::TASK_STATE];
+    unsigned long start = millis();
+    while (millis() - start < 2000)
+    {
+      loop();
+      if (_taskDueTime[API::TASK_STATE] != dueTime)
+      {
+        dueTime = _taskDueTime[API::TASK_STATE];
+        runs++;
+      }
+    }
+    sim::setTaskCost(API::TASK_STATE, 0);
+
+    long stats = taskStats(API::TASK_STATE);
+    long utilization = taskUtilization(API::TASK_STATE);
+    printf("State task : %lu runs, %ld misses, utilization %ld / 1000\n", runs, stats & 0xFFFF, utilization);
+    CHECK_NEAR(2000 / 35, runs, 2);
+    CHECK_NEAR(runs, stats & 0xFFFF, 1);
+    CHECK_NEAR(25000, stats >> 16, 100);
+    CHECK_NEAR(25 * 1000 / 35, utilization, 20);
+    CHECK((taskStats(API::TASK_BATTERY_MONITORING) & 0xFFFF) > 0); // Delayed by the state task
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
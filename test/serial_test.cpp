@@ -0,0 +1,444 @@
+/* ESP32 API of the STM32 firmware, through the simulated UART */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+/* Boot, run the scenario with the board started, check that the TX line was released between the answers */
+static void runBoard(const std::function<void()> &scenario)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([&scenario]() {
+    startBoard();
+    runFor(100);
+    scenario();
+    CHECK_EQUAL(0, sim::uartTxWhileReleased());
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(binary_request_gets_a_binary_answer)
+{
+  runBoard([]() {
+    sendFrame(API::GET_API_VERSION);
+    Frame frame;
+    CHECK(readFrame(frame));
+    CHECK_EQUAL(API::GET_API_VERSION, frame.cmd);
+    CHECK_EQUAL(API::NO_SEQUENCE, frame.seq);
+    CHECK_EQUAL(API::FRAME_VALUE_SIZE, frame.len);
+    CHECK_EQUAL(API::API_VERSION, frame.value());
+  });
+}
+
+TEST(binary_argument)
+{
+  runBoard([]() {
+    sendValueFrame(API::SET_LOAD_STATS_WINDOW, 2000);
+    sendValueFrame(API::SET_LED_GAUGE, 50);
+    runFor(50);
+    CHECK_EQUAL(2000 * 1000 / ADC_SAMPLE_PERIOD_US, _loadStatsWindowSamples);
+    CHECK(millis() - customLedSetTime < 100);
+  });
+}
+
+TEST(text_and_binary_requests_are_answered_in_their_format)
+{
+  runBoard([]() {
+    sendCommand(API::GET_HW_REVISION);
+    sendFrame(API::GET_HW_REVISION);
+    sendCommand(API::GET_FW_VERSION);
+    runFor(20);
+
+    std::string &bytes = receivedBytes();
+    std::string text = "### " + std::to_string(HW_REVISION) + "\r\n";
+    CHECK_EQUAL(0, bytes.find(text));
+
+    bytes.erase(0, text.size());
+    Frame frame;
+    CHECK(extractFrame(frame));
+    CHECK_EQUAL(API::GET_HW_REVISION, frame.cmd);
+    CHECK_EQUAL(HW_REVISION, frame.value());
+    CHECK(bytes == "### " + std::to_string(FIRMWARE_VERSION) + "\r\n");
+  });
+}
+
+TEST(corrupted_frame_is_ignored)
+{
+  runBoard([]() {
+    uint8_t frame[API::FRAME_MAX_SIZE];
+    uint8_t size = API::encodeFrame(frame, API::GET_API_VERSION, NULL, 0);
+    frame[size - 1] ^= 0x01;
+    sim::esp32.write(frame, size);
+    runFor(50);
+    CHECK(sim::esp32.readAll().empty());
+
+    // The next valid frame is answered
+    sendFrame(API::GET_BOARD_ID);
+    Frame answer;
+    CHECK(readFrame(answer));
+    CHECK_EQUAL(API::GET_BOARD_ID, answer.cmd);
+    CHECK_EQUAL(1, answer.value());
+  });
+}
+
+TEST(oversized_frame_is_dropped)
+{
+  runBoard([]() {
+    const uint8_t header[] = {API::FRAME_SYNC, API::SET_LED_FRAME, API::FRAME_MAX_PAYLOAD + 1};
+    sim::esp32.write(header, sizeof(header));
+    runFor(50);
+
+    sendFrame(API::GET_API_VERSION);
+    Frame answer;
+    CHECK(readFrame(answer));
+    CHECK_EQUAL(API::API_VERSION, answer.value());
+  });
+}
+
+TEST(binary_answer_is_shorter)
+{
+  runBoard([]() {
+    sendCommand(API::GET_BATTERY_VOLTAGE);
+    runFor(20);
+    size_t textSize = receivedBytes().size();
+    receivedBytes().clear();
+
+    sendFrame(API::GET_BATTERY_VOLTAGE);
+    runFor(20);
+    size_t binarySize = receivedBytes().size();
+
+    CHECK_EQUAL(API::FRAME_HEADER_SIZE + API::FRAME_VALUE_SIZE + 1, binarySize);
+    CHECK(binarySize < textSize);
+  });
+}
+
+TEST(telemetry_snapshot_matches_the_single_queries)
+{
+  runBoard([]() {
+    runFor(3000);
+    sim::esp32.readAll();
+    sendCommand(API::GET_TELEMETRY);
+    runFor(20);
+    long values[API::TELEMETRY_FIELDS];
+    std::string text = sim::esp32.readAll();
+    CHECK_EQUAL(0, text.find(API::PREAMBLE));
+    const char *field = text.c_str() + strlen(API::PREAMBLE);
+    for (uint8_t i = 0; i < API::TELEMETRY_FIELDS; i++)
+    {
+      char *end;
+      values[i] = strtol(field, &end, 10);
+      CHECK(end != field);
+      field = end;
+    }
+
+    CHECK_NEAR(query(API::GET_BATTERY_VOLTAGE), values[0], 5);
+    CHECK_NEAR(15600, values[1], 50);
+    CHECK_EQUAL(query(API::GET_BATTERY_PERCENTAGE), values[2]);
+    CHECK_NEAR(query(API::GET_LOAD_CURRENT), values[3], 5);
+    CHECK_EQUAL(query(API::GET_TEMPERATURE), values[4]);
+    CHECK_EQUAL(API::NO_EVENT, values[5]);
+    CHECK_EQUAL(API::STATE_ACTIVE, values[6]);
+    CHECK_NEAR(millis(), values[7], 50);
+
+    sendFrame(API::GET_TELEMETRY);
+    Frame frame;
+    CHECK(readFrame(frame));
+    CHECK_EQUAL(API::TELEMETRY_SIZE, frame.len);
+    API::Telemetry telemetry;
+    API::decodeTelemetry(frame.payload, telemetry);
+    CHECK_EQUAL(values[1], telemetry.avgBatteryVoltage);
+    CHECK_EQUAL(API::STATE_ACTIVE, telemetry.state);
+    CHECK_NEAR(millis(), telemetry.uptime, 50);
+  });
+}
+
+TEST(subscription_pushes_telemetry_and_events)
+{
+  runBoard([]() {
+    runFor(STARTUP_GUARD_TIME_MS);
+    sendValueFrame(API::SUBSCRIBE, 200);
+    runFor(2010);
+
+    int telemetryFrames = 0;
+    Frame frame;
+    while (extractFrame(frame))
+    {
+      CHECK_EQUAL(API::PUSH_TELEMETRY, frame.cmd);
+      telemetryFrames++;
+    }
+    CHECK_EQUAL(10, telemetryFrames);
+
+    // Button click : pushed, not kept for polling
+    sim::pressButton();
+    sim::after(100000, sim::releaseButton);
+    bool clickPushed = false;
+    runUntil([&clickPushed]() {
+      Frame pushed;
+      while (extractFrame(pushed))
+        if (pushed.cmd == API::PUSH_EVENT && pushed.value() == API::PUSH_BUTTON_CLICK)
+          clickPushed = true;
+      return clickPushed;
+    }, 1000);
+    CHECK(clickPushed);
+    CHECK_EQUAL(API::NO_EVENT, buttonEvent);
+
+    // Low battery
+    setBatteryVoltage(14000);
+    bool lowPushed = false;
+    runUntil([&lowPushed]() {
+      Frame pushed;
+      while (extractFrame(pushed))
+        if (pushed.cmd == API::PUSH_EVENT && pushed.value() == API::PUSH_BATTERY_LOW)
+          lowPushed = true;
+      return lowPushed;
+    }, 30000);
+    CHECK(lowPushed);
+
+    sendFrame(API::UNSUBSCRIBE);
+    runFor(20);
+    receivedBytes().clear();
+    runFor(1000);
+    CHECK(receivedBytes().empty());
+  });
+}
+
+TEST(text_subscription_is_ignored)
+{
+  runBoard([]() {
+    sendCommand(API::SUBSCRIBE, 100);
+    runFor(1000);
+    CHECK(!_subscribed);
+    CHECK(receivedBytes().empty());
+  });
+}
+
+TEST(command_split_across_tasks_is_parsed)
+{
+  runBoard([]() {
+    const char request[] = "### V\n";
+    for (const char *c = request; *c; c++)
+    {
+      sim::esp32.write(*c);
+      runFor(PARSER_TIMEOUT_MS / 2);
+    }
+    CHECK_NEAR(15600, readAnswer(), 50);
+  });
+}
+
+TEST(incomplete_command_is_dropped_after_the_timeout)
+{
+  runBoard([]() {
+    sim::esp32.print("### V");
+    runFor(PARSER_TIMEOUT_MS + 5);
+    sim::esp32.print("\n");
+    runFor(50);
+    CHECK(receivedBytes().empty());
+
+    const uint8_t header[] = {API::FRAME_SYNC, API::GET_API_VERSION};
+    sim::esp32.write(header, sizeof(header));
+    runFor(PARSER_TIMEOUT_MS + 5);
+    const uint8_t rest[] = {0, API::frameCrc(API::GET_API_VERSION, NULL, 0)};
+    sim::esp32.write(rest, sizeof(rest));
+    runFor(50);
+    CHECK(receivedBytes().empty());
+
+    CHECK_EQUAL(API::API_VERSION, query(API::GET_API_VERSION));
+  });
+}
+
+TEST(late_task_does_not_drop_the_received_bytes)
+{
+  runBoard([]() {
+    sim::esp32.print("### V");
+    runFor(2);
+    sim::esp32.print("\n");
+    delay(PARSER_TIMEOUT_MS + 10); // The serial task is late : the end of the line waits in the receive buffer
+    CHECK_NEAR(15600, readAnswer(), 50);
+  });
+}
+
+TEST(stray_sync_byte_before_a_text_command)
+{
+  runBoard([]() {
+    const uint8_t noises[][2] = {{API::FRAME_SYNC, 0}, {API::FRAME_SYNC_SEQ, 0}, {API::FRAME_SYNC, 1}};
+    for (uint8_t i = 0; i < 3; i++)
+    {
+      sim::esp32.write(noises[i], noises[i][1] ? 2 : 1); // The preamble is read as the frame header
+      sendCommand(API::GET_API_VERSION);
+      CHECK_EQUAL(API::API_VERSION, readAnswer());
+    }
+  });
+}
+
+TEST(rejected_frame_resyncs_after_its_sync_byte)
+{
+  runBoard([]() {
+    // Truncated header : the next frame is read as its payload, then the CRC doesn't match
+    const uint8_t header[] = {API::FRAME_SYNC, API::SET_LED_FRAME, 4};
+    sim::esp32.write(header, sizeof(header));
+    sendFrame(API::GET_API_VERSION, 1);
+    sendFrame(API::GET_API_VERSION, 2);
+
+    for (int seq = 1; seq <= 2; seq++)
+    {
+      Frame frame;
+      CHECK(readFrame(frame));
+      CHECK_EQUAL(seq, frame.seq);
+      CHECK_EQUAL(API::API_VERSION, frame.value());
+    }
+  });
+}
+
+TEST(garbage_between_commands_is_skipped)
+{
+  runBoard([]() {
+    srand(1234);
+    for (int i = 0; i < 50; i++)
+    {
+      // Noise without any sync byte, then a request
+      for (int n = rand() % 20; n > 0; n--)
+      {
+        uint8_t c = rand();
+        if (c != '#' && c != API::FRAME_SYNC && c != API::FRAME_SYNC_SEQ)
+          sim::esp32.write(c);
+      }
+      if (i % 2)
+        sendCommand(API::GET_API_VERSION);
+      else
+        sendFrame(API::GET_API_VERSION, i);
+
+      if (i % 2)
+        CHECK_EQUAL(API::API_VERSION, readAnswer());
+      else
+      {
+        Frame frame;
+        CHECK(readFrame(frame));
+        CHECK_EQUAL(i, frame.seq);
+        CHECK_EQUAL(API::API_VERSION, frame.value());
+      }
+      receivedBytes().clear();
+    }
+  });
+}
+
+TEST(unterminated_line_resyncs_on_the_next_command)
+{
+  runBoard([]() {
+    sim::esp32.print("### D12");
+    sendFrame(API::GET_FW_VERSION);
+    Frame frame;
+    CHECK(readFrame(frame));
+    CHECK_EQUAL(FIRMWARE_VERSION, frame.value());
+
+    sim::esp32.print("### ");
+    CHECK_EQUAL(HW_REVISION, query(API::GET_HW_REVISION));
+  });
+}
+
+TEST(request_burst_does_not_overflow_the_receive_buffer)
+{
+  runBoard([]() {
+    for (int i = 0; i < 8; i++)
+      sendCommand(API::GET_API_VERSION);
+    runFor(50);
+
+    CHECK_EQUAL(0, sim::uartRxOverflows());
+    std::string answers = receivedBytes();
+    std::string answer = std::string(API::PREAMBLE) + std::to_string(API::API_VERSION) + "\r\n";
+    int count = 0;
+    for (size_t position = 0; (position = answers.find(answer, position)) != std::string::npos; position++)
+      count++;
+    CHECK_EQUAL(8, count);
+  });
+}
+
+TEST(pipelined_requests_are_answered_in_order)
+{
+  runBoard([]() {
+    const uint8_t commands[] = {API::GET_API_VERSION, API::GET_BATTERY_VOLTAGE, API::GET_HW_REVISION,
+                                API::GET_LOAD_CURRENT, API::GET_FW_VERSION, API::GET_BOARD_ID};
+    const int count = sizeof(commands) / sizeof(commands[0]);
+    for (int i = 0; i < count; i++)
+      sendFrame(commands[i], 200 + i); // Back-to-back, no wait for the answers
+
+    for (int i = 0; i < count; i++)
+    {
+      Frame frame;
+      CHECK(readFrame(frame));
+      CHECK_EQUAL(commands[i], frame.cmd);
+      CHECK_EQUAL(200 + i, frame.seq);
+    }
+  });
+}
+
+TEST(pipelined_requests_keep_their_sequence_across_the_wrap)
+{
+  runBoard([]() {
+    for (int seq = 250; seq < 262; seq++)
+      sendFrame(API::GET_API_VERSION, seq & 0xFF);
+
+    for (int seq = 250; seq < 262; seq++)
+    {
+      Frame frame;
+      CHECK(readFrame(frame));
+      CHECK_EQUAL(seq & 0xFF, frame.seq);
+      CHECK_EQUAL(API::API_VERSION, frame.value());
+    }
+    CHECK_EQUAL(0, sim::uartRxOverflows());
+  });
+}
+
+TEST(unsequenced_and_sequenced_requests_can_be_mixed)
+{
+  runBoard([]() {
+    sendFrame(API::GET_API_VERSION, 7);
+    sendFrame(API::GET_HW_REVISION);
+    sendFrame(API::GET_FW_VERSION, 8);
+
+    Frame frame;
+    CHECK(readFrame(frame));
+    CHECK_EQUAL(7, frame.seq);
+    CHECK(readFrame(frame));
+    CHECK_EQUAL(API::NO_SEQUENCE, frame.seq);
+    CHECK_EQUAL(HW_REVISION, frame.value());
+    CHECK(readFrame(frame));
+    CHECK_EQUAL(8, frame.seq);
+    CHECK_EQUAL(FIRMWARE_VERSION, frame.value());
+  });
+}
+
+/* Simulated link throughput : lock-step requests wait for each answer, pipelined ones keep up to 4 requests in flight */
+TEST(pipelined_requests_are_faster_than_lock_step)
+{
+  static const int REQUESTS = 40;
+  static uint64_t lockStepTime, pipelinedTime;
+
+  runBoard([]() {
+    Frame frame;
+    uint64_t start = sim::now();
+    for (int i = 0; i < REQUESTS; i++)
+    {
+      sendFrame(API::GET_BATTERY_VOLTAGE, i);
+      CHECK(readFrame(frame));
+    }
+    lockStepTime = sim::now() - start;
+
+    start = sim::now();
+    int sent = 0, received = 0;
+    while (received < REQUESTS)
+    {
+      while (sent < REQUESTS && sent - received < 4)
+        sendFrame(API::GET_BATTERY_VOLTAGE, sent++);
+      CHECK(readFrame(frame));
+      CHECK_EQUAL(received, frame.seq);
+      received++;
+    }
+    pipelinedTime = sim::now() - start;
+
+    printf("%d requests : lock-step %lu us, pipelined %lu us\n", REQUESTS, (unsigned long)lockStepTime,
+           (unsigned long)pipelinedTime);
+    CHECK(pipelinedTime < lockStepTime * 3 / 4);
+  });
+}
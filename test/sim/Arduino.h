@@ -0,0 +1,399 @@
+/* Host simulation of the Arduino STM32 core and of the STM32F030 peripherals used by the sketches
+ *
+ * Only what the sketches use is provided. The peripheral registers are SimReg objects : the simulator (see
+ * arduino_sim.cpp) reacts to register writes and updates the registers as the virtual time goes on, so the sketches
+ * run unchanged. The test side controls the board through sim.h.
+ */
+
+#ifndef SIM_ARDUINO_H
+#define SIM_ARDUINO_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <stdlib.h>
+#include <math.h>
+#include <algorithm>
+#include <cstdlib>
+
+using std::min;
+using std::max;
+using std::abs;
+
+typedef bool boolean;
+typedef uint8_t byte;
+
+#define HIGH 0x1
+#define LOW 0x0
+
+enum {
+  INPUT = 0,
+  OUTPUT,
+  INPUT_PULLUP,
+  INPUT_PULLDOWN,
+  INPUT_ANALOG
+};
+
+#define constrain(amt, low, high) ((amt) < (low) ? (low) : ((amt) > (high) ? (high) : (amt)))
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+
+void pinMode(uint32_t pin, uint32_t mode);
+void digitalWrite(uint32_t pin, uint32_t value);
+int digitalRead(uint32_t pin);
+int analogRead(uint32_t pin);
+void analogReadResolution(int bits);
+
+void noInterrupts();
+void interrupts();
+
+/* Scheduler hook (scheduler.ino) : the simulated run time of each task, see sim::setTaskCost() */
+namespace sim { void chargeTaskCost(uint8_t task); }
+#define TASK_RUN_HOOK(index) sim::chargeTaskCost(index)
+
+/* Serial port */
+class Print {
+public:
+  virtual ~Print() {}
+  virtual size_t write(uint8_t c) = 0;
+  virtual size_t write(const uint8_t *buffer, size_t size);
+  size_t write(const char *str) { return write((const uint8_t *)str, strlen(str)); }
+
+  size_t print(const char *str) { return write(str); }
+  size_t print(char c) { return write((uint8_t)c); }
+  size_t print(int value) { return print((long)value); }
+  size_t print(unsigned int value) { return print((unsigned long)value); }
+  size_t print(long value);
+  size_t print(unsigned long value);
+
+  size_t println() { return write("\r\n"); }
+  template <typename T> size_t println(T value) { size_t n = print(value); return n + println(); }
+};
+
+class Stream : public Print {
+public:
+  virtual int available() = 0;
+  virtual int read() = 0;
+  virtual int peek() = 0;
+  virtual void flush() {}
+};
+
+/* UART connected to the simulated ESP32 (see sim.h) */
+class HardwareSerial : public Stream {
+public:
+  void begin(unsigned long baud);
+  void end() {}
+  int available() override;
+  int read() override;
+  int peek() override;
+  void flush() override;
+  size_t write(uint8_t c) override;
+  using Print::write;
+};
+
+extern HardwareSerial Serial1;
+
+/* Registers : see arduino_sim.cpp. Reading a register from the main context takes 1us, so busy waits on a flag see
+   the time going on. */
+class SimReg {
+public:
+  SimReg() : value(0) {}
+  operator uint32_t() const;
+  SimReg &operator=(uint32_t v);
+  SimReg &operator=(const SimReg &other) { return *this = (uint32_t)other; }
+  SimReg &operator|=(uint32_t v) { return *this = (uint32_t)*this | v; }
+  SimReg &operator&=(uint32_t v) { return *this = (uint32_t)*this & v; }
+  SimReg &operator^=(uint32_t v) { return *this = (uint32_t)*this ^ v; }
+
+  uint32_t value; // Raw access, without side effect (simulator only)
+};
+
+#define __IO
+
+typedef struct {
+  SimReg ISR, IER, CR, CFGR1, CFGR2, SMPR, TR, CHSELR, DR;
+} ADC_TypeDef;
+
+typedef struct {
+  SimReg ISR, IFCR;
+} DMA_TypeDef;
+
+typedef struct {
+  SimReg CCR, CNDTR, CPAR, CMAR;
+} DMA_Channel_TypeDef;
+
+typedef struct {
+  SimReg CR1, CR2, SMCR, DIER, SR, EGR, CNT, PSC, ARR;
+} TIM_TypeDef;
+
+typedef struct {
+  SimReg MODER, OTYPER, OSPEEDR, PUPDR, IDR, ODR, BSRR, LCKR, AFR[2], BRR;
+} GPIO_TypeDef;
+
+typedef struct {
+  SimReg CR, CFGR, AHBENR, APB2ENR, APB1ENR, BDCR, CSR;
+} RCC_TypeDef;
+
+typedef struct {
+  SimReg CR, CSR;
+} PWR_TypeDef;
+
+typedef struct {
+  SimReg TR, DR, CR, ISR, PRER, ALRMAR, WPR, SSR, ALRMASSR;
+} RTC_TypeDef;
+
+typedef struct {
+  SimReg IMR, EMR, RTSR, FTSR, SWIER, PR;
+} EXTI_TypeDef;
+
+typedef struct {
+  SimReg CFGR1, EXTICR[4];
+} SYSCFG_TypeDef;
+
+typedef struct {
+  SimReg SCR;
+} SCB_Type;
+
+typedef struct {
+  SimReg KR, PR, RLR, SR;
+} IWDG_TypeDef;
+
+extern ADC_TypeDef simADC1;
+extern DMA_TypeDef simDMA1;
+extern DMA_Channel_TypeDef simDMA1_Channel1;
+extern TIM_TypeDef simTIM3, simTIM16;
+extern GPIO_TypeDef simGPIOA;
+extern RCC_TypeDef simRCC;
+extern PWR_TypeDef simPWR;
+extern RTC_TypeDef simRTC;
+extern EXTI_TypeDef simEXTI;
+extern SYSCFG_TypeDef simSYSCFG;
+extern SCB_Type simSCB;
+extern IWDG_TypeDef simIWDG;
+
+#define ADC1 (&simADC1)
+#define DMA1 (&simDMA1)
+#define DMA1_Channel1 (&simDMA1_Channel1)
+#define TIM3 (&simTIM3)
+#define TIM16 (&simTIM16)
+#define GPIOA (&simGPIOA)
+#define RCC (&simRCC)
+#define PWR (&simPWR)
+#define RTC (&simRTC)
+#define EXTI (&simEXTI)
+#define SYSCFG (&simSYSCFG)
+#define SCB (&simSCB)
+#define IWDG (&simIWDG)
+
+#define ADC_ISR_ADRDY 0x00000001U
+#define ADC_CR_ADEN 0x00000001U
+#define ADC_CR_ADDIS 0x00000002U
+#define ADC_CR_ADSTART 0x00000004U
+#define ADC_CR_ADSTP 0x00000010U
+#define ADC_CR_ADCAL 0x80000000U
+#define ADC_CFGR1_DMAEN 0x00000001U
+#define ADC_CFGR1_DMACFG 0x00000002U
+#define ADC_CFGR1_EXTSEL_0 0x00000040U
+#define ADC_CFGR1_EXTSEL_1 0x00000080U
+#define ADC_CFGR1_EXTSEL_2 0x00000100U
+#define ADC_CFGR1_EXTEN_0 0x00000400U
+#define ADC_CFGR1_EXTEN_1 0x00000800U
+#define ADC_CFGR2_CKMODE_0 0x40000000U
+#define ADC_CFGR2_CKMODE_1 0x80000000U
+#define ADC_SMPR_SMP 0x00000007U
+
+#define DMA_ISR_GIF1 0x00000001U
+#define DMA_ISR_TCIF1 0x00000002U
+#define DMA_ISR_HTIF1 0x00000004U
+#define DMA_IFCR_CGIF1 0x00000001U
+#define DMA_IFCR_CTCIF1 0x00000002U
+#define DMA_IFCR_CHTIF1 0x00000004U
+#define DMA_CCR_EN 0x00000001U
+#define DMA_CCR_CIRC 0x00000020U
+#define DMA_CCR_MINC 0x00000080U
+#define DMA_CCR_PSIZE_0 0x00000100U
+#define DMA_CCR_MSIZE_0 0x00000400U
+
+#define TIM_CR1_CEN 0x00000001U
+#define TIM_CR1_ARPE 0x00000080U
+#define TIM_CR2_MMS_1 0x00000020U
+#define TIM_DIER_UIE 0x00000001U
+#define TIM_SR_UIF 0x00000001U
+#define TIM_EGR_UG 0x00000001U
+
+#define PWR_CR_LPDS 0x00000001U
+#define PWR_CR_PDDS 0x00000002U
+#define PWR_CR_DBP 0x00000100U
+
+#define RCC_BDCR_RTCSEL 0x00000300U
+#define RCC_BDCR_RTCSEL_LSI 0x00000200U
+#define RCC_BDCR_RTCEN 0x00008000U
+
+#define RTC_ISR_ALRAWF 0x00000001U
+#define RTC_ISR_INITF 0x00000040U
+#define RTC_ISR_INIT 0x00000080U
+#define RTC_ISR_ALRAF 0x00000100U
+#define RTC_CR_ALRAE 0x00000100U
+#define RTC_CR_ALRAIE 0x00001000U
+#define RTC_ALRMAR_MSK1 0x00000080U
+#define RTC_ALRMAR_MSK2 0x00008000U
+#define RTC_ALRMAR_MSK3 0x00800000U
+#define RTC_ALRMAR_MSK4 0x80000000U
+
+#define EXTI_EMR_MR17 0x00020000U
+#define EXTI_RTSR_TR17 0x00020000U
+
+#define SCB_SCR_SLEEPDEEP_Msk 0x00000004UL
+
+#define __HAL_RCC_ADC1_CLK_ENABLE() do {} while (0)
+#define __HAL_RCC_DMA1_CLK_ENABLE() do {} while (0)
+#define __HAL_RCC_TIM3_CLK_ENABLE() do {} while (0)
+#define __HAL_RCC_PWR_CLK_ENABLE() do {} while (0)
+#define __HAL_RCC_SYSCFG_CLK_ENABLE() do {} while (0)
+
+void __WFI();
+void __WFE();
+void __SEV();
+
+extern "C" void SystemClock_Config(void);
+uint32_t HAL_RCC_GetHCLKFreq();
+
+typedef enum {
+  HAL_OK = 0,
+  HAL_ERROR,
+  HAL_BUSY,
+  HAL_TIMEOUT
+} HAL_StatusTypeDef;
+
+/* Pins : the digital pin n is PA_n, its ADC channel is n */
+typedef enum {
+  PA_0 = 0x00, PA_1, PA_2, PA_3, PA_4, PA_5, PA_6, PA_7, PA_8, PA_9, PA_10, PA_11, PA_12, PA_13, PA_14, PA_15,
+  NC = (int)0xFFFFFFFF
+} PinName;
+
+typedef enum {
+  PortA = 0
+} PortName;
+
+typedef struct {
+  PinName pin;
+  void *peripheral;
+  int function;
+} PinMap;
+
+extern const PinMap PinMap_ADC[];
+extern const PinMap PinMap_UART_TX[];
+
+#define STM_PORT(X) (((uint32_t)(X) >> 4) & 0xF)
+#define STM_PIN(X) ((uint32_t)(X) & 0xF)
+#define STM_GPIO_PIN(X) ((uint16_t)(1 << STM_PIN(X)))
+#define STM_PIN_MODE(X) ((X) & 0x1F)
+#define STM_PIN_PUPD(X) (((X) >> 5) & 0x3)
+#define STM_PIN_AFNUM(X) (((X) >> 8) & 0xF)
+#define STM_PIN_CHANNEL(X) (((X) >> 16) & 0x1F)
+
+PinName digitalPinToPinName(uint32_t pin);
+uint32_t pinmap_function(PinName pin, const PinMap *map);
+GPIO_TypeDef *get_GPIO_Port(uint32_t port);
+GPIO_TypeDef *set_GPIO_Port_Clock(uint32_t port);
+
+#define GPIO_MODE_INPUT 0x00000000U
+#define GPIO_MODE_OUTPUT_PP 0x00000001U
+#define GPIO_MODE_AF_PP 0x00000002U
+#define GPIO_MODE_ANALOG 0x00000003U
+#define GPIO_NOPULL 0x00000000U
+#define GPIO_PULLUP 0x00000001U
+#define GPIO_PULLDOWN 0x00000002U
+#define GPIO_SPEED_FREQ_HIGH 0x00000003U
+
+typedef struct {
+  uint32_t Pin;
+  uint32_t Mode;
+  uint32_t Pull;
+  uint32_t Speed;
+  uint32_t Alternate;
+} GPIO_InitTypeDef;
+
+void HAL_GPIO_Init(GPIO_TypeDef *port, GPIO_InitTypeDef *init);
+
+/* LED timer (stm32duino timer.h) */
+typedef struct stimer_s stimer_t;
+struct stimer_s {
+  TIM_TypeDef *timer;
+  void (*irqHandle)(stimer_t *);
+};
+
+void attachIntHandle(stimer_t *obj, void (*irqHandle)(stimer_t *));
+void TimerHandleInit(stimer_t *obj, uint16_t period, uint16_t prescaler);
+void TimerHandleDeinit(stimer_t *obj);
+
+/* Flash : the last 4 pages (0x08003000 - 0x08003FFF) are emulated, see sim.h */
+#define FLASH_PAGE_SIZE 0x400U
+#define FLASH_TYPEPROGRAM_HALFWORD 0x01U
+#define FLASH_TYPEPROGRAM_WORD 0x02U
+#define FLASH_TYPEERASE_PAGES 0x00U
+#define OB_DATA_ADDRESS_DATA0 0x1FFFF804U
+#define OB_DATA_ADDRESS_DATA1 0x1FFFF806U
+#define OPTIONBYTE_DATA 0x04U
+
+typedef struct {
+  uint32_t TypeErase;
+  uint32_t PageAddress;
+  uint32_t NbPages;
+} FLASH_EraseInitTypeDef;
+
+typedef struct {
+  uint32_t OptionType;
+  uint32_t WRPState;
+  uint32_t WRPPage;
+  uint8_t RDPLevel;
+  uint8_t USERConfig;
+  uint32_t DATAAddress;
+  uint8_t DATAData;
+} FLASH_OBProgramInitTypeDef;
+
+HAL_StatusTypeDef HAL_FLASH_Unlock();
+HAL_StatusTypeDef HAL_FLASH_Lock();
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t typeProgram, uint32_t address, uint64_t data);
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *erase, uint32_t *pageError);
+uint32_t HAL_FLASHEx_OBGetUserData(uint32_t address);
+HAL_StatusTypeDef HAL_FLASH_OB_Unlock();
+HAL_StatusTypeDef HAL_FLASH_OB_Lock();
+HAL_StatusTypeDef HAL_FLASH_OB_Launch();
+HAL_StatusTypeDef HAL_FLASHEx_OBErase();
+HAL_StatusTypeDef HAL_FLASHEx_OBProgram(FLASH_OBProgramInitTypeDef *init);
+
+/* Independent watchdog */
+#define IWDG_PRESCALER_4 0x00000000U
+#define IWDG_PRESCALER_8 0x00000001U
+#define IWDG_PRESCALER_16 0x00000002U
+#define IWDG_PRESCALER_32 0x00000003U
+#define IWDG_PRESCALER_64 0x00000004U
+#define IWDG_PRESCALER_128 0x00000005U
+#define IWDG_PRESCALER_256 0x00000006U
+#define IWDG_WINDOW_DISABLE 0x00000FFFU
+
+typedef struct {
+  uint32_t Prescaler;
+  uint32_t Reload;
+  uint32_t Window;
+} IWDG_InitTypeDef;
+
+typedef struct {
+  IWDG_TypeDef *Instance;
+  IWDG_InitTypeDef Init;
+} IWDG_HandleTypeDef;
+
+HAL_StatusTypeDef HAL_IWDG_Init(IWDG_HandleTypeDef *hiwdg);
+HAL_StatusTypeDef HAL_IWDG_Refresh(IWDG_HandleTypeDef *hiwdg);
+
+/* Linker script symbols : the end of the image (see test/CMakeLists.txt) */
+extern uint32_t simImageEnd, simDataStart;
+#define _sidata simImageEnd
+#define _sdata simDataStart
+#define _edata simDataStart
+
+#endif
@@ -0,0 +1,1224 @@
+/* Host simulation of the Arduino STM32 core and of the STM32F030 peripherals (see Arduino.h and sim.h)
+ *
+ * Two time bases :
+ *  * the real time, for the outside world (scheduled actions, UART, button) and the LSI clocked peripherals (RTC,
+ *    watchdog), which keep running in Stop mode
+ *  * the tick time (millis, micros, TIM3, TIM16), which stops in Stop mode. tick = real - time spent in Stop mode.
+ */
+
+#include "sim.h"
+
+#include <stdio.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <deque>
+#include <map>
+#include <vector>
+
+extern int testFailureCount; // See test.h
+
+ADC_TypeDef simADC1;
+DMA_TypeDef simDMA1;
+DMA_Channel_TypeDef simDMA1_Channel1;
+TIM_TypeDef simTIM3, simTIM16;
+GPIO_TypeDef simGPIOA;
+RCC_TypeDef simRCC;
+PWR_TypeDef simPWR;
+RTC_TypeDef simRTC;
+EXTI_TypeDef simEXTI;
+SYSCFG_TypeDef simSYSCFG;
+SCB_Type simSCB;
+IWDG_TypeDef simIWDG;
+
+HardwareSerial Serial1;
+const PinMap PinMap_ADC[1] = {};
+const PinMap PinMap_UART_TX[1] = {};
+
+namespace sim {
+Esp32Uart esp32;
+}
+
+namespace {
+
+const uint32_t HCLK_FREQ = 48000000;
+const uint64_t UART_BYTE_US = 87; // 10 bits at 115200 bauds
+const unsigned int UART_RX_BUFFER_SIZE = 64; // Arduino core buffer
+const uintptr_t FLASH_EMULATED_START = 0x08003000;
+const uintptr_t FLASH_EMULATED_END = 0x08004000;
+const uint64_t FLASH_PROGRAM_US = 50;
+const uint64_t FLASH_ERASE_US = 30000;
+const uint64_t NEVER = UINT64_MAX;
+
+/* Kept across the power cycles (shared with the child processes of sim::boot) */
+struct Persistent {
+  uint8_t optionBytes[2];
+};
+Persistent *persistent;
+
+struct Timer {
+  TIM_TypeDef *regs;
+  bool running;
+  uint64_t next; // Tick time of the next update event
+  uint32_t activeArr; // Shadow register
+
+  uint64_t period(uint32_t arr) const
+  {
+    return max((uint64_t)1, ((uint64_t)arr + 1) * ((uint64_t)regs->PSC.value + 1) * 1000000 / HCLK_FREQ);
+  }
+};
+
+struct Action {
+  uint64_t time;
+  std::function<void()> run;
+};
+
+sim::Wiring wiring;
+bool wired;
+
+uint64_t realTime; // us
+uint64_t stopTime; // us spent in Stop mode
+uint64_t sleepTime; // us spent in Sleep mode (__WFI)
+bool stopMode;
+bool interruptsEnabled = true;
+bool inInterrupt;
+bool inSimulator; // Register accesses from the simulator itself have no side effect
+bool stalled; // Flash operation : the CPU and the interrupts wait
+bool eventRegister;
+bool ledIrqPending;
+unsigned long ledIrqCount;
+unsigned long systemClockConfigs;
+
+std::multimap<uint64_t, std::function<void()>> actions;
+
+// Inputs
+int pinInputs[16] = {-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1};
+std::function<uint16_t()> analogInputs[16];
+bool buttonPressed;
+
+// LED accounting
+uint64_t ledAccountTime;
+uint64_t ledOnTimes[16][16];
+
+// ADC / DMA
+Timer tim3 = {&simTIM3, false, 0, 0};
+Timer tim16 = {&simTIM16, false, 0, 0};
+stimer_t *ledTimerHandle;
+uint32_t dmaCount;
+uint32_t dmaIndex;
+
+// RTC
+bool rtcRunning;
+uint64_t rtcStart;
+uint64_t rtcNextAlarm = NEVER;
+bool rtcUnlockStep;
+bool rtcUnlocked;
+uint32_t lsiFrequency = 40000;
+
+// Scheduler (see setTaskCost)
+uint32_t taskCosts[8]; // us
+
+// Watchdog
+bool watchdogRunning;
+uint64_t watchdogDeadline = NEVER;
+uint64_t watchdogTimeout;
+
+// UART
+std::deque<std::pair<uint64_t, uint8_t>> uartToStm32; // Arrival time, byte
+std::deque<uint8_t> stm32RxBuffer;
+std::deque<std::pair<uint64_t, uint8_t>> uartToEsp32;
+uint64_t uartRxLastArrival;
+uint64_t uartTxBusyUntil;
+unsigned long uartRxOverflowCount;
+unsigned long uartTxReleasedCount;
+
+// Flash
+bool flashUnlocked;
+unsigned long flashOperationCount;
+unsigned long flashErrorCount;
+unsigned long flashPowerLossAt;
+
+uint64_t tickTime() { return realTime - stopTime; }
+
+uint32_t moder(uint8_t pin) { return (simGPIOA.MODER.value >> (2 * pin)) & 3; }
+
+/* Level seen on an input */
+int pinLevel(uint8_t pin)
+{
+  if (moder(pin) == 1 || moder(pin) == 2)
+    return (simGPIOA.ODR.value >> pin) & 1;
+  if (wired && pin == wiring.buttonPin)
+    return buttonPressed ? HIGH : LOW; // Pulled down by the board
+  if (pinInputs[pin] >= 0)
+    return pinInputs[pin];
+  return ((simGPIOA.PUPDR.value >> (2 * pin)) & 3) == 1;
+}
+
+bool powered()
+{
+  if (!wired)
+    return true;
+  bool enabled = moder(wiring.powerEnablePin) == 1 && ((simGPIOA.ODR.value >> wiring.powerEnablePin) & 1);
+  return enabled || buttonPressed;
+}
+
+void checkPower()
+{
+  if (!powered())
+    throw sim::PowerOff();
+}
+
+/* Add the time since the last change to the LED being lit */
+void accountLeds()
+{
+  uint64_t elapsed = realTime - ledAccountTime;
+  ledAccountTime = realTime;
+  if (!wired || elapsed == 0)
+    return;
+
+  int lit = sim::litLed();
+  if (lit >= 0)
+    ledOnTimes[lit >> 8][lit & 0xFF] += elapsed;
+}
+
+void runLedInterrupt()
+{
+  if (!interruptsEnabled || inInterrupt || stalled || ledTimerHandle == NULL)
+  {
+    ledIrqPending = true;
+    return;
+  }
+
+  ledIrqPending = false;
+  ledIrqCount++;
+  inInterrupt = true;
+  ledTimerHandle->irqHandle(ledTimerHandle);
+  inInterrupt = false;
+}
+
+void adcScan()
+{
+  if (!(simADC1.CR.value & ADC_CR_ADEN) || !(simADC1.CR.value & ADC_CR_ADSTART) ||
+      !(simADC1.CFGR1.value & (ADC_CFGR1_EXTEN_0 | ADC_CFGR1_EXTEN_1)) || (simTIM3.CR2.value & 0x70) != TIM_CR2_MMS_1)
+    return;
+
+  for (uint8_t channel = 0; channel < 16; channel++)
+  {
+    if (!(simADC1.CHSELR.value & (1UL << channel)))
+      continue;
+
+    uint16_t reading = analogInputs[channel] ? min(analogInputs[channel](), (uint16_t)4095) : 0;
+    simADC1.DR.value = reading;
+
+    if (!(simADC1.CFGR1.value & ADC_CFGR1_DMAEN) || !(simDMA1_Channel1.CCR.value & DMA_CCR_EN) || dmaCount == 0)
+      continue;
+
+    volatile uint16_t *memory = (volatile uint16_t *)(uintptr_t)simDMA1_Channel1.CMAR.value;
+    memory[dmaIndex++] = reading;
+    if (dmaIndex == dmaCount / 2)
+      simDMA1.ISR.value |= DMA_ISR_HTIF1 | DMA_ISR_GIF1;
+    if (dmaIndex == dmaCount)
+    {
+      simDMA1.ISR.value |= DMA_ISR_TCIF1 | DMA_ISR_GIF1;
+      dmaIndex = 0;
+    }
+    simDMA1_Channel1.CNDTR.value = dmaCount - dmaIndex;
+  }
+}
+
+void timerUpdate(Timer &timer)
+{
+  timer.activeArr = timer.regs->ARR.value;
+  uint64_t updateTime = timer.next;
+  timer.next += timer.period(timer.activeArr);
+
+  if (&timer == &tim3)
+    adcScan();
+  else if (simTIM16.DIER.value & TIM_DIER_UIE)
+  {
+    runLedInterrupt();
+    if (!(simTIM16.CR1.value & TIM_CR1_ARPE)) // The new period applies right away
+      timer.next = updateTime + timer.period(timer.regs->ARR.value);
+  }
+}
+
+void setTimerRunning(Timer &timer, bool running)
+{
+  if (running && !timer.running)
+  {
+    timer.activeArr = timer.regs->ARR.value;
+    timer.next = tickTime() + timer.period(timer.activeArr);
+  }
+  timer.running = running;
+}
+
+uint64_t rtcSecondUs()
+{
+  uint32_t prer = simRTC.PRER.value;
+  return (uint64_t)(((prer >> 16) & 0x7F) + 1) * ((prer & 0x7FFF) + 1) * 1000000 / lsiFrequency;
+}
+
+void updateRtcAlarm()
+{
+  if (!rtcRunning || !(simRTC.CR.value & RTC_CR_ALRAE) || (simRTC.ISR.value & RTC_ISR_INIT))
+  {
+    rtcNextAlarm = NEVER;
+    return;
+  }
+
+  // Only the "every second" alarm is supported
+  uint64_t second = rtcSecondUs();
+  rtcNextAlarm = rtcStart + ((realTime - rtcStart) / second + 1) * second;
+}
+
+bool buttonWakeUpEnabled()
+{
+  uint8_t line = wiring.buttonPin;
+  return (simEXTI.EMR.value & (1UL << line)) && (simEXTI.RTSR.value & (1UL << line)) &&
+         ((simSYSCFG.EXTICR[line / 4].value >> (4 * (line % 4))) & 0xF) == 0; // Port A
+}
+
+/* Earliest event (real time), up to limit */
+uint64_t nextEvent(uint64_t limit)
+{
+  uint64_t next = limit;
+  if (!actions.empty())
+    next = min(next, actions.begin()->first);
+  if (!stopMode && tim3.running)
+    next = min(next, tim3.next + stopTime);
+  if (!stopMode && tim16.running)
+    next = min(next, tim16.next + stopTime);
+  next = min(next, rtcNextAlarm);
+  if (watchdogDeadline != NEVER)
+    next = min(next, watchdogDeadline + 1);
+  return next;
+}
+
+/* Let the time go on up to target, processing the events in order.
+   Return true when woken up by an event in Stop mode. */
+bool runUntil(uint64_t target)
+{
+  bool wasInSimulator = inSimulator;
+  inSimulator = true;
+  bool wakeUp = false;
+
+  while (true)
+  {
+    uint64_t next = nextEvent(target);
+    if (next > realTime)
+    {
+      accountLeds();
+      if (stopMode)
+        stopTime += next - realTime;
+      realTime = next;
+    }
+
+    if (watchdogDeadline != NEVER && realTime > watchdogDeadline)
+    {
+      inSimulator = wasInSimulator;
+      throw sim::WatchdogReset();
+    }
+
+    int buttonLevel = wired ? pinLevel(wiring.buttonPin) : LOW;
+    bool processed = false;
+
+    while (!actions.empty() && actions.begin()->first <= realTime)
+    {
+      std::function<void()> action = actions.begin()->second;
+      actions.erase(actions.begin());
+      action();
+      processed = true;
+    }
+
+    if (stopMode && wired && buttonLevel == LOW && pinLevel(wiring.buttonPin) == HIGH && buttonWakeUpEnabled())
+      wakeUp = true;
+
+    if (rtcNextAlarm <= realTime)
+    {
+      bool rising = !(simRTC.ISR.value & RTC_ISR_ALRAF);
+      simRTC.ISR.value |= RTC_ISR_ALRAF;
+      if (rising && (simEXTI.EMR.value & EXTI_EMR_MR17) && (simEXTI.RTSR.value & EXTI_RTSR_TR17))
+        wakeUp = stopMode;
+      rtcNextAlarm += rtcSecondUs();
+      processed = true;
+    }
+
+    if (!stopMode)
+    {
+      while (tim3.running && tim3.next + stopTime <= realTime)
+      {
+        timerUpdate(tim3);
+        processed = true;
+      }
+      while (tim16.running && tim16.next + stopTime <= realTime)
+      {
+        timerUpdate(tim16);
+        processed = true;
+      }
+    }
+
+    checkPower();
+
+    if ((stopMode && wakeUp) || (realTime >= target && !processed))
+      break;
+  }
+
+  inSimulator = wasInSimulator;
+  return wakeUp;
+}
+
+/* Wait in the main context (busy wait or sleep) */
+void wait(uint64_t us)
+{
+  runUntil(realTime + us);
+}
+
+/* CPU stalled by a flash operation : the interrupts wait */
+void stall(uint64_t us)
+{
+  stalled = true;
+  wait(us);
+  stalled = false;
+  if (ledIrqPending && interruptsEnabled && !inInterrupt)
+    runLedInterrupt();
+}
+
+void powerLossCheck(uint32_t pageToHalfErase)
+{
+  flashOperationCount++;
+  if (flashPowerLossAt != 0 && flashOperationCount >= flashPowerLossAt)
+  {
+    if (pageToHalfErase != 0)
+    {
+      mprotect((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ | PROT_WRITE);
+      memset((void *)(uintptr_t)pageToHalfErase, 0xFF, FLASH_PAGE_SIZE / 2);
+      mprotect((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ);
+    }
+    throw sim::PowerOff();
+  }
+}
+
+void uartReceive()
+{
+  while (!uartToStm32.empty() && uartToStm32.front().first <= realTime)
+  {
+    if (stm32RxBuffer.size() < UART_RX_BUFFER_SIZE)
+      stm32RxBuffer.push_back(uartToStm32.front().second);
+    else
+      uartRxOverflowCount++;
+    uartToStm32.pop_front();
+  }
+}
+
+void registerWrite(SimReg *reg, uint32_t old)
+{
+  uint32_t v = reg->value;
+
+  if (reg == &simGPIOA.BSRR || reg == &simGPIOA.BRR || reg == &simGPIOA.MODER || reg == &simGPIOA.ODR)
+  {
+    // Account the LED with the previous state
+    reg->value = old;
+    accountLeds();
+    reg->value = v;
+
+    if (reg == &simGPIOA.BSRR)
+    {
+      simGPIOA.ODR.value = (simGPIOA.ODR.value & ~(v >> 16)) | (v & 0xFFFF);
+      reg->value = 0;
+    }
+    else if (reg == &simGPIOA.BRR)
+    {
+      simGPIOA.ODR.value &= ~(v & 0xFFFF);
+      reg->value = 0;
+    }
+    checkPower();
+  }
+  else if (reg == &simADC1.CR)
+  {
+    if (v & ADC_CR_ADCAL)
+      reg->value &= ~ADC_CR_ADCAL; // Calibration done
+    if ((v & ADC_CR_ADEN) && !(old & ADC_CR_ADEN))
+      simADC1.ISR.value |= ADC_ISR_ADRDY;
+    if (v & ADC_CR_ADDIS)
+      reg->value &= ~(ADC_CR_ADEN | ADC_CR_ADSTART | ADC_CR_ADDIS);
+    reg->value |= old & ADC_CR_ADEN; // Cleared through ADDIS only
+  }
+  else if (reg == &simADC1.ISR)
+    reg->value = old & ~v; // Cleared by writing 1
+  else if (reg == &simDMA1.IFCR)
+  {
+    if (v & DMA_IFCR_CGIF1)
+      v |= DMA_IFCR_CTCIF1 | DMA_IFCR_CHTIF1 | 0x8;
+    simDMA1.ISR.value &= ~(v & 0xF);
+    reg->value = 0;
+  }
+  else if (reg == &simDMA1.ISR)
+    reg->value = old; // Read only
+  else if (reg == &simDMA1_Channel1.CCR)
+  {
+    if ((v & DMA_CCR_EN) && !(old & DMA_CCR_EN))
+    {
+      dmaCount = simDMA1_Channel1.CNDTR.value;
+      dmaIndex = 0;
+    }
+  }
+  else if (reg == &simDMA1_Channel1.CNDTR)
+  {
+    if (simDMA1_Channel1.CCR.value & DMA_CCR_EN)
+      reg->value = old; // Only writable while the channel is disabled
+  }
+  else if (reg == &simTIM3.CR1)
+    setTimerRunning(tim3, v & TIM_CR1_CEN);
+  else if (reg == &simTIM16.CR1)
+    setTimerRunning(tim16, v & TIM_CR1_CEN);
+  else if (reg == &simRCC.BDCR)
+  {
+    if (!(simPWR.CR.value & PWR_CR_DBP))
+      reg->value = old; // Backup domain write protection
+    else if ((v & RCC_BDCR_RTCEN) && !(old & RCC_BDCR_RTCEN))
+    {
+      rtcRunning = (v & RCC_BDCR_RTCSEL) == RCC_BDCR_RTCSEL_LSI;
+      rtcStart = realTime;
+    }
+  }
+  else if (reg == &simRTC.WPR)
+  {
+    rtcUnlocked = rtcUnlockStep && v == 0x53;
+    rtcUnlockStep = (v == 0xCA);
+  }
+  else if (reg == &simRTC.ISR)
+  {
+    uint32_t flags = 0x3F00; // Not write protected, cleared by writing 0
+    uint32_t protectedBits = RTC_ISR_INIT;
+    bool writable = (simPWR.CR.value & PWR_CR_DBP) && rtcUnlocked;
+    uint32_t value = (old & ~(flags | protectedBits)) | (old & v & flags);
+    value |= (writable ? v : old) & protectedBits;
+    value = (value & RTC_ISR_INIT) ? (value | RTC_ISR_INITF) : (value & ~RTC_ISR_INITF);
+    reg->value = value;
+    if ((old ^ value) & RTC_ISR_INIT)
+      updateRtcAlarm();
+  }
+  else if (reg == &simRTC.CR || reg == &simRTC.PRER || reg == &simRTC.ALRMAR || reg == &simRTC.ALRMASSR)
+  {
+    if (!(simPWR.CR.value & PWR_CR_DBP) || !rtcUnlocked ||
+        (reg == &simRTC.PRER && !(simRTC.ISR.value & RTC_ISR_INITF)) ||
+        ((reg == &simRTC.ALRMAR || reg == &simRTC.ALRMASSR) && (simRTC.CR.value & RTC_CR_ALRAE)))
+    {
+      reg->value = old; // Write protected
+      return;
+    }
+
+    if (reg == &simRTC.CR)
+    {
+      if (v & RTC_CR_ALRAE)
+        simRTC.ISR.value &= ~RTC_ISR_ALRAWF;
+      else
+        simRTC.ISR.value |= RTC_ISR_ALRAWF;
+      if ((old ^ v) & RTC_CR_ALRAE)
+        updateRtcAlarm();
+    }
+  }
+}
+
+void registerRead(const SimReg *reg)
+{
+  if (reg == &simGPIOA.IDR)
+  {
+    uint32_t idr = 0;
+    for (uint8_t pin = 0; pin < 16; pin++)
+      if (moder(pin) != 3 && pinLevel(pin))
+        idr |= 1UL << pin;
+    const_cast<SimReg *>(reg)->value = idr;
+  }
+}
+
+/* Fresh flash and option bytes, shared with the child processes */
+struct FlashSetup {
+  FlashSetup()
+  {
+    void *flash = mmap((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    void *shared = mmap(NULL, sizeof(Persistent), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (flash == MAP_FAILED || shared == MAP_FAILED)
+    {
+      perror("mmap");
+      exit(1);
+    }
+    persistent = (Persistent *)shared;
+    sim::resetFlash();
+  }
+} flashSetup;
+
+} // namespace
+
+/* Registers */
+
+SimReg::operator uint32_t() const
+{
+  if (!inSimulator && !inInterrupt)
+    wait(1);
+  registerRead(this);
+  return value;
+}
+
+SimReg &SimReg::operator=(uint32_t v)
+{
+  uint32_t old = value;
+  value = v;
+  if (!inSimulator)
+    registerWrite(this, old);
+  return *this;
+}
+
+/* Arduino core */
+
+unsigned long millis() { return tickTime() / 1000; }
+unsigned long micros() { return tickTime(); }
+
+void delay(unsigned long ms)
+{
+  wait((uint64_t)ms * 1000);
+}
+
+void delayMicroseconds(unsigned int us)
+{
+  wait(us);
+}
+
+void pinMode(uint32_t pin, uint32_t mode)
+{
+  uint32_t moderBits = (mode == OUTPUT) ? 1 : (mode == INPUT_ANALOG) ? 3 : 0;
+  uint32_t pupdBits = (mode == INPUT_PULLUP) ? 1 : (mode == INPUT_PULLDOWN) ? 2 : 0;
+
+  inSimulator = true;
+  simGPIOA.PUPDR.value = (simGPIOA.PUPDR.value & ~(3UL << (2 * pin))) | (pupdBits << (2 * pin));
+  inSimulator = false;
+  uint32_t moder = simGPIOA.MODER.value;
+  if (!inInterrupt)
+    wait(1); // Read-modify-write : an interrupt may occur before the write
+  simGPIOA.MODER = (moder & ~(3UL << (2 * pin))) | (moderBits << (2 * pin));
+}
+
+void digitalWrite(uint32_t pin, uint32_t value)
+{
+  simGPIOA.BSRR = value ? (1UL << pin) : (1UL << (pin + 16));
+}
+
+int digitalRead(uint32_t pin)
+{
+  return (simGPIOA.IDR >> pin) & 1;
+}
+
+int analogRead(uint32_t pin)
+{
+  wait(20);
+  return analogInputs[pin] ? min(analogInputs[pin](), (uint16_t)4095) : 0;
+}
+
+void analogReadResolution(int bits) {}
+
+void noInterrupts()
+{
+  interruptsEnabled = false;
+}
+
+void interrupts()
+{
+  interruptsEnabled = true;
+  if (ledIrqPending && !inInterrupt && !stalled)
+    runLedInterrupt();
+}
+
+void __WFI()
+{
+  if (ledIrqPending)
+    return;
+
+  // SysTick, LED timer or UART RX
+  uint64_t wakeUp = stopTime + (tickTime() / 1000 + 1) * 1000;
+  if (tim16.running && (simTIM16.DIER.value & TIM_DIER_UIE))
+    wakeUp = min(wakeUp, tim16.next + stopTime);
+  for (const std::pair<uint64_t, uint8_t> &byte : uartToStm32)
+  {
+    if (byte.first > realTime) // RX interrupt of the next byte
+    {
+      wakeUp = min(wakeUp, byte.first);
+      break;
+    }
+  }
+
+  uint64_t sleepStart = realTime;
+  runUntil(wakeUp);
+  sleepTime += realTime - sleepStart;
+}
+
+void __SEV()
+{
+  eventRegister = true;
+}
+
+void __WFE()
+{
+  if (eventRegister)
+  {
+    eventRegister = false;
+    return;
+  }
+
+  if (!(simSCB.SCR.value & SCB_SCR_SLEEPDEEP_Msk))
+  {
+    __WFI();
+    return;
+  }
+
+  if (simPWR.CR.value & PWR_CR_PDDS)
+  {
+    fprintf(stderr, "Standby mode is not simulated\n");
+    abort();
+  }
+
+  // Stop mode : until a wake up event
+  stopMode = true;
+  try
+  {
+    while (!runUntil(NEVER - 1));
+  }
+  catch (...)
+  {
+    stopMode = false;
+    throw;
+  }
+  stopMode = false;
+}
+
+extern "C" void SystemClock_Config(void)
+{
+  systemClockConfigs++;
+}
+
+uint32_t HAL_RCC_GetHCLKFreq()
+{
+  return HCLK_FREQ;
+}
+
+PinName digitalPinToPinName(uint32_t pin)
+{
+  return pin < 16 ? (PinName)pin : NC;
+}
+
+uint32_t pinmap_function(PinName pin, const PinMap *map)
+{
+  if (map == PinMap_ADC)
+    return GPIO_MODE_ANALOG | (STM_PIN(pin) << 16);
+  return GPIO_MODE_AF_PP | (GPIO_PULLUP << 5) | (1 << 8);
+}
+
+GPIO_TypeDef *get_GPIO_Port(uint32_t port)
+{
+  return port == PortA ? GPIOA : NULL;
+}
+
+GPIO_TypeDef *set_GPIO_Port_Clock(uint32_t port)
+{
+  return get_GPIO_Port(port);
+}
+
+void HAL_GPIO_Init(GPIO_TypeDef *port, GPIO_InitTypeDef *init)
+{
+  for (uint8_t pin = 0; pin < 16; pin++)
+  {
+    if (!(init->Pin & (1UL << pin)))
+      continue;
+
+    inSimulator = true;
+    port->PUPDR.value = (port->PUPDR.value & ~(3UL << (2 * pin))) | ((init->Pull & 3) << (2 * pin));
+    inSimulator = false;
+    uint32_t moder = port->MODER.value;
+    if (!inInterrupt)
+      wait(1); // Read-modify-write, like pinMode()
+    port->MODER = (moder & ~(3UL << (2 * pin))) | ((init->Mode & 3) << (2 * pin));
+  }
+}
+
+void attachIntHandle(stimer_t *obj, void (*irqHandle)(stimer_t *))
+{
+  obj->irqHandle = irqHandle;
+}
+
+void TimerHandleInit(stimer_t *obj, uint16_t period, uint16_t prescaler)
+{
+  ledTimerHandle = obj;
+  obj->timer->PSC = prescaler;
+  obj->timer->ARR = period;
+  obj->timer->DIER |= TIM_DIER_UIE;
+  obj->timer->CR1 |= TIM_CR1_CEN;
+}
+
+void TimerHandleDeinit(stimer_t *obj)
+{
+  obj->timer->CR1 &= ~TIM_CR1_CEN;
+  obj->timer->DIER &= ~TIM_DIER_UIE;
+  ledIrqPending = false;
+}
+
+/* Serial port */
+
+size_t Print::write(const uint8_t *buffer, size_t size)
+{
+  for (size_t i = 0; i < size; i++)
+    write(buffer[i]);
+  return size;
+}
+
+size_t Print::print(long value)
+{
+  char text[24];
+  snprintf(text, sizeof(text), "%ld", value);
+  return write(text);
+}
+
+size_t Print::print(unsigned long value)
+{
+  char text[24];
+  snprintf(text, sizeof(text), "%lu", value);
+  return write(text);
+}
+
+void HardwareSerial::begin(unsigned long baud) {}
+
+int HardwareSerial::available()
+{
+  uartReceive();
+  return stm32RxBuffer.size();
+}
+
+int HardwareSerial::read()
+{
+  uartReceive();
+  if (stm32RxBuffer.empty())
+    return -1;
+  uint8_t c = stm32RxBuffer.front();
+  stm32RxBuffer.pop_front();
+  return c;
+}
+
+int HardwareSerial::peek()
+{
+  uartReceive();
+  return stm32RxBuffer.empty() ? -1 : stm32RxBuffer.front();
+}
+
+void HardwareSerial::flush()
+{
+  if (uartTxBusyUntil > realTime)
+    wait(uartTxBusyUntil - realTime);
+}
+
+size_t HardwareSerial::write(uint8_t c)
+{
+  if (wired && moder(wiring.uartTxPin) != 2)
+    uartTxReleasedCount++;
+
+  uartTxBusyUntil = max(uartTxBusyUntil, realTime) + UART_BYTE_US;
+  uartToEsp32.push_back(std::make_pair(uartTxBusyUntil, c));
+  return 1;
+}
+
+/* Flash */
+
+HAL_StatusTypeDef HAL_FLASH_Unlock()
+{
+  flashUnlocked = true;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Lock()
+{
+  flashUnlocked = false;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASH_Program(uint32_t typeProgram, uint32_t address, uint64_t data)
+{
+  uint8_t halfWords = (typeProgram == FLASH_TYPEPROGRAM_HALFWORD) ? 1 : (typeProgram == FLASH_TYPEPROGRAM_WORD) ? 2 : 4;
+
+  for (uint8_t i = 0; i < halfWords; i++, address += 2, data >>= 16)
+  {
+    if (!flashUnlocked || address < FLASH_EMULATED_START || address + 2 > FLASH_EMULATED_END || (address & 1))
+    {
+      flashErrorCount++;
+      return HAL_ERROR;
+    }
+
+    powerLossCheck(0);
+    stall(FLASH_PROGRAM_US);
+
+    volatile uint16_t *halfWord = (volatile uint16_t *)(uintptr_t)address;
+    if (*halfWord != 0xFFFF)
+    {
+      flashErrorCount++; // PGERR
+      return HAL_ERROR;
+    }
+
+    mprotect((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ | PROT_WRITE);
+    *halfWord = data;
+    mprotect((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ);
+  }
+
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_Erase(FLASH_EraseInitTypeDef *erase, uint32_t *pageError)
+{
+  *pageError = 0xFFFFFFFF;
+
+  for (uint32_t page = 0; page < erase->NbPages; page++)
+  {
+    uint32_t address = erase->PageAddress + page * FLASH_PAGE_SIZE;
+    if (!flashUnlocked || address < FLASH_EMULATED_START || address >= FLASH_EMULATED_END || (address % FLASH_PAGE_SIZE))
+    {
+      flashErrorCount++;
+      *pageError = address;
+      return HAL_ERROR;
+    }
+
+    powerLossCheck(address);
+    stall(FLASH_ERASE_US);
+
+    mprotect((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ | PROT_WRITE);
+    memset((void *)(uintptr_t)address, 0xFF, FLASH_PAGE_SIZE);
+    mprotect((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ);
+  }
+
+  return HAL_OK;
+}
+
+uint32_t HAL_FLASHEx_OBGetUserData(uint32_t address)
+{
+  return persistent->optionBytes[address == OB_DATA_ADDRESS_DATA1 ? 1 : 0];
+}
+
+HAL_StatusTypeDef HAL_FLASH_OB_Unlock() { return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASH_OB_Lock() { return HAL_OK; }
+HAL_StatusTypeDef HAL_FLASH_OB_Launch() { return HAL_OK; }
+
+HAL_StatusTypeDef HAL_FLASHEx_OBErase()
+{
+  persistent->optionBytes[0] = persistent->optionBytes[1] = 0xFF;
+  return HAL_OK;
+}
+
+HAL_StatusTypeDef HAL_FLASHEx_OBProgram(FLASH_OBProgramInitTypeDef *init)
+{
+  persistent->optionBytes[init->DATAAddress == OB_DATA_ADDRESS_DATA1 ? 1 : 0] = init->DATAData;
+  return HAL_OK;
+}
+
+/* Watchdog : (reload + 1) * 4 * 2^prescaler LSI periods without refresh */
+
+HAL_StatusTypeDef HAL_IWDG_Init(IWDG_HandleTypeDef *hiwdg)
+{
+  watchdogRunning = true;
+  watchdogTimeout = ((uint64_t)hiwdg->Init.Reload + 1) * (4ULL << hiwdg->Init.Prescaler) * 1000000 / lsiFrequency;
+  return HAL_IWDG_Refresh(hiwdg);
+}
+
+HAL_StatusTypeDef HAL_IWDG_Refresh(IWDG_HandleTypeDef *hiwdg)
+{
+  if (watchdogRunning)
+    watchdogDeadline = realTime + watchdogTimeout;
+  return HAL_OK;
+}
+
+/* Test side */
+
+namespace sim {
+
+void setWiring(const Wiring &newWiring)
+{
+  wiring = newWiring;
+  wired = true;
+}
+
+BootResult boot(const std::function<void()> &scenario, const std::function<void(BootResult)> &atEnd)
+{
+  fflush(stdout);
+  fflush(stderr);
+
+  pid_t pid = fork();
+  if (pid < 0)
+  {
+    perror("fork");
+    exit(1);
+  }
+
+  if (pid == 0)
+  {
+    int result;
+    try
+    {
+      scenario();
+      result = BOOT_RETURNED;
+    }
+    catch (const PowerOff &)
+    {
+      result = BOOT_POWER_OFF;
+    }
+    catch (const WatchdogReset &)
+    {
+      result = BOOT_WATCHDOG_RESET;
+    }
+    catch (...)
+    {
+      result = BOOT_CRASHED;
+    }
+
+    if (atEnd && result != BOOT_CRASHED)
+    {
+      inSimulator = true; // Checks only
+      atEnd((BootResult)result);
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    _exit(result | (testFailureCount > 0 ? 0x80 : 0));
+  }
+
+  int status;
+  waitpid(pid, &status, 0);
+  if (!WIFEXITED(status))
+  {
+    fprintf(stderr, "Boot crashed (signal %d)\n", WIFSIGNALED(status) ? WTERMSIG(status) : 0);
+    testFailureCount++;
+    return BOOT_CRASHED;
+  }
+
+  int code = WEXITSTATUS(status);
+  if (code & 0x80)
+    testFailureCount++;
+  if ((code & 0x7F) == BOOT_CRASHED)
+  {
+    fprintf(stderr, "Boot crashed (exception)\n");
+    testFailureCount++;
+  }
+  return (BootResult)(code & 0x7F);
+}
+
+void resetFlash(uint32_t boardId)
+{
+  mprotect((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ | PROT_WRITE);
+  memset((void *)FLASH_EMULATED_START, 0xFF, FLASH_EMULATED_END - FLASH_EMULATED_START);
+  *(volatile uint32_t *)(FLASH_EMULATED_END - 4) = boardId;
+  mprotect((void *)FLASH_EMULATED_START, FLASH_EMULATED_END - FLASH_EMULATED_START, PROT_READ);
+  persistent->optionBytes[0] = persistent->optionBytes[1] = 0xFF;
+}
+
+uint64_t now()
+{
+  return realTime;
+}
+
+void advance(uint64_t us)
+{
+  wait(us);
+}
+
+void at(uint64_t timeUs, const std::function<void()> &action)
+{
+  actions.insert(std::make_pair(max(timeUs, realTime), action));
+}
+
+void after(uint64_t us, const std::function<void()> &action)
+{
+  at(realTime + us, action);
+}
+
+void setLsiFrequency(uint32_t hz)
+{
+  lsiFrequency = hz;
+}
+
+void setTaskCost(uint8_t task, uint32_t us)
+{
+  taskCosts[task % 8] = us;
+}
+
+void chargeTaskCost(uint8_t task)
+{
+  if (taskCosts[task % 8] > 0)
+    wait(taskCosts[task % 8]);
+}
+
+void setPinInput(uint8_t pin, int level)
+{
+  pinInputs[pin] = level;
+}
+
+void setAnalogInput(uint8_t pin, const std::function<uint16_t()> &source)
+{
+  analogInputs[pin] = source;
+}
+
+void setAnalogValue(uint8_t pin, uint16_t value)
+{
+  analogInputs[pin] = [value]() { return value; };
+}
+
+void pressButton()
+{
+  buttonPressed = true;
+}
+
+void releaseButton()
+{
+  buttonPressed = false;
+  if (!inSimulator)
+    checkPower();
+}
+
+bool isPowered()
+{
+  return powered();
+}
+
+int pinOutput(uint8_t pin)
+{
+  return moder(pin) == 1 ? (int)((simGPIOA.ODR.value >> pin) & 1) : -1;
+}
+
+bool pinFloating(uint8_t pin)
+{
+  return (moder(pin) == 0 || moder(pin) == 3) && ((simGPIOA.PUPDR.value >> (2 * pin)) & 3) == 0;
+}
+
+int litLed()
+{
+  int high = -1, low = -1;
+  for (uint8_t i = 0; i < wiring.ledPinsCount; i++)
+  {
+    uint8_t pin = wiring.ledPins[i];
+    if (moder(pin) != 1)
+      continue;
+    if ((simGPIOA.ODR.value >> pin) & 1)
+    {
+      if (high >= 0)
+        return -1;
+      high = pin;
+    }
+    else
+    {
+      if (low >= 0)
+        return -1;
+      low = pin;
+    }
+  }
+
+  return (high >= 0 && low >= 0) ? (high << 8) | low : -1;
+}
+
+uint64_t ledOnTime(uint8_t highPin, uint8_t lowPin)
+{
+  accountLeds();
+  return ledOnTimes[highPin][lowPin];
+}
+
+void resetLedOnTimes()
+{
+  accountLeds();
+  memset(ledOnTimes, 0, sizeof(ledOnTimes));
+}
+
+unsigned long ledInterruptCount()
+{
+  return ledIrqCount;
+}
+
+unsigned long flashOperations()
+{
+  return flashOperationCount;
+}
+
+unsigned long flashErrors()
+{
+  return flashErrorCount;
+}
+
+unsigned long uartTxWhileReleased()
+{
+  return uartTxReleasedCount;
+}
+
+unsigned long systemClockConfigCalls()
+{
+  return systemClockConfigs;
+}
+
+uint64_t sleepModeTime()
+{
+  return sleepTime;
+}
+
+uint64_t stopModeTime()
+{
+  return stopTime;
+}
+
+bool inStopMode()
+{
+  return stopMode;
+}
+
+void powerLossAfterFlashOperations(unsigned long operations)
+{
+  flashPowerLossAt = (operations == 0) ? 0 : flashOperationCount + operations;
+}
+
+void setOptionBytes(uint8_t data0, uint8_t data1)
+{
+  persistent->optionBytes[0] = data0;
+  persistent->optionBytes[1] = data1;
+}
+
+unsigned long uartRxOverflows()
+{
+  return uartRxOverflowCount;
+}
+
+int Esp32Uart::available()
+{
+  int count = 0;
+  for (size_t i = 0; i < uartToEsp32.size() && uartToEsp32[i].first <= realTime; i++)
+    count++;
+  return count;
+}
+
+int Esp32Uart::read()
+{
+  if (available() == 0)
+    return -1;
+  uint8_t c = uartToEsp32.front().second;
+  uartToEsp32.pop_front();
+  return c;
+}
+
+int Esp32Uart::peek()
+{
+  return available() ? uartToEsp32.front().second : -1;
+}
+
+size_t Esp32Uart::write(uint8_t c)
+{
+  uartRxLastArrival = max(uartRxLastArrival, realTime) + UART_BYTE_US;
+  uartToStm32.push_back(std::make_pair(uartRxLastArrival, c));
+  return 1;
+}
+
+std::string Esp32Uart::readAll()
+{
+  std::string text;
+  while (available())
+    text += (char)read();
+  return text;
+}
+
+} // namespace sim
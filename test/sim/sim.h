@@ -0,0 +1,107 @@
+/* Host simulation of the board : test side
+ *
+ * The virtual time only goes on when the sketch waits (delay, __WFI, Stop mode, busy waits on registers) : the code
+ * itself runs in zero time. Peripherals (ADC scans, LED timer, RTC, watchdog) and the actions scheduled by the test
+ * run at their time, in order.
+ *
+ * The board is powered while the regulator enable line is an output driven high, or while the push button is
+ * pressed. A power loss (or a watchdog reset) is thrown as an exception out of the sketch code : sim::boot() runs each
+ * power cycle in a child process, with fresh RAM, while the emulated flash is kept.
+ */
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <Arduino.h>
+#include <functional>
+#include <string>
+
+namespace sim {
+
+/* Thrown out of the sketch when the board loses its power */
+struct PowerOff {};
+
+/* Thrown out of the sketch when the watchdog expires */
+struct WatchdogReset {};
+
+enum BootResult {
+  BOOT_RETURNED = 0, // The scenario returned with the board still powered
+  BOOT_POWER_OFF = 1,
+  BOOT_WATCHDOG_RESET = 2,
+  BOOT_CRASHED = 3
+};
+
+/* Board wiring, set once by the test harness */
+struct Wiring {
+  uint8_t powerEnablePin;
+  uint8_t buttonPin; // Reads HIGH while the button is pressed, which also powers the board
+  uint8_t uartTxPin; // Must be in alternate function mode while transmitting
+  const uint8_t *ledPins; // Charlieplexed LEDs
+  uint8_t ledPinsCount;
+};
+void setWiring(const Wiring &wiring);
+
+/* Run a power cycle of the board in a child process : the RAM starts from its initial state, the flash and the
+   option bytes are shared with the other power cycles of the test. Failed checks in the child fail the test.
+   The board state at the end of the power cycle (pins, time, sketch variables) is checked in atEnd, in the child. */
+BootResult boot(const std::function<void()> &scenario,
+                const std::function<void(BootResult)> &atEnd = std::function<void(BootResult)>());
+
+/* Restore the erased flash, the board ID and blank option bytes. Called before each test. */
+void resetFlash(uint32_t boardId = 1);
+
+// Time
+uint64_t now(); // Real time (us), also counting the time spent in Stop mode
+void advance(uint64_t us); // Let the time go on without running the main loop (the interrupts still run)
+void at(uint64_t timeUs, const std::function<void()> &action); // Run an action at a given real time
+void after(uint64_t us, const std::function<void()> &action);
+void setLsiFrequency(uint32_t hz); // RTC and watchdog clock, 40kHz by default
+void setTaskCost(uint8_t task, uint32_t us); // Busy time added to each run of a scheduler task (0 by default)
+
+// Inputs
+void setPinInput(uint8_t pin, int level); // -1 : floating, the pull-up / pull-down decides
+void setAnalogInput(uint8_t pin, const std::function<uint16_t()> &source); // ADC reading of a pin
+void setAnalogValue(uint8_t pin, uint16_t value);
+void pressButton();
+void releaseButton();
+bool isPowered();
+
+// Outputs
+int pinOutput(uint8_t pin); // -1 if the pin is not an output
+bool pinFloating(uint8_t pin); // Input or analog, without pull-up / pull-down
+int litLed(); // Lit LED as (high pin << 8) | low pin, -1 if none or ambiguous (several pins driven)
+uint64_t ledOnTime(uint8_t highPin, uint8_t lowPin); // Total time (us) the LED was lit
+void resetLedOnTimes();
+unsigned long ledInterruptCount();
+unsigned long flashOperations(); // Program and erase operations since the boot
+unsigned long flashErrors(); // Programming a non erased half-word, outside the emulated area, while locked
+unsigned long uartTxWhileReleased(); // Bytes sent while the TX pin was not in alternate function mode
+unsigned long systemClockConfigCalls();
+uint64_t sleepModeTime(); // us spent in Sleep mode (__WFI)
+uint64_t stopModeTime(); // us spent in Stop mode
+bool inStopMode(); // For actions run during the Stop mode
+
+/* Power loss after the given number of flash operations (program a half-word or erase a page), 0 to disable.
+   An interrupted erase leaves half of the page erased, an interrupted program doesn't change the half-word. */
+void powerLossAfterFlashOperations(unsigned long operations);
+
+void setOptionBytes(uint8_t data0, uint8_t data1);
+
+/* ESP32 side of the UART. Bytes are received at 115200 bauds. */
+class Esp32Uart : public Stream {
+public:
+  int available() override;
+  int read() override;
+  int peek() override;
+  size_t write(uint8_t c) override;
+  using Print::write;
+  std::string readAll();
+};
+extern Esp32Uart esp32;
+
+/* Overflowed bytes of the STM32 receive buffer */
+unsigned long uartRxOverflows();
+
+} // namespace sim
+
+#endif
@@ -0,0 +1,145 @@
+/* Sleep between the tasks (sleepUntilNextTask() in scheduler.ino) : GET_SLEEP_RATIO against the time spent in __WFI */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "power_model.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+/* Time in each mode over a part of a scenario */
+struct ModeTimes {
+  uint64_t start, sleepStart, stopStart;
+  void begin() { start = sim::now(); sleepStart = sim::sleepModeTime(); stopStart = sim::stopModeTime(); }
+  double sleepRatio() const { return (sim::sleepModeTime() - sleepStart) * 1000.0 / (sim::now() - start); }
+  double stopRatio() const { return (sim::stopModeTime() - stopStart) * 1000.0 / (sim::now() - start); }
+};
+
+/* Time in __WFI since the given point (1/1000) */
+static long simulatedSleepRatio(uint64_t sleepStart, uint64_t start)
+{
+  return (sim::sleepModeTime() - sleepStart) * 1000 / (sim::now() - start);
+}
+
+TEST(sleep_ratio_matches_the_time_in_sleep_mode)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+    query(API::GET_SLEEP_RATIO); // Reset
+
+    uint64_t sleepStart = sim::sleepModeTime(), start = sim::now();
+    runFor(2000);
+    long expected = simulatedSleepRatio(sleepStart, start);
+    long ratio = query(API::GET_SLEEP_RATIO);
+    CHECK(expected > 500); // Idle most of the time
+    CHECK_NEAR(expected, ratio, 10);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(serial_traffic_lowers_the_sleep_ratio)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(1000);
+    long idleRatio = query(API::GET_SLEEP_RATIO);
+
+    uint64_t sleepStart = sim::sleepModeTime(), start = sim::now();
+    for (int i = 0; i < 200; i++)
+      query(API::GET_BATTERY_VOLTAGE);
+    long expected = simulatedSleepRatio(sleepStart, start);
+    long ratio = query(API::GET_SLEEP_RATIO);
+    CHECK(ratio < idleRatio);
+    CHECK_NEAR(expected, ratio, 10);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(no_sleep_while_a_task_is_due)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(100);
+
+    _taskDueTime[0] = millis();
+    unsigned long sleepTime = _sleepTime;
+    uint64_t sleepStart = sim::sleepModeTime();
+    sleepUntilNextTask();
+    CHECK_EQUAL(sleepTime, _sleepTime);
+    CHECK_EQUAL(sleepStart, sim::sleepModeTime());
+
+    // Idle again : sleeps until the next interrupt (SysTick at most)
+    loop();
+    CHECK(_sleepTime > sleepTime);
+    CHECK(sim::sleepModeTime() > sleepStart);
+    CHECK(sim::sleepModeTime() - sleepStart <= 1000);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(current_model_weights_the_mode_currents)
+{
+  const ModeCurrents currents = {10.0, 2.0, 4.0};
+  CHECK_NEAR(10.0, averageCurrentMa(0, 0, currents), 1e-9);
+  CHECK_NEAR(2.0, averageCurrentMa(1000, 0, currents), 1e-9);
+  CHECK_NEAR(0.004, averageCurrentMa(0, 1000, currents), 1e-9);
+  CHECK_NEAR(6.0, averageCurrentMa(500, 0, currents), 1e-9);
+  CHECK_NEAR(0.1 * 10.0 + 0.2 * 2.0 + 0.7 * 0.004, averageCurrentMa(200, 700, currents), 1e-9);
+}
+
+TEST(average_current_per_state)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK(runUntil([]() { return currentState == ACTIVE; }, 5000));
+    runFor(1000);
+
+    // ACTIVE, the ESP32 polling the battery voltage every 20ms
+    ModeTimes times;
+    query(API::GET_SLEEP_RATIO);
+    times.begin();
+    for (int i = 0; i < 100; i++)
+    {
+      query(API::GET_BATTERY_VOLTAGE);
+      runFor(20);
+    }
+    double pollingSleepRatio = times.sleepRatio();
+    double pollingCurrent = averageCurrentMa(pollingSleepRatio, times.stopRatio());
+    CHECK_NEAR(pollingCurrent, averageCurrentMa(query(API::GET_SLEEP_RATIO), 0), 0.1);
+
+    // ACTIVE, the ESP32 off : no UART traffic
+    times.begin();
+    runFor(2000);
+    double idleSleepRatio = times.sleepRatio();
+    double idleCurrent = averageCurrentMa(idleSleepRatio, times.stopRatio());
+    CHECK_NEAR(idleCurrent, averageCurrentMa(query(API::GET_SLEEP_RATIO), 0), 0.1);
+
+    // Storage : 60s between two button presses, RTC alarms included
+    static ModeTimes storageTimes;
+    static double storageSleepRatio, storageStopRatio;
+    sim::after(1000000, []() { storageTimes.begin(); });
+    sim::after(61000000, []() {
+      storageSleepRatio = storageTimes.sleepRatio();
+      storageStopRatio = storageTimes.stopRatio();
+      sim::pressButton();
+    });
+    sim::after(61100000, sim::releaseButton);
+    sendCommand(API::ENTER_STORAGE_MODE);
+    CHECK(runUntil([]() { return currentState == ESP32_STARTUP; }, 1000));
+    double storageCurrent = averageCurrentMa(storageSleepRatio, storageStopRatio);
+
+    printf("STM32 average current (run %.1fmA, sleep %.1fmA, stop %.1fuA) :\n", STM32_MODE_CURRENTS.runMa,
+           STM32_MODE_CURRENTS.sleepMa, STM32_MODE_CURRENTS.stopUa);
+    printf("  ACTIVE, ESP32 polling : sleep %.0f / 1000, %.2fmA\n", pollingSleepRatio, pollingCurrent);
+    printf("  ACTIVE, ESP32 off     : sleep %.0f / 1000, %.2fmA\n", idleSleepRatio, idleCurrent);
+    printf("  Storage               : stop %.1f / 1000, %.1fuA\n", storageStopRatio, storageCurrent * 1000);
+    CHECK(idleCurrent < pollingCurrent);
+    CHECK(storageCurrent < STM32_MODE_CURRENTS.stopUa * 2 / 1000);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
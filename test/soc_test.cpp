@@ -0,0 +1,75 @@
+/* State of charge estimation (state_of_charge.ino) */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+TEST(coulomb_counting_matches_the_charge_ratio)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    sendValueFrame(API::SET_BATTERY_CAPACITY, 1000);
+    runFor(100);
+    CHECK_EQUAL(1000, _battCapacity);
+
+    // 3A for 2 minutes : 100mAh, 10% of the capacity
+    setLoadCurrent(3000);
+    int startPercentage = -1;
+    unsigned long mismatches = 0, updates = 0;
+    unsigned long start = millis();
+    while (millis() - start < 120000)
+    {
+      loop();
+      if (_remainingCharge < 0 || _socPercentage <= 0)
+        continue;
+      if (startPercentage < 0)
+        startPercentage = _socPercentage;
+
+      // Same result as the division
+      long long full = (long long)_battCapacity * MS_PER_HOUR;
+      if (_socPercentage != max((int)(_remainingCharge * 100 / full), 1))
+        mismatches++;
+      updates++;
+    }
+    CHECK(updates > 0);
+    CHECK_EQUAL(0, mismatches);
+    double delivered = (adcToLoadCurrent(loadCurrentReading(3000)) >> CURRENT_MEAS_DECIMAL_PART) * 120.0 / 3600;
+    CHECK_NEAR(startPercentage - delivered / 10, getBatteryPercentage(), 1);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(voltage_drop_is_compensated)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    sendValueFrame(API::SET_BATTERY_RESISTANCE, 120);
+    setBatteryVoltage(15000);
+    setLoadCurrent(2000);
+    runFor(120000); // Long term filter
+
+    unsigned int current = adcToLoadCurrent(loadCurrentReading(2000)) >> CURRENT_MEAS_DECIMAL_PART;
+    CHECK_NEAR(getAverageBatteryVoltage() + current * 120 / 1000, getOcvBatteryVoltage(), 2);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(capacity_is_limited)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    sendValueFrame(API::SET_BATTERY_CAPACITY, 250000);
+    runFor(100);
+    CHECK_EQUAL(MAX_BATT_CAPACITY, _battCapacity);
+    CHECK(_chargePerPercent == (unsigned long long)MAX_BATT_CAPACITY * MS_PER_HOUR / 100);
+
+    runFor(1000);
+    CHECK(getBatteryPercentage() > 0);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
@@ -0,0 +1,22 @@
+/* Profile storage disabled : the code reaches the storage pages (image end set by test/CMakeLists.txt) */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+TEST(storage_is_reported_as_disabled)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK(!_profileStorageAvailable);
+    CHECK_EQUAL(-1, query(API::GET_STORAGE_STATE));
+
+    const unsigned int breaks[7] = {12800, 14200, 14600, 15000, 15400, 15800, 16800};
+    CHECK(!storeUserProfile(0, breaks));
+    CHECK_EQUAL(0, sim::flashOperations()); // The code is never overwritten
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
@@ -0,0 +1,155 @@
+/* Storage mode (storage_mode.ino) : Stop mode until a button press, with the LEDs and the ESP32 turned off */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+/* Board subscribed to the push events, then in storage mode. The button is pressed after pressUs, for holdUs. */
+static void enterStorageMode(uint64_t pressUs, uint64_t holdUs)
+{
+  startBoard();
+  CHECK(runUntil([]() { return currentState == ACTIVE; }, 5000)); // Entered from the ACTIVE state only
+  sendValueFrame(API::SUBSCRIBE, 0);
+  runFor(10);
+  CHECK(_subscribed);
+
+  sim::after(pressUs, sim::pressButton);
+  sim::after(pressUs + holdUs, sim::releaseButton);
+  sendCommand(API::ENTER_STORAGE_MODE);
+}
+
+TEST(button_press_resumes_the_board)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    int esp32Enabled = -1;
+    enterStorageMode(3000000, 100000);
+    esp32Enabled = sim::pinOutput(ESP32_ENABLE_PIN);
+
+    // ESP32 off and LEDs released during the Stop mode
+    sim::after(2000000, [esp32Enabled]() {
+      CHECK(sim::inStopMode());
+      CHECK(sim::pinOutput(ESP32_ENABLE_PIN) != esp32Enabled);
+      CHECK(!(TIM16->CR1 & TIM_CR1_CEN));
+      for (uint8_t i = 0; i < LED_PINS_COUNT; i++)
+        CHECK(sim::pinFloating(LED_PINS[i]));
+      CHECK(!_subscribed);
+    });
+
+    unsigned long ledInterrupts = sim::ledInterruptCount();
+    runUntil([]() { return currentState == ESP32_STARTUP; }, 1000);
+    CHECK(sim::stopModeTime() > 2500000);
+    CHECK(sim::ledInterruptCount() > ledInterrupts);
+    CHECK(TIM16->CR1 & TIM_CR1_CEN);
+
+    // The ESP32 starts again, not subscribed
+    runFor(LOAD_SWITCH_START_DELAY_MS + 100);
+    CHECK_EQUAL(ACTIVE, currentState);
+    CHECK_EQUAL(esp32Enabled, sim::pinOutput(ESP32_ENABLE_PIN));
+    CHECK(!_subscribed);
+    CHECK(sim::isPowered());
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(resume_press_is_not_a_click)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    enterStorageMode(2000000, 150000);
+    runUntil([]() { return currentState == ESP32_STARTUP; }, 1000);
+    CHECK(!sim::inStopMode());
+    CHECK_EQUAL(LOW, digitalRead(PUSH_BUTTON_DETECT_PIN)); // Resumed once released
+
+    runFor(LOAD_SWITCH_START_DELAY_MS + 100);
+    CHECK_EQUAL(API::NO_EVENT, query(API::GET_BUTTON_EVENT));
+    CHECK_EQUAL(ACTIVE, currentState);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(rtc_alarms_keep_the_watchdog_refreshed)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    enterStorageMode(30000000, 100000);
+    runUntil([]() { return currentState == ESP32_STARTUP; }, 1000);
+    CHECK(sim::stopModeTime() > 29000000);
+    CHECK_EQUAL(ESP32_STARTUP, currentState);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(storage_is_not_counted_in_the_task_stats)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    enterStorageMode(2000000, 300000);
+    runUntil([]() { return currentState == ESP32_STARTUP; }, 1000);
+    runFor(LOAD_SWITCH_START_DELAY_MS + 100);
+
+    CHECK(query(API::GET_LOOP_TIME) < 10000); // The 300ms press is not a loop iteration
+    CHECK(query(API::GET_SLEEP_RATIO) > 500);
+    for (uint8_t i = 0; i < TASKS_COUNT; i++)
+    {
+      sim::esp32.readAll();
+      sendCommand(API::GET_TASK_STATS, i);
+      long stats = readAnswer();
+      CHECK_EQUAL(0, stats & 0xFFFF); // No deadline miss
+      CHECK((stats >> 16) < 10000);
+    }
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(wake_up_latency)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    static uint64_t pressStopTime, releaseTime;
+    enterStorageMode(3000000000ULL, 0); // Pressed below
+    sim::after(2000000, []() {
+      pressStopTime = sim::stopModeTime();
+      sim::pressButton();
+    });
+    sim::after(2100000, []() {
+      releaseTime = sim::now();
+      sim::releaseButton();
+    });
+    runUntil([]() { return currentState == ESP32_STARTUP; }, 1000);
+
+    // Stop mode left on the button edge, tasks restarted once the button is released (polled every 10ms)
+    uint64_t stopAfterPress = sim::stopModeTime() - pressStopTime, resumeLatency = sim::now() - releaseTime;
+    printf("Stop mode after the press : %lu us, tasks restarted %lu us after the release\n",
+           (unsigned long)stopAfterPress, (unsigned long)resumeLatency);
+    CHECK_EQUAL(0, stopAfterPress);
+    CHECK(resumeLatency <= 10000);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(empty_battery_shuts_the_board_down)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    enterStorageMode(3000000000ULL, 100000);
+
+    // The battery is measured every STORAGE_BATTERY_CHECK_PERIOD_S only
+    sim::after(STORAGE_BATTERY_CHECK_PERIOD_S * 1000000 + 10000000, []() {
+      CHECK(sim::isPowered());
+      CHECK(sim::inStopMode());
+      setBatteryVoltage(13900); // 4S LiPo under 3.5V per cell
+    });
+    sim::after(2 * STORAGE_BATTERY_CHECK_PERIOD_S * 1000000 - 10000000, []() {
+      CHECK(sim::isPowered());
+    });
+    runFor(1000);
+  }, [](sim::BootResult) {
+    CHECK(!sim::isPowered());
+    CHECK(sim::stopModeTime() > 2 * STORAGE_BATTERY_CHECK_PERIOD_S * 1000000ULL - 10000000); // At the second check
+    CHECK(sim::stopModeTime() < 2 * STORAGE_BATTERY_CHECK_PERIOD_S * 1000000ULL + 1000000);
+  });
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+}
@@ -0,0 +1,60 @@
+/* Target build : the optional features are left out (firmware_features.h defaults). The board still starts, stores
+   its profiles and shuts down, and the commands of the missing features are ignored. */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+static_assert(!FEATURE_LED_ANIMATIONS && !FEATURE_CALIBRATION_COMMANDS && !FEATURE_LOAD_STATS, "Target build expected");
+
+TEST(board_runs_without_the_optional_features)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(LOAD_SWITCH_START_DELAY_MS + 100);
+    CHECK_EQUAL(ACTIVE, currentState);
+    CHECK_EQUAL(API::API_VERSION, query(API::GET_API_VERSION));
+    CHECK(query(API::GET_STORAGE_STATE) > 0);
+    CHECK(getBatteryState().breaksValid);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(missing_feature_commands_are_ignored)
+{
+  wireBoard();
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[0], HIGH); // Custom : the calibration commands would be accepted
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[1], HIGH);
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(100);
+    CHECK_EQUAL(LONG_MIN, query(API::GET_LOAD_STATS));
+    CHECK_EQUAL(LONG_MIN, query(API::GET_CALIBRATION_STATE));
+
+    sendCommand(API::CALIBRATE_VOLTAGE, CALIBRATION_VOLTAGE);
+    sendCommand(API::PLAY_ANIMATION, API::ANIMATION_BLINK);
+    runFor(200);
+    CHECK(!isAnimationPlaying());
+    CHECK_EQUAL(-1, sim::litLed());
+    CHECK_EQUAL(API::API_VERSION, query(API::GET_API_VERSION)); // Still answering
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(long_press_shuts_down_without_animation)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    runFor(STARTUP_GUARD_TIME_MS + 1000);
+
+    sim::pressButton();
+    sim::after(2000000, sim::releaseButton);
+    runFor(3000);
+    CHECK(false); // Not reached
+  });
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+}
@@ -0,0 +1,55 @@
+/* Minimal test framework : TEST(name) { ... } bodies with CHECK macros, run by test_main.cpp.
+ *
+ * Each test runs in its own process, on a fresh simulated board (see sim/sim.h).
+ */
+
+#ifndef TEST_H
+#define TEST_H
+
+#include <stdio.h>
+
+extern int testFailureCount;
+
+typedef void (*TestFunction)();
+
+struct TestRegistration {
+  TestRegistration(const char *name, TestFunction function);
+};
+
+#define TEST(name) \
+  static void test_##name(); \
+  static TestRegistration testRegistration_##name(#name, test_##name); \
+  static void test_##name()
+
+#define CHECK(condition) \
+  do { \
+    if (!(condition)) \
+    { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+      testFailureCount++; \
+    } \
+  } while (0)
+
+#define CHECK_EQUAL(expected, actual) \
+  do { \
+    long long checkExpected = (long long)(expected), checkActual = (long long)(actual); \
+    if (checkExpected != checkActual) \
+    { \
+      fprintf(stderr, "%s:%d: CHECK_EQUAL(%s, %s) failed : expected %lld, got %lld\n", __FILE__, __LINE__, #expected, \
+              #actual, checkExpected, checkActual); \
+      testFailureCount++; \
+    } \
+  } while (0)
+
+#define CHECK_NEAR(expected, actual, tolerance) \
+  do { \
+    double checkExpected = (double)(expected), checkActual = (double)(actual); \
+    if (checkActual < checkExpected - (tolerance) || checkActual > checkExpected + (tolerance)) \
+    { \
+      fprintf(stderr, "%s:%d: CHECK_NEAR(%s, %s, %s) failed : expected %g, got %g\n", __FILE__, __LINE__, #expected, \
+              #actual, #tolerance, checkExpected, checkActual); \
+      testFailureCount++; \
+    } \
+  } while (0)
+
+#endif
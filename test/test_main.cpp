@@ -0,0 +1,66 @@
+/* Test runner : runs the tests matching the optional argument (substring of the name), each in its own process */
+
+#include "test.h"
+#include "sim.h"
+
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+int testFailureCount;
+
+namespace {
+
+struct Test {
+  const char *name;
+  TestFunction function;
+};
+
+std::vector<Test> &tests()
+{
+  static std::vector<Test> registered;
+  return registered;
+}
+
+} // namespace
+
+TestRegistration::TestRegistration(const char *name, TestFunction function)
+{
+  tests().push_back({name, function});
+}
+
+int main(int argc, char **argv)
+{
+  int failed = 0, run = 0;
+
+  for (const Test &test : tests())
+  {
+    if (argc > 1 && strstr(test.name, argv[1]) == NULL)
+      continue;
+
+    printf("[ RUN  ] %s\n", test.name);
+    fflush(stdout);
+    run++;
+
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+      sim::resetFlash();
+      test.function();
+      fflush(stdout);
+      fflush(stderr);
+      _exit(testFailureCount > 0 ? 1 : 0);
+    }
+
+    int status;
+    waitpid(pid, &status, 0);
+    bool passed = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    if (!passed)
+      failed++;
+    printf("[ %s ] %s\n", passed ? " OK " : "FAIL", test.name);
+  }
+
+  printf("%d tests, %d failed\n", run, failed);
+  return (failed > 0 || run == 0) ? 1 : 0;
+}
@@ -0,0 +1,108 @@
+/* Thermal protection (thermal_protection.ino) : threshold changes, levels along a temperature ramp */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+static void setThreshold(uint8_t level, int temperature)
+{
+  sendCommand(API::SET_THERMAL_THRESHOLD, temperature + level);
+  runFor(10);
+}
+
+static void checkThresholds(int warning, int loadCut, int shutdown)
+{
+  CHECK_EQUAL(warning, _thermalThresholds[0]);
+  CHECK_EQUAL(loadCut, _thermalThresholds[1]);
+  CHECK_EQUAL(shutdown, _thermalThresholds[2]);
+}
+
+TEST(thresholds_stay_in_order_with_a_margin)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    checkThresholds(600, 700, 800);
+
+    setThreshold(API::THERMAL_WARNING, 700); // Same as the load cut
+    setThreshold(API::THERMAL_WARNING, 650); // Within the hysteresis of the load cut
+    setThreshold(API::THERMAL_LOAD_CUT, 850); // Above the shutdown
+    setThreshold(API::THERMAL_SHUTDOWN, 1250); // Never read by the thermistor
+    setThreshold(API::THERMAL_NORMAL, 500);
+    checkThresholds(600, 700, 800);
+
+    setThreshold(API::THERMAL_WARNING, 640);
+    setThreshold(API::THERMAL_SHUTDOWN, 1200);
+    setThreshold(API::THERMAL_LOAD_CUT, 1100);
+    checkThresholds(640, 1100, 1200);
+
+    // Lowered : the warning first
+    setThreshold(API::THERMAL_LOAD_CUT, 500);
+    checkThresholds(640, 1100, 1200);
+    setThreshold(API::THERMAL_WARNING, 400);
+    setThreshold(API::THERMAL_LOAD_CUT, 500);
+    setThreshold(API::THERMAL_SHUTDOWN, 600);
+    checkThresholds(400, 500, 600);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+#if HW_REVISION > 1
+/* Level expected after a reading at the given temperature : up at a threshold, down THERMAL_HYSTERESIS below it */
+static uint8_t expectedLevel(uint8_t level, int temperature)
+{
+  while (level < API::THERMAL_SHUTDOWN && temperature >= _thermalThresholds[level])
+    level++;
+  while (level > API::THERMAL_NORMAL && temperature < _thermalThresholds[level - 1] - THERMAL_HYSTERESIS)
+    level--;
+  return level;
+}
+
+/* Half degree steps : never on a threshold, whatever the rounding of the thermistor reading */
+static void rampTo(int target)
+{
+  static int temperature = 255;
+  static uint8_t level = API::THERMAL_NORMAL;
+  int step = (target > temperature) ? 10 : -10;
+  while (temperature != target)
+  {
+    temperature += step;
+    setTemperature(temperature);
+    runFor(2 * TEMP_MEAS_PERIOD_MS);
+    level = expectedLevel(level, temperature);
+    CHECK_EQUAL(level, query(API::GET_THERMAL_LEVEL));
+    CHECK_EQUAL(level < API::THERMAL_LOAD_CUT, sim::pinOutput(MAIN_OUT_ENABLE_PIN));
+  }
+}
+
+TEST(levels_follow_a_temperature_ramp)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    setThreshold(API::THERMAL_WARNING, 500);
+    setThreshold(API::THERMAL_LOAD_CUT, 600);
+    setThreshold(API::THERMAL_SHUTDOWN, 700);
+    runFor(LOAD_SWITCH_START_DELAY_MS + 100);
+    CHECK_EQUAL(HIGH, sim::pinOutput(MAIN_OUT_ENABLE_PIN));
+
+    rampTo(655); // Warning, then load cut
+    CHECK_EQUAL(API::THERMAL_LOAD_CUT, _thermalLevel);
+    rampTo(545); // Load cut kept down to 55°C
+    CHECK_EQUAL(API::THERMAL_WARNING, _thermalLevel);
+    rampTo(625);
+    rampTo(255);
+    CHECK_EQUAL(API::THERMAL_NORMAL, _thermalLevel);
+    CHECK_EQUAL(HIGH, sim::pinOutput(MAIN_OUT_ENABLE_PIN)); // Requested : turned back on
+
+    rampTo(715);
+    CHECK(false); // Shut down at 70°C
+  }, [](sim::BootResult) {
+    CHECK_EQUAL(API::THERMAL_SHUTDOWN, _thermalLevel);
+    CHECK_EQUAL(LOW, sim::pinOutput(ESP32_ENABLE_PIN));
+  });
+  CHECK_EQUAL(sim::BOOT_POWER_OFF, result);
+}
+#endif
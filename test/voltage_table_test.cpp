@@ -0,0 +1,159 @@
+/* Voltage to percentage lookup table (batt_monitoring.ino), built a few percentages per ADC block */
+
+#include "STM32_KXKM_Battery_monitoring.ino.cpp"
+#include "bench.h"
+#include "board.h"
+#include "test.h"
+
+typedef KXKM_STM32_Energy API;
+
+static void setBreaks(const unsigned int (&breaks)[7])
+{
+  for (uint8_t i = 0; i < 7; i++)
+    setBatteryVoltageBreak(i, breaks[i]);
+}
+
+/* Lookups until the table is valid, checking the work done by each one */
+static int buildByLookups()
+{
+  int lookups = 0;
+  while (!_voltageTableValid && lookups < 100)
+  {
+    uint8_t before = _voltageTableNextPercentage;
+    getVoltagePercentage(15000);
+    lookups++;
+    if (before != VOLTAGE_TABLE_IDLE && _voltageTableNextPercentage != VOLTAGE_TABLE_IDLE)
+      CHECK(_voltageTableNextPercentage - before <= VOLTAGE_TABLE_BUILD_STEP);
+    if (_voltageTableNextPercentage == VOLTAGE_TABLE_IDLE && !_voltageTableValid)
+      break; // Invalid breaks
+  }
+  return lookups;
+}
+
+static void checkTableMatchesInterpolation(const unsigned int (&breaks)[7])
+{
+  for (unsigned int voltage = breaks[0] - 200; voltage <= breaks[6] + 200; voltage++)
+  {
+    int expected = interpolateVoltagePercentage(voltage);
+    int actual = getVoltagePercentage(voltage);
+    if (expected != actual)
+    {
+      CHECK_EQUAL(expected, actual);
+      printf("At %u mV\n", voltage);
+      return;
+    }
+  }
+}
+
+TEST(table_is_built_in_bounded_steps)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    const unsigned int breaks[7] = {12800, 14200, 14600, 15000, 15400, 15800, 16800};
+    setBreaks(breaks);
+    CHECK(!_voltageTableValid);
+    CHECK_EQUAL(0, _voltageTableNextPercentage);
+
+    CHECK_EQUAL((101 + VOLTAGE_TABLE_BUILD_STEP - 1) / VOLTAGE_TABLE_BUILD_STEP, buildByLookups());
+    CHECK(_voltageTableValid);
+    checkTableMatchesInterpolation(breaks);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(table_with_undefined_intermediate_breaks)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    const unsigned int breaks[7] = {10500, 0, 11800, 0, 0, 12400, 12700};
+    setBreaks(breaks);
+    buildByLookups();
+    CHECK(_voltageTableValid);
+    checkTableMatchesInterpolation(breaks);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(decreasing_breaks_use_the_interpolation)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    const unsigned int breaks[7] = {12800, 14200, 14100, 15000, 15400, 15800, 16800};
+    setBreaks(breaks);
+    buildByLookups();
+    CHECK(!_voltageTableValid);
+    CHECK_EQUAL(VOLTAGE_TABLE_IDLE, _voltageTableNextPercentage);
+    CHECK_EQUAL(interpolateVoltagePercentage(14150), getVoltagePercentage(14150));
+
+    setBatteryVoltageBreak(2, 14600); // Fixed : built again
+    buildByLookups();
+    CHECK(_voltageTableValid);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(breaks_changed_during_the_build_restart_it)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    const unsigned int breaks[7] = {12800, 14200, 14600, 15000, 15400, 15800, 16800};
+    setBreaks(breaks);
+    getVoltagePercentage(15000);
+    getVoltagePercentage(15000);
+    CHECK(_voltageTableNextPercentage > 0);
+
+    const unsigned int lowered[7] = {12000, 13200, 13600, 14000, 14400, 14800, 16000};
+    setBreaks(lowered);
+    CHECK_EQUAL(0, _voltageTableNextPercentage);
+    buildByLookups();
+    checkTableMatchesInterpolation(lowered);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(table_is_built_by_the_monitoring_task)
+{
+  wireBoard();
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[0], HIGH); // Custom
+  sim::setPinInput(BATT_TYPE_SELECTOR_PINS[1], HIGH);
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    CHECK_EQUAL(API::BATTERY_CUSTOM, _battType);
+
+    // Breaks sent by the ESP32 : the table is valid after 11 ADC blocks
+    const unsigned int breaks[7] = {12800, 14200, 14600, 15000, 15400, 15800, 16800};
+    for (uint8_t i = 0; i < 7; i++)
+      sendValueFrame(API::SET_BATTERY_VOLTAGE_LOW + i, breaks[i]);
+    runFor(10);
+    CHECK(!_voltageTableValid);
+    runFor(11 * ADC_BLOCK_PERIOD_MS);
+    CHECK(_voltageTableValid);
+    CHECK_EQUAL(interpolateVoltagePercentage(getOcvBatteryVoltage()), getBatteryPercentage());
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}
+
+TEST(lookup_benchmark)
+{
+  wireBoard();
+  sim::BootResult result = sim::boot([]() {
+    startBoard();
+    const unsigned int breaks[7] = {12800, 14200, 14600, 15000, 15400, 15800, 16800};
+    setBreaks(breaks);
+    buildByLookups();
+    CHECK(_voltageTableValid);
+
+    // Over the whole range and 200mV around it
+    const unsigned int low = breaks[0] - 200, range = breaks[6] + 200 - low;
+    double table = benchPerCall([=](unsigned long i) { return getVoltagePercentage(low + i % range); }, 100000);
+    double interpolation = benchPerCall([=](unsigned long i) {
+      return interpolateVoltagePercentage(low + i % range);
+    }, 100000);
+    printf("Percentage lookup : table %.1f, interpolation %.1f %s per call\n", table, interpolation, BENCH_UNIT);
+  });
+  CHECK_EQUAL(sim::BOOT_RETURNED, result);
+}